@@ -0,0 +1,146 @@
+#include "AsyncIo.h"
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#ifdef WEBPROXY_IO_URING
+// The loop running the caller, when its socket I/O goes through a ring
+static EventLoop* ringLoop() {
+    EventLoop* loop = EventLoop::current();
+    return loop && loop->ring() ? loop : nullptr;
+}
+
+// A completion's result as the plain calls report it: -1 and errno
+static ssize_t ringResult(int result) {
+    if (result >= 0) {
+        return result;
+    }
+    errno = result == -ECANCELED ? ETIMEDOUT : -result;
+    return -1;
+}
+#endif
+
+Task<ssize_t> asyncRead(int fd, char* buffer, size_t length, int timeout) {
+#ifdef WEBPROXY_IO_URING
+    EventLoop* loop = ringLoop();
+    if (loop) {
+        int result = co_await RingAwaiter(loop, IORING_OP_RECV, fd, buffer, (unsigned)length, 0, timeout);
+        ssize_t n = ringResult(result);
+        co_return n;
+    }
+#endif
+    while (true) {
+        ssize_t n = recv(fd, buffer, length, MSG_DONTWAIT);
+        if (n >= 0) {
+            co_return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return -1;
+        }
+        int ready = co_await asyncPoll(fd, POLLIN, timeout);
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            co_return -1;
+        }
+    }
+}
+
+Task<bool> asyncWrite(int fd, const char* data, size_t length, int timeout) {
+    SocketWriter writer(fd);
+    writer.add(data, length);
+    co_return co_await asyncFlush(writer, false, timeout);
+}
+
+Task<bool> asyncFlush(SocketWriter& writer, bool more, int timeout) {
+#ifdef WEBPROXY_IO_URING
+    EventLoop* loop = ringLoop();
+    if (loop) {
+        // One sendmsg of every queued segment per completion; the kernel
+        // waits for room in the socket instead of the loop polling for it
+        struct msghdr message = {};
+        int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+        while (writer.pending(message)) {
+            int result = co_await RingAwaiter(loop, IORING_OP_SENDMSG, writer.descriptor(), &message, 1, flags, timeout);
+            bool sent = writer.written(ringResult(result));
+            if (!sent) {
+                co_return false;
+            }
+        }
+        bool flushed = writer.flush(more);
+        co_return flushed;
+    }
+#endif
+    writer.setWait(false);
+    while (!writer.flush(more)) {
+        if (!writer.blocked()) {
+            co_return false;
+        }
+        int ready = co_await asyncPoll(writer.descriptor(), POLLOUT, timeout);
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+Task<int> asyncConnect(const std::string& host, const std::string& port, const SocketOptions& options, int timeout, int attempt) {
+    struct addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int lookup = -1;
+    co_await offload([&]() { lookup = getaddrinfo(host.c_str(), port.c_str(), &hints, &res); });
+    if (lookup != 0) {
+        co_return -1;
+    }
+
+    int addresses = 0;
+    for (struct addrinfo* address = res; address; address = address->ai_next) {
+        addresses++;
+    }
+    struct addrinfo* address = res;
+    for (int i = attempt % addresses; i > 0; i--) {
+        address = address->ai_next;
+    }
+    int sockfd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (sockfd < 0) {
+        freeaddrinfo(res);
+        co_return -1;
+    }
+    tuneUpstream(sockfd, options);
+    // Non-blocking for the connect only; reads and writes pass MSG_DONTWAIT
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+    int connectResult = connect(sockfd, address->ai_addr, address->ai_addrlen);
+    freeaddrinfo(res);
+    if (connectResult < 0) {
+        int soError = errno;
+        if (soError == EINPROGRESS) {
+            int ready = co_await asyncPoll(sockfd, POLLOUT, timeout);
+            if (ready == 1) {
+                socklen_t len = sizeof(soError);
+                getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &soError, &len);
+            } else if (ready == 0) {
+                soError = ETIMEDOUT;
+            }
+        }
+        if (soError != 0) {
+            close(sockfd);
+            errno = soError;
+            co_return -1;
+        }
+    }
+    fcntl(sockfd, F_SETFL, flags);
+    co_return sockfd;
+}
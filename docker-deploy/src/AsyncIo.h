@@ -0,0 +1,25 @@
+#pragma once
+#include <string>
+#include <sys/types.h>
+#include "Task.h"
+#include "EventLoop.h"
+#include "SocketWriter.h"
+#include "SocketOptions.h"
+
+/*
+ @brief: Socket operations for coroutines. On an event loop they suspend
+         while the socket is not ready; on any other thread they block like
+         the plain calls, so the same forwarding code serves both modes.
+         On a loop with a ring, reads and writes are ring operations.
+         Timeouts are in milliseconds, -1 waits for ever.
+*/
+
+// recv(): bytes read, 0 at end of stream, -1 on error (errno ETIMEDOUT on timeout)
+Task<ssize_t> asyncRead(int fd, char* buffer, size_t length, int timeout = -1);
+// Write all of data; false on error or timeout
+Task<bool> asyncWrite(int fd, const char* data, size_t length, int timeout = SocketWriter::WRITE_TIMEOUT_MS);
+// Flush a SocketWriter, waiting on the loop instead of in poll()
+Task<bool> asyncFlush(SocketWriter& writer, bool more = false, int timeout = SocketWriter::WRITE_TIMEOUT_MS);
+// A connected, tuned socket to host:port, or -1 (errno ETIMEDOUT on timeout). The name lookup runs on the blocking pool.
+// attempt picks among the addresses the name has, so a retry can go elsewhere.
+Task<int> asyncConnect(const std::string& host, const std::string& port, const SocketOptions& options, int timeout, int attempt = 0);
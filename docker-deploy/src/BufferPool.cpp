@@ -0,0 +1,164 @@
+#include "BufferPool.h"
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <atomic>
+#include <algorithm>
+
+static const size_t CLASS_SIZES[BufferPool::CLASS_COUNT] = {4096, 16384, 65536, 262144};
+static const size_t THREAD_CACHE_LIMIT = 8;  // buffers per class kept by one thread
+static const size_t GLOBAL_LIMIT = 256;      // buffers per class kept for everyone
+// Runtime limits, at most the compiled ones above (config reload)
+static std::atomic<size_t> threadLimit(THREAD_CACHE_LIMIT);
+static std::atomic<size_t> globalLimit(GLOBAL_LIMIT);
+
+static int classOf(size_t size) {
+    for (int i = 0; i < BufferPool::CLASS_COUNT; ++i) {
+        if (size <= CLASS_SIZES[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Fixed-size free lists: a new thread's cache costs no allocation
+template <size_t LIMIT>
+struct FreeLists {
+    char* buffers[BufferPool::CLASS_COUNT][LIMIT];
+    size_t counts[BufferPool::CLASS_COUNT] = {};
+
+    bool push(int sizeClass, char* data, size_t limit) {
+        if (counts[sizeClass] >= limit) {
+            return false;
+        }
+        buffers[sizeClass][counts[sizeClass]++] = data;
+        return true;
+    }
+
+    char* pop(int sizeClass) {
+        return counts[sizeClass] == 0 ? nullptr : buffers[sizeClass][--counts[sizeClass]];
+    }
+};
+
+struct GlobalLists : FreeLists<GLOBAL_LIMIT> {
+    std::mutex mutex;
+
+    ~GlobalLists() {
+        for (int i = 0; i < BufferPool::CLASS_COUNT; ++i) {
+            while (char* buffer = pop(i)) {
+                free(buffer);
+            }
+        }
+    }
+};
+
+static GlobalLists& globalLists() {
+    static GlobalLists lists;
+    return lists;
+}
+
+static void releaseGlobal(char* data, int sizeClass) {
+    GlobalLists& global = globalLists();
+    std::lock_guard<std::mutex> lock(global.mutex);
+    if (!global.push(sizeClass, data, globalLimit)) {
+        free(data);
+    }
+}
+
+// Hands its buffers to the shared list when the thread exits
+struct ThreadCache : FreeLists<THREAD_CACHE_LIMIT> {
+    ~ThreadCache() {
+        for (int i = 0; i < BufferPool::CLASS_COUNT; ++i) {
+            while (char* buffer = pop(i)) {
+                releaseGlobal(buffer, i);
+            }
+        }
+    }
+};
+
+static thread_local ThreadCache threadCache;
+
+AllocationStats& BufferPool::stats() {
+    static AllocationStats counters;
+    return counters;
+}
+
+/*
+ @brief: Change how many free buffers are kept, clamped to the compiled
+         limits. The shared list is trimmed now; thread caches shrink as
+         their buffers are released.
+*/
+void BufferPool::setLimits(size_t globalBuffers, size_t threadBuffers) {
+    threadLimit = std::min(threadBuffers, THREAD_CACHE_LIMIT);
+    globalLimit = std::min(globalBuffers, GLOBAL_LIMIT);
+    GlobalLists& global = globalLists();
+    std::lock_guard<std::mutex> lock(global.mutex);
+    for (int i = 0; i < CLASS_COUNT; ++i) {
+        while (global.counts[i] > globalLimit) {
+            free(global.pop(i));
+        }
+    }
+}
+
+size_t BufferPool::classSize(int sizeClass) {
+    return CLASS_SIZES[sizeClass];
+}
+
+/*
+ @brief: Get a buffer of at least size bytes; capacity receives its real size,
+         which has to be handed back to release()
+*/
+char* BufferPool::acquire(size_t size, size_t& capacity) {
+    int sizeClass = classOf(size);
+    if (sizeClass < 0) {
+        // Larger than any class: not pooled
+        capacity = size;
+        stats().systemAllocations++;
+        char* data = static_cast<char*>(malloc(size));
+        if (!data) {
+            throw std::bad_alloc();
+        }
+        return data;
+    }
+    capacity = CLASS_SIZES[sizeClass];
+    if (char* data = threadCache.pop(sizeClass)) {
+        stats().threadHits++;
+        return data;
+    }
+    {
+        GlobalLists& global = globalLists();
+        std::lock_guard<std::mutex> lock(global.mutex);
+        if (char* data = global.pop(sizeClass)) {
+            stats().globalHits++;
+            return data;
+        }
+    }
+    stats().systemAllocations++;
+    char* data = static_cast<char*>(malloc(capacity));
+    if (!data) {
+        throw std::bad_alloc();
+    }
+    return data;
+}
+
+void BufferPool::release(char* data, size_t capacity) {
+    if (!data) {
+        return;
+    }
+    int sizeClass = classOf(capacity);
+    if (sizeClass < 0 || CLASS_SIZES[sizeClass] != capacity) {
+        free(data);
+        return;
+    }
+    if (!threadCache.push(sizeClass, data, threadLimit)) {
+        releaseGlobal(data, sizeClass);
+    }
+}
+
+PooledBuffer::PooledBuffer(size_t size) {
+    buffer = BufferPool::acquire(size, bufferCapacity);
+}
+
+PooledBuffer::~PooledBuffer() {
+    BufferPool::release(buffer, bufferCapacity);
+}
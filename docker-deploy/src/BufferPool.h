@@ -0,0 +1,49 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ @brief: Where pooled memory came from. systemAllocations stays flat once the
+         pool is warm; benchmarks read these to check the request path.
+*/
+struct AllocationStats {
+    std::atomic<uint64_t> threadHits{0};        // reused from the calling thread's free list
+    std::atomic<uint64_t> globalHits{0};        // reused from the shared free list
+    std::atomic<uint64_t> systemAllocations{0}; // had to go to malloc
+    std::atomic<uint64_t> arenaBlocks{0};       // blocks taken by request arenas
+};
+
+/*
+ @brief: Size-classed buffers (4 KB to 256 KB). Each thread keeps a short free
+         list per class; it spills into, and refills from, a shared list, so
+         buffers outlive the thread-per-connection threads that used them.
+*/
+class BufferPool {
+public:
+    static const int CLASS_COUNT = 4;
+
+    static char* acquire(size_t size, size_t& capacity);
+    static void release(char* data, size_t capacity);
+    static size_t classSize(int sizeClass);
+    static void setLimits(size_t globalBuffers, size_t threadBuffers);
+    static AllocationStats& stats();
+};
+
+/*
+ @brief: A pooled buffer for the lifetime of a scope
+*/
+class PooledBuffer {
+private:
+    char* buffer;
+    size_t bufferCapacity;
+
+public:
+    explicit PooledBuffer(size_t size);
+    ~PooledBuffer();
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    char* data() { return buffer; }
+    size_t capacity() const { return bufferCapacity; }
+};
@@ -0,0 +1,143 @@
+#include "CacheKey.h"
+#include <cstring>
+#include <strings.h>
+#include <cctype>
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+/*
+ @brief: 64-bit multiply-xorshift hash, one multiplication per 8 input bytes
+*/
+uint64_t hashBytes(const void* data, size_t length) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t seed = 0x9E3779B97F4A7C15ULL ^ length;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        seed = mix(seed ^ word, 0xBF58476D1CE4E5B9ULL);
+        p += 8;
+        length -= 8;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p, length);
+    return mix(seed ^ tail, 0x94D049BB133111EBULL);
+}
+
+static bool isUnreserved(char c) {
+    return isalnum((unsigned char)c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+// Length of an "http://" or "https://" prefix, 0 for anything else
+static size_t schemeLength(const std::string& url) {
+    if (url.size() >= 7 && strncasecmp(url.c_str(), "http://", 7) == 0) {
+        return 7;
+    }
+    if (url.size() >= 8 && strncasecmp(url.c_str(), "https://", 8) == 0) {
+        return 8;
+    }
+    return 0;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ @brief: Reduce a request target to origin-form path + query:
+         drop scheme/authority and fragment, decode percent-encoded
+         unreserved characters and upper-case the remaining escapes.
+         Appends to path, so a key is built without a temporary.
+*/
+static void appendCanonicalUrl(std::string& path, const std::string& url) {
+    size_t start = 0;
+    size_t scheme = schemeLength(url);
+    if (scheme > 0) {
+        // Authority ends at the path, the query or the fragment
+        start = url.find_first_of("/?#", scheme);
+        if (start == std::string::npos) {
+            path += '/';
+            return;
+        }
+    }
+    size_t end = url.find('#', start);
+    if (end == std::string::npos) {
+        end = url.size();
+    }
+
+    if (start == end || url[start] != '/') {
+        path += '/';
+    }
+    for (size_t i = start; i < end; ++i) {
+        if (url[i] == '%' && i + 2 < end) {
+            int high = hexValue(url[i + 1]);
+            int low = hexValue(url[i + 2]);
+            if (high >= 0 && low >= 0) {
+                char decoded = (char)(high * 16 + low);
+                if (isUnreserved(decoded)) {
+                    path += decoded;
+                } else {
+                    path += '%';
+                    path += (char)toupper((unsigned char)url[i + 1]);
+                    path += (char)toupper((unsigned char)url[i + 2]);
+                }
+                i += 2;
+                continue;
+            }
+        }
+        path += url[i];
+    }
+}
+
+std::string canonicalizeUrl(const std::string& url) {
+    std::string path;
+    path.reserve(url.size() + 1);
+    appendCanonicalUrl(path, url);
+    return path;
+}
+
+CacheKey makeCacheKey(const std::string& normalized) {
+    CacheKey key;
+    key.key = normalized;
+    key.hash = hashBytes(normalized.data(), normalized.size());
+    return key;
+}
+
+/*
+ @brief: host is lower-cased and the default port elided, so
+         "GET http://Example.com:80/a" and "GET /a" with "Host: example.com"
+         map to the same entry. https (intercepted, or an https:// target)
+         is keyed apart from http, with 443 as its default port.
+*/
+CacheKey makeCacheKey(const std::string& host, const std::string& port, const std::string& url, bool tls) {
+    CacheKey key;
+    makeCacheKey(key, host, port, url, tls);
+    return key;
+}
+
+/*
+ @brief: Same, rebuilt into key: a reused request keeps the key's capacity
+*/
+void makeCacheKey(CacheKey& key, const std::string& host, const std::string& port, const std::string& url, bool tls) {
+    tls = tls || schemeLength(url) == 8;
+    std::string& normalized = key.key;
+    normalized.clear();
+    normalized.reserve(host.size() + port.size() + url.size() + 10);
+    if (tls) {
+        normalized += "https://";
+    }
+    for (char c : host) {
+        normalized += (char)tolower((unsigned char)c);
+    }
+    if (!port.empty() && port != (tls ? "443" : "80")) {
+        normalized += ':';
+        normalized += port;
+    }
+    appendCanonicalUrl(normalized, url);
+    key.hash = hashBytes(normalized.data(), normalized.size());
+}
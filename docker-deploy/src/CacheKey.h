@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ @brief: Normalized cache key, built once per request. The cache index is
+         keyed by hash; key is kept to verify a hit without allocating.
+*/
+struct CacheKey {
+    uint64_t hash = 0;
+    std::string key;
+
+    bool empty() const { return key.empty(); }
+};
+
+// Identity hasher for tables that are already keyed by CacheKey::hash
+struct CacheKeyHash {
+    size_t operator()(uint64_t hash) const { return hash; }
+};
+
+uint64_t hashBytes(const void* data, size_t length);
+std::string canonicalizeUrl(const std::string& url);
+CacheKey makeCacheKey(const std::string& normalized);
+CacheKey makeCacheKey(const std::string& host, const std::string& port, const std::string& url, bool tls = false);
+void makeCacheKey(CacheKey& key, const std::string& host, const std::string& port, const std::string& url, bool tls = false);
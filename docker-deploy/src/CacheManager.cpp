@@ -1,76 +1,918 @@
 #include "CacheManager.h"
-CacheManager::CacheManager(size_t maxSize, size_t cursize) : maxCacheSize(maxSize), currentSize(cursize) {}
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <strings.h>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
 
-bool CacheManager::isExpired(const CacheEntry& entry) const {
-    return entry.expiry < time(nullptr);
+// Snapshot layout: header, bodies, then the index. Loading only maps the index.
+static const char SNAPSHOT_MAGIC[8] = {'W', 'P', 'C', 'A', 'C', 'H', 'E', '3'};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t count;
+    uint64_t indexOffset;
+    uint64_t indexLength;
+};
+
+// Pages (or heap victims) freed for one body that found no chunk in the slabs
+static const size_t MAX_SLAB_RECLAIMS = 16;
+// Bodies this short live inside the string object and never reach the slabs
+static const size_t INLINE_BODY = std::string().capacity();
+
+// Pages the slabs may take: the budget, plus room for partly used pages
+static size_t slabLimit(size_t memoryBytes) {
+    return memoryBytes + memoryBytes / 8;
+}
+
+CacheManager::CacheManager(const CacheOptions& options)
+    : options(options), currentSize(0), logicalSize(0), variantCount(0), heapBytes(0), heapFallbacks(0) {
+    if (options.slabs) {
+        slabs = std::make_unique<SlabAllocator>(slabLimit(options.memoryBytes), options.hugePages);
+        classVariants.resize(slabs->classCount());
+    }
+    policy = makeEvictionPolicy(options.evictionPolicy, options.memoryBytes);
+    if (!policy) {
+        throw std::runtime_error("Unknown eviction policy: " + options.evictionPolicy);
+    }
+    if (options.diskEnabled) {
+        disk = std::make_unique<DiskCache>(options.diskDirectory, options.diskSegmentBytes, options.diskSegments);
+    }
+    if (options.sharedBytes > 0) {
+        shared = std::make_unique<SharedCache>(options.sharedBytes);
+    }
+}
+
+/*
+ @brief: Look up the variant matching the request in either tier. Expired
+         entries are still returned, the caller decides whether to revalidate.
+*/
+std::shared_ptr<const CacheEntry> CacheManager::get(const CacheKey& key, const Headers& requestHeaders) {
+    if (shared) {
+        auto entry = shared->get(key, requestHeaders);
+        if (entry) {
+            return entry;
+        }
+    }
+    std::shared_ptr<const CacheEntry> entry;
+    bool promoteEntry = false;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        // Misses count too: frequency decides what gets admitted later
+        policy->recordAccess(key.hash);
+        auto it = findLocked(key);
+        if (it == cache.end()) {
+            return nullptr;
+        }
+        Slot& slot = it->second;
+        std::string varyKey = slot.vary.empty() ? std::string() : buildVaryKey(slot.vary, requestHeaders);
+        auto variant = slot.variants.begin();
+        while (variant != slot.variants.end() && variant->entry->varyKey != varyKey) {
+            ++variant;
+        }
+        if (variant == slot.variants.end()) {
+            return nullptr;
+        }
+        entry = variant->entry;
+        if (entry->inMemory()) {
+            policy->onHit(&variant->policyEntry);
+            return entry;
+        }
+        // The segment holding this object has been recycled
+        if (!entry->disk->valid()) {
+            eraseVariantLocked(it, variant);
+            return nullptr;
+        }
+        ++variant->diskHits;
+        promoteEntry = variant->diskHits >= options.promoteAfterHits && entry->size <= options.maxMemoryObject;
+    }
+    if (promoteEntry) {
+        promote(key, entry);
+    }
+    return entry;
 }
-void CacheManager::evictLRU() {
+
+/*
+ @brief: Store a response. Objects above maxMemoryObject skip the memory tier;
+         with a shared tier, only what does not fit there stays in this process.
+*/
+void CacheManager::put(const CacheKey& key, std::shared_ptr<CacheEntry> entry) {
+    entry->size = entry->response->size();
+    entry->timestamp = time(nullptr);
+    if (shared && shared->put(key, *entry)) {
+        return;
+    }
+    std::shared_ptr<const CacheEntry> stored = entry;
+    size_t maxMemoryObject, memoryBudget;
+    {
+        // reconfigure() may change the limits
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        maxMemoryObject = options.maxMemoryObject;
+        memoryBudget = options.memoryBytes;
+    }
+    if (disk && entry->size > maxMemoryObject) {
+        stored = toDisk(*entry);
+        if (!stored) {
+            return;
+        }
+    } else if (entry->size > memoryBudget) {
+        return;
+    }
+
+    EntryList evicted;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        insertLocked(key, stored, evicted);
+    }
+    spill(evicted);
+    // Once admitted, the memory tier keeps a copy in the slabs; the caller's stays on the heap
+    if (slabs && stored->inMemory()) {
+        placeInSlabs(key, stored);
+    }
+}
+
+/*
+ @brief: Update the expiration of a variant after a successful revalidation (304)
+*/
+void CacheManager::refresh(const CacheKey& key, const std::shared_ptr<const CacheEntry>& entry, time_t expiration) {
+    if (shared) {
+        shared->refresh(key, entry->varyKey, expiration);
+    }
     std::lock_guard<std::mutex> lock(cacheMutex);
-    time_t oldestTimestamp = time(nullptr);
-    std::string oldestUrl;
-    for (const auto& entry : cache) {
-        if (entry.second.timestamp < oldestTimestamp) {
-            oldestTimestamp = entry.second.timestamp;
-            oldestUrl = entry.first;
+    auto it = findLocked(key);
+    if (it == cache.end()) {
+        return;
+    }
+    auto variant = findVariantLocked(it->second, entry);
+    if (variant == it->second.variants.end()) {
+        return;
+    }
+    auto updated = std::make_shared<CacheEntry>(*entry);
+    updated->expiration = expiration;
+    variant->entry = updated;
+}
+
+/*
+ @brief: Write a cached response to the client, from memory or with sendfile()
+*/
+bool CacheManager::send(int clientSocket, const CacheEntry& entry) {
+    return send(clientSocket, entry, 0, entry.size);
+}
+
+/*
+ @brief: Send a slice of the stored response (offsets include the headers)
+*/
+bool CacheManager::send(int clientSocket, const CacheEntry& entry, size_t start, size_t length) {
+    SocketWriter writer(clientSocket);
+    return send(writer, entry, start, length) && writer.flush();
+}
+
+/*
+ @brief: Queue a slice behind what the caller has already queued (headers,
+         multipart framing). Disk objects go out with sendfile() right away;
+         the entry has to outlive the writer's next flush.
+*/
+bool CacheManager::send(SocketWriter& writer, const CacheEntry& entry, size_t start, size_t length) {
+    if (entry.inMemory()) {
+        return writer.add(entry.response->data() + start, length);
+    }
+    return writer.addFile(entry.disk->segment->fd, entry.disk->offset + start, length);
+}
+
+/*
+ @brief: Header block of a stored response, without the blank line
+*/
+std::string CacheManager::readHeaders(const CacheEntry& entry) {
+    if (entry.headerLength < 4) {
+        // Not sliceable: find the end of the headers in the whole response
+        std::string response;
+        if (!entry.inMemory() && !DiskCache::read(*entry.disk, 0, entry.size, response)) {
+            return "";
         }
+        std::string_view whole = entry.inMemory() ? std::string_view(*entry.response) : std::string_view(response);
+        size_t headerEnd = whole.find("\r\n\r\n");
+        return headerEnd == std::string::npos ? "" : std::string(whole.substr(0, headerEnd));
+    }
+    if (entry.inMemory()) {
+        return std::string(entry.response->data(), entry.headerLength - 4);
+    }
+    std::string headers;
+    if (!DiskCache::read(*entry.disk, 0, entry.headerLength - 4, headers)) {
+        return "";
+    }
+    return headers;
+}
+
+/*
+ @brief: Same, without a copy when the entry is in memory and sliceable;
+         otherwise read into storage. Valid while entry and storage are.
+*/
+std::string_view CacheManager::headerView(const CacheEntry& entry, std::string& storage) {
+    if (entry.inMemory() && entry.headerLength >= 4) {
+        return std::string_view(entry.response->data(), entry.headerLength - 4);
     }
-    remove(oldestUrl);
+    storage = readHeaders(entry);
+    return storage;
 }
-std::shared_ptr<CacheEntry> CacheManager::get(const std::string& url) {
+
+void CacheManager::remove(const CacheKey& key) {
+    if (shared) {
+        shared->remove(key);
+    }
     std::lock_guard<std::mutex> lock(cacheMutex);
-    
-    auto it = cache.find(url);
+    auto it = findLocked(key);
     if (it != cache.end()) {
-        if (isExpired(it->second)) { // check if the entry is expired
-            std::cout << url << ": in cache, but expired at" << it->second.expiry << std::endl;
-            return nullptr; // Important: do i need to remove the entry? 
+        eraseLocked(it);
+    }
+}
+
+void CacheManager::clear() {
+    if (shared) {
+        shared->clear();
+    }
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    cache.clear();
+    policy->clear();
+    for (auto& members : classVariants) {
+        members.clear();
+    }
+    currentSize = 0;
+    logicalSize = 0;
+    heapBytes = 0;
+    variantCount = 0;
+}
+
+size_t CacheManager::size() {
+    size_t sharedCount = shared ? shared->size() : 0;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return variantCount + sharedCount;
+}
+
+size_t CacheManager::memoryBytes() {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return currentSize;
+}
+
+std::string CacheManager::describeMemory() {
+    std::string text;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        text = "logical=" + std::to_string(logicalSize) + " charged=" + std::to_string(currentSize);
+    }
+    if (slabs) {
+        text += " " + slabs->stats().describe();
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        text += " heap=" + std::to_string(heapBytes) + " heap_fallbacks=" + std::to_string(heapFallbacks);
+    }
+    return text;
+}
+
+/*
+ @brief: Normalize a request header value named in Vary, so that equivalent
+         requests share a variant. Accept-Encoding is reduced to what we
+         forward upstream: "gzip" or nothing.
+*/
+std::string CacheManager::normalizeVaryValue(const std::string& name, const std::string& value) {
+    if (strcasecmp(name.c_str(), "accept-encoding") == 0) {
+        std::stringstream tokens(value);
+        std::string token;
+        while (std::getline(tokens, token, ',')) {
+            std::string coding;
+            bool refused = false;
+            std::stringstream parts(token);
+            std::string part;
+            while (std::getline(parts, part, ';')) {
+                part.erase(0, part.find_first_not_of(" \t"));
+                part.erase(part.find_last_not_of(" \t") + 1);
+                if (coding.empty()) {
+                    coding = part;
+                } else if (part.rfind("q=", 0) == 0 && strtod(part.c_str() + 2, nullptr) == 0) {
+                    refused = true;
+                }
+            }
+            if (!refused && (strcasecmp(coding.c_str(), "gzip") == 0 || coding == "*")) {
+                return "gzip";
+            }
         }
-        else if (it->second.requiresValidation) { // check if the entry requires validation
-            std::cout << url << ": in cache, requires validation" << std::endl;
-            return std::make_shared<CacheEntry>(it->second); // TODO: Important: still needs validation ( How to handle this case?)
+        return "";
+    }
+    // Other headers: lower-case, trim and collapse whitespace
+    std::string normalized;
+    bool space = false;
+    for (char c : value) {
+        if (c == ' ' || c == '\t') {
+            space = !normalized.empty();
+            continue;
         }
-        else { // valid entry
-            std::cout << url << ": in cache, valid" << std::endl;
-            return std::make_shared<CacheEntry>(it->second); //
+        if (space) {
+            normalized += ' ';
+            space = false;
         }
+        normalized += (char)tolower((unsigned char)c);
     }
-    std::cout << url << ": not in cache" << std::endl; // not in cache
-    return nullptr;
-    
+    return normalized;
+}
+
+std::string CacheManager::buildVaryKey(const std::vector<std::string>& vary, const Headers& requestHeaders) {
+    std::string varyKey;
+    for (const auto& name : vary) {
+        std::string value(requestHeaders.get(name));
+        varyKey += name;
+        varyKey += '=';
+        varyKey += normalizeVaryValue(name, value);
+        varyKey += '\n';
+    }
+    return varyKey;
+}
+
+/*
+ @brief: Find by hash and verify the full key; no allocation on this path
+*/
+CacheManager::Index::iterator CacheManager::findLocked(const CacheKey& key) {
+    auto it = cache.find(key.hash);
+    if (it != cache.end() && it->second.key != key.key) {
+        return cache.end();
+    }
+    return it;
+}
+
+std::list<CacheManager::Variant>::iterator CacheManager::findVariantLocked(Slot& slot, const std::shared_ptr<const CacheEntry>& entry) {
+    auto variant = slot.variants.begin();
+    while (variant != slot.variants.end() && variant->entry != entry) {
+        ++variant;
+    }
+    return variant;
+}
+
+std::list<CacheManager::Variant>::iterator CacheManager::findVariantLocked(Slot& slot, const PolicyEntry* policyEntry) {
+    auto variant = slot.variants.begin();
+    while (&variant->policyEntry != policyEntry) {
+        ++variant;
+    }
+    return variant;
 }
 
-void CacheManager::put(const std::string& url, const std::string& response, 
-             const std::chrono::seconds& maxAge, bool requiresValidation) {
+/*
+ @brief: Insert a variant; memory entries past the budget are handed back in
+         evicted. A colliding key with the same hash, or a URL whose Vary
+         header changed, loses its old variants.
+*/
+void CacheManager::insertLocked(const CacheKey& key, std::shared_ptr<const CacheEntry> entry, EntryList& evicted) {
+    auto it = cache.find(key.hash);
+    if (it != cache.end() && (it->second.key != key.key || it->second.vary != entry->vary)) {
+        eraseLocked(it);
+        it = cache.end();
+    }
+    if (it == cache.end()) {
+        Slot slot;
+        slot.key = key.key;
+        slot.vary = entry->vary;
+        it = cache.emplace(key.hash, std::move(slot)).first;
+    }
+    // Add the new variant first so the slot never becomes empty below
+    Slot& slot = it->second;
+    Variant variant;
+    variant.entry = entry;
+    variant.diskHits = 0;
+    auto added = slot.variants.insert(slot.variants.end(), variant);
+    if (entry->inMemory()) {
+        added->charge = entry->size;
+        if (slabs) {
+            // Charged for the chunk it takes in the slabs, before it is moved there,
+            // so admission and budget eviction see its final cost
+            added->charge = slabs->chunkBytes(entry->size + 1);
+            if (entry->response->get_allocator().resource() != slabs.get()) {
+                heapBytes += added->charge;
+            }
+        }
+        added->policyEntry.hash = key.hash;
+        added->policyEntry.size = added->charge;
+        policy->onInsert(&added->policyEntry);
+        currentSize += added->charge;
+        logicalSize += entry->size;
+    }
+    ++variantCount;
+
+    for (auto old = slot.variants.begin(); old != added; ++old) {
+        if (old->entry->varyKey == entry->varyKey) {
+            eraseVariantLocked(it, old);
+            break;
+        }
+    }
+    // Cap the variants per URL, the oldest one goes first
+    while (slot.variants.size() > std::max<size_t>(options.maxVariants, 1)) {
+        eraseVariantLocked(it, slot.variants.begin());
+    }
+
+    // The new variant itself may be refused; it then goes to the disk tier like any victim.
+    evictLocked(evicted);
+}
+
+/*
+ @brief: Evict what the policy picks until memory is back under budget
+*/
+void CacheManager::evictLocked(EntryList& evicted) {
+    while (currentSize > options.memoryBytes) {
+        PolicyEntry* victim = policy->victim();
+        if (!victim) {
+            break;
+        }
+        evictEntryLocked(victim, evicted);
+    }
+}
+
+void CacheManager::evictEntryLocked(PolicyEntry* victim, EntryList& evicted) {
+    auto owner = cache.find(victim->hash);
+    auto variant = findVariantLocked(owner->second, victim);
+    CacheKey victimKey;
+    victimKey.hash = victim->hash;
+    victimKey.key = owner->second.key;
+    evicted.emplace_back(std::move(victimKey), variant->entry);
+    eraseVariantLocked(owner, variant);
+}
+
+/*
+ @brief: Move an admitted body into the slabs. When no page is left even
+         after reclaiming, the variant keeps its heap copy; describeMemory()
+         reports those.
+*/
+void CacheManager::placeInSlabs(const CacheKey& key, const std::shared_ptr<const CacheEntry>& entry) {
+    if (entry->size <= INLINE_BODY) {
+        return;
+    }
+    auto body = toSlabs(*entry->response, entry);
     std::lock_guard<std::mutex> lock(cacheMutex);
-    if (currentSize + response.size()>= maxCacheSize) {
-        evictLRU();
+    // Evicted or replaced meanwhile
+    auto it = findLocked(key);
+    if (it == cache.end()) {
+        return;
     }
-    CacheEntry entry;
-    entry.response = response;
-    entry.timestamp = time(nullptr);
-    entry.expiry = entry.timestamp + maxAge.count();
-    entry.requiresValidation = requiresValidation;
+    auto variant = findVariantLocked(it->second, entry);
+    if (variant == it->second.variants.end()) {
+        return;
+    }
+    if (!body) {
+        ++heapFallbacks;
+        return;
+    }
+    auto copy = std::make_shared<CacheEntry>(*entry);
+    copy->response = body;
+    variant->entry = copy;
+    heapBytes -= variant->charge;
+    variant->slabClass = slabs->classOf(body->capacity() + 1);
+    if (variant->slabClass >= 0) {
+        auto& members = classVariants[variant->slabClass];
+        variant->classPosition = members.insert(members.begin(), &variant->policyEntry);
+    }
+}
 
-    cache[url] = entry;
-    currentSize += response.size();
-    std::cout << url << ": added to cache" << std::endl;    
-    
+/*
+ @brief: Copy a body into the slabs; only its characters go there, the
+         control block stays on the heap. At the page limit, pages are
+         reclaimed through the policy until the body fits. nullptr when
+         that frees nothing.
+*/
+std::shared_ptr<const CacheBody> CacheManager::toSlabs(std::string_view body, const std::shared_ptr<const CacheEntry>& placing) {
+    std::pmr::polymorphic_allocator<char> allocator(slabs.get());
+    for (size_t attempt = 0; attempt < MAX_SLAB_RECLAIMS; attempt++) {
+        try {
+            return std::make_shared<const CacheBody>(body.data(), body.size(), allocator);
+        } catch (const std::bad_alloc&) {
+        }
+        // The chunks are free once the victims have been spilled and dropped
+        EntryList evicted;
+        bool reclaimed;
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            reclaimed = reclaimPageLocked(placing, evicted);
+        }
+        spill(evicted);
+        if (!reclaimed) {
+            break;
+        }
+    }
+    return nullptr;
 }
 
-void CacheManager::clear() {
+/*
+ @brief: Free the slab page of the policy's next victim by evicting every
+         object on it. The empty page goes back to the pool, where any size
+         class can take it, so pages move away from classes that went cold.
+         A victim whose body is on the heap only gives back its budget.
+         false when the next victim is the body being placed, or its page
+         holds an object a reader still sends: evicting would free nothing.
+*/
+bool CacheManager::reclaimPageLocked(const std::shared_ptr<const CacheEntry>& placing, EntryList& evicted) {
+    PolicyEntry* coldest = policy->victim();
+    if (!coldest) {
+        return false;
+    }
+    auto variant = findVariantLocked(cache.find(coldest->hash)->second, coldest);
+    if (variant->entry == placing) {
+        return false;
+    }
+    if (variant->slabClass < 0) {
+        evictEntryLocked(coldest, evicted);
+        return true;
+    }
+    auto pageOf = [](const Variant& v) {
+        return (uintptr_t)v.entry->response->data() & ~(uintptr_t)(SlabAllocator::PAGE_BYTES - 1);
+    };
+    uintptr_t page = pageOf(*variant);
+    std::vector<PolicyEntry*> onPage;
+    for (PolicyEntry* member : classVariants[variant->slabClass]) {
+        auto neighbour = findVariantLocked(cache.find(member->hash)->second, member);
+        if (pageOf(*neighbour) != page) {
+            continue;
+        }
+        // Only the index holds it: the chunk is freed with the variant
+        if (neighbour->entry.use_count() > 1 || neighbour->entry->response.use_count() > 1) {
+            return false;
+        }
+        onPage.push_back(member);
+    }
+    for (PolicyEntry* member : onPage) {
+        evictEntryLocked(member, evicted);
+    }
+    return true;
+}
+
+/*
+ @brief: Apply reloaded limits. The policy and the disk tier are fixed at
+         construction; a smaller memory budget evicts into the disk tier now.
+*/
+void CacheManager::reconfigure(const CacheOptions& updated) {
+    EntryList evicted;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        options.memoryBytes = updated.memoryBytes;
+        options.maxMemoryObject = updated.maxMemoryObject;
+        options.promoteAfterHits = updated.promoteAfterHits;
+        options.maxVariants = updated.maxVariants;
+        options.rangeFetchFull = updated.rangeFetchFull;
+        options.rangeFetchMax = updated.rangeFetchMax;
+        options.snapshotInterval = updated.snapshotInterval;
+        options.freshness = updated.freshness;
+        policy->resize(options.memoryBytes);
+        if (slabs) {
+            slabs->setLimit(slabLimit(options.memoryBytes));
+        }
+        evictLocked(evicted);
+    }
+    spill(evicted);
+}
+
+CacheOptions CacheManager::getOptions() {
     std::lock_guard<std::mutex> lock(cacheMutex);
-    cache.clear();
+    return options;
+}
+
+/*
+ @brief: Drop one variant, and the URL once its last variant is gone
+*/
+void CacheManager::eraseVariantLocked(Index::iterator it, std::list<Variant>::iterator variant) {
+    if (variant->entry->inMemory()) {
+        policy->onRemove(&variant->policyEntry);
+        currentSize -= variant->charge;
+        logicalSize -= variant->entry->size;
+        if (variant->slabClass >= 0) {
+            classVariants[variant->slabClass].erase(variant->classPosition);
+        }
+        if (slabs && variant->entry->response->get_allocator().resource() != slabs.get()) {
+            heapBytes -= variant->charge;
+        }
+    }
+    --variantCount;
+    it->second.variants.erase(variant);
+    if (it->second.variants.empty()) {
+        cache.erase(it);
+    }
 }
-void CacheManager::remove(const std::string& url) {
-        std::lock_guard<std::mutex> lock(cacheMutex); // 加锁
-        auto it = cache.find(url);
+
+void CacheManager::eraseLocked(Index::iterator it) {
+    while (it->second.variants.size() > 1) {
+        eraseVariantLocked(it, it->second.variants.begin());
+    }
+    eraseVariantLocked(it, it->second.variants.begin());
+}
+
+/*
+ @brief: Move entries evicted from memory into the disk tier
+*/
+void CacheManager::spill(EntryList& evicted) {
+    if (!disk) {
+        return;
+    }
+    for (auto& victim : evicted) {
+        auto onDisk = toDisk(*victim.second);
+        if (!onDisk) {
+            continue;
+        }
+        EntryList none;
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        // A newer response may have been stored while we were writing
+        auto it = findLocked(victim.first);
+        bool replaced = false;
         if (it != cache.end()) {
-            currentSize -= it->second.response.size();
-            cache.erase(it);
-            std::cout << url << ": removed from cache" << std::endl;
+            for (const auto& variant : it->second.variants) {
+                replaced = replaced || variant.entry->varyKey == onDisk->varyKey;
+            }
+        }
+        if (!replaced) {
+            insertLocked(victim.first, onDisk, none);
+        }
+    }
+}
+
+std::shared_ptr<const CacheEntry> CacheManager::toDisk(const CacheEntry& entry) {
+    std::shared_ptr<DiskSegment> retired;
+    auto extent = disk->write(*entry.response, retired);
+    if (retired) {
+        dropSegment(retired);
+    }
+    if (!extent) {
+        return nullptr;
+    }
+    auto copy = std::make_shared<CacheEntry>(entry);
+    copy->response = nullptr;
+    copy->disk = extent;
+    return copy;
+}
+
+/*
+ @brief: Forget every variant stored in a recycled segment, so the index
+         does not fill with dead entries and the unlinked file is closed
+         once the last sendfile() from it is done
+*/
+void CacheManager::dropSegment(const std::shared_ptr<DiskSegment>& segment) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    for (auto it = cache.begin(); it != cache.end();) {
+        // Erasing its last variant erases the slot, the next one stays valid
+        auto nextSlot = std::next(it);
+        auto& variants = it->second.variants;
+        for (auto variant = variants.begin(); variant != variants.end();) {
+            auto next = std::next(variant);
+            if (!variant->entry->inMemory() && variant->entry->disk->segment == segment) {
+                bool last = variants.size() == 1;
+                eraseVariantLocked(it, variant);
+                if (last) {
+                    break;
+                }
+            }
+            variant = next;
+        }
+        it = nextSlot;
+    }
+}
+
+/*
+ @brief: Bring a hot disk entry back into the memory tier
+*/
+void CacheManager::promote(const CacheKey& key, std::shared_ptr<const CacheEntry> entry) {
+    std::string text;
+    if (!DiskCache::read(*entry->disk, 0, entry->size, text)) {
+        return;
+    }
+    auto copy = std::make_shared<CacheEntry>(*entry);
+    copy->response = std::make_shared<const CacheBody>(text);
+    copy->disk = nullptr;
+    std::shared_ptr<const CacheEntry> stored = copy;
+
+    EntryList evicted;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        // Not if it was replaced or removed meanwhile
+        auto it = findLocked(key);
+        if (it == cache.end() || findVariantLocked(it->second, entry) == it->second.variants.end()) {
+            return;
+        }
+        insertLocked(key, stored, evicted);
+    }
+    spill(evicted);
+    if (slabs) {
+        placeInSlabs(key, stored);
+    }
+}
+
+static bool writeAll(int fd, const void* data, size_t length) {
+    const char* p = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+static void appendField(std::string& out, const std::string& value) {
+    uint32_t length = value.size();
+    out.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    out.append(value);
+}
+
+template <typename T>
+static void appendValue(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static bool readField(const char*& p, const char* end, std::string& value) {
+    uint32_t length;
+    if (end - p < (ptrdiff_t)sizeof(length)) {
+        return false;
+    }
+    memcpy(&length, p, sizeof(length));
+    p += sizeof(length);
+    if (end - p < (ptrdiff_t)length) {
+        return false;
+    }
+    value.assign(p, length);
+    p += length;
+    return true;
+}
+
+template <typename T>
+static bool readValue(const char*& p, const char* end, T& value) {
+    if (end - p < (ptrdiff_t)sizeof(T)) {
+        return false;
+    }
+    memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+/*
+ @brief: Write every live entry (both tiers) to path. The file is written
+         next to the target and renamed, so a crash never leaves half a snapshot.
+*/
+bool CacheManager::saveSnapshot(const std::string& path) {
+    std::vector<std::pair<std::string, std::shared_ptr<const CacheEntry>>> entries;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        entries.reserve(variantCount);
+        for (const auto& item : cache) {
+            for (const auto& variant : item.second.variants) {
+                entries.emplace_back(item.second.key, variant.entry);
+            }
+        }
+    }
+
+    std::string tmpPath = path + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.count = 0;
+    bool ok = writeAll(fd, &header, sizeof(header));
+
+    std::string index;
+    uint64_t offset = sizeof(header);
+    time_t now = time(nullptr);
+    for (const auto& item : entries) {
+        const CacheEntry& entry = *item.second;
+        if (!ok) {
+            break;
+        }
+        if (entry.expiration <= now || (!entry.inMemory() && !entry.disk->valid())) {
+            continue;
         }
+        if (entry.inMemory()) {
+            ok = writeAll(fd, entry.response->data(), entry.size);
+        } else {
+            // File to file copy, the body never passes through user space
+            ok = DiskCache::sendTo(fd, *entry.disk, 0, entry.size) >= 0;
+        }
+        appendField(index, item.first);
+        appendField(index, entry.etag);
+        appendField(index, entry.lastModified);
+        appendField(index, entry.varyKey);
+        appendValue<uint32_t>(index, entry.vary.size());
+        for (const auto& name : entry.vary) {
+            appendField(index, name);
+        }
+        appendValue<int64_t>(index, entry.expiration);
+        appendValue<int64_t>(index, entry.timestamp);
+        appendValue<uint8_t>(index, entry.mustRevalidate);
+        appendValue<uint64_t>(index, entry.headerLength);
+        appendValue<uint64_t>(index, offset);
+        appendValue<uint64_t>(index, entry.size);
+        offset += entry.size;
+        ++header.count;
     }
 
-size_t CacheManager::size() const {
-    return cache.size();
-} 
\ No newline at end of file
+    header.indexOffset = offset;
+    header.indexLength = index.size();
+    ok = ok && writeAll(fd, index.data(), index.size());
+    ok = ok && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) < 0) {
+        unlink(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+/*
+ @brief: Register the entries of a snapshot as disk-resident. Only the index is
+         mapped and parsed; bodies stay in the file and are served with
+         sendfile() or promoted on demand. Expired entries are dropped.
+*/
+size_t CacheManager::loadSnapshot(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    // The segment owns the fd from here on and keeps the file alive
+    auto segment = std::make_shared<DiskSegment>(fd, path);
+    struct stat st;
+    SnapshotHeader header;
+    if (fstat(fd, &st) < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.indexOffset + header.indexLength > (uint64_t)st.st_size) {
+        return 0;
+    }
+
+    // mmap needs a page-aligned offset
+    long pageSize = sysconf(_SC_PAGESIZE);
+    off_t mapStart = header.indexOffset - header.indexOffset % pageSize;
+    size_t mapLength = header.indexOffset + header.indexLength - mapStart;
+    if (header.indexLength == 0) {
+        return 0;
+    }
+    void* map = mmap(nullptr, mapLength, PROT_READ, MAP_PRIVATE, fd, mapStart);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    const char* p = static_cast<const char*>(map) + (header.indexOffset - mapStart);
+    const char* end = p + header.indexLength;
+
+    time_t now = time(nullptr);
+    size_t loaded = 0;
+    EntryList none;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    for (uint64_t i = 0; i < header.count; ++i) {
+        std::string key;
+        auto entry = std::make_shared<CacheEntry>();
+        int64_t expiration, timestamp;
+        uint8_t mustRevalidate;
+        uint64_t headerLength, offset, length;
+        uint32_t varyCount;
+        if (!readField(p, end, key) || !readField(p, end, entry->etag) ||
+            !readField(p, end, entry->lastModified) || !readField(p, end, entry->varyKey) ||
+            !readValue(p, end, varyCount)) {
+            break;
+        }
+        entry->vary.resize(varyCount);
+        bool complete = true;
+        for (auto& name : entry->vary) {
+            complete = complete && readField(p, end, name);
+        }
+        if (!complete || !readValue(p, end, expiration) ||
+            !readValue(p, end, timestamp) || !readValue(p, end, mustRevalidate) || !readValue(p, end, headerLength) ||
+            !readValue(p, end, offset) || !readValue(p, end, length)) {
+            break;
+        }
+        if (expiration <= now || offset + length > header.indexOffset) {
+            continue;
+        }
+        entry->expiration = expiration;
+        entry->timestamp = timestamp;
+        entry->mustRevalidate = mustRevalidate;
+        entry->headerLength = headerLength;
+        entry->size = length;
+        entry->disk = std::make_shared<DiskExtent>();
+        entry->disk->segment = segment;
+        entry->disk->offset = offset;
+        entry->disk->length = length;
+        // Entries stored since startup are newer than the snapshot
+        CacheKey cacheKey = makeCacheKey(key);
+        auto it = findLocked(cacheKey);
+        bool stored = false;
+        if (it != cache.end()) {
+            for (const auto& variant : it->second.variants) {
+                stored = stored || variant.entry->varyKey == entry->varyKey;
+            }
+        }
+        if (!stored) {
+            insertLocked(cacheKey, entry, none);
+            ++loaded;
+        }
+    }
+    munmap(map, mapLength);
+    return loaded;
+}
@@ -1,35 +1,137 @@
 #pragma once
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <list>
+#include <vector>
 #include <mutex>
 #include <chrono>
 #include <memory>
+#include <memory_resource>
+#include "DiskCache.h"
+#include "CacheKey.h"
+#include "HttpHeaders.h"
+#include "Freshness.h"
+#include "EvictionPolicy.h"
+#include "SocketWriter.h"
+#include "SharedCache.h"
+#include "SlabAllocator.h"
+
+// A stored response; in the memory tier its bytes live in the slabs
+typedef std::pmr::string CacheBody;
 
 struct CacheEntry {
-    std::string response;
+    std::shared_ptr<const CacheBody> response;   // set while the object is in memory
+    std::shared_ptr<DiskExtent> disk;            // set while the object is on disk
+    size_t size;
+    std::string etag;
+    std::string lastModified;
+    time_t expiration;
     time_t timestamp;
-    time_t expiry;
-    bool requiresValidation;
+    bool mustRevalidate;
+    std::vector<std::string> vary; // lower-cased header names from the Vary response header
+    std::string varyKey;           // normalized request values of those headers
+    size_t headerLength = 0;       // start of the body; 0 when it cannot be sliced for ranges
+
+    bool inMemory() const { return response != nullptr; }
+};
+
+struct CacheOptions {
+    size_t memoryBytes = 64 * 1024 * 1024;
+    size_t maxMemoryObject = 1024 * 1024;   // larger objects go straight to disk
+    bool diskEnabled = false;
+    std::string diskDirectory = "/var/log/erss/cache";
+    size_t diskSegmentBytes = 64 * 1024 * 1024;
+    size_t diskSegments = 16;
+    unsigned promoteAfterHits = 3;          // disk hits before moving back to memory
+    std::string snapshotPath;               // empty: no warm restarts
+    int snapshotInterval = 300;             // seconds between periodic snapshots
+    size_t maxVariants = 8;                 // Vary variants kept per URL
+    bool rangeFetchFull = false;            // fetch the whole object on a Range miss
+    size_t rangeFetchMax = 16 * 1024 * 1024; // larger objects: only up to the range, not cached
+    std::string evictionPolicy = "lru";     // memory tier: "lru" or "tinylfu"
+    FreshnessOptions freshness;             // lifetimes the origin did not set
+    size_t sharedBytes = 0;                 // shared memory tier for worker processes, 0 = none
+    bool slabs = true;                      // memory tier bodies in size-class slabs, not on the heap
+    bool hugePages = false;                 // back the slab arenas with transparent huge pages
 };
 
 class CacheManager {
 private:
-    std::unordered_map<std::string, CacheEntry> cache;
+    struct Variant {
+        std::shared_ptr<const CacheEntry> entry;
+        PolicyEntry policyEntry; // tracked by the eviction policy while in memory
+        unsigned diskHits;
+        size_t charge = 0;       // memory budget used: the body's chunk with slabs, else its size
+        int slabClass = -1;      // body in the slabs: its size class, to find its page's neighbours
+        std::list<PolicyEntry*>::iterator classPosition;
+    };
+    // One URL: the header names it varies on and its stored variants, oldest first
+    struct Slot {
+        std::string key; // full key, compared on lookup to rule out hash collisions
+        std::vector<std::string> vary;
+        std::list<Variant> variants;
+    };
+    typedef std::unordered_map<uint64_t, Slot, CacheKeyHash> Index;
+    typedef std::vector<std::pair<CacheKey, std::shared_ptr<const CacheEntry>>> EntryList;
+    // Declared before the index, so it outlives the bodies in it
+    std::unique_ptr<SlabAllocator> slabs;
+    std::vector<std::list<PolicyEntry*>> classVariants; // per size class, the variants with a body there
+    Index cache;
+    std::unique_ptr<EvictionPolicy> policy; // orders the memory-resident variants
     std::mutex cacheMutex;
-    size_t maxCacheSize;
-    size_t currentSize;
-    bool isExpired(const CacheEntry& entry) const; // check if the entry is expired
-    void evictLRU(); // evict the least recently used entry
+    CacheOptions options;
+    size_t currentSize;  // charged bytes of the memory tier
+    size_t logicalSize;  // response bytes of the memory tier
+    size_t variantCount;
+    size_t heapBytes;        // charged bytes of memory-tier bodies the slabs had no room for
+    uint64_t heapFallbacks;  // bodies left on the heap that way
+    std::unique_ptr<DiskCache> disk;
+    // Worker processes: looked up before, and filled instead of, the tiers above
+    std::unique_ptr<SharedCache> shared;
+
+    Index::iterator findLocked(const CacheKey& key);
+    std::list<Variant>::iterator findVariantLocked(Slot& slot, const std::shared_ptr<const CacheEntry>& entry);
+    std::list<Variant>::iterator findVariantLocked(Slot& slot, const PolicyEntry* policyEntry);
+    void insertLocked(const CacheKey& key, std::shared_ptr<const CacheEntry> entry, EntryList& evicted);
+    void evictLocked(EntryList& evicted);
+    void evictEntryLocked(PolicyEntry* victim, EntryList& evicted);
+    void placeInSlabs(const CacheKey& key, const std::shared_ptr<const CacheEntry>& entry);
+    std::shared_ptr<const CacheBody> toSlabs(std::string_view body, const std::shared_ptr<const CacheEntry>& placing);
+    bool reclaimPageLocked(const std::shared_ptr<const CacheEntry>& placing, EntryList& evicted);
+    void eraseVariantLocked(Index::iterator it, std::list<Variant>::iterator variant);
+    void eraseLocked(Index::iterator it);
+    void spill(EntryList& evicted);
+    std::shared_ptr<const CacheEntry> toDisk(const CacheEntry& entry);
+    void dropSegment(const std::shared_ptr<DiskSegment>& segment);
+    void promote(const CacheKey& key, std::shared_ptr<const CacheEntry> entry);
 
 public:
-    CacheManager(size_t maxSize = 1024, size_t cursize = 0);
-    std::shared_ptr<CacheEntry> get(const std::string& url);
-    void put(const std::string& url, const std::string& response, 
-             const std::chrono::seconds& maxAge, bool requiresValidation);
-    void remove(const std::string& url);
+    typedef HeaderList Headers;
+
+    CacheManager(const CacheOptions& options = CacheOptions());
+    std::shared_ptr<const CacheEntry> get(const CacheKey& key, const Headers& requestHeaders);
+    void put(const CacheKey& key, std::shared_ptr<CacheEntry> entry);
+    void refresh(const CacheKey& key, const std::shared_ptr<const CacheEntry>& entry, time_t expiration);
+    bool send(int clientSocket, const CacheEntry& entry);
+    bool send(int clientSocket, const CacheEntry& entry, size_t start, size_t length);
+    bool send(SocketWriter& writer, const CacheEntry& entry, size_t start, size_t length);
+    std::string readHeaders(const CacheEntry& entry);
+    std::string_view headerView(const CacheEntry& entry, std::string& storage);
+    CacheOptions getOptions();
+    void reconfigure(const CacheOptions& updated);
+    void remove(const CacheKey& key);
     void clear();
-    
 
-    size_t size() const;
-}; 
\ No newline at end of file
+    static std::string normalizeVaryValue(const std::string& name, const std::string& value);
+    static std::string buildVaryKey(const std::vector<std::string>& vary, const Headers& requestHeaders);
+
+    bool saveSnapshot(const std::string& path);
+    size_t loadSnapshot(const std::string& path);
+
+    size_t size();
+    size_t memoryBytes();
+    // "logical=40M charged=44M" and, with slabs, their page accounting and heap fallbacks
+    std::string describeMemory();
+};
@@ -0,0 +1,163 @@
+#include "CircuitBreaker.h"
+#include <algorithm>
+
+std::string BreakerStats::describe() const {
+    return "open=" + std::to_string(open.load()) +
+           " opened=" + std::to_string(opened.load()) +
+           " closed=" + std::to_string(closed.load()) +
+           " rejected=" + std::to_string(rejected.load()) +
+           " stale_served=" + std::to_string(staleServed.load()) +
+           " probes=" + std::to_string(probes.load());
+}
+
+BreakerStats& CircuitBreaker::stats() {
+    static BreakerStats breakers;
+    return breakers;
+}
+
+void CircuitBreaker::open(Origin& origin, time_t now) {
+    if (origin.state == BREAKER_CLOSED) {
+        stats().open++;
+    }
+    origin.state = BREAKER_OPEN;
+    origin.openedAt = now;
+    origin.probes = 0;
+    origin.generation = ++generations;
+    stats().opened++;
+}
+
+/*
+ @brief: Forget closed origins with nothing in the window, so one-off hosts
+         do not pile up
+*/
+void CircuitBreaker::prune(time_t now, int window) {
+    for (auto it = origins.begin(); it != origins.end();) {
+        const Origin& origin = it->second;
+        bool recent = std::any_of(std::begin(origin.buckets), std::end(origin.buckets),
+                                  [&](const Bucket& bucket) { return now - bucket.second < window; });
+        if (origin.state == BREAKER_CLOSED && !recent) {
+            it = origins.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool CircuitBreaker::allow(const std::string& name, const BreakerOptions& options, time_t now, BreakerTicket& ticket) {
+    ticket = BreakerTicket();
+    if (!options.enabled) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = origins.find(name);
+    if (it == origins.end()) {
+        return true;
+    }
+    Origin& origin = it->second;
+    ticket.generation = origin.generation;
+    if (origin.state == BREAKER_CLOSED) {
+        return true;
+    }
+    if (origin.state == BREAKER_OPEN && now - origin.openedAt >= options.openTime) {
+        origin.state = BREAKER_HALF_OPEN;
+        origin.probes = 0;
+        origin.generation = ++generations;
+    }
+    int maxProbes = std::max(options.halfOpenProbes, 1);
+    if (origin.state == BREAKER_HALF_OPEN && origin.probes >= maxProbes && now - origin.probeAt >= options.openTime) {
+        // Trials that never reported back (the client went away) free their
+        // slots after openTime; their outcomes no longer count
+        origin.probes = 0;
+        origin.generation = ++generations;
+    }
+    if (origin.state == BREAKER_HALF_OPEN && origin.probes < maxProbes) {
+        origin.probes++;
+        origin.probeAt = now;
+        ticket.generation = origin.generation;
+        ticket.probe = true;
+        stats().probes++;
+        return true;
+    }
+    stats().rejected++;
+    return false;
+}
+
+int CircuitBreaker::record(const std::string& name, const BreakerTicket& ticket, bool success, const BreakerOptions& options, time_t now) {
+    if (!options.enabled) {
+        return -1;
+    }
+    int window = std::clamp(options.window, 1, MAX_WINDOW);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = origins.find(name);
+    if (it == origins.end()) {
+        if (success) {
+            // Healthy origins are only tracked once something fails
+            return -1;
+        }
+        if (origins.size() >= MAX_ORIGINS) {
+            prune(now, window);
+        }
+        it = origins.emplace(name, Origin()).first;
+    }
+    Origin& origin = it->second;
+    if (origin.state == BREAKER_HALF_OPEN) {
+        if (!ticket.probe || ticket.generation != origin.generation) {
+            // A request from before the trial: it says nothing about the origin now
+            return -1;
+        }
+        if (success) {
+            origin.state = BREAKER_CLOSED;
+            origin.generation = ++generations;
+            std::fill(std::begin(origin.buckets), std::end(origin.buckets), Bucket());
+            stats().open--;
+            stats().closed++;
+        } else {
+            open(origin, now);
+        }
+        return origin.state;
+    }
+    if (origin.state == BREAKER_OPEN) {
+        // A request from before the circuit opened
+        return -1;
+    }
+    Bucket& bucket = origin.buckets[now % window];
+    if (bucket.second != now) {
+        bucket = Bucket();
+        bucket.second = now;
+    }
+    (success ? bucket.successes : bucket.failures)++;
+    if (success) {
+        return -1;
+    }
+    uint64_t successes = 0, failures = 0;
+    for (int i = 0; i < window; i++) {
+        if (now - origin.buckets[i].second < window) {
+            successes += origin.buckets[i].successes;
+            failures += origin.buckets[i].failures;
+        }
+    }
+    if (successes + failures >= (uint64_t)std::max(options.minRequests, 1) &&
+        failures * 100 >= (successes + failures) * options.failurePercent) {
+        open(origin, now);
+        return BREAKER_OPEN;
+    }
+    return -1;
+}
+
+int CircuitBreaker::retryAfter(const std::string& name, const BreakerOptions& options, time_t now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = origins.find(name);
+    if (it == origins.end() || it->second.state == BREAKER_CLOSED) {
+        return 0;
+    }
+    if (it->second.state == BREAKER_HALF_OPEN) {
+        return 1;
+    }
+    return std::max<int>(1, options.openTime - (int)(now - it->second.openedAt));
+}
+
+BreakerState CircuitBreaker::state(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = origins.find(name);
+    return it == origins.end() ? BREAKER_CLOSED : it->second.state;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+ @brief: When an origin counts as unhealthy, and how it is tried again
+*/
+struct BreakerOptions {
+    bool enabled = true;
+    int window = 10;          // seconds of outcomes the failure rate is taken over
+    int minRequests = 5;      // outcomes in the window before the circuit can open
+    int failurePercent = 50;  // failure rate that opens it
+    int openTime = 10;        // seconds an open circuit fails fast before a trial
+    int halfOpenProbes = 1;   // trial requests let through at a time
+    bool serveStale = true;   // answer from a stale cached copy while open
+};
+
+enum BreakerState { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+
+// What allow() let through, handed back to record() with the outcome
+struct BreakerTicket {
+    uint64_t generation = 0; // the circuit's generation when the request went out
+    bool probe = false;      // a half-open trial
+};
+
+struct BreakerStats {
+    std::atomic<uint64_t> opened{0};      // closed or half-open -> open
+    std::atomic<uint64_t> closed{0};      // half-open -> closed after a trial
+    std::atomic<uint64_t> rejected{0};    // requests failed fast
+    std::atomic<uint64_t> staleServed{0}; // answered from a stale copy, origin down
+    std::atomic<uint64_t> probes{0};      // trial requests
+    std::atomic<int64_t> open{0};         // circuits open or half-open now
+
+    // "open=1 opened=3 closed=2 rejected=40 stale_served=12 probes=3" for the log
+    std::string describe() const;
+};
+
+/*
+ @brief: Per-origin health over a sliding window of one second buckets.
+         Closed: everything passes and outcomes are counted. Open: requests
+         fail fast for openTime. Half-open: a few trial requests pass; the
+         first outcome of a trial closes or reopens the circuit. Every state
+         change starts a new generation, so a late outcome from an earlier
+         one cannot decide a half-open circuit.
+*/
+class CircuitBreaker {
+private:
+    static constexpr int MAX_WINDOW = 60;
+    static constexpr size_t MAX_ORIGINS = 4096;
+    struct Bucket {
+        time_t second = 0;
+        uint32_t successes = 0;
+        uint32_t failures = 0;
+    };
+    struct Origin {
+        BreakerState state = BREAKER_CLOSED;
+        time_t openedAt = 0;
+        time_t probeAt = 0;   // when the last trial went out
+        int probes = 0;       // trials without an outcome yet
+        uint64_t generation = 0;
+        Bucket buckets[MAX_WINDOW];
+    };
+    std::mutex mutex;
+    std::unordered_map<std::string, Origin> origins;
+    uint64_t generations = 0; // unique across origins, so a pruned one cannot reuse them
+
+    void open(Origin& origin, time_t now);
+    void prune(time_t now, int window);
+
+public:
+    // Whether a request to origin may go out now; counts the rejection if not
+    bool allow(const std::string& origin, const BreakerOptions& options, time_t now, BreakerTicket& ticket);
+    // Outcome of a request allow() let through. Returns the state when it changed, else -1.
+    int record(const std::string& origin, const BreakerTicket& ticket, bool success, const BreakerOptions& options, time_t now);
+    // Seconds until an open circuit lets a trial through, 0 if not open
+    int retryAfter(const std::string& origin, const BreakerOptions& options, time_t now);
+    BreakerState state(const std::string& origin);
+
+    static BreakerStats& stats();
+};
@@ -0,0 +1,50 @@
+#include "Compressor.h"
+#include <cstring>
+
+GzipCompressor::GzipCompressor(int level) : ready(false) {
+    memset(&stream, 0, sizeof(stream));
+    // 15 + 16: largest window, gzip wrapper instead of zlib
+    ready = deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+GzipCompressor::~GzipCompressor() {
+    if (ready) {
+        deflateEnd(&stream);
+    }
+}
+
+bool GzipCompressor::compress(const char* data, size_t length, std::string& out) {
+    if (!ready) {
+        return false;
+    }
+    char buffer[16384];
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = length;
+    while (stream.avail_in > 0) {
+        stream.next_out = (Bytef*)buffer;
+        stream.avail_out = sizeof(buffer);
+        if (deflate(&stream, Z_NO_FLUSH) == Z_STREAM_ERROR) {
+            return false;
+        }
+        out.append(buffer, sizeof(buffer) - stream.avail_out);
+    }
+    return true;
+}
+
+bool GzipCompressor::finish(std::string& out) {
+    if (!ready) {
+        return false;
+    }
+    char buffer[16384];
+    int result;
+    do {
+        stream.next_out = (Bytef*)buffer;
+        stream.avail_out = sizeof(buffer);
+        result = deflate(&stream, Z_FINISH);
+        if (result == Z_STREAM_ERROR) {
+            return false;
+        }
+        out.append(buffer, sizeof(buffer) - stream.avail_out);
+    } while (result != Z_STREAM_END);
+    return true;
+}
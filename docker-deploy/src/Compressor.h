@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+struct CompressionOptions {
+    bool enabled = false;
+    int level = 6;            // zlib level 1..9
+    size_t minSize = 1024;    // smaller bodies are not worth a gzip header
+    std::vector<std::string> types = {"text/", "application/json", "application/javascript",
+                                      "application/xml", "image/svg+xml"};
+};
+
+/*
+ @brief: Streaming gzip encoder; compressed output is appended to out
+*/
+class GzipCompressor {
+private:
+    z_stream stream;
+    bool ready;
+
+public:
+    GzipCompressor(int level);
+    ~GzipCompressor();
+
+    bool compress(const char* data, size_t length, std::string& out);
+    bool finish(std::string& out);
+};
@@ -0,0 +1,333 @@
+#include "Config.h"
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <strings.h>
+#include <cstdlib>
+#include <cerrno>
+
+static std::string trim(const std::string& value) {
+    size_t start = value.find_first_not_of(" \t\r");
+    if (start == std::string::npos) {
+        return "";
+    }
+    size_t end = value.find_last_not_of(" \t\r");
+    return value.substr(start, end - start + 1);
+}
+
+static bool parseBool(const std::string& value, bool& out) {
+    const char* text = value.c_str();
+    if (strcasecmp(text, "true") == 0 || strcasecmp(text, "on") == 0 || strcasecmp(text, "yes") == 0 || value == "1") {
+        out = true;
+        return true;
+    }
+    if (strcasecmp(text, "false") == 0 || strcasecmp(text, "off") == 0 || strcasecmp(text, "no") == 0 || value == "0") {
+        out = false;
+        return true;
+    }
+    return false;
+}
+
+/*
+ @brief: Non-negative decimal number; with sizeSuffix also a K, M or G
+         suffix (powers of 1024), for keys that count bytes
+*/
+static bool parseNumber(const std::string& value, bool sizeSuffix, size_t& out) {
+    if (value.empty() || value[0] < '0' || value[0] > '9') {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    unsigned long long number = strtoull(value.c_str(), &end, 10);
+    if (errno == ERANGE) {
+        return false;
+    }
+    int shift = 0;
+    if (sizeSuffix) {
+        switch (*end) {
+            case 'k': case 'K': shift = 10; ++end; break;
+            case 'm': case 'M': shift = 20; ++end; break;
+            case 'g': case 'G': shift = 30; ++end; break;
+            default: break;
+        }
+    }
+    if (*end != '\0' || number > (~0ULL >> shift)) {
+        return false;
+    }
+    out = number << shift;
+    return true;
+}
+
+// Byte sizes: "64K", "16M", "1G" or plain bytes
+static bool parseSize(const std::string& value, size_t& out) {
+    return parseNumber(value, true, out);
+}
+
+// Counts, seconds, percentages: digits only
+static bool parseCount(const std::string& value, size_t& out) {
+    return parseNumber(value, false, out);
+}
+
+/*
+ @brief: Comma separated, blanks around the items dropped
+*/
+static bool parseList(const std::string& value, std::vector<std::string>& out) {
+    out.clear();
+    std::stringstream items(value);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        item = trim(item);
+        if (!item.empty()) {
+            out.push_back(item);
+        }
+    }
+    return true;
+}
+
+static bool parseInt(const std::string& value, int& out, bool sizeSuffix = false) {
+    size_t number;
+    if (!parseNumber(value, sizeSuffix, number) || number > 0x7fffffff) {
+        return false;
+    }
+    out = (int)number;
+    return true;
+}
+
+/*
+ @brief: Set one key. Returns false with error set for unknown keys and
+         values that do not parse.
+*/
+bool setConfigValue(Config& config, const std::string& key, const std::string& value, std::string& error) {
+    bool ok;
+    // Proxy
+    if (key == "port") ok = parseInt(value, config.port) && config.port >= 1 && config.port <= 65535;
+    else if (key == "listen_backlog") ok = parseInt(value, config.listenBacklog);
+    else if (key == "io_backend") {
+        config.ioBackend = value;
+        ok = value == "threads" || value == "uring" || value == "async";
+    }
+    else if (key == "loop_threads") ok = parseInt(value, config.loopThreads) && config.loopThreads > 0;
+    else if (key == "blocking_threads") ok = parseInt(value, config.blockingThreads) && config.blockingThreads > 0;
+    else if (key == "workers") ok = parseInt(value, config.workers);
+    else if (key == "log_path") { config.logPath = value; ok = !value.empty(); }
+    else if (key == "max_clients") ok = parseInt(value, config.maxClients);
+    else if (key == "buffer_size") ok = parseSize(value, config.bufferSize) && config.bufferSize >= 1024;
+    else if (key == "header_timeout") ok = parseInt(value, config.headerTimeout);
+    else if (key == "idle_timeout") ok = parseInt(value, config.idleTimeout);
+    else if (key == "connect_timeout") ok = parseInt(value, config.connectTimeout);
+    else if (key == "first_byte_timeout") ok = parseInt(value, config.firstByteTimeout);
+    else if (key == "tunnel_timeout") ok = parseInt(value, config.tunnelTimeout);
+    else if (key == "drain_timeout") ok = parseInt(value, config.drainTimeout);
+    else if (key == "upgrade_socket") { config.upgradeSocket = value; ok = true; }
+    else if (key == "upgrade_cache") ok = parseBool(value, config.upgradeCache);
+    else if (key == "pool.global_buffers") ok = parseCount(value, config.poolGlobalBuffers);
+    else if (key == "pool.thread_buffers") ok = parseCount(value, config.poolThreadBuffers);
+    // Cache
+    else if (key == "cache.memory_bytes") ok = parseSize(value, config.cache.memoryBytes);
+    else if (key == "cache.max_memory_object") ok = parseSize(value, config.cache.maxMemoryObject);
+    else if (key == "cache.disk") ok = parseBool(value, config.cache.diskEnabled);
+    else if (key == "cache.disk_directory") { config.cache.diskDirectory = value; ok = !value.empty(); }
+    else if (key == "cache.disk_segment_bytes") ok = parseSize(value, config.cache.diskSegmentBytes);
+    else if (key == "cache.disk_segments") ok = parseCount(value, config.cache.diskSegments) && config.cache.diskSegments > 0;
+    else if (key == "cache.slabs") ok = parseBool(value, config.cache.slabs);
+    else if (key == "cache.huge_pages") ok = parseBool(value, config.cache.hugePages);
+    else if (key == "cache.shared_bytes") ok = parseSize(value, config.cache.sharedBytes) && (config.cache.sharedBytes == 0 || config.cache.sharedBytes >= 4 * 1024 * 1024);
+    else if (key == "cache.promote_after_hits") {
+        size_t hits;
+        ok = parseCount(value, hits);
+        config.cache.promoteAfterHits = hits;
+    }
+    else if (key == "cache.snapshot") { config.cache.snapshotPath = value; ok = true; }
+    else if (key == "cache.snapshot_interval") ok = parseInt(value, config.cache.snapshotInterval) && config.cache.snapshotInterval > 0;
+    else if (key == "cache.max_variants") ok = parseCount(value, config.cache.maxVariants);
+    else if (key == "cache.range_fetch_full") ok = parseBool(value, config.cache.rangeFetchFull);
+    else if (key == "cache.range_fetch_max") ok = parseSize(value, config.cache.rangeFetchMax);
+    else if (key == "cache.default_ttl") ok = parseInt(value, config.cache.freshness.defaultTtl);
+    else if (key == "cache.heuristic_percent") ok = parseInt(value, config.cache.freshness.heuristicPercent) && config.cache.freshness.heuristicPercent <= 100;
+    else if (key == "cache.heuristic_max") ok = parseInt(value, config.cache.freshness.heuristicMax);
+    else if (key == "cache.negative_ttl") ok = parseInt(value, config.cache.freshness.negativeTtl);
+    else if (key == "cache.error_statuses") {
+        std::vector<std::string> statuses;
+        parseList(value, statuses);
+        config.cache.freshness.errorStatuses.clear();
+        ok = true;
+        for (const std::string& status : statuses) {
+            int code;
+            ok = ok && parseInt(status, code) && code >= 500 && code <= 599;
+            config.cache.freshness.errorStatuses.push_back(code);
+        }
+    }
+    else if (key == "cache.error_ttl") ok = parseInt(value, config.cache.freshness.errorTtl);
+    else if (key == "cache.eviction") {
+        config.cache.evictionPolicy = value;
+        ok = value == "lru" || value == "tinylfu";
+    }
+    // Compression
+    else if (key == "gzip.enabled") ok = parseBool(value, config.compression.enabled);
+    else if (key == "gzip.level") ok = parseInt(value, config.compression.level) && config.compression.level >= 1 && config.compression.level <= 9;
+    else if (key == "gzip.min_size") ok = parseSize(value, config.compression.minSize);
+    else if (key == "gzip.types") ok = parseList(value, config.compression.types);
+    // Circuit breaker
+    else if (key == "breaker.enabled") ok = parseBool(value, config.breaker.enabled);
+    else if (key == "breaker.window") ok = parseInt(value, config.breaker.window) && config.breaker.window >= 1 && config.breaker.window <= 60;
+    else if (key == "breaker.min_requests") ok = parseInt(value, config.breaker.minRequests) && config.breaker.minRequests > 0;
+    else if (key == "breaker.failure_percent") ok = parseInt(value, config.breaker.failurePercent) && config.breaker.failurePercent >= 1 && config.breaker.failurePercent <= 100;
+    else if (key == "breaker.open_time") ok = parseInt(value, config.breaker.openTime);
+    else if (key == "breaker.half_open_probes") ok = parseInt(value, config.breaker.halfOpenProbes) && config.breaker.halfOpenProbes > 0;
+    else if (key == "breaker.serve_stale") ok = parseBool(value, config.breaker.serveStale);
+    // Hedged GETs
+    else if (key == "hedge.enabled") ok = parseBool(value, config.hedge.enabled);
+    else if (key == "hedge.delay") ok = parseInt(value, config.hedge.delay);
+    else if (key == "hedge.min_delay") ok = parseInt(value, config.hedge.minDelay);
+    else if (key == "hedge.budget_percent") ok = parseInt(value, config.hedge.budgetPercent) && config.hedge.budgetPercent <= 100;
+    // Cache peers
+    else if (key == "peer.nodes") ok = parseList(value, config.peers.nodes);
+    else if (key == "peer.self") { config.peers.self = value; ok = true; }
+    else if (key == "peer.retry") ok = parseInt(value, config.peers.retry);
+    // TLS interception
+    else if (key == "tls.intercept") ok = parseBool(value, config.tls.intercept);
+    else if (key == "tls.domains") ok = parseList(value, config.tls.domains);
+    else if (key == "tls.ca_cert") { config.tls.caCert = value; ok = true; }
+    else if (key == "tls.ca_key") { config.tls.caKey = value; ok = true; }
+    else if (key == "tls.verify_upstream") ok = parseBool(value, config.tls.verifyUpstream);
+    else if (key == "tls.upstream_ca") { config.tls.upstreamCa = value; ok = true; }
+    // Sockets
+    else if (key == "socket.reuseaddr") ok = parseBool(value, config.socket.reuseAddress);
+    else if (key == "socket.nodelay") ok = parseBool(value, config.socket.noDelay);
+    else if (key == "socket.fastopen") ok = parseBool(value, config.socket.fastOpen);
+    else if (key == "socket.fastopen_queue") ok = parseInt(value, config.socket.fastOpenQueue);
+    else if (key == "socket.defer_accept") ok = parseInt(value, config.socket.deferAccept);
+    else if (key == "socket.rcvbuf") ok = parseInt(value, config.socket.receiveBuffer, true);
+    else if (key == "socket.sndbuf") ok = parseInt(value, config.socket.sendBuffer, true);
+    else if (key == "socket.keepalive") ok = parseBool(value, config.socket.keepAlive);
+    else if (key == "socket.keepalive_idle") ok = parseInt(value, config.socket.keepAliveIdle);
+    else if (key == "socket.keepalive_interval") ok = parseInt(value, config.socket.keepAliveInterval);
+    else if (key == "socket.keepalive_count") ok = parseInt(value, config.socket.keepAliveCount);
+    else {
+        error = "unknown key \"" + key + "\"";
+        return false;
+    }
+    if (!ok) {
+        error = "bad value \"" + value + "\" for " + key;
+    }
+    return ok;
+}
+
+/*
+ @brief: Defaults, then the file, then the overrides
+*/
+bool buildConfig(const ConfigSource& source, Config& config, std::string& error) {
+    Config built;
+    if (!source.path.empty()) {
+        std::ifstream file(source.path);
+        if (!file.is_open()) {
+            error = "cannot open " + source.path;
+            return false;
+        }
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(file, line)) {
+            ++lineNumber;
+            size_t comment = line.find('#');
+            if (comment != std::string::npos) {
+                line.erase(comment);
+            }
+            line = trim(line);
+            if (line.empty()) {
+                continue;
+            }
+            size_t equals = line.find('=');
+            if (equals == std::string::npos) {
+                error = source.path + ":" + std::to_string(lineNumber) + ": expected key = value";
+                return false;
+            }
+            std::string lineError;
+            if (!setConfigValue(built, trim(line.substr(0, equals)), trim(line.substr(equals + 1)), lineError)) {
+                error = source.path + ":" + std::to_string(lineNumber) + ": " + lineError;
+                return false;
+            }
+        }
+    }
+    for (const auto& item : source.overrides) {
+        if (!setConfigValue(built, item.first, item.second, error)) {
+            return false;
+        }
+    }
+    config = built;
+    return true;
+}
+
+/*
+ @brief: --config FILE and --set key=value, plus the older single-purpose
+         flags, which are recorded as the overrides they stand for
+*/
+bool parseCommandLine(int argc, char* argv[], ConfigSource& source, std::string& error) {
+    auto& overrides = source.overrides;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--config" && hasValue) {
+            source.path = argv[++i];
+        } else if (arg == "--set" && hasValue) {
+            std::string setting = argv[++i];
+            size_t equals = setting.find('=');
+            if (equals == std::string::npos) {
+                error = "--set expects key=value";
+                return false;
+            }
+            overrides.emplace_back(setting.substr(0, equals), setting.substr(equals + 1));
+        } else if (arg == "--upgrade") {
+            source.takeOver = true;
+        } else if (arg == "--port" && hasValue) {
+            overrides.emplace_back("port", argv[++i]);
+        } else if (arg == "--disk-cache" && hasValue) {
+            overrides.emplace_back("cache.disk", "true");
+            overrides.emplace_back("cache.disk_directory", argv[++i]);
+        } else if (arg == "--snapshot" && hasValue) {
+            overrides.emplace_back("cache.snapshot", argv[++i]);
+        } else if (arg == "--gzip" && hasValue) {
+            overrides.emplace_back("gzip.enabled", "true");
+            overrides.emplace_back("gzip.level", argv[++i]);
+        } else if (arg == "--gzip-min-size" && hasValue) {
+            overrides.emplace_back("gzip.min_size", argv[++i]);
+        } else if (arg == "--eviction" && hasValue) {
+            overrides.emplace_back("cache.eviction", argv[++i]);
+        } else if (arg == "--no-nodelay") {
+            overrides.emplace_back("socket.nodelay", "false");
+        } else if (arg == "--no-reuseaddr") {
+            overrides.emplace_back("socket.reuseaddr", "false");
+        } else if (arg == "--no-keepalive") {
+            overrides.emplace_back("socket.keepalive", "false");
+        } else if (arg == "--fastopen") {
+            overrides.emplace_back("socket.fastopen", "true");
+        } else if (arg == "--defer-accept" && hasValue) {
+            overrides.emplace_back("socket.defer_accept", argv[++i]);
+        } else if (arg == "--rcvbuf" && hasValue) {
+            overrides.emplace_back("socket.rcvbuf", argv[++i]);
+        } else if (arg == "--sndbuf" && hasValue) {
+            overrides.emplace_back("socket.sndbuf", argv[++i]);
+        } else {
+            error = "unknown option " + arg;
+            return false;
+        }
+    }
+    return true;
+}
+
+RuntimeSettings::RuntimeSettings(const Config& config)
+    : ioBackend(config.ioBackend), loopThreads(config.loopThreads), blockingThreads(config.blockingThreads),
+      compression(config.compression), socket(config.socket), tls(config.tls), breaker(config.breaker),
+      hedge(config.hedge), peers(config.peers), bufferSize(config.bufferSize),
+      headerTimeout(config.headerTimeout), idleTimeout(config.idleTimeout), connectTimeout(config.connectTimeout),
+      firstByteTimeout(config.firstByteTimeout), tunnelTimeout(config.tunnelTimeout),
+      drainTimeout(config.drainTimeout), maxClients(config.maxClients) {}
+
+SharedSettings::SharedSettings(const Config& config) : current(std::make_shared<const RuntimeSettings>(config)) {}
+
+std::shared_ptr<const RuntimeSettings> SharedSettings::get() const {
+    return std::atomic_load(&current);
+}
+
+void SharedSettings::set(const Config& config) {
+    std::atomic_store(&current, std::shared_ptr<const RuntimeSettings>(std::make_shared<const RuntimeSettings>(config)));
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include "CacheManager.h"
+#include "Compressor.h"
+#include "SocketOptions.h"
+#include "TlsInterceptor.h"
+#include "CircuitBreaker.h"
+#include "HedgePolicy.h"
+#include "PeerRing.h"
+
+/*
+ @brief: Every tunable of the proxy. Built from the defaults below, then a
+         "key = value" file, then command line overrides. See proxy.conf for
+         the keys and which of them SIGHUP reloads.
+*/
+struct Config {
+    int port = 12345;
+    int listenBacklog = 10;
+    std::string ioBackend = "threads";  // "threads", "async" (event loops) or "uring" (event loops over io_uring, if built in)
+    int loopThreads = 4;             // io_backend async/uring: event loop threads
+    int blockingThreads = 16;        // io_backend async/uring: threads for name lookups and cache sends
+    int workers = 0;                 // processes sharing the listener and a shared memory cache, 0 = serve in this one
+    std::string logPath = "/var/log/erss/proxy.log";
+    int maxClients = 0;              // concurrent client threads, 0 = unlimited
+    size_t bufferSize = 65536;       // recv() buffer per transfer
+    int headerTimeout = 30;          // seconds a client gets to send its request
+    int idleTimeout = 60;            // seconds a body transfer may stall
+    int connectTimeout = 5;          // seconds for an upstream connect()
+    int firstByteTimeout = 60;       // seconds until the upstream starts answering
+    int tunnelTimeout = 300;         // seconds a CONNECT tunnel may sit idle; 0 disables any of these
+    int drainTimeout = 30;           // seconds clients get to finish on stop or upgrade
+    std::string upgradeSocket;       // Unix socket for handing over to a new process, empty = off
+    bool upgradeCache = true;        // with --upgrade, also take over the cache
+    size_t poolGlobalBuffers = 256;  // BufferPool: buffers per class kept for all threads
+    size_t poolThreadBuffers = 8;    // BufferPool: buffers per class kept by one thread
+    CacheOptions cache;
+    CompressionOptions compression;
+    SocketOptions socket;
+    TlsOptions tls;
+    BreakerOptions breaker;
+    HedgeOptions hedge;
+    PeerOptions peers;
+};
+
+/*
+ @brief: Where a Config comes from, kept so SIGHUP can rebuild it the same way
+*/
+struct ConfigSource {
+    std::string path;                                            // empty: no file
+    std::vector<std::pair<std::string, std::string>> overrides;  // command line, applied last
+    bool takeOver = false;                                       // --upgrade: start from the running process
+};
+
+bool setConfigValue(Config& config, const std::string& key, const std::string& value, std::string& error);
+bool buildConfig(const ConfigSource& source, Config& config, std::string& error);
+bool parseCommandLine(int argc, char* argv[], ConfigSource& source, std::string& error);
+
+/*
+ @brief: The part of the configuration request threads read. Swapped as a
+         whole on reload, so a request sees either all old or all new values.
+*/
+struct RuntimeSettings {
+    std::string ioBackend;
+    int loopThreads;
+    int blockingThreads;
+    CompressionOptions compression;
+    SocketOptions socket;
+    TlsOptions tls;
+    BreakerOptions breaker;
+    HedgeOptions hedge;
+    PeerOptions peers;
+    size_t bufferSize;
+    int headerTimeout;
+    int idleTimeout;
+    int connectTimeout;
+    int firstByteTimeout;
+    int tunnelTimeout;
+    int drainTimeout;
+    int maxClients;
+
+    explicit RuntimeSettings(const Config& config);
+    // A timeout above in the milliseconds asyncPoll() takes, -1 when disabled
+    static int milliseconds(int seconds) { return seconds > 0 ? seconds * 1000 : -1; }
+};
+
+class SharedSettings {
+private:
+    std::shared_ptr<const RuntimeSettings> current;
+
+public:
+    explicit SharedSettings(const Config& config = Config());
+    std::shared_ptr<const RuntimeSettings> get() const;
+    void set(const Config& config);
+};
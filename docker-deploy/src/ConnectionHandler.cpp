@@ -5,49 +5,156 @@
 #include <stdexcept>
 #include <iostream>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include "BufferPool.h"
+#include "IoUring.h"
+#include "AsyncIo.h"
+#include "TimingWheel.h"
 //#include "MessageForwarder.h"
 
+static const char BUSY_RESPONSE[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
 
-ConnectionHandler::ConnectionHandler(std::shared_ptr<RequestHandler> handler, std::shared_ptr<Logger> logger)
-    : requestHandler(handler), logger(logger), serverSocket(-1), id(0) {}
+
+ConnectionHandler::ConnectionHandler(std::shared_ptr<RequestHandler> handler, std::shared_ptr<CacheManager> cache, std::shared_ptr<Logger> logger,
+                                     std::shared_ptr<SharedSettings> settings)
+    : requestHandler(handler), cacheManager(cache), logger(logger),
+      settings(settings ? settings : std::make_shared<SharedSettings>()),
+      serverSocket(-1), id(0), accepting(false) {
+    forwarder = std::make_unique<MessageForwarder>(cacheManager, this->settings);
+    const TlsOptions& tls = this->settings->get()->tls;
+    if (tls.intercept) {
+#ifdef WEBPROXY_TLS
+        try {
+            forwarder->setInterceptor(std::make_shared<TlsInterceptor>(tls));
+            logger->log(Logger::INFO, "Intercepting TLS for " + std::to_string(tls.domains.size()) + " domains");
+        } catch (const std::runtime_error& e) {
+            logger->log(Logger::ERROR, std::string(e.what()) + ", tunnelling all CONNECTs");
+        }
+#else
+        logger->log(Logger::WARNING, "Built without TLS (TLS=0), tunnelling all CONNECTs");
+#endif
+    }
+    if (pipe2(wakePipe, O_CLOEXEC) < 0) {
+        throw std::runtime_error("Failed to create pipe");
+    }
+    // stop() never blocks. The read end stays blocking: io_uring completes a
+    // read on an O_NONBLOCK file with EAGAIN instead of waiting.
+    fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+}
 
 ConnectionHandler::~ConnectionHandler() {
     stop();
+    if (serverSocket >= 0) {
+        close(serverSocket);
+    }
+    close(wakePipe[0]);
+    close(wakePipe[1]);
 }
 /**
- * @brief: Start listen at the the port for clients' requests
+ * @brief: Create the listening socket and bind it to port, not listening yet
  */
-void ConnectionHandler::start(int port) {
+int ConnectionHandler::bindListener(int port) {
     // Create the socket
-    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket < 0) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
         logger->log(Logger::ERROR, "Failed to create socket");
         throw std::runtime_error("Failed to create socket");
     }
 
+    // Listener options apply at startup only
+    tuneListener(listener, settings->get()->socket);
+
     struct sockaddr_in serverAddr;
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_addr.s_addr = INADDR_ANY;
     serverAddr.sin_port = htons(port);
     // Bind the socket
-    if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+    if (bind(listener, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+        close(listener);
         logger->log(Logger::ERROR, "Failed to bind socket");
         throw std::runtime_error("Failed to bind socket");
     }
-    // Listen at the socket 
-    if (listen(serverSocket, 10) < 0) {
+    return listener;
+}
+
+/**
+ * @brief: Start listen at the the port for clients' requests. A listener
+ *         inherited from the previous process or the worker supervisor
+ *         (listenFd) is used as it is.
+ */
+void ConnectionHandler::start(int port, int backlog, int listenFd) {
+    int listener = listenFd;
+    if (listener < 0) {
+        listener = bindListener(port);
+    }
+    // Listen at the socket; on an inherited socket this only updates the backlog
+    if (listen(listener, backlog) < 0) {
+        close(listener);
         logger->log(Logger::ERROR, "Failed to listen on socket");
         throw std::runtime_error("Failed to listen on socket");
     }
-    
-    MessageForwarder forwarder;
-    while (true) {
+    // Non-blocking: during a handoff two processes accept from the same socket
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL, 0) | O_NONBLOCK);
+    serverSocket = listener;
+
+    accepting = true;
+    std::string backend = settings->get()->ioBackend;
+    if (backend == "async" || backend == "uring") {
+        acceptWithLoops(listener, backend == "uring");
+    } else {
+        std::vector<std::unique_ptr<EventLoop>> noLoops;
+        acceptWithPoll(listener, noLoops);
+    }
+
+    // Stopped: let the clients that are still being served finish
+    drain(settings->get()->drainTimeout);
+    for (auto& thread : clientThreads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    clientThreads.clear();
+    close(serverSocket);
+    serverSocket = -1;
+}
+/**
+ * @brief: Accept until stopped. Each client gets a thread that reads the
+ *         request or, with event loops, a coroutine on the next loop.
+ */
+void ConnectionHandler::acceptWithPoll(int listener, std::vector<std::unique_ptr<EventLoop>>& loops) {
+    struct pollfd fds[2];
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakePipe[0];
+    fds[1].events = POLLIN;
+    while (accepting) {
+        // Block until a request comes or stop() writes to the pipe. The listener
+        // may be shared with a successor, so it is never shut down to wake us.
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            logger->log(Logger::ERROR, "Failed to poll the listening socket");
+            break;
+        }
+        if (!accepting) {
+            break;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
         struct sockaddr_in clientAddr;
         socklen_t clientAddrLen = sizeof(clientAddr);
-        // Block until request come
-        int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientAddrLen);
+        int clientSocket = accept(listener, (struct sockaddr*)&clientAddr, &clientAddrLen);
         if (clientSocket < 0) {
-            logger->log(Logger::ERROR, "Failed to accept connection");
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                logger->log(Logger::ERROR, "Failed to accept connection");
+            }
+            continue;
+        }
+        // Over the client limit: refuse instead of starting another thread
+        if (!admit(clientSocket)) {
+            send(clientSocket, BUSY_RESPONSE, sizeof(BUSY_RESPONSE) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(clientSocket);
             continue;
         }
         
@@ -61,39 +168,325 @@ void ConnectionHandler::start(int port) {
         // Store the new request
         std::string ip = std::string(clientIP);
         //logger->log("from " + ip, id);
+        if (!loops.empty()) {
+            loops[id % loops.size()]->spawn(serveClient(clientSocket, id, std::string()));
+            continue;
+        }
         // Create a new thread and execute handleClient func
-        clientThreads.emplace_back(&ConnectionHandler::handleClient, this, clientSocket, id, std::ref(forwarder));
-    } 
+        clientThreads.emplace_back(&ConnectionHandler::handleClient, this, clientSocket, id);
+    }
+
 }
+
 /**
- * @brief: Handle user request, and return response
+ * @brief: Event loops: every client is a coroutine, so loop_threads threads
+ *         serve them all; blocking work goes to blocking_threads more.
+ *         uring: the loops read and write their sockets through io_uring
+ *         and the clients are accepted on a ring as well.
  */
-void ConnectionHandler::handleClient(int clientSocket, int clientId, MessageForwarder& forwarder) {
-    //const int BUFFER_SIZE = 4096;
-    char buffer[BUFFER_SIZE];
-    // Read the data
-    ssize_t bytesRead = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0);
-    if (bytesRead > 0) {
-        // Add the end symbol
-        buffer[bytesRead] = '\0';
-        // Convert the C style string to the C++ style
-        std::string request(buffer);
-        // Get the response 
-        requestHandler->handleRequest(request, clientSocket, clientId, forwarder);
+void ConnectionHandler::acceptWithLoops(int listener, bool uring) {
+    auto current = settings->get();
+    BlockingPool pool(current->blockingThreads);
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    for (int i = 0; i < current->loopThreads; ++i) {
+        loops.push_back(std::make_unique<EventLoop>(&pool, uring));
     }
+    logger->log(Logger::INFO, "Serving clients with " + std::to_string(loops.size()) + " event loops");
+    bool served = false;
+    if (uring) {
+#ifdef WEBPROXY_IO_URING
+        served = loops[0]->ring() && acceptWithUring(listener, loops);
+        if (!served) {
+            logger->log(Logger::WARNING, "io_uring is not available, serving with epoll");
+        }
+#else
+        logger->log(Logger::WARNING, "Built without io_uring (IO_URING=0), serving with epoll");
+#endif
+    }
+    if (!served) {
+        acceptWithPoll(listener, loops);
+    }
+
+    // The loops have to outlive their clients: drain here, then wait for the
+    // ones whose sockets were shut down to unwind
+    drain(settings->get()->drainTimeout);
+    std::unique_lock<std::mutex> lock(clientsMutex);
+    clientsDone.wait(lock, [this] { return clientSockets.empty(); });
+}
+
+/**
+ * @brief: A client on an event loop: the same steps as handleClient. The
+ *         io_uring front end passes the request it has read already.
+ */
+Task<void> ConnectionHandler::serveClient(int clientSocket, int clientId, std::string request) {
+    std::string received = std::move(request);
+    if (received.empty()) {
+        std::string read = co_await readRequest(clientSocket);
+        received = std::move(read);
+    }
+    if (!received.empty()) {
+        co_await requestHandler->handleRequest(received, clientSocket, clientId, *forwarder);
+    }
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        clientSockets.erase(clientSocket);
+    }
+    clientsDone.notify_all();
     close(clientSocket);
 }
 
-void ConnectionHandler::stop() {
-    if (serverSocket >= 0) {
-        close(serverSocket);
-        serverSocket = -1;
+/**
+ * @brief: The client's request, or nothing if it closed, failed or sent
+ *         nothing within header_timeout
+ */
+Task<std::string> ConnectionHandler::readRequest(int clientSocket) {
+    auto current = settings->get();
+    PooledBuffer pooled(current->bufferSize);
+    std::string request;
+    ssize_t bytesRead = co_await asyncRead(clientSocket, pooled.data(), current->bufferSize - 1,
+                                           RuntimeSettings::milliseconds(current->headerTimeout));
+    if (bytesRead > 0) {
+        request.assign(pooled.data(), bytesRead);
+    } else if (bytesRead < 0 && errno == ETIMEDOUT) {
+        TimingWheel::stats().count(TIMEOUT_HEADER_READ);
     }
-    // Wait all thread finished
-    for (auto& thread : clientThreads) {
-        if (thread.joinable()) {
-            thread.join();
+    co_return request;
+}
+
+/**
+ * @brief: Count a new client in, unless max_clients are already served
+ */
+bool ConnectionHandler::admit(int clientSocket) {
+    auto current = settings->get();
+    tuneAccepted(clientSocket, current->socket);
+    {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        if (current->maxClients <= 0 || clientSockets.size() < (size_t)current->maxClients) {
+            clientSockets.insert(clientSocket);
+            return true;
         }
     }
-    clientThreads.clear();
-} 
\ No newline at end of file
+    logger->log(Logger::WARNING, "Refused a client: " + std::to_string(current->maxClients) + " clients active");
+    return false;
+}
+
+#ifdef WEBPROXY_IO_URING
+// user_data of the ring operations: the kind in the high bits, the client socket in the low ones
+enum : uint64_t { URING_ACCEPT = 1, URING_WAKE, URING_RECV, URING_TIMEOUT, URING_REFUSE, URING_CANCEL };
+static const unsigned URING_ENTRIES = 256;
+static const unsigned URING_BUFFERS = 64;   // request buffers shared by all pending clients
+static const unsigned short URING_BUFFER_GROUP = 0;
+
+static uint64_t uringData(uint64_t kind, int fd = 0) {
+    return kind << 32 | (uint32_t)fd;
+}
+
+/**
+ * @brief: io_uring front end. A multishot accept on the registered listener
+ *         produces the clients; each one's first read goes into a provided
+ *         buffer, so a slow client holds no coroutine and no buffer of its
+ *         own. Full requests are handed to the next loop, which goes on
+ *         with ring reads and writes. Over the client limit, a send linked
+ *         to a close refuses the client without a system call from here.
+ *         Returns false if the ring cannot be set up, before anything was
+ *         accepted.
+ */
+bool ConnectionHandler::acceptWithUring(int listener, std::vector<std::unique_ptr<EventLoop>>& loops) {
+    IoUring ring;
+    // Fixed file 0 is the listener, 1 the wake pipe
+    int files[2] = {listener, wakePipe[0]};
+    if (!ring.init(URING_ENTRIES) || !ring.registerFiles(files, 2) ||
+        !ring.setupBuffers(URING_BUFFER_GROUP, URING_BUFFERS, settings->get()->bufferSize)) {
+        return false;
+    }
+    logger->log(Logger::INFO, "Accepting with io_uring");
+
+    unsigned inflight = 0; // operations that will still post a completion
+    std::set<int> pending; // clients whose first read is queued
+    char wakeByte;
+    __kernel_timespec headerTimeout = {}; // copied by the kernel when the timeout is submitted
+    auto armAccept = [&]() {
+        io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = uringData(URING_ACCEPT);
+        ++inflight;
+    };
+    auto armRecv = [&](int clientSocket) {
+        io_uring_sqe* sqe = ring.getSqe(1);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = clientSocket;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = uringData(URING_RECV, clientSocket);
+        pending.insert(clientSocket);
+        ++inflight;
+        // header_timeout: a linked timeout cancels the read of a silent client
+        headerTimeout.tv_sec = settings->get()->headerTimeout;
+        if (headerTimeout.tv_sec > 0) {
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe = ring.getSqe();
+            sqe->opcode = IORING_OP_LINK_TIMEOUT;
+            sqe->addr = reinterpret_cast<uint64_t>(&headerTimeout);
+            sqe->len = 1;
+            sqe->user_data = uringData(URING_TIMEOUT, clientSocket);
+            ++inflight;
+        }
+    };
+    auto refuse = [&](int clientSocket) {
+        io_uring_sqe* sqe = ring.getSqe(1);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = clientSocket;
+        sqe->addr = reinterpret_cast<uint64_t>(BUSY_RESPONSE);
+        sqe->len = sizeof(BUSY_RESPONSE) - 1;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+        // Hard link: the close runs even when the send fails
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->user_data = uringData(URING_REFUSE);
+        sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = clientSocket;
+        sqe->user_data = uringData(URING_REFUSE);
+        inflight += 2;
+    };
+    auto finish = [&](int clientSocket) {
+        pending.erase(clientSocket);
+        {
+            std::lock_guard<std::mutex> lock(clientsMutex);
+            clientSockets.erase(clientSocket);
+        }
+        clientsDone.notify_all();
+        close(clientSocket);
+    };
+
+    armAccept();
+    io_uring_sqe* wake = ring.getSqe();
+    wake->opcode = IORING_OP_READ;
+    wake->fd = 1;
+    wake->flags = IOSQE_FIXED_FILE;
+    wake->addr = reinterpret_cast<uint64_t>(&wakeByte);
+    wake->len = 1;
+    wake->user_data = uringData(URING_WAKE);
+    ++inflight;
+
+    bool cancelled = false;
+    while (inflight > 0) {
+        if (!accepting && !cancelled) {
+            // Stop: cancel the accept and the reads still waiting, then reap
+            io_uring_sqe* sqe = ring.getSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+            sqe->user_data = uringData(URING_CANCEL);
+            ++inflight;
+            cancelled = true;
+        }
+        if (ring.submitAndWait(1) < 0 && errno != EAGAIN && errno != EBUSY) {
+            logger->log(Logger::ERROR, "io_uring_enter failed");
+            break;
+        }
+        while (io_uring_cqe* cqe = ring.peekCqe()) {
+            uint64_t kind = cqe->user_data >> 32;
+            int fd = (int)(cqe->user_data & 0xffffffff);
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring.cqeSeen();
+            if (!(flags & IORING_CQE_F_MORE)) {
+                --inflight;
+            }
+            if (kind == URING_ACCEPT) {
+                if (res >= 0) {
+                    if (!accepting) {
+                        close(res);
+                    } else if (admit(res)) {
+                        armRecv(res);
+                    } else {
+                        refuse(res);
+                    }
+                }
+                if (!(flags & IORING_CQE_F_MORE) && accepting) {
+                    armAccept();
+                }
+            } else if (kind == URING_WAKE) {
+                accepting = false;
+            } else if (kind == URING_RECV) {
+                if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+                    unsigned short bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+                    std::string request(ring.buffer(bufferId), res);
+                    ring.recycleBuffer(bufferId);
+                    pending.erase(fd);
+                    ++this->id;
+                    loops[id % loops.size()]->spawn(serveClient(fd, id, std::move(request)));
+                } else if (res == -ENOBUFS && accepting) {
+                    // Every buffer is in use: the coroutine reads the request itself
+                    pending.erase(fd);
+                    ++this->id;
+                    loops[id % loops.size()]->spawn(serveClient(fd, id, std::string()));
+                } else {
+                    finish(fd);
+                }
+            } else if (kind == URING_TIMEOUT && res == -ETIME) {
+                // The read completes with -ECANCELED and finishes the client
+                TimingWheel::stats().count(TIMEOUT_HEADER_READ);
+            }
+        }
+    }
+    // Reads the ring could not cancel (enter failed) are closed here
+    for (int clientSocket : std::set<int>(pending)) {
+        finish(clientSocket);
+    }
+    return true;
+}
+#endif
+
+/**
+ * @brief: Handle user request, and return response
+ */
+void ConnectionHandler::handleClient(int clientSocket, int clientId) {
+    std::string request = readRequest(clientSocket).runHere();
+    if (!request.empty()) {
+        // Get the response; nothing suspends off an event loop
+        requestHandler->handleRequest(request, clientSocket, clientId, *forwarder).runHere();
+    }
+    {
+        // Out of the set before close(), so drain() never touches a reused fd
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        clientSockets.erase(clientSocket);
+    }
+    clientsDone.notify_all();
+    close(clientSocket);
+}
+
+/**
+ * @brief: Wait up to timeout seconds for the clients to finish, then shut
+ *         their sockets down so the threads still running return
+ */
+void ConnectionHandler::drain(int timeout) {
+    std::unique_lock<std::mutex> lock(clientsMutex);
+    if (clientSockets.empty()) {
+        return;
+    }
+    logger->log(Logger::INFO, "Draining " + std::to_string(clientSockets.size()) + " connections");
+    if (clientsDone.wait_for(lock, std::chrono::seconds(timeout), [this] { return clientSockets.empty(); })) {
+        return;
+    }
+    logger->log(Logger::WARNING, "Drain deadline passed, closing " + std::to_string(clientSockets.size()) + " connections");
+    for (int clientSocket : clientSockets) {
+        shutdown(clientSocket, SHUT_RDWR);
+    }
+}
+
+/**
+ * @brief: Stop accepting; start() wakes up, drains the clients and returns
+ */
+void ConnectionHandler::stop() {
+    accepting = false;
+    char wake = 1;
+    ssize_t ignored = write(wakePipe[1], &wake, 1);
+    (void)ignored;
+}
+
+int ConnectionHandler::listener() const {
+    return serverSocket;
+}
\ No newline at end of file
@@ -1,9 +1,15 @@
 #pragma once
 #include <vector>
+#include <set>
 #include <thread>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include "RequestHandler.h"
 #include "Logger.h"
+#include "Config.h"
+#include "EventLoop.h"
 //#include "MessageForwarder.h"
 
 class ConnectionHandler {
@@ -11,15 +17,38 @@ private:
     // store all clients' threads
     std::vector<std::thread> clientThreads;
     std::shared_ptr<RequestHandler> requestHandler;
+    std::shared_ptr<CacheManager> cacheManager;
     std::shared_ptr<Logger> logger;
-    int serverSocket;
+    std::shared_ptr<SharedSettings> settings;
+    // one forwarder shared by all client threads
+    std::unique_ptr<MessageForwarder> forwarder;
+    std::atomic<int> serverSocket;
     int id;
+    std::atomic<bool> accepting;
+    int wakePipe[2]; // stop() writes here to wake the accept loop
+    // sockets of the clients being served, for max_clients and draining
+    std::set<int> clientSockets;
+    std::mutex clientsMutex;
+    std::condition_variable clientsDone;
+
+    void drain(int timeout);
+    bool admit(int clientSocket);
+    void acceptWithPoll(int listener, std::vector<std::unique_ptr<EventLoop>>& loops);
+    void acceptWithLoops(int listener, bool uring);
+    Task<void> serveClient(int clientSocket, int clientId, std::string request);
+    Task<std::string> readRequest(int clientSocket);
+#ifdef WEBPROXY_IO_URING
+    bool acceptWithUring(int listener, std::vector<std::unique_ptr<EventLoop>>& loops);
+#endif
 
 public:
-    ConnectionHandler(std::shared_ptr<RequestHandler> handler, std::shared_ptr<Logger> logger);
+    ConnectionHandler(std::shared_ptr<RequestHandler> handler, std::shared_ptr<CacheManager> cache, std::shared_ptr<Logger> logger,
+                      std::shared_ptr<SharedSettings> settings = nullptr);
     ~ConnectionHandler();
 
-    void start(int port);
+    int bindListener(int port);
+    void start(int port, int backlog = 10, int listenFd = -1);
     void stop();
-    void handleClient(int clientSocket, int clientId,  MessageForwarder& forwarder);
+    int listener() const;
+    void handleClient(int clientSocket, int clientId);
 }; 
\ No newline at end of file
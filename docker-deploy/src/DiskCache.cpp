@@ -0,0 +1,128 @@
+#include "DiskCache.h"
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <stdexcept>
+
+DiskSegment::DiskSegment(int fd, const std::string& path) : fd(fd), path(path), retired(false) {}
+
+DiskSegment::~DiskSegment() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+DiskCache::DiskCache(const std::string& directory, size_t segmentSize, size_t segmentCount)
+    : directory(directory), segmentSize(segmentSize), segments(segmentCount), current(0), writeOffset(0) {
+    if (segmentCount == 0) {
+        throw std::runtime_error("Disk cache needs at least one segment");
+    }
+    mkdir(directory.c_str(), 0755);
+    segments[0] = openSegment(0);
+}
+
+/*
+ @brief: Create (or recreate) the segment file for a ring slot
+*/
+std::shared_ptr<DiskSegment> DiskCache::openSegment(size_t index) {
+    std::string path = directory + "/segment." + std::to_string(index);
+    // Unlink first so readers of the old inode keep valid data
+    unlink(path.c_str());
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open disk cache segment: " + path);
+    }
+    return std::make_shared<DiskSegment>(fd, path);
+}
+
+/*
+ @brief: Append an object to the log, return its extent or nullptr when it does not fit
+*/
+std::shared_ptr<DiskExtent> DiskCache::write(std::string_view data, std::shared_ptr<DiskSegment>& retired) {
+    if (data.empty() || data.size() > segmentSize) {
+        return nullptr;
+    }
+    auto extent = std::make_shared<DiskExtent>();
+    {
+        // Reserve the space under the lock, write outside of it
+        std::lock_guard<std::mutex> lock(diskMutex);
+        if (writeOffset + (off_t)data.size() > (off_t)segmentSize) {
+            current = (current + 1) % segments.size();
+            if (segments[current]) {
+                segments[current]->retired = true;
+                retired = segments[current];
+            }
+            try {
+                segments[current] = openSegment(current);
+            } catch (const std::exception& e) {
+                segments[current] = nullptr;
+                return nullptr;
+            }
+            writeOffset = 0;
+        }
+        if (!segments[current]) {
+            return nullptr;
+        }
+        extent->segment = segments[current];
+        extent->offset = writeOffset;
+        extent->length = data.size();
+        writeOffset += data.size();
+    }
+
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = pwrite(extent->segment->fd, data.data() + written, data.size() - written, extent->offset + written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return nullptr;
+        }
+        written += n;
+    }
+    return extent;
+}
+
+/*
+ @brief: Read [start, start + length) of an object (promotion, cached headers)
+*/
+bool DiskCache::read(const DiskExtent& extent, size_t start, size_t length, std::string& out) {
+    out.resize(length);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(extent.segment->fd, &out[done], length - done, extent.offset + start + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/*
+ @brief: Send [start, start + length) of an object straight from the page cache
+*/
+ssize_t DiskCache::sendTo(int socket, const DiskExtent& extent, size_t start, size_t length) {
+    off_t offset = extent.offset + start;
+    size_t remaining = length;
+    while (remaining > 0) {
+        ssize_t n = sendfile(socket, extent.segment->fd, &offset, remaining);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        remaining -= n;
+    }
+    return length;
+}
+
+size_t DiskCache::capacity() const {
+    return segmentSize * segments.size();
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <sys/types.h>
+
+/*
+ @brief: One append-only file of the disk tier. The fd stays open while any
+         extent still points into it, so a recycled segment can be unlinked
+         without breaking a sendfile() that is already running.
+*/
+struct DiskSegment {
+    int fd;
+    std::string path;
+    std::atomic<bool> retired;
+
+    DiskSegment(int fd, const std::string& path);
+    ~DiskSegment();
+};
+
+// Location of one stored object inside a segment
+struct DiskExtent {
+    std::shared_ptr<DiskSegment> segment;
+    off_t offset;
+    size_t length;
+
+    bool valid() const { return !segment->retired; }
+};
+
+/*
+ @brief: Log-structured store for the second cache tier. Objects are appended
+         to a ring of fixed-size segment files; when the ring wraps, the oldest
+         segment is retired and every extent in it becomes a miss.
+*/
+class DiskCache {
+private:
+    std::string directory;
+    size_t segmentSize;
+    std::vector<std::shared_ptr<DiskSegment>> segments;
+    size_t current;
+    off_t writeOffset;
+    std::mutex diskMutex;
+
+    std::shared_ptr<DiskSegment> openSegment(size_t index);
+
+public:
+    DiskCache(const std::string& directory, size_t segmentSize, size_t segmentCount);
+
+    // retired is set to the segment the ring wrapped over, if this write recycled one
+    std::shared_ptr<DiskExtent> write(std::string_view data, std::shared_ptr<DiskSegment>& retired);
+    size_t capacity() const;
+
+    // Extent I/O does not touch the ring, so it also works for extents
+    // that point into a loaded snapshot file
+    static bool read(const DiskExtent& extent, size_t start, size_t length, std::string& out);
+    static ssize_t sendTo(int socket, const DiskExtent& extent, size_t start, size_t length);
+};
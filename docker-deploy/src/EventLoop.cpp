@@ -0,0 +1,334 @@
+#include "EventLoop.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+
+// The index of a descriptor rides in the low bits of the waiter address
+static_assert(alignof(PollAwaiter) >= PollAwaiter::MAX_FDS, "PollAwaiter alignment");
+
+static thread_local EventLoop* currentLoop = nullptr;
+
+#ifdef WEBPROXY_IO_URING
+// epoll data of the ring descriptor: waiters are aligned, none is at address 0
+static const uint64_t RING_EVENT = 1;
+static const unsigned RING_ENTRIES = 256;
+#endif
+
+BlockingPool::BlockingPool(size_t threadCount) : stopping(false) {
+    for (size_t i = 0; i < threadCount; ++i) {
+        threads.emplace_back(&BlockingPool::work, this);
+    }
+}
+
+BlockingPool::~BlockingPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void BlockingPool::run(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    ready.notify_one();
+}
+
+void BlockingPool::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+        // Queued jobs still run on stop: each one resumes a coroutine
+        if (jobs.empty()) {
+            return;
+        }
+        std::function<void()> job = std::move(jobs.front());
+        jobs.pop_front();
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+}
+
+EventLoop::EventLoop(BlockingPool* pool, bool uring) : running(true), pool(pool) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (epollFd < 0 || wakeFd < 0) {
+        throw std::runtime_error("Failed to create event loop");
+    }
+    // data 0 is the wake descriptor, waiters are never at address 0
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+#ifdef WEBPROXY_IO_URING
+    if (uring) {
+        // The loop sleeps in epoll, so completions are posted without it
+        // entering the ring (no DEFER_TASKRUN); the ring descriptor wakes it
+        auto ring = std::make_unique<IoUring>();
+        event.data.u64 = RING_EVENT;
+        if (ring->init(RING_ENTRIES, 0) && epoll_ctl(epollFd, EPOLL_CTL_ADD, ring->descriptor(), &event) == 0) {
+            ioRing = std::move(ring);
+        }
+    }
+#else
+    (void)uring;
+#endif
+    thread = std::thread(&EventLoop::run, this);
+}
+
+EventLoop::~EventLoop() {
+    stop();
+    thread.join();
+    close(wakeFd);
+    close(epollFd);
+}
+
+EventLoop* EventLoop::current() {
+    return currentLoop;
+}
+
+void EventLoop::spawn(Task<void> task) {
+    post(task.detach());
+}
+
+void launch(Task<void> task) {
+    if (EventLoop* loop = EventLoop::current()) {
+        loop->spawn(std::move(task));
+        return;
+    }
+    std::thread([task = std::move(task)]() mutable { task.runHere(); }).detach();
+}
+
+void EventLoop::post(std::coroutine_handle<> handle) {
+    {
+        std::lock_guard<std::mutex> lock(postedMutex);
+        posted.push_back(handle);
+    }
+    uint64_t one = 1;
+    ssize_t ignored = write(wakeFd, &one, sizeof(one));
+    (void)ignored;
+}
+
+/*
+ @brief: Leave the loop. Coroutines still suspended stay so; callers wait for
+         their clients to finish before stopping.
+*/
+void EventLoop::stop() {
+    running = false;
+    uint64_t one = 1;
+    ssize_t ignored = write(wakeFd, &one, sizeof(one));
+    (void)ignored;
+}
+
+void EventLoop::resumePosted() {
+    uint64_t count;
+    ssize_t ignored = read(wakeFd, &count, sizeof(count));
+    (void)ignored;
+    std::vector<std::coroutine_handle<>> batch;
+    {
+        std::lock_guard<std::mutex> lock(postedMutex);
+        batch.swap(posted);
+    }
+    for (auto handle : batch) {
+        handle.resume();
+    }
+}
+
+void EventLoop::fire(PollAwaiter* waiter, int result) {
+    waiter->unwatch();
+    waiter->result = result;
+    waiter->handle.resume();
+}
+
+void EventLoop::run() {
+    currentLoop = this;
+    const int MAX_EVENTS = 128;
+    struct epoll_event events[MAX_EVENTS];
+    std::vector<PollAwaiter*> ready;
+    while (running) {
+#ifdef WEBPROXY_IO_URING
+        // What the coroutines queued last round goes to the kernel in one call
+        if (ioRing) {
+            ioRing->submit();
+        }
+#endif
+        int count = epoll_wait(epollFd, events, MAX_EVENTS, timers.nextTimeout(Clock::now()));
+        if (count < 0 && errno != EINTR) {
+            break;
+        }
+        // Collect first, resume after: a resumed coroutine may end and take
+        // its waiter with it while the batch still names that waiter
+        bool wake = false;
+        ready.clear();
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.u64 == 0) {
+                wake = true;
+                continue;
+            }
+#ifdef WEBPROXY_IO_URING
+            if (events[i].data.u64 == RING_EVENT) {
+                // Reaped below, every round
+                continue;
+            }
+#endif
+            PollAwaiter* waiter = reinterpret_cast<PollAwaiter*>(events[i].data.u64 & ~(uint64_t)(PollAwaiter::MAX_FDS - 1));
+            int index = (int)(events[i].data.u64 & (PollAwaiter::MAX_FDS - 1));
+            uint32_t happened = events[i].events;
+            short revents = 0;
+            revents |= (happened & EPOLLIN) ? POLLIN : 0;
+            revents |= (happened & EPOLLOUT) ? POLLOUT : 0;
+            revents |= (happened & EPOLLERR) ? POLLERR : 0;
+            revents |= (happened & EPOLLHUP) ? POLLHUP : 0;
+            waiter->fds[index].revents = revents;
+            if (!waiter->fired) {
+                waiter->fired = true;
+                ready.push_back(waiter);
+            }
+        }
+        for (PollAwaiter* waiter : ready) {
+            int result = 0;
+            for (int i = 0; i < waiter->count; ++i) {
+                result += waiter->fds[i].revents != 0;
+            }
+            fire(waiter, result);
+        }
+#ifdef WEBPROXY_IO_URING
+        if (ioRing) {
+            reap();
+        }
+#endif
+        // Expired timers are already unlinked; their waiters belong to
+        // different coroutines, so firing one cannot end another
+        expired.clear();
+        timers.advance(Clock::now(), expired);
+        for (TimerNode* timer : expired) {
+            fire(static_cast<PollAwaiter*>(timer), 0);
+        }
+        if (wake) {
+            resumePosted();
+        }
+    }
+    currentLoop = nullptr;
+}
+
+#ifdef WEBPROXY_IO_URING
+/*
+ @brief: Resume the coroutines whose operations completed. Collected first,
+         like the epoll batch; each coroutine waits on one operation.
+*/
+void EventLoop::reap() {
+    completed.clear();
+    while (io_uring_cqe* cqe = ioRing->peekCqe()) {
+        // user_data 0: a linked timeout, its operation reports for it
+        if (cqe->user_data != 0) {
+            RingAwaiter* waiter = reinterpret_cast<RingAwaiter*>(cqe->user_data);
+            waiter->result = cqe->res;
+            completed.push_back(waiter);
+        }
+        ioRing->cqeSeen();
+    }
+    for (RingAwaiter* waiter : completed) {
+        waiter->handle.resume();
+    }
+}
+
+bool RingAwaiter::await_suspend(std::coroutine_handle<> caller) {
+    handle = caller;
+    IoUring* ring = loop->ring();
+    io_uring_sqe* sqe = ring->getSqe(timeout >= 0 ? 1 : 0);
+    if (!sqe) {
+        result = -EBUSY;
+        return false;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(address);
+    sqe->len = length;
+    sqe->msg_flags = msgFlags;
+    sqe->user_data = reinterpret_cast<uint64_t>(this);
+    if (timeout >= 0) {
+        sqe->flags = IOSQE_IO_LINK;
+        deadline.tv_sec = timeout / 1000;
+        deadline.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        sqe = ring->getSqe();
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->addr = reinterpret_cast<uint64_t>(&deadline);
+        sqe->len = 1;
+        sqe->user_data = 0;
+    }
+    return true;
+}
+#endif
+
+PollAwaiter::PollAwaiter(struct pollfd* fds, int count, int timeout)
+    : fds(fds), count(count), timeout(timeout), loop(nullptr), fired(false), result(0) {}
+
+PollAwaiter::PollAwaiter(int fd, short events, int timeout)
+    : fds(&single), count(1), timeout(timeout), loop(nullptr), fired(false), result(0) {
+    single.fd = fd;
+    single.events = events;
+    single.revents = 0;
+}
+
+bool PollAwaiter::await_ready() {
+    loop = EventLoop::current();
+    if (loop && count <= MAX_FDS) {
+        return false;
+    }
+    // Not on a loop: the calling thread may block
+    do {
+        result = poll(fds, count, timeout);
+    } while (result < 0 && errno == EINTR);
+    return true;
+}
+
+bool PollAwaiter::await_suspend(std::coroutine_handle<> caller) {
+    handle = caller;
+    if (!watch()) {
+        // epoll refuses the descriptor (regular file, already closed)
+        result = -1;
+        return false;
+    }
+    if (timeout >= 0) {
+        loop->timers.arm(this, timeout);
+    }
+    return true;
+}
+
+/*
+ @brief: Add the descriptors to the loop's epoll set. The low bits of the
+         event data carry the index, as waiters are aligned.
+*/
+bool PollAwaiter::watch() {
+    for (int i = 0; i < count; ++i) {
+        fds[i].revents = 0;
+        struct epoll_event event = {};
+        event.events = ((fds[i].events & POLLIN) ? EPOLLIN : 0) | ((fds[i].events & POLLOUT) ? EPOLLOUT : 0);
+        event.data.u64 = reinterpret_cast<uint64_t>(this) | (uint64_t)i;
+        if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fds[i].fd, &event) < 0) {
+            int error = errno;
+            for (int j = 0; j < i; ++j) {
+                epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fds[j].fd, nullptr);
+            }
+            errno = error;
+            return false;
+        }
+    }
+    return true;
+}
+
+void PollAwaiter::unwatch() {
+    for (int i = 0; i < count; ++i) {
+        epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fds[i].fd, nullptr);
+    }
+    loop->timers.cancel(this);
+}
@@ -0,0 +1,219 @@
+#pragma once
+#include <coroutine>
+#include <chrono>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <poll.h>
+#include "Task.h"
+#include "TimingWheel.h"
+#include "IoUring.h"
+
+/*
+ @brief: Threads for work that has to block (name lookups, sending cached
+         objects with sendfile), so it never stalls an event loop
+*/
+class BlockingPool {
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool stopping;
+
+    void work();
+
+public:
+    explicit BlockingPool(size_t threadCount);
+    ~BlockingPool();
+    BlockingPool(const BlockingPool&) = delete;
+    BlockingPool& operator=(const BlockingPool&) = delete;
+
+    void run(std::function<void()> job);
+};
+
+class PollAwaiter;
+class RingAwaiter;
+
+/*
+ @brief: One thread running coroutines over epoll. A coroutine that would
+         block waits on its sockets here (asyncPoll) and the thread serves
+         the others meanwhile. Coroutines stay on the loop they started on.
+         With a ring, their socket reads and writes are io_uring operations
+         instead (RingAwaiter), submitted in one batch per round.
+*/
+class EventLoop {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    int epollFd;
+    int wakeFd;                                   // eventfd: post() and stop()
+    std::thread thread;
+    std::atomic<bool> running;
+    std::mutex postedMutex;
+    std::vector<std::coroutine_handle<>> posted;  // resumed on the loop thread
+    TimingWheel timers;                           // PollAwaiter timeouts
+    std::vector<TimerNode*> expired;
+    BlockingPool* pool;
+#ifdef WEBPROXY_IO_URING
+    std::unique_ptr<IoUring> ioRing;              // only touched by the loop thread
+    std::vector<RingAwaiter*> completed;
+
+    void reap();
+#endif
+
+    void run();
+    void resumePosted();
+    void fire(PollAwaiter* waiter, int result);
+
+    friend class PollAwaiter;
+
+public:
+    // uring: socket I/O through a ring of this loop; without one (IO_URING=0,
+    // or the kernel refuses) the loop polls with epoll as usual
+    explicit EventLoop(BlockingPool* pool = nullptr, bool uring = false);
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Start a coroutine on this loop; it frees itself when it is done. Any thread.
+    void spawn(Task<void> task);
+    // Resume a suspended coroutine on this loop. Any thread.
+    void post(std::coroutine_handle<> handle);
+    void stop();
+    BlockingPool* blockingPool() const { return pool; }
+#ifdef WEBPROXY_IO_URING
+    IoUring* ring() const { return ioRing.get(); }
+#endif
+
+    // The loop the calling thread runs, nullptr on any other thread
+    static EventLoop* current();
+};
+
+/*
+ @brief: co_await asyncPoll(...): poll() for coroutines. On an event loop the
+         coroutine suspends until one of the descriptors is ready or the
+         timeout (milliseconds, -1 = none) passes; on any other thread it is
+         a plain poll(). Yields poll()'s result: ready count, 0 on timeout.
+*/
+class PollAwaiter : private TimerNode {
+public:
+    static const int MAX_FDS = 4;
+
+private:
+    struct pollfd single;
+    struct pollfd* fds;
+    int count;
+    int timeout;
+    EventLoop* loop;
+    std::coroutine_handle<> handle;
+    bool fired;
+    int result;
+
+    bool watch();
+    void unwatch();
+
+    friend class EventLoop;
+
+public:
+    PollAwaiter(struct pollfd* fds, int count, int timeout);
+    PollAwaiter(int fd, short events, int timeout);
+    PollAwaiter(const PollAwaiter&) = delete;
+    PollAwaiter& operator=(const PollAwaiter&) = delete;
+
+    bool await_ready();
+    bool await_suspend(std::coroutine_handle<> caller);
+    int await_resume() const { return result; }
+};
+
+inline PollAwaiter asyncPoll(struct pollfd* fds, int count, int timeout) {
+    return PollAwaiter(fds, count, timeout);
+}
+
+inline PollAwaiter asyncPoll(int fd, short events, int timeout) {
+    return PollAwaiter(fd, events, timeout);
+}
+
+#ifdef WEBPROXY_IO_URING
+/*
+ @brief: co_await one operation (recv, sendmsg) on the ring of the loop
+         running the caller. A timeout (milliseconds, -1 = none) is linked
+         to it and cancels it. Yields the completion's result: bytes, or
+         -errno, -ECANCELED when the timeout fired.
+*/
+class RingAwaiter {
+private:
+    EventLoop* loop;
+    uint8_t opcode;
+    int fd;
+    const void* address;
+    unsigned length;
+    int msgFlags;
+    int timeout;
+    __kernel_timespec deadline; // read by the kernel when the entry is submitted
+    std::coroutine_handle<> handle;
+    int result;
+
+    friend class EventLoop;
+
+public:
+    RingAwaiter(EventLoop* loop, uint8_t opcode, int fd, const void* address, unsigned length, int msgFlags, int timeout)
+        : loop(loop), opcode(opcode), fd(fd), address(address), length(length), msgFlags(msgFlags), timeout(timeout), result(0) {}
+    RingAwaiter(const RingAwaiter&) = delete;
+    RingAwaiter& operator=(const RingAwaiter&) = delete;
+
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> caller);
+    int await_resume() const { return result; }
+};
+#endif
+
+/*
+ @brief: Run a coroutine alongside the caller: spawned on the caller's event
+         loop, or on a thread of its own when the caller is not on one. The
+         task frees itself when it is done.
+*/
+void launch(Task<void> task);
+
+/*
+ @brief: co_await offload(job): run a blocking job on the loop's BlockingPool
+         and resume here when it is done. Off a loop (or without a pool) the
+         job simply runs on the calling thread.
+*/
+template <typename Job>
+class OffloadAwaiter {
+private:
+    Job job;
+    EventLoop* loop;
+    std::coroutine_handle<> handle;
+
+public:
+    explicit OffloadAwaiter(Job job) : job(std::move(job)), loop(EventLoop::current()) {}
+
+    bool await_ready() {
+        if (loop && loop->blockingPool()) {
+            return false;
+        }
+        job();
+        return true;
+    }
+    void await_suspend(std::coroutine_handle<> caller) {
+        handle = caller;
+        loop->blockingPool()->run([this]() {
+            job();
+            loop->post(handle);
+        });
+    }
+    void await_resume() {}
+};
+
+template <typename Job>
+OffloadAwaiter<Job> offload(Job job) {
+    return OffloadAwaiter<Job>(std::move(job));
+}
@@ -0,0 +1,217 @@
+#include "EvictionPolicy.h"
+#include <algorithm>
+
+/****LRU****/
+
+void LruPolicy::onInsert(PolicyEntry* entry) {
+    order.push_front(entry);
+    entry->position = order.begin();
+}
+
+void LruPolicy::onHit(PolicyEntry* entry) {
+    order.splice(order.begin(), order, entry->position);
+}
+
+void LruPolicy::onRemove(PolicyEntry* entry) {
+    order.erase(entry->position);
+}
+
+PolicyEntry* LruPolicy::victim() {
+    return order.empty() ? nullptr : order.back();
+}
+
+void LruPolicy::clear() {
+    order.clear();
+}
+
+/****FREQUENCY SKETCH****/
+
+static const uint64_t SKETCH_SEEDS[4] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+};
+
+FrequencySketch::FrequencySketch(size_t expectedEntries) : additions(0) {
+    size_t width = 64;
+    while (width < expectedEntries) {
+        width <<= 1;
+    }
+    mask = width - 1;
+    sampleSize = 10 * width;
+    counters.assign(DEPTH * width, 0);
+}
+
+size_t FrequencySketch::indexOf(uint64_t hash, int row) const {
+    uint64_t h = (hash + SKETCH_SEEDS[row]) * SKETCH_SEEDS[row];
+    h ^= h >> 32;
+    return row * (mask + 1) + (h & mask);
+}
+
+/*
+ @brief: Conservative update: only the counters holding the minimum grow,
+         which keeps over-estimation from collisions down
+*/
+void FrequencySketch::increment(uint64_t hash) {
+    unsigned current = estimate(hash);
+    if (current >= 15) {
+        return;
+    }
+    for (int row = 0; row < DEPTH; ++row) {
+        uint8_t& counter = counters[indexOf(hash, row)];
+        if (counter == current) {
+            ++counter;
+        }
+    }
+    if (++additions >= sampleSize) {
+        age();
+    }
+}
+
+unsigned FrequencySketch::estimate(uint64_t hash) const {
+    unsigned frequency = 15;
+    for (int row = 0; row < DEPTH; ++row) {
+        frequency = std::min<unsigned>(frequency, counters[indexOf(hash, row)]);
+    }
+    return frequency;
+}
+
+void FrequencySketch::age() {
+    for (auto& counter : counters) {
+        counter >>= 1;
+    }
+    additions /= 2;
+}
+
+void FrequencySketch::clear() {
+    std::fill(counters.begin(), counters.end(), 0);
+    additions = 0;
+}
+
+/****W-TINYLFU****/
+
+TinyLfuPolicy::TinyLfuPolicy(size_t capacityBytes, size_t averageObjectBytes)
+    : windowBytes(0), protectedBytes(0), totalBytes(0), capacity(capacityBytes),
+      sketch(capacityBytes / std::max<size_t>(averageObjectBytes, 1)) {
+    resize(capacityBytes);
+}
+
+/*
+ @brief: Recompute the region limits; the sketch keeps its size. Entries over
+         the new limits move out as the cache evicts down to its budget.
+*/
+void TinyLfuPolicy::resize(size_t capacityBytes) {
+    capacity = capacityBytes;
+    // 1% window, the main region is 20% probation and 80% protected
+    windowMax = std::max<size_t>(capacity / 100, 1);
+    protectedMax = (capacity - std::min(windowMax, capacity)) / 5 * 4;
+}
+
+std::list<PolicyEntry*>& TinyLfuPolicy::listOf(int segment) {
+    if (segment == WINDOW) {
+        return window;
+    }
+    return segment == PROBATION ? probation : protectedList;
+}
+
+void TinyLfuPolicy::moveTo(PolicyEntry* entry, Segment segment) {
+    std::list<PolicyEntry*>& target = listOf(segment);
+    target.splice(target.begin(), listOf(entry->segment), entry->position);
+    if (entry->segment == WINDOW) {
+        windowBytes -= entry->size;
+    } else if (entry->segment == PROTECTED) {
+        protectedBytes -= entry->size;
+    }
+    if (segment == WINDOW) {
+        windowBytes += entry->size;
+    } else if (segment == PROTECTED) {
+        protectedBytes += entry->size;
+    }
+    entry->segment = segment;
+}
+
+void TinyLfuPolicy::recordAccess(uint64_t hash) {
+    sketch.increment(hash);
+}
+
+void TinyLfuPolicy::onInsert(PolicyEntry* entry) {
+    window.push_front(entry);
+    entry->position = window.begin();
+    entry->segment = WINDOW;
+    windowBytes += entry->size;
+    totalBytes += entry->size;
+    // While there is room the window overflows into the main region freely
+    while (windowBytes > windowMax && window.size() > 1 && totalBytes <= capacity) {
+        moveTo(window.back(), PROBATION);
+    }
+}
+
+void TinyLfuPolicy::onHit(PolicyEntry* entry) {
+    if (entry->segment == PROBATION) {
+        moveTo(entry, PROTECTED);
+        // Keep the protected segment within its share
+        while (protectedBytes > protectedMax && protectedList.size() > 1) {
+            moveTo(protectedList.back(), PROBATION);
+        }
+    } else {
+        std::list<PolicyEntry*>& current = listOf(entry->segment);
+        current.splice(current.begin(), current, entry->position);
+    }
+}
+
+void TinyLfuPolicy::onRemove(PolicyEntry* entry) {
+    listOf(entry->segment).erase(entry->position);
+    if (entry->segment == WINDOW) {
+        windowBytes -= entry->size;
+    } else if (entry->segment == PROTECTED) {
+        protectedBytes -= entry->size;
+    }
+    totalBytes -= entry->size;
+}
+
+/*
+ @brief: The window's oldest object is the admission candidate; it enters the
+         main region only when it is more popular than the main victim,
+         otherwise it is the one evicted
+*/
+PolicyEntry* TinyLfuPolicy::victim() {
+    PolicyEntry* candidate = windowBytes > windowMax && !window.empty() ? window.back() : nullptr;
+    PolicyEntry* mainVictim = nullptr;
+    if (!probation.empty()) {
+        mainVictim = probation.back();
+    } else if (!protectedList.empty()) {
+        mainVictim = protectedList.back();
+    }
+    if (!candidate) {
+        if (mainVictim) {
+            return mainVictim;
+        }
+        return window.empty() ? nullptr : window.back();
+    }
+    if (!mainVictim) {
+        return candidate;
+    }
+    if (sketch.estimate(candidate->hash) > sketch.estimate(mainVictim->hash)) {
+        moveTo(candidate, PROBATION);
+        return mainVictim;
+    }
+    return candidate;
+}
+
+void TinyLfuPolicy::clear() {
+    window.clear();
+    probation.clear();
+    protectedList.clear();
+    windowBytes = 0;
+    protectedBytes = 0;
+    totalBytes = 0;
+    sketch.clear();
+}
+
+std::unique_ptr<EvictionPolicy> makeEvictionPolicy(const std::string& name, size_t capacityBytes) {
+    if (name == "lru") {
+        return std::make_unique<LruPolicy>();
+    }
+    if (name == "tinylfu") {
+        return std::make_unique<TinyLfuPolicy>(capacityBytes);
+    }
+    return nullptr;
+}
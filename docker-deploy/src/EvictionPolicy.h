@@ -0,0 +1,115 @@
+#pragma once
+#include <list>
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ @brief: Per-object bookkeeping owned by the cache and managed by the policy.
+         hash feeds frequency estimators; segment and position are private
+         to the policy that holds the entry.
+*/
+struct PolicyEntry {
+    uint64_t hash = 0;
+    size_t size = 0;
+    int segment = 0;
+    std::list<PolicyEntry*>::iterator position;
+};
+
+/*
+ @brief: Decides which memory-resident object leaves the cache next. All calls
+         are made under the cache lock.
+*/
+class EvictionPolicy {
+public:
+    virtual ~EvictionPolicy() {}
+    virtual const char* name() const = 0;
+    // Every lookup, hit or miss, before any other call for that request
+    virtual void recordAccess(uint64_t hash) {}
+    virtual void onInsert(PolicyEntry* entry) = 0;
+    virtual void onHit(PolicyEntry* entry) = 0;
+    virtual void onRemove(PolicyEntry* entry) = 0;
+    // Next entry to evict while over budget; may be the one just inserted
+    virtual PolicyEntry* victim() = 0;
+    virtual void clear() = 0;
+    // The memory budget changed (config reload)
+    virtual void resize(size_t capacityBytes) {}
+};
+
+/*
+ @brief: Plain recency order
+*/
+class LruPolicy : public EvictionPolicy {
+private:
+    std::list<PolicyEntry*> order; // most recent first
+
+public:
+    const char* name() const override { return "lru"; }
+    void onInsert(PolicyEntry* entry) override;
+    void onHit(PolicyEntry* entry) override;
+    void onRemove(PolicyEntry* entry) override;
+    PolicyEntry* victim() override;
+    void clear() override;
+};
+
+/*
+ @brief: Count-min sketch with 4-bit counters. All counters are halved after
+         sampleSize increments, so old popularity fades out.
+*/
+class FrequencySketch {
+private:
+    static const int DEPTH = 4;
+    std::vector<uint8_t> counters; // DEPTH rows of width counters
+    size_t mask;
+    size_t sampleSize;
+    size_t additions;
+
+    size_t indexOf(uint64_t hash, int row) const;
+    void age();
+
+public:
+    FrequencySketch(size_t expectedEntries);
+    void increment(uint64_t hash);
+    unsigned estimate(uint64_t hash) const;
+    void clear();
+};
+
+/*
+ @brief: W-TinyLFU: new objects enter a small LRU window; when the cache is full
+         the window's oldest object only replaces the main region's victim if
+         the sketch has seen it more often. The main region is a segmented LRU
+         (probation, then protected after a second hit).
+*/
+class TinyLfuPolicy : public EvictionPolicy {
+private:
+    enum Segment { WINDOW, PROBATION, PROTECTED };
+    std::list<PolicyEntry*> window;
+    std::list<PolicyEntry*> probation;
+    std::list<PolicyEntry*> protectedList;
+    size_t windowBytes;
+    size_t protectedBytes;
+    size_t totalBytes;
+    size_t capacity;
+    size_t windowMax;
+    size_t protectedMax;
+    FrequencySketch sketch;
+
+    std::list<PolicyEntry*>& listOf(int segment);
+    void moveTo(PolicyEntry* entry, Segment segment);
+
+public:
+    TinyLfuPolicy(size_t capacityBytes, size_t averageObjectBytes = 4096);
+    const char* name() const override { return "tinylfu"; }
+    void recordAccess(uint64_t hash) override;
+    void onInsert(PolicyEntry* entry) override;
+    void onHit(PolicyEntry* entry) override;
+    void onRemove(PolicyEntry* entry) override;
+    PolicyEntry* victim() override;
+    void clear() override;
+    void resize(size_t capacityBytes) override;
+};
+
+// "lru" or "tinylfu"; nullptr for unknown names
+std::unique_ptr<EvictionPolicy> makeEvictionPolicy(const std::string& name, size_t capacityBytes);
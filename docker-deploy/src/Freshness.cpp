@@ -0,0 +1,211 @@
+#include "Freshness.h"
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+
+/*
+ @brief: Call f(value, length) for every header line called name
+*/
+template <typename F>
+static void forEachHeader(const std::string& headers, const char* name, F f) {
+    size_t nameLength = strlen(name);
+    size_t headerEnd = headers.find("\r\n\r\n");
+    if (headerEnd == std::string::npos) {
+        headerEnd = headers.size();
+    }
+    size_t lineEnd = headers.find("\r\n");
+    while (lineEnd != std::string::npos && lineEnd < headerEnd) {
+        size_t lineStart = lineEnd + 2;
+        lineEnd = headers.find("\r\n", lineStart);
+        size_t end = lineEnd == std::string::npos ? headers.size() : lineEnd;
+        if (end - lineStart > nameLength && headers[lineStart + nameLength] == ':' &&
+            strncasecmp(headers.c_str() + lineStart, name, nameLength) == 0) {
+            size_t valueStart = lineStart + nameLength + 1;
+            while (valueStart < end && (headers[valueStart] == ' ' || headers[valueStart] == '\t')) {
+                valueStart++;
+            }
+            f(headers.c_str() + valueStart, end - valueStart);
+        }
+    }
+}
+
+static std::string firstHeader(const std::string& headers, const char* name) {
+    std::string value;
+    bool found = false;
+    forEachHeader(headers, name, [&](const char* data, size_t length) {
+        if (!found) {
+            value.assign(data, length);
+            found = true;
+        }
+    });
+    return value;
+}
+
+// Non-negative delta-seconds; invalid values count as 0 (RFC 9111 1.2.2)
+static long parseSeconds(const char* data, size_t length) {
+    if (length >= 2 && data[0] == '"' && data[length - 1] == '"') {
+        data++;
+        length -= 2;
+    }
+    long seconds = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] < '0' || data[i] > '9') {
+            return 0;
+        }
+        seconds = std::min(seconds * 10 + (data[i] - '0'), 0x7fffffffL);
+    }
+    return length == 0 ? 0 : seconds;
+}
+
+CacheControl CacheControl::parse(const std::string& responseHeaders) {
+    CacheControl control;
+    forEachHeader(responseHeaders, "Cache-Control", [&](const char* data, size_t length) {
+        size_t pos = 0;
+        while (pos < length) {
+            size_t end = pos;
+            while (end < length && data[end] != ',') {
+                end++;
+            }
+            size_t start = pos;
+            while (start < end && (data[start] == ' ' || data[start] == '\t')) {
+                start++;
+            }
+            size_t stop = end;
+            while (stop > start && (data[stop - 1] == ' ' || data[stop - 1] == '\t')) {
+                stop--;
+            }
+            const char* directive = data + start;
+            size_t directiveLength = stop - start;
+            const char* equals = static_cast<const char*>(memchr(directive, '=', directiveLength));
+            size_t nameLength = equals ? equals - directive : directiveLength;
+            auto is = [&](const char* name) {
+                return nameLength == strlen(name) && strncasecmp(directive, name, nameLength) == 0;
+            };
+            long value = equals ? parseSeconds(equals + 1, directive + directiveLength - equals - 1) : 0;
+            if (is("no-store")) control.noStore = true;
+            // A field-qualified no-cache or private still applies to the whole response here
+            else if (is("no-cache")) control.noCache = true;
+            else if (is("private")) control.isPrivate = true;
+            else if (is("public")) control.isPublic = true;
+            else if (is("must-revalidate") || is("proxy-revalidate")) control.mustRevalidate = true;
+            // Repeated lifetimes: the shortest one
+            else if (is("max-age")) control.maxAge = control.maxAge < 0 ? value : std::min(control.maxAge, value);
+            else if (is("s-maxage")) control.sMaxAge = control.sMaxAge < 0 ? value : std::min(control.sMaxAge, value);
+            pos = end + 1;
+        }
+    });
+    return control;
+}
+
+int responseStatus(const std::string& responseHeaders) {
+    size_t space = responseHeaders.find(' ');
+    if (space == std::string::npos || space + 4 > responseHeaders.size()) {
+        return 0;
+    }
+    int status = 0;
+    for (size_t i = space + 1; i < space + 4; i++) {
+        if (responseHeaders[i] < '0' || responseHeaders[i] > '9') {
+            return 0;
+        }
+        status = status * 10 + (responseHeaders[i] - '0');
+    }
+    return status;
+}
+
+time_t parseHttpDate(const std::string& value) {
+    struct tm tm = {};
+    if (strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm) == nullptr) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+// Cacheable unless the origin says otherwise (RFC 9110 15.1); 206 is left
+// out as the cache only stores whole objects
+static bool heuristicallyCacheable(int status) {
+    switch (status) {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool isNegative(int status) {
+    return status == 404 || status == 410 || status == 501;
+}
+
+static bool isStoredError(int status, const FreshnessOptions& options) {
+    return std::find(options.errorStatuses.begin(), options.errorStatuses.end(), status) != options.errorStatuses.end();
+}
+
+bool hasExplicitFreshness(const std::string& responseHeaders) {
+    CacheControl control = CacheControl::parse(responseHeaders);
+    return control.sMaxAge >= 0 || control.maxAge >= 0 || !firstHeader(responseHeaders, "Expires").empty();
+}
+
+bool isStorable(const std::string& responseHeaders, const FreshnessOptions& options) {
+    CacheControl control = CacheControl::parse(responseHeaders);
+    if (control.noStore || control.isPrivate) {
+        return false;
+    }
+    int status = responseStatus(responseHeaders);
+    // 304 answers a conditional request and 206 is a piece: neither is the object
+    if (status < 200 || status == 206 || status == 304) {
+        return false;
+    }
+    if (heuristicallyCacheable(status) || isStoredError(status, options)) {
+        return true;
+    }
+    return control.isPublic || hasExplicitFreshness(responseHeaders);
+}
+
+long freshnessLifetime(const std::string& responseHeaders, time_t responseTime, const FreshnessOptions& options) {
+    // A shared cache prefers s-maxage to max-age, and both to Expires
+    CacheControl control = CacheControl::parse(responseHeaders);
+    if (control.sMaxAge >= 0) {
+        return control.sMaxAge;
+    }
+    if (control.maxAge >= 0) {
+        return control.maxAge;
+    }
+    time_t date = parseHttpDate(firstHeader(responseHeaders, "Date"));
+    if (date == -1) {
+        date = responseTime;
+    }
+    std::string expires = firstHeader(responseHeaders, "Expires");
+    if (!expires.empty()) {
+        // An invalid date, such as "0", means already expired
+        time_t expiresAt = parseHttpDate(expires);
+        return expiresAt == -1 ? 0 : std::max<long>(0, expiresAt - date);
+    }
+    int status = responseStatus(responseHeaders);
+    if (isNegative(status)) {
+        return options.negativeTtl;
+    }
+    if (isStoredError(status, options)) {
+        return options.errorTtl;
+    }
+    // Heuristic: a fraction of how long the object had not changed
+    time_t lastModified = parseHttpDate(firstHeader(responseHeaders, "Last-Modified"));
+    if (lastModified != -1 && lastModified <= date) {
+        long unchanged = date - lastModified;
+        return std::min<long>(unchanged * options.heuristicPercent / 100, options.heuristicMax);
+    }
+    return options.defaultTtl;
+}
+
+long initialAge(const std::string& responseHeaders, time_t requestTime, time_t responseTime) {
+    time_t date = parseHttpDate(firstHeader(responseHeaders, "Date"));
+    long apparentAge = date == -1 ? 0 : std::max<long>(0, responseTime - date);
+    std::string age = firstHeader(responseHeaders, "Age");
+    long ageValue = parseSeconds(age.data(), age.size());
+    long responseDelay = std::max<long>(0, responseTime - requestTime);
+    return std::max(apparentAge, ageValue + responseDelay);
+}
+
+time_t expirationTime(const std::string& responseHeaders, time_t requestTime, time_t responseTime, const FreshnessOptions& options) {
+    return responseTime + freshnessLifetime(responseHeaders, responseTime, options) -
+           initialAge(responseHeaders, requestTime, responseTime);
+}
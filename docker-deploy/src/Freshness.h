@@ -0,0 +1,48 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <ctime>
+
+/*
+ @brief: How long stored responses stay fresh when the origin does not say
+         (RFC 9111 4.2.2), and how long error responses are kept
+*/
+struct FreshnessOptions {
+    int defaultTtl = 60;            // seconds, with neither explicit freshness nor Last-Modified
+    int heuristicPercent = 10;      // of the time since Last-Modified
+    int heuristicMax = 86400;       // cap on heuristic freshness
+    int negativeTtl = 60;           // 404, 410 and 501 without explicit freshness
+    std::vector<int> errorStatuses; // 5xx statuses also stored, e.g. 502, 503
+    int errorTtl = 5;               // their lifetime without explicit freshness
+};
+
+/*
+ @brief: Cache-Control directives of a response, from every Cache-Control line
+*/
+struct CacheControl {
+    bool noStore = false;
+    bool noCache = false;
+    bool isPrivate = false;
+    bool isPublic = false;
+    bool mustRevalidate = false; // must-revalidate or proxy-revalidate
+    long maxAge = -1;            // seconds, -1 when absent
+    long sMaxAge = -1;
+
+    static CacheControl parse(const std::string& responseHeaders);
+};
+
+// Status code from the status line, 0 if malformed
+int responseStatus(const std::string& responseHeaders);
+// IMF-fixdate ("Tue, 01 Jan 2019 00:00:00 GMT") to a UTC time_t, -1 if malformed
+time_t parseHttpDate(const std::string& value);
+// Whether the origin set a lifetime: s-maxage, max-age or Expires
+bool hasExplicitFreshness(const std::string& responseHeaders);
+// Whether a shared cache may store the response (RFC 9111 3)
+bool isStorable(const std::string& responseHeaders, const FreshnessOptions& options);
+// Seconds the response is fresh for (RFC 9111 4.2.1): s-maxage, max-age,
+// Expires - Date, then the negative/error TTLs or the heuristics
+long freshnessLifetime(const std::string& responseHeaders, time_t responseTime, const FreshnessOptions& options);
+// Its age on arrival (RFC 9111 4.2.3), from Age, Date and the round trip
+long initialAge(const std::string& responseHeaders, time_t requestTime, time_t responseTime);
+// When a response requested at requestTime and received at responseTime turns stale
+time_t expirationTime(const std::string& responseHeaders, time_t requestTime, time_t responseTime, const FreshnessOptions& options);
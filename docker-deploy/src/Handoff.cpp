@@ -0,0 +1,236 @@
+#include "Handoff.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+static const char REQUEST[] = "UPGRADE\n";
+static const char REQUEST_CACHE[] = "UPGRADE cache\n";
+// How long either side waits for the other
+static const int HANDOFF_TIMEOUT = 60;
+
+static bool fillAddress(const std::string& path, struct sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+static void setTimeouts(int fd) {
+    struct timeval tv;
+    tv.tv_sec = HANDOFF_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static bool sendBytes(int fd, const void* data, size_t length) {
+    const char* p = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool recvBytes(int fd, void* data, size_t length) {
+    char* p = static_cast<char*>(data);
+    while (length > 0) {
+        ssize_t n = recv(fd, p, length, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+int openHandoffSocket(const std::string& path) {
+    struct sockaddr_un addr;
+    if (!fillAddress(path, addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    // Left behind by the previous process, which never unlinks it
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    chmod(path.c_str(), 0600);
+    return fd;
+}
+
+bool readHandoffRequest(int connection, bool& wantCache) {
+    setTimeouts(connection);
+    char line[32];
+    size_t used = 0;
+    while (used < sizeof(line) - 1) {
+        ssize_t n = recv(connection, line + used, 1, 0);
+        if (n <= 0) {
+            return false;
+        }
+        if (line[used++] == '\n') {
+            break;
+        }
+    }
+    line[used] = '\0';
+    if (strcmp(line, REQUEST_CACHE) == 0) {
+        wantCache = true;
+        return true;
+    }
+    wantCache = false;
+    return strcmp(line, REQUEST) == 0;
+}
+
+int requestHandoff(const std::string& path, bool wantCache) {
+    struct sockaddr_un addr;
+    if (!fillAddress(path, addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setTimeouts(fd);
+    const char* request = wantCache ? REQUEST_CACHE : REQUEST;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || !sendBytes(fd, request, strlen(request))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ @brief: Pass fd to the peer. It arrives as a new descriptor for the same
+         open socket, so both processes can accept on it for a moment.
+*/
+bool sendDescriptor(int connection, int fd) {
+    char tag = 'L';
+    struct iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    ssize_t n;
+    do {
+        n = sendmsg(connection, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == 1;
+}
+
+int receiveDescriptor(int connection) {
+    char tag;
+    struct iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    ssize_t n;
+    do {
+        n = recvmsg(connection, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n != 1 || tag != 'L') {
+        return -1;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+bool sendFileStream(int connection, const std::string& path) {
+    uint64_t length = 0;
+    int fd = path.empty() ? -1 : open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        length = st.st_size;
+    }
+    bool ok = sendBytes(connection, &length, sizeof(length));
+    off_t offset = 0;
+    while (ok && (uint64_t)offset < length) {
+        ssize_t n = sendfile(connection, fd, &offset, length - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = n > 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+bool receiveFileStream(int connection, const std::string& path) {
+    uint64_t length;
+    if (!recvBytes(connection, &length, sizeof(length)) || length == 0) {
+        return false;
+    }
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    char buffer[65536];
+    bool ok = true;
+    while (ok && length > 0) {
+        size_t want = length < sizeof(buffer) ? length : sizeof(buffer);
+        ssize_t n = recv(connection, buffer, want, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = n > 0 && write(fd, buffer, n) == n;
+        length -= ok ? n : 0;
+    }
+    close(fd);
+    if (!ok) {
+        unlink(path.c_str());
+    }
+    return ok;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+
+/*
+ @brief: Zero-downtime upgrades. The running proxy listens on a Unix socket;
+         a new process started with --upgrade connects to it and receives:
+           1. the listening TCP socket, passed with SCM_RIGHTS, so pending and
+              new connections are never refused
+           2. optionally the cache, as a snapshot streamed over the connection
+         The old process stops accepting once the socket is sent, streams the
+         snapshot, then drains its clients and exits.
+*/
+
+// Old side: bind the Unix socket (a stale file at path is replaced)
+int openHandoffSocket(const std::string& path);
+// Old side: read the successor's request; wantCache is set if it asked for the cache
+bool readHandoffRequest(int connection, bool& wantCache);
+// New side: connect and ask for the listener, and the cache if wantCache
+int requestHandoff(const std::string& path, bool wantCache);
+
+bool sendDescriptor(int connection, int fd);
+int receiveDescriptor(int connection);
+
+// A length-prefixed file; an empty path sends length 0 (nothing to transfer)
+bool sendFileStream(int connection, const std::string& path);
+// Write the stream to path; false if it was empty or cut short
+bool receiveFileStream(int connection, const std::string& path);
@@ -0,0 +1,62 @@
+#include "HedgePolicy.h"
+#include <algorithm>
+
+std::string HedgeStats::describe() const {
+    return "issued=" + std::to_string(issued.load()) +
+           " won=" + std::to_string(won.load()) +
+           " denied=" + std::to_string(denied.load());
+}
+
+HedgeStats& HedgePolicy::stats() {
+    static HedgeStats hedges;
+    return hedges;
+}
+
+int HedgePolicy::delayFor(const std::string& origin, const HedgeOptions& options) {
+    if (!options.enabled) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    // A burst of slow responses can spend at most 10 saved-up hedges
+    budget = std::min(budget + options.budgetPercent / 100.0, 10.0);
+    if (options.delay > 0) {
+        return options.delay;
+    }
+    auto it = origins.find(origin);
+    if (it == origins.end() || it->second.count < MIN_SAMPLES) {
+        return -1;
+    }
+    const Latencies& latencies = it->second;
+    uint32_t sorted[SAMPLES];
+    std::copy(latencies.samples, latencies.samples + latencies.count, sorted);
+    uint32_t* p95 = sorted + latencies.count * 95 / 100;
+    std::nth_element(sorted, p95, sorted + latencies.count);
+    return std::max<int>(*p95, options.minDelay);
+}
+
+bool HedgePolicy::takeBudget() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (budget < 1) {
+        stats().denied++;
+        return false;
+    }
+    budget -= 1;
+    stats().issued++;
+    return true;
+}
+
+void HedgePolicy::recordFirstByte(const std::string& origin, uint32_t milliseconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = origins.find(origin);
+    if (it == origins.end()) {
+        if (origins.size() >= MAX_ORIGINS) {
+            // Start over rather than track every host ever seen
+            origins.clear();
+        }
+        it = origins.emplace(origin, Latencies()).first;
+    }
+    Latencies& latencies = it->second;
+    latencies.samples[latencies.next] = milliseconds;
+    latencies.next = (latencies.next + 1) % SAMPLES;
+    latencies.count = std::min(latencies.count + 1, SAMPLES);
+}
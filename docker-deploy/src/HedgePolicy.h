@@ -0,0 +1,54 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+ @brief: When a GET that is slow to answer gets a second upstream attempt
+*/
+struct HedgeOptions {
+    bool enabled = false;
+    int delay = 0;           // milliseconds without a first byte before hedging; 0 = the origin's p95
+    int minDelay = 10;       // floor for the p95 delay, milliseconds
+    int budgetPercent = 10;  // extra attempts allowed, per 100 hedgeable requests
+};
+
+struct HedgeStats {
+    std::atomic<uint64_t> issued{0};  // second attempts sent
+    std::atomic<uint64_t> won{0};     // of those, answered first
+    std::atomic<uint64_t> denied{0};  // slow requests not hedged, out of budget
+
+    // "issued=12 won=9 denied=3" for the log
+    std::string describe() const;
+};
+
+/*
+ @brief: Per-origin time-to-first-byte samples for the p95 delay, and the
+         budget that caps hedges to a share of the traffic
+*/
+class HedgePolicy {
+private:
+    static constexpr int SAMPLES = 128;       // most recent first-byte times kept per origin
+    static constexpr int MIN_SAMPLES = 20;    // before the p95 is trusted
+    static constexpr size_t MAX_ORIGINS = 4096;
+    struct Latencies {
+        uint32_t samples[SAMPLES];
+        int count = 0;
+        int next = 0;
+    };
+    std::mutex mutex;
+    std::unordered_map<std::string, Latencies> origins;
+    double budget = 0;  // hedges that may go out now
+
+public:
+    // Milliseconds to wait for the first byte before hedging, -1 = do not hedge.
+    // Also earns budget: every hedgeable request adds budgetPercent / 100.
+    int delayFor(const std::string& origin, const HedgeOptions& options);
+    // Spend one hedge; false (and counted as denied) when over budget
+    bool takeBudget();
+    void recordFirstByte(const std::string& origin, uint32_t milliseconds);
+
+    static HedgeStats& stats();
+};
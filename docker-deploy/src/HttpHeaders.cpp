@@ -0,0 +1,119 @@
+#include "HttpHeaders.h"
+#include <strings.h>
+#include <algorithm>
+
+static bool sameName(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+HeaderField HeaderList::view(const Field& field) const {
+    return HeaderField{field.id, std::string_view(text.data() + field.nameAt, field.nameLength),
+                       std::string_view(text.data() + field.valueAt, field.valueLength)};
+}
+
+size_t HeaderList::indexOf(HeaderId id, std::string_view name) const {
+    const Field* all = fields();
+    for (size_t i = 0; i < count; i++) {
+        if (all[i].id == id && (id != HeaderId::Other || sameName(view(all[i]).name, name))) {
+            return i;
+        }
+    }
+    return count;
+}
+
+void HeaderList::append(std::string_view name, std::string_view value) {
+    if (name.size() > UINT16_MAX) {
+        return;  // not a header any client sends
+    }
+    // Either may be a view of text, which appending can move
+    const char* begin = text.data();
+    if ((name.data() >= begin && name.data() < begin + text.size()) ||
+        (value.data() >= begin && value.data() < begin + text.size())) {
+        std::string copy;
+        copy.append(name).append(value);
+        append(std::string_view(copy.data(), name.size()), std::string_view(copy.data() + name.size(), value.size()));
+        return;
+    }
+    Field field;
+    field.id = headerId(name);
+    field.nameAt = (uint32_t)text.size();
+    field.nameLength = (uint16_t)name.size();
+    text.append(name);
+    field.valueAt = (uint32_t)text.size();
+    field.valueLength = (uint32_t)value.size();
+    text.append(value);
+    if (count < INLINE) {
+        inlineFields[count] = field;
+    } else {
+        if (count == INLINE) {
+            moreFields.assign(inlineFields.begin(), inlineFields.end());
+        }
+        moreFields.push_back(field);
+    }
+    count++;
+}
+
+std::string_view HeaderList::get(HeaderId id) const {
+    size_t index = indexOf(id, {});
+    return index < count ? view(fields()[index]).value : std::string_view();
+}
+
+std::string_view HeaderList::get(std::string_view name) const {
+    size_t index = indexOf(headerId(name), name);
+    return index < count ? view(fields()[index]).value : std::string_view();
+}
+
+void HeaderList::setValue(HeaderId id, std::string_view name, std::string_view value) {
+    size_t index = indexOf(id, name);
+    if (index == count) {
+        append(name, value);
+        return;
+    }
+    // Keep the first one's place in the order; the old bytes stay unused in text
+    std::string copy(value);
+    Field& field = fields()[index];
+    field.valueAt = (uint32_t)text.size();
+    field.valueLength = (uint32_t)copy.size();
+    text.append(copy);
+    for (size_t i = index + 1; i < count;) {
+        const Field& other = fields()[i];
+        if (other.id == id && (id != HeaderId::Other || sameName(view(other).name, name))) {
+            eraseAt(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+size_t HeaderList::eraseAll(HeaderId id, std::string_view name) {
+    size_t removed = 0;
+    for (size_t i = 0; i < count;) {
+        const Field& field = fields()[i];
+        if (field.id == id && (id != HeaderId::Other || sameName(view(field).name, name))) {
+            eraseAt(i);
+            removed++;
+        } else {
+            i++;
+        }
+    }
+    return removed;
+}
+
+void HeaderList::eraseAt(size_t index) {
+    if (count > INLINE) {
+        moreFields.erase(moreFields.begin() + index);
+        if (--count == INLINE) {
+            std::copy(moreFields.begin(), moreFields.end(), inlineFields.begin());
+            moreFields.clear();
+        }
+        return;
+    }
+    std::copy(inlineFields.begin() + index + 1, inlineFields.begin() + count, inlineFields.begin() + index);
+    count--;
+}
+
+void HeaderList::clear() {
+    text.clear();
+    moreFields.clear();
+    count = 0;
+}
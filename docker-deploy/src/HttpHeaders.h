@@ -0,0 +1,214 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class HttpMethod : uint8_t {
+    Unknown, Get, Head, Post, Put, Delete, Connect, Options, Trace, Patch
+};
+
+// Header names the proxy acts on; everything else is Other and compared by name
+enum class HeaderId : uint8_t {
+    Other,
+    Host, ContentLength, TransferEncoding, Connection, ProxyConnection, KeepAlive,
+    Te, Trailer, Upgrade, ProxyAuthorization, ProxyAuthenticate, Expect,
+    AcceptEncoding, IfNoneMatch, IfModifiedSince, IfMatch, IfUnmodifiedSince, Range, IfRange,
+    CacheControl, Pragma, ContentType, ContentEncoding, Authorization, Cookie, UserAgent, Accept, Via
+};
+
+/*
+ @brief: Perfect hash over a fixed set of names, built at compile time. The
+         constructor tries seeds until every name has a slot of its own, so
+         a lookup hashes the length and three characters, then compares with
+         the one name in that slot. Case-insensitive for header names.
+*/
+template <typename Id, size_t N, size_t SLOTS>
+class PerfectHash {
+public:
+    struct Entry {
+        std::string_view name;
+        Id id;
+    };
+
+private:
+    static_assert((SLOTS & (SLOTS - 1)) == 0, "SLOTS must be a power of two");
+    std::array<Entry, N> entries;
+    std::array<uint8_t, SLOTS> slots{};  // index + 1 into entries, 0: empty
+    uint32_t seed = 0;
+    bool caseless;
+
+    static constexpr char lower(char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; }
+
+    constexpr size_t slotOf(std::string_view name) const {
+        uint32_t hash = (seed ^ (uint32_t)name.size()) * 0x01000193u;
+        for (size_t i : {(size_t)0, name.size() / 2, name.size() - 1}) {
+            hash = (hash ^ (uint8_t)(caseless ? lower(name[i]) : name[i])) * 0x01000193u;
+        }
+        return (hash ^ (hash >> 16)) & (SLOTS - 1);
+    }
+
+    constexpr bool place() {
+        slots = {};
+        for (size_t i = 0; i < N; i++) {
+            size_t slot = slotOf(entries[i].name);
+            if (slots[slot]) {
+                return false;
+            }
+            slots[slot] = (uint8_t)(i + 1);
+        }
+        return true;
+    }
+
+public:
+    constexpr PerfectHash(const std::array<Entry, N>& entries, bool caseless) : entries(entries), caseless(caseless) {
+        static_assert(N < SLOTS && N < 255);
+        while (!place()) {
+            if (++seed > 10000) {
+                throw "no collision-free seed; raise SLOTS";
+            }
+        }
+    }
+
+    constexpr Id find(std::string_view name, Id missing) const {
+        if (name.empty()) {
+            return missing;
+        }
+        uint8_t slot = slots[slotOf(name)];
+        if (!slot || entries[slot - 1].name.size() != name.size()) {
+            return missing;
+        }
+        std::string_view known = entries[slot - 1].name;
+        for (size_t i = 0; i < name.size(); i++) {
+            if (caseless ? lower(name[i]) != lower(known[i]) : name[i] != known[i]) {
+                return missing;
+            }
+        }
+        return entries[slot - 1].id;
+    }
+
+    constexpr std::string_view nameOf(Id id) const {
+        for (const Entry& entry : entries) {
+            if (entry.id == id) {
+                return entry.name;
+            }
+        }
+        return {};
+    }
+};
+
+// Methods are case-sensitive (RFC 9110 9.1)
+inline constexpr PerfectHash<HttpMethod, 9, 16> METHOD_TABLE({{
+    {"GET", HttpMethod::Get}, {"HEAD", HttpMethod::Head}, {"POST", HttpMethod::Post},
+    {"PUT", HttpMethod::Put}, {"DELETE", HttpMethod::Delete}, {"CONNECT", HttpMethod::Connect},
+    {"OPTIONS", HttpMethod::Options}, {"TRACE", HttpMethod::Trace}, {"PATCH", HttpMethod::Patch},
+}}, false);
+
+inline constexpr PerfectHash<HeaderId, 28, 128> HEADER_TABLE({{
+    {"Host", HeaderId::Host}, {"Content-Length", HeaderId::ContentLength},
+    {"Transfer-Encoding", HeaderId::TransferEncoding}, {"Connection", HeaderId::Connection},
+    {"Proxy-Connection", HeaderId::ProxyConnection}, {"Keep-Alive", HeaderId::KeepAlive},
+    {"TE", HeaderId::Te}, {"Trailer", HeaderId::Trailer}, {"Upgrade", HeaderId::Upgrade},
+    {"Proxy-Authorization", HeaderId::ProxyAuthorization}, {"Proxy-Authenticate", HeaderId::ProxyAuthenticate},
+    {"Expect", HeaderId::Expect}, {"Accept-Encoding", HeaderId::AcceptEncoding},
+    {"If-None-Match", HeaderId::IfNoneMatch}, {"If-Modified-Since", HeaderId::IfModifiedSince},
+    {"If-Match", HeaderId::IfMatch}, {"If-Unmodified-Since", HeaderId::IfUnmodifiedSince},
+    {"Range", HeaderId::Range}, {"If-Range", HeaderId::IfRange}, {"Cache-Control", HeaderId::CacheControl},
+    {"Pragma", HeaderId::Pragma}, {"Content-Type", HeaderId::ContentType},
+    {"Content-Encoding", HeaderId::ContentEncoding}, {"Authorization", HeaderId::Authorization},
+    {"Cookie", HeaderId::Cookie}, {"User-Agent", HeaderId::UserAgent}, {"Accept", HeaderId::Accept},
+    {"Via", HeaderId::Via},
+}}, true);
+
+constexpr HttpMethod methodId(std::string_view method) {
+    return METHOD_TABLE.find(method, HttpMethod::Unknown);
+}
+
+constexpr HeaderId headerId(std::string_view name) {
+    return HEADER_TABLE.find(name, HeaderId::Other);
+}
+
+// The canonical spelling of a well-known header
+constexpr std::string_view headerName(HeaderId id) {
+    return HEADER_TABLE.nameOf(id);
+}
+
+static_assert(methodId("CONNECT") == HttpMethod::Connect && methodId("get") == HttpMethod::Unknown);
+static_assert(headerId("content-LENGTH") == HeaderId::ContentLength && headerId("X-Host") == HeaderId::Other);
+
+struct HeaderField {
+    HeaderId id;
+    std::string_view name;
+    std::string_view value;
+};
+
+/*
+ @brief: A request's headers in arrival order. Names and values are kept in
+         one buffer and the fields, id plus offsets into it, inline for up
+         to INLINE headers. Lookups are case-insensitive; a well-known name
+         is matched by its id. Views returned are valid until the next change.
+*/
+class HeaderList {
+public:
+    static constexpr size_t INLINE = 16;
+
+private:
+    struct Field {
+        uint32_t nameAt;
+        uint32_t valueAt;
+        uint32_t valueLength;
+        uint16_t nameLength;
+        HeaderId id;
+    };
+    std::string text;
+    std::array<Field, INLINE> inlineFields;
+    std::vector<Field> moreFields;  // all of them, once there are more than INLINE
+    uint32_t count = 0;
+
+    Field* fields() { return count > INLINE ? moreFields.data() : inlineFields.data(); }
+    const Field* fields() const { return count > INLINE ? moreFields.data() : inlineFields.data(); }
+    HeaderField view(const Field& field) const;
+    // Index of the first field named name (id, when it is well known), count if none
+    size_t indexOf(HeaderId id, std::string_view name) const;
+    size_t eraseAll(HeaderId id, std::string_view name);
+    void eraseAt(size_t index);
+    void setValue(HeaderId id, std::string_view name, std::string_view value);
+
+public:
+    class const_iterator {
+    private:
+        const HeaderList* list;
+        size_t index;
+
+    public:
+        const_iterator(const HeaderList* list, size_t index) : list(list), index(index) {}
+        HeaderField operator*() const { return (*list)[index]; }
+        const_iterator& operator++() { ++index; return *this; }
+        bool operator!=(const const_iterator& other) const { return index != other.index; }
+    };
+
+    // Bytes of names and values to expect, so that parsing copies into one allocation
+    void reserve(size_t bytes) { text.reserve(bytes); }
+    void append(std::string_view name, std::string_view value);
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    HeaderField operator[](size_t index) const { return view(fields()[index]); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, count); }
+
+    bool contains(HeaderId id) const { return indexOf(id, {}) < count; }
+    bool contains(std::string_view name) const { return indexOf(headerId(name), name) < count; }
+    // The first value, empty when there is none
+    std::string_view get(HeaderId id) const;
+    std::string_view get(std::string_view name) const;
+    // Replace the first value and drop the others, or append
+    void set(HeaderId id, std::string_view value) { setValue(id, headerName(id), value); }
+    void set(std::string_view name, std::string_view value) { setValue(headerId(name), name, value); }
+    // Number of fields removed
+    size_t erase(HeaderId id) { return eraseAll(id, {}); }
+    size_t erase(std::string_view name) { return eraseAll(headerId(name), name); }
+    void clear();
+};
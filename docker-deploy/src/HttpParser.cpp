@@ -1,65 +1,118 @@
 #include "HttpParser.h"
 #include <sstream>
 #include <iostream>
+#include <cstring>
+#include <strings.h>
+#include <cctype>
 
 HttpParser::HttpParser() {}
 
 HttpRequest HttpParser::parseRequest(const std::string& rawRequest) {
     HttpRequest request;
+    parseRequest(rawRequest, request);
+    return request;
+}
+
+/*
+ @brief: Parse in place over rawRequest: no stream or per-line copies, the
+         fields are assigned straight from the buffer. Every field of request
+         is reset, but its strings keep their capacity, so a reused request
+         parses without allocating.
+*/
+void HttpParser::parseRequest(const std::string& rawRequest, HttpRequest& request) {
     request.raw = rawRequest;
-    // Bind the stream with request
-    std::istringstream stream(rawRequest);
-    std::string line;
+    request.headers.clear();
+    request.body.clear();
+    request.host.clear();
+    request.port.clear();
+    request.tls = false;
+    request.arena = std::pmr::get_default_resource();
+    const char* data = rawRequest.data();
+    size_t length = rawRequest.size();
 
     // Parse request line
-    std::getline(stream, line);
-    if (!line.empty() && line.back() == '\r') {
-        line.pop_back();
+    size_t lineEnd = rawRequest.find('\n');
+    size_t next = lineEnd == std::string::npos ? length : lineEnd + 1;
+    if (lineEnd == std::string::npos) {
+        lineEnd = length;
     }
-    request.request = line;
-    std::istringstream requestLine(line);
-    requestLine >> request.method >> request.url >> request.version;
-    if (!request.version.empty() && request.version.back() == '\r') {
-        request.version.pop_back();
+    if (lineEnd > 0 && data[lineEnd - 1] == '\r') {
+        --lineEnd;
+    }
+    request.request.assign(data, lineEnd);
+    // method, url and version are separated by whitespace
+    std::string* fields[] = {&request.method, &request.url, &request.version};
+    size_t pos = 0;
+    for (std::string* field : fields) {
+        while (pos < lineEnd && isspace((unsigned char)data[pos])) {
+            ++pos;
+        }
+        size_t fieldStart = pos;
+        while (pos < lineEnd && !isspace((unsigned char)data[pos])) {
+            ++pos;
+        }
+        field->assign(data + fieldStart, pos - fieldStart);
     }
+    request.methodId = methodId(request.method);
 
-    // Parse headers
-    while (std::getline(stream, line) && line != "\r" && line != "") {
+    // Parse headers; names and values are copied into one buffer
+    size_t headersEnd = rawRequest.find("\r\n\r\n", next);
+    request.headers.reserve((headersEnd == std::string::npos ? length : headersEnd) - next);
+    pos = next;
+    while (pos < length) {
+        lineEnd = rawRequest.find('\n', pos);
+        next = lineEnd == std::string::npos ? length : lineEnd + 1;
+        if (lineEnd == std::string::npos) {
+            lineEnd = length;
+        }
+        if (lineEnd > pos && data[lineEnd - 1] == '\r') {
+            --lineEnd;
+        }
+        if (lineEnd == pos) {
+            // Blank line: the body follows
+            pos = next;
+            break;
+        }
         // Format key : value
-        size_t colonPos = line.find(':');
-        if (colonPos != std::string::npos) {
-            // Substr(startPoint, length)
-            std::string key = line.substr(0, colonPos);
-            std::string value = line.substr(colonPos + 2);
-            if (!value.empty() && value.back() == '\r') {
-                value.pop_back();
+        const char* colon = static_cast<const char*>(memchr(data + pos, ':', lineEnd - pos));
+        if (colon) {
+            size_t colonPos = colon - data;
+            size_t valueStart = colonPos + 1;
+            while (valueStart < lineEnd && (data[valueStart] == ' ' || data[valueStart] == '\t')) {
+                ++valueStart;
             }
-            if (key == "Host") {
+            std::string_view key(data + pos, colonPos - pos);
+            std::string_view value(data + valueStart, lineEnd - valueStart);
+            request.headers.append(key, value);
+            if (headerId(key) == HeaderId::Host) {
                 size_t portPos = value.find(':');
-                if (portPos != std::string::npos) {
+                if (portPos != std::string_view::npos) {
                     // If port is specified, extract hostname and port
-                    request.host = value.substr(0, portPos);
-                    request.port = value.substr(portPos + 1);
+                    request.host.assign(value.substr(0, portPos));
+                    request.port.assign(value.substr(portPos + 1));
                 } else {
                     // If no port is specified, use the hostname and default port
-                    request.host = value;
-                    request.port = "80";
-                    if (request.method == "CONNECT") {
-                        request.port = "443";
-                    }
-                }       
+                    request.host.assign(value);
+                    bool https = request.methodId == HttpMethod::Connect || strncasecmp(request.url.c_str(), "https://", 8) == 0;
+                    request.port = https ? "443" : "80";
+                }
             }
-            request.headers[key] = value;
         }
+        pos = next;
     }
 
     // Parse body if present
-    std::stringstream bodyStream;
-    while (std::getline(stream, line)) {
-        bodyStream << line << "\n";
+    if (pos < length) {
+        request.body.assign(data + pos, length - pos);
+    }
+
+    // Build the cache key once; lookup and store reuse it
+    if (request.methodId == HttpMethod::Get || request.methodId == HttpMethod::Head) {
+        makeCacheKey(request.cacheKey, request.host, request.port, request.url);
+    } else {
+        request.cacheKey.hash = 0;
+        request.cacheKey.key.clear();
     }
-    request.body = bodyStream.str();
-    return request;
 }
 
 std::string HttpParser::buildRequest(const HttpRequest& request) {
@@ -67,8 +120,8 @@ std::string HttpParser::buildRequest(const HttpRequest& request) {
     
     ss << request.method << " " << request.url << " " << request.version << "\r\n";
     
-    for (const auto& header : request.headers) {
-        ss << header.first << ": " << header.second << "\r\n";
+    for (const HeaderField& header : request.headers) {
+        ss << header.name << ": " << header.value << "\r\n";
     }
     
     ss << "\r\n" << request.body;
@@ -82,8 +135,13 @@ bool HttpParser::isValidRequest(const HttpRequest& request) {
     }
     
     // Validate method
-    if (request.method != "GET" && request.method != "POST" && 
-        request.method != "CONNECT") {
+    switch (request.methodId) {
+    case HttpMethod::Get:
+    case HttpMethod::Head:
+    case HttpMethod::Post:
+    case HttpMethod::Connect:
+        break;
+    default:
         return false;
     }
     
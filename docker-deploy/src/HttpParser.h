@@ -1,23 +1,30 @@
 #pragma once
 #include <string>
-#include <unordered_map>
+#include <memory_resource>
+#include "CacheKey.h"
+#include "HttpHeaders.h"
 
 struct HttpRequest {
     std::string method;
+    HttpMethod methodId = HttpMethod::Unknown;
     std::string request;
     std::string url;
     std::string version;
-    std::unordered_map<std::string, std::string> headers;
+    HeaderList headers;
     std::string body;
     std::string raw;
     std::string host;
     std::string port;
+    bool tls = false;  // decrypted from an intercepted CONNECT: the origin speaks TLS
+    CacheKey cacheKey; // normalized and hashed once, only set for cacheable methods
+    std::pmr::memory_resource* arena = std::pmr::get_default_resource(); // scratch memory for this request
 };
 
 class HttpParser {
 public:
     HttpParser();
     HttpRequest parseRequest(const std::string& rawRequest);
+    void parseRequest(const std::string& rawRequest, HttpRequest& request);
     std::string buildRequest(const HttpRequest& request);
     bool isValidRequest(const HttpRequest& request);
 }; 
\ No newline at end of file
@@ -0,0 +1,196 @@
+#include "IoUring.h"
+#ifdef WEBPROXY_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+static int uringSetup(unsigned entries, io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, const void* arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+IoUring::IoUring()
+    : ringFd(-1), sqRing(MAP_FAILED), sqRingSize(0), sqLocalTail(0), sqes(nullptr), sqesSize(0),
+      cqRing(MAP_FAILED), cqRingSize(0), bufferRing(nullptr), bufferRingSize(0), buffers(nullptr),
+      bufferCount(0), bufferLength(0), bufferTail(0) {}
+
+IoUring::~IoUring() {
+    // Closing the ring cancels what is still queued; callers reap first
+    if (ringFd >= 0) {
+        close(ringFd);
+    }
+    if (cqRing != MAP_FAILED && cqRing != sqRing) {
+        munmap(cqRing, cqRingSize);
+    }
+    if (sqRing != MAP_FAILED) {
+        munmap(sqRing, sqRingSize);
+    }
+    if (sqes) {
+        munmap(sqes, sqesSize);
+    }
+    if (bufferRing) {
+        munmap(bufferRing, bufferRingSize);
+    }
+    free(buffers);
+}
+
+bool IoUring::init(unsigned entries, unsigned flags) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = flags;
+    ringFd = uringSetup(entries, &params);
+    if (ringFd < 0 && errno == EINVAL && flags != 0) {
+        // Kernels before 6.1
+        memset(&params, 0, sizeof(params));
+        ringFd = uringSetup(entries, &params);
+    }
+    if (ringFd < 0) {
+        return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        return false;
+    }
+    cqRing = single ? sqRing
+                    : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED) {
+        return false;
+    }
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqeMemory = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqeMemory == MAP_FAILED) {
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe*>(sqeMemory);
+
+    char* sq = static_cast<char*>(sqRing);
+    sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqEntries = params.sq_entries;
+    sqLocalTail = *sqTail;
+    char* cq = static_cast<char*>(cqRing);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+/*
+ @brief: Fixed files: operations name them by index with IOSQE_FIXED_FILE and
+         skip the per-call file table lookup
+*/
+bool IoUring::registerFiles(const int* fds, unsigned count) {
+    return uringRegister(ringFd, IORING_REGISTER_FILES, fds, count) == 0;
+}
+
+bool IoUring::setupBuffers(unsigned short group, unsigned count, size_t length) {
+    bufferRingSize = count * sizeof(io_uring_buf);
+    void* ring = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        bufferRingSize = 0;
+        return false;
+    }
+    bufferRing = static_cast<io_uring_buf_ring*>(ring);
+    buffers = static_cast<char*>(malloc(count * length));
+    if (!buffers) {
+        return false;
+    }
+    bufferCount = count;
+    bufferLength = length;
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(bufferRing);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    // Also the check for multishot accept, which came in the same release (5.19)
+    if (uringRegister(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        return false;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        recycleBuffer(i);
+    }
+    return true;
+}
+
+void IoUring::recycleBuffer(unsigned short id) {
+    // Not bufferRing->bufs: in C++ the header's flexible array sits behind an
+    // empty struct and starts 8 bytes late. Entry 0 shares the ring's first 16.
+    io_uring_buf* slot = reinterpret_cast<io_uring_buf*>(bufferRing) + (bufferTail & (bufferCount - 1));
+    slot->addr = reinterpret_cast<uint64_t>(buffer(id));
+    slot->len = bufferLength;
+    slot->bid = id;
+    ++bufferTail;
+    __atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe* IoUring::getSqe(unsigned linked) {
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (sqLocalTail - head + linked >= sqEntries) {
+        // Full: hand the queued entries to the kernel, which takes them all
+        submitAndWait(0);
+        head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqLocalTail - head + linked >= sqEntries) {
+            return nullptr;
+        }
+    }
+    unsigned index = sqLocalTail & sqMask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    ++sqLocalTail;
+    return sqe;
+}
+
+int IoUring::submitAndWait(unsigned waitFor) {
+    unsigned toSubmit = sqLocalTail - *sqTail;
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = uringEnter(ringFd, toSubmit, waitFor, IORING_ENTER_GETEVENTS);
+        // A signal may interrupt the wait after the entries were taken
+        toSubmit = 0;
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+int IoUring::submit() {
+    if (sqLocalTail == *sqTail) {
+        return 0;
+    }
+    return submitAndWait(0);
+}
+
+io_uring_cqe* IoUring::peekCqe() {
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &cqes[head & cqMask];
+}
+
+void IoUring::cqeSeen() {
+    __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
+#endif
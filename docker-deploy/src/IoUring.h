@@ -0,0 +1,72 @@
+#pragma once
+#ifdef WEBPROXY_IO_URING
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ @brief: A minimal io_uring instance on the raw system calls (no liburing):
+         the submission and completion rings, registered files and one
+         provided buffer ring. Driven by a single thread: the accept front
+         end, or an event loop for the socket I/O of its coroutines.
+*/
+class IoUring {
+private:
+    int ringFd;
+    // submission ring
+    void* sqRing;
+    size_t sqRingSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail;
+    io_uring_sqe* sqes;
+    size_t sqesSize;
+    // completion ring (shares sqRing when the kernel maps both at once)
+    void* cqRing;
+    size_t cqRingSize;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    io_uring_cqe* cqes;
+    // provided buffers: the kernel picks one per receive
+    io_uring_buf_ring* bufferRing;
+    size_t bufferRingSize;
+    char* buffers;
+    unsigned bufferCount;
+    size_t bufferLength;
+    unsigned short bufferTail;
+
+public:
+    IoUring();
+    ~IoUring();
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // false when the kernel has no io_uring or refuses the setup. The default
+    // flags run completions only when the owning thread waits in the ring;
+    // a ring watched with epoll passes 0.
+    bool init(unsigned entries, unsigned flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+    bool registerFiles(const int* fds, unsigned count);
+    // count buffers (a power of two) of length bytes in buffer group group
+    bool setupBuffers(unsigned short group, unsigned count, size_t length);
+
+    // A zeroed submission entry; submits what is queued when the ring is full.
+    // linked: entries the caller links behind this one, kept free so a full
+    // ring never submits the chain in two parts.
+    io_uring_sqe* getSqe(unsigned linked = 0);
+    // Submit everything queued and wait for at least waitFor completions
+    int submitAndWait(unsigned waitFor);
+    // Submit everything queued without waiting; no system call when nothing is
+    int submit();
+    // Readable (epoll) while completions wait to be reaped
+    int descriptor() const { return ringFd; }
+    io_uring_cqe* peekCqe();
+    void cqeSeen();
+
+    char* buffer(unsigned short id) { return buffers + (size_t)id * bufferLength; }
+    void recycleBuffer(unsigned short id);
+};
+#endif
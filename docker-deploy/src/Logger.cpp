@@ -15,6 +15,21 @@ Logger::~Logger() {
     }
 }
 
+/*
+ @brief: Switch to another file (or the same one after log rotation). The old
+         file stays in use when the new one cannot be opened.
+*/
+bool Logger::reopen(const std::string& path) {
+    std::ofstream file(path, std::ios::app);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(logMutex);
+    logFile = std::move(file);
+    logPath = path;
+    return true;
+}
+
 void Logger::log(LogLevel level, const std::string& message) {
     std::lock_guard<std::mutex> lock(logMutex);
     
@@ -54,7 +69,7 @@ void Logger::log(LogLevel level, const std::string& message, int clientId) {
             << message << std::put_time(&tm, "%Y-%m-%d %H:%M:%S") <<std::endl;
 }
 
-void Logger::log(const std::string& message, int clientId) {
+void Logger::log(std::string_view message, int clientId) {
     std::lock_guard<std::mutex> lock(logMutex);
     auto now = std::time(nullptr);
     auto tm = *std::localtime(&now);
@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <mutex>
 #include <string>
@@ -20,8 +21,9 @@ public:
 
     Logger(const std::string& logPath);
     ~Logger();
+    bool reopen(const std::string& path);
     
     void log(LogLevel level, const std::string& message);
-    void log(const std::string& message, int clientId);
+    void log(std::string_view message, int clientId);
     void log(LogLevel level, const std::string& message, int clientId);
 }; 
\ No newline at end of file
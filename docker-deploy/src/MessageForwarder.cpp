@@ -6,106 +6,440 @@
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <strings.h>
 #include <sstream>
+#include <charconv>
+#include <string_view>
+#include <chrono>
+#include "BufferPool.h"
+#include "RequestArena.h"
+#include "SocketWriter.h"
+#include "AsyncIo.h"
+#include "TimingWheel.h"
 
-void MessageForwarder::forwardGet(HttpRequest& req, int clientSocket, int clientId, std::shared_ptr<Logger> logger) {
+/*
+ @brief: send() that finishes partial writes and never raises SIGPIPE
+*/
+static bool sendAll(int socket, const char* data, size_t length) {
+    SocketWriter writer(socket);
+    writer.add(data, length);
+    return writer.flush();
+}
+
+// Marks a request one peer sends another, so it is not passed on again
+static const char PEER_HEADER[] = "X-Proxy-Peer";
+
+// Answers that count against the origin's health; 501 is a normal answer
+static bool isOriginFailure(int status) {
+    return status == 500 || status == 502 || status == 503 || status == 504;
+}
+
+/*
+@brief: The gzip variant's validator: the origin's entity tag, weakened. It
+        stays comparable for If-None-Match, with the origin too, but never
+        lets If-Range splice bytes of the two encodings.
+*/
+static std::string weakEtag(std::string_view etag) {
+    if (etag.empty() || etag.compare(0, 2, "W/") == 0) {
+        return std::string(etag);
+    }
+    return "W/" + std::string(etag);
+}
+
+static void appendNumber(std::pmr::string& out, size_t value) {
+    char digits[24];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr - digits);
+}
+
+// Idle upstream connections kept per origin
+static const size_t MAX_IDLE_PER_ORIGIN = 8;
+
+/*
+ @brief: Whether a Connection header of headers lists name, so the field is
+         hop-by-hop for this request. Every token counts, however many.
+*/
+static bool listedInConnection(const HeaderList& headers, std::string_view name) {
+    for (const HeaderField& header : headers) {
+        std::string_view tokens = header.id == HeaderId::Connection ? header.value : std::string_view();
+        while (!tokens.empty()) {
+            size_t comma = tokens.find(',');
+            std::string_view token = tokens.substr(0, comma);
+            tokens = comma == std::string_view::npos ? std::string_view() : tokens.substr(comma + 1);
+            while (!token.empty() && (token.front() == ' ' || token.front() == '\t')) {
+                token.remove_prefix(1);
+            }
+            while (!token.empty() && (token.back() == ' ' || token.back() == '\t')) {
+                token.remove_suffix(1);
+            }
+            if (token.size() == name.size() && strncasecmp(token.data(), name.data(), name.size()) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ @brief: Hop-by-hop headers (RFC 9110 7.6.1, and those of RFC 2616 13.5.1),
+         never passed on. Transfer-Encoding stays: a request body is relayed
+         in the framing it arrived in.
+*/
+static bool isHopByHop(HeaderId id) {
+    switch (id) {
+    case HeaderId::Connection:
+    case HeaderId::ProxyConnection:
+    case HeaderId::KeepAlive:
+    case HeaderId::Te:
+    case HeaderId::Trailer:
+    case HeaderId::Upgrade:
+    case HeaderId::ProxyAuthorization:
+    case HeaderId::ProxyAuthenticate:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ @brief: The path and query of an absolute-form target (RFC 9112 3.2.1);
+         empty when it has neither. Origin-form targets come back unchanged.
+*/
+static std::string_view originForm(std::string_view url) {
+    size_t scheme = url.find("://");
+    if (scheme == std::string_view::npos || url.find('/') < scheme) {
+        return url;
+    }
+    size_t path = url.find_first_of("/?", scheme + 3);
+    return path == std::string_view::npos ? std::string_view() : url.substr(path);
+}
+
+/*
+ @brief: Follows chunked framing across reads, to tell when the body has
+         ended on a connection the origin keeps open
+*/
+class ChunkedEnd {
+private:
+    enum State { SIZE, EXTENSION, SIZE_LF, DATA, DATA_CR, DATA_LF, TRAILER, TRAILER_LINE, TRAILER_LF, DONE, BROKEN };
+    State state = SIZE;
+    size_t remaining = 0;  // chunk size while in SIZE, then bytes of it left
+    int digits = 0;
+
+    void endOfSizeLine() {
+        state = remaining == 0 ? TRAILER : DATA;
+    }
+
+public:
+    // True once the last chunk and any trailers have gone by
+    bool feed(const char* data, size_t length) {
+        for (size_t i = 0; i < length && state != DONE && state != BROKEN; i++) {
+            char c = data[i];
+            switch (state) {
+            case SIZE:
+                if (isxdigit((unsigned char)c) && digits < 15) {
+                    remaining = remaining * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10));
+                    digits++;
+                } else if (digits > 0 && (c == ';' || c == ' ' || c == '\t')) {
+                    state = EXTENSION;
+                } else if (digits > 0 && c == '\r') {
+                    state = SIZE_LF;
+                } else {
+                    state = BROKEN;
+                }
+                break;
+            case EXTENSION:
+                if (c == '\r') {
+                    state = SIZE_LF;
+                }
+                break;
+            case SIZE_LF:
+                if (c == '\n') {
+                    endOfSizeLine();
+                } else {
+                    state = BROKEN;
+                }
+                break;
+            case DATA: {
+                size_t take = std::min(remaining, length - i);
+                remaining -= take;
+                i += take - 1;
+                if (remaining == 0) {
+                    state = DATA_CR;
+                }
+                break;
+            }
+            case DATA_CR:
+                state = c == '\r' ? DATA_LF : BROKEN;
+                break;
+            case DATA_LF:
+                state = c == '\n' ? SIZE : BROKEN;
+                digits = 0;
+                break;
+            case TRAILER:
+                state = c == '\r' ? TRAILER_LF : TRAILER_LINE;
+                break;
+            case TRAILER_LINE:
+                if (c == '\n') {
+                    state = TRAILER;
+                }
+                break;
+            case TRAILER_LF:
+                state = c == '\n' ? DONE : BROKEN;
+                break;
+            default:
+                break;
+            }
+        }
+        return state == DONE;
+    }
+};
+
+MessageForwarder::MessageForwarder(std::shared_ptr<CacheManager> cacheManager, std::shared_ptr<SharedSettings> settings)
+    : sharedSettings(settings ? settings : std::make_shared<SharedSettings>()), cacheManager(cacheManager) {}
+
+Task<void> MessageForwarder::forwardGet(HttpRequest& req, int clientSocket, int clientId, std::shared_ptr<Logger> logger) {
+    // One settings snapshot for the whole request, even across a reload
+    auto settings = sharedSettings->get();
+    const CompressionOptions& compression = settings->compression;
     // Log the request before forwarding
-    logger->log("Requesting \"" + req.request + " from " + req.host, clientId);
-    
-    // Generate cache key
-    std::string cacheKey = generateCacheKey(req);
-    
-    // Check in the cache
-    auto cacheIt = responseCache.find(cacheKey);
-    //
-    //logger->log("Finding Cache key: " + cacheKey, clientId);
-    // pritn every pair in the cache
-    //for (auto it = responseCache.begin(); it != responseCache.end(); ++it) {
-       // logger->log("Has Cache key: " + it->first, clientId);
-    //}
+    std::pmr::string requesting(req.arena);
+    requesting.reserve(req.request.size() + req.host.size() + 16);
+    requesting.append("Requesting \"").append(req.request).append(" from ").append(req.host);
+    logger->log(requesting, clientId);
+    
+    // Cache key was normalized and hashed by the parser
+    const CacheKey& cacheKey = req.cacheKey;
+    
+    // Send the normalized Accept-Encoding upstream, so the variant the origin
+    // returns is the one the Vary key describes
+    if (req.headers.contains(HeaderId::AcceptEncoding)) {
+        std::string normalized = CacheManager::normalizeVaryValue("accept-encoding", std::string(req.headers.get(HeaderId::AcceptEncoding)));
+        if (normalized.empty()) {
+            req.headers.erase(HeaderId::AcceptEncoding);
+        } else {
+            req.headers.set(HeaderId::AcceptEncoding, normalized);
+        }
+    }
+
+    // HEAD is answered from the GET entry, or forwarded and never stored
+    bool head = req.methodId == HttpMethod::Head;
+
+    // Sent by a peer that found this proxy owns the key: fetch it, never pass it on
+    bool fromPeer = req.headers.erase(PEER_HEADER) > 0;
+    if (fromPeer) {
+        PeerRing::stats().served++;
+    }
+
+    // Check in the cache (memory tier first, then disk)
+    auto cached = cacheManager->get(cacheKey, req.headers);
     bool fromCache = false;
     bool revalidationNeeded = false;
-    if (cacheIt == responseCache.end()){
+    // The client's own validators, set aside while ours go upstream
+    std::string clientIfNoneMatch, clientIfModifiedSince;
+    if (!cached){
         // print to logfile: ID: not in cache
         logger->log("not in cache", clientId); // wks
     }
-    if (cacheIt != responseCache.end()) {
+    bool fresh = false;
+    if (cached) {
         // Check if cache entry is still valid
-        if (time(nullptr) < cacheIt->second.expiration && !cacheIt->second.mustRevalidate) {
+        fresh = time(nullptr) < cached->expiration;
+        if (fresh && !cached->mustRevalidate) {
             // Get from cache
             // print to logfile: ID: in cache, valid
             logger->log("in cache, valid", clientId); // wks
-            //logger->log(Logger::LogLevel::INFO, "Serving response from cache for: " + req.host + req.request, clientId);
-            send(clientSocket, cacheIt->second.response.c_str(), cacheIt->second.response.length(), 0);
-            return;
+            co_await offload([&]() { serveFromCache(clientSocket, req, *cached); });
+            co_return;
         }
-        else if (time(nullptr) >= cacheIt->second.expiration) // wks
+        if (!fresh) // wks
         {
-            logger->log("in cache, but expired at " + std::to_string(cacheIt->second.expiration), clientId); // wks
+            logger->log("in cache, but expired at " + std::to_string(cached->expiration), clientId); // wks
         }
-        else if (!cacheIt->second.etag.empty() || !cacheIt->second.lastModified.empty()) {
-            // Need to revalidate(走协商缓存)
-            revalidationNeeded = true;
-            logger->log("in cache, requires validation", clientId); // wks
-            // Add validation headers to the request
-            if (!cacheIt->second.etag.empty()) {
-                req.headers["If-None-Match"] = cacheIt->second.etag;
-            }
-            if (!cacheIt->second.lastModified.empty()) {
-                req.headers["If-Modified-Since"] = cacheIt->second.lastModified;
+    }
+
+    // A miss for a key another peer owns is fetched through that peer, which
+    // caches it; when the peer is down or fails, from the origin as usual
+    if (!cached && !fromPeer && !req.tls) {
+        const std::string* owner = PeerRing::owner(cacheKey.hash, settings->peers);
+        if (owner) {
+            if (!peers.isDown(*owner, time(nullptr)) &&
+                co_await fetchFromPeer(req, *owner, clientSocket, clientId, logger)) {
+                PeerRing::stats().forwarded++;
+                co_return;
             }
+            PeerRing::stats().fallbacks++;
+        }
+    }
+
+    // An origin that keeps failing is not tried; the client gets a stale copy or a 503
+    std::string origin = originName(req);
+    BreakerTicket ticket;
+    if (!co_await admit(origin, ticket, req, clientSocket, clientId, logger, cached)) {
+        co_return;
+    }
+
+    // A stale or no-cache copy with validators is revalidated, not fetched again
+    if (cached && (!cached->etag.empty() || !cached->lastModified.empty())) {
+        // Need to revalidate(走协商缓存)
+        revalidationNeeded = true;
+        if (fresh) {
+            logger->log("in cache, requires validation", clientId); // wks
+        }
+        // Add validation headers to the request
+        clientIfNoneMatch = req.headers.get(HeaderId::IfNoneMatch);
+        clientIfModifiedSince = req.headers.get(HeaderId::IfModifiedSince);
+        req.headers.erase(HeaderId::IfNoneMatch);
+        req.headers.erase(HeaderId::IfModifiedSince);
+        if (!cached->etag.empty()) {
+            req.headers.set(HeaderId::IfNoneMatch, cached->etag);
+        }
+        if (!cached->lastModified.empty()) {
+            req.headers.set(HeaderId::IfModifiedSince, cached->lastModified);
+        }
+    }
+    // serveFromCache() answers the client against its own validators
+    auto restoreClientValidators = [&]() {
+        if (!revalidationNeeded) {
+            return;
+        }
+        req.headers.erase(HeaderId::IfNoneMatch);
+        req.headers.erase(HeaderId::IfModifiedSince);
+        if (!clientIfNoneMatch.empty()) {
+            req.headers.set(HeaderId::IfNoneMatch, clientIfNoneMatch);
+        }
+        if (!clientIfModifiedSince.empty()) {
+            req.headers.set(HeaderId::IfModifiedSince, clientIfModifiedSince);
         }
+    };
+    
+    // A Range miss may fetch the whole object to cache it; the client's range
+    // is cut out of it on the way. With If-Range the origin decides.
+    std::string rangeHeader;
+    bool rangeFromFull = false;
+    size_t rangeFetchMax = 0;
+    if (!cached && !head && req.headers.contains(HeaderId::Range) && !req.headers.contains(HeaderId::IfRange)) {
+        CacheOptions cacheOptions = cacheManager->getOptions();
+        rangeFromFull = cacheOptions.rangeFetchFull;
+        rangeFetchMax = cacheOptions.rangeFetchMax;
+    }
+    if (rangeFromFull) {
+        rangeHeader = req.headers.get(HeaderId::Range);
+        req.headers.erase(HeaderId::Range);
     }
     
     //logger->log("Requesting \"" + req.request + "\" from " + req.host, clientId); // wks
     
-    // Connect to the target server
-    int serverSocket = connectToServer(req.host, req.port);
+    // Connect to the target server; a GET or HEAD that went out on a pooled
+    // connection is sent again on a new one if the origin had closed it
+    bool reusedConnection = false;
+    int serverSocket = co_await connectToServer(req.host, req.port, req.tls, &reusedConnection);
     if (serverSocket < 0) {
+        int connectError = errno;
         logger->log(Logger::LogLevel::ERROR, "Failed to connect to server: " + req.host + ":" + req.port, clientId);
-        sendErrorResponse(clientSocket, 502, "Bad Gateway");
-        return;
+        reportOutcome(origin, ticket, false, clientId, logger);
+        restoreClientValidators();
+        if (!co_await serveStale(origin, req, clientSocket, clientId, logger, cached)) {
+            co_await sendConnectError(clientSocket, connectError);
+        }
+        co_return;
     }
     
     // Forward the request to the server
-    std::string requestToSend = buildForwardRequest(req);
+    PooledBuffer requestBuffer(forwardRequestSize(req, nullptr));
+    std::string_view requestToSend = buildForwardRequest(req, requestBuffer.data(), nullptr);
+    restoreClientValidators();
     //logger->log("1111111", clientId);
     //logger->log(Logger::LogLevel::INFO, requestToSend.c_str(), clientId);
     
-    if (send(serverSocket, requestToSend.c_str(), requestToSend.length(), 0) < 0) {
+    // Request and response times correct the age of what comes back
+    time_t requestTime = time(nullptr);
+    time_t responseTime = requestTime;
+    bool sent = co_await asyncWrite(serverSocket, requestToSend.data(), requestToSend.size());
+    if (!sent && reusedConnection) {
+        reusedConnection = false;
+        serverSocket = co_await resend(req, serverSocket, requestToSend);
+        sent = serverSocket >= 0;
+    }
+    if (!sent) {
         logger->log(Logger::LogLevel::ERROR, "Failed to send request to server", clientId);
-        close(serverSocket);
-        sendErrorResponse(clientSocket, 500, "Internal Server Error");
-        return;
+        reportOutcome(origin, ticket, false, clientId, logger);
+        if (serverSocket >= 0) {
+            close(serverSocket);
+        }
+        co_await sendErrorResponse(clientSocket, 500, "Internal Server Error");
+        co_return;
     }
     
-    // Read and forward the response from the server to the client
+    // Read and forward the response from the server to the client; the
+    // connection goes back to the pool if the origin keeps it open and the
+    // response was read to its end as framed
     bool keepAliveServer = false;
-    // bool keepAliveClient = false;
-    
-    // Check if client requested keep-alive
-    auto clientConnectionIt = req.headers.find("Connection");
-    if (clientConnectionIt != req.headers.end() && 
-        strcasecmp(clientConnectionIt->second.c_str(), "keep-alive") == 0) {
-        // keepAliveClient = true;
-    }
+    bool responseComplete = false;
+    bool lengthKnown = false;
+    ChunkedEnd chunks;
     
     // Buffer for receiving data
-    char buffer[BUFFER_SIZE];
+    PooledBuffer pooled(settings->bufferSize);
+    char* buffer = pooled.data();
     ssize_t bytesRead;
     std::string responseHeaders;
-    std::string fullResponse; // For caching
+    CacheBody fullResponse; // For caching
     bool headersComplete = false;
     size_t contentLength = 0;
     size_t receivedBodyBytes = 0;
     bool chunkedEncoding = false;
-    
-    // Read and process the response
-    while ((bytesRead = recv(serverSocket, buffer, BUFFER_SIZE - 1, 0)) > 0) {
+    std::string headerSection;
+    // Set when the body is gzipped on the way to the client
+    std::unique_ptr<GzipCompressor> compressor;
+    std::string compressedBody;
+    // Accept-Encoding was normalized above: it is only left when the client takes gzip
+    bool clientAcceptsGzip = req.headers.contains(HeaderId::AcceptEncoding);
+    // Set when one range of the whole object is streamed to the client: body
+    // offsets [rangeStart, rangeEnd), and whether the rest is read for the cache
+    bool streamRange = false;
+    bool rangeFillsCache = false;
+    size_t rangeStart = 0, rangeEnd = 0;
+    auto rangeSlice = [&](const char* data, size_t offset, size_t length) {
+        size_t from = std::max(offset, rangeStart);
+        size_t to = std::min(offset + length, rangeEnd);
+        return from < to ? std::string_view(data + (from - offset), to - from) : std::string_view();
+    };
+    
+    // Read and process the response; the first read waits for the upstream
+    // to start answering, the others only while the body keeps moving
+    int firstByteTimeout = RuntimeSettings::milliseconds(settings->firstByteTimeout);
+    int idleTimeout = RuntimeSettings::milliseconds(settings->idleTimeout);
+    // A slow first byte may get a second attempt, whichever answers first is read
+    auto sentAt = std::chrono::steady_clock::now();
+    int hedged = co_await hedge(req, origin, serverSocket, requestToSend, firstByteTimeout, clientId, logger);
+    reusedConnection = reusedConnection && hedged == serverSocket;
+    serverSocket = hedged;
+    while (true) {
+        bytesRead = co_await asyncRead(serverSocket, buffer, settings->bufferSize - 1,
+                                       fullResponse.empty() ? firstByteTimeout : idleTimeout);
+        // Hung up or reset before answering, not merely slow
+        if (bytesRead <= 0 && reusedConnection && responseHeaders.empty() && (bytesRead == 0 || errno != ETIMEDOUT)) {
+            reusedConnection = false;
+            serverSocket = co_await resend(req, serverSocket, requestToSend);
+            if (serverSocket >= 0) {
+                logger->log("pooled connection to " + origin + " was closed, request sent again", clientId);
+                continue;
+            }
+            bytesRead = -1;
+        }
+        if (bytesRead <= 0) {
+            break;
+        }
         buffer[bytesRead] = '\0';
+        if (fullResponse.empty() && settings->hedge.enabled) {
+            auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - sentAt);
+            hedger.recordFirstByte(origin, (uint32_t)waited.count());
+        }
         
         // Store the full response for potential caching
-        fullResponse.append(buffer, bytesRead);
+        if (!streamRange || rangeFillsCache) {
+            fullResponse.append(buffer, bytesRead);
+        }
         
         // If Proxy hasn't finished reading headers
         if (!headersComplete) {
@@ -115,31 +449,35 @@ void MessageForwarder::forwardGet(HttpRequest& req, int clientSocket, int client
             size_t headerEnd = responseHeaders.find("\r\n\r\n");
             if (headerEnd != std::string::npos) {
                 headersComplete = true;
+                responseTime = time(nullptr);
+                reportOutcome(origin, ticket, !isOriginFailure(responseStatus(responseHeaders)), clientId, logger);
                 std::string responseLine = responseHeaders.substr(0, responseHeaders.find("\r\n")); // wks
                 //logger->log(Logger::LogLevel::INFO, std::to_string(clientId) + ": Received \"" + responseLine + "\" from " + req.host, clientId); // wks
                 
+                // Extract headers
+                headerSection = responseHeaders.substr(0, headerEnd);
+                keepAliveServer = keepsAlive(headerSection);
+                
                 // Handle 304 Not Modified for cache revalidation
-                if (revalidationNeeded && responseHeaders.find("HTTP/1.1 304") != std::string::npos) {
+                if (revalidationNeeded && responseStatus(responseHeaders) == 304) {
                     logger->log(Logger::LogLevel::INFO, "Revalidated cache - serving from cache", clientId);
                     
-                    // Update expiration time
-                    CacheEntry& entry = responseCache[cacheKey];
-                    entry.expiration = getExpirationTime(responseHeaders);
-                    
-                    // Serve from cache
-                    send(clientSocket, entry.response.c_str(), entry.response.length(), 0);
+                    // Serve from cache, with a new expiration: the lifetime the
+                    // 304 sets, or else the stored one, aged from the 304
+                    co_await offload([&]() {
+                        FreshnessOptions freshness = cacheManager->getOptions().freshness;
+                        long lifetime = hasExplicitFreshness(responseHeaders)
+                            ? freshnessLifetime(responseHeaders, responseTime, freshness)
+                            : freshnessLifetime(cacheManager->readHeaders(*cached), responseTime, freshness);
+                        time_t expiration = responseTime + lifetime - initialAge(responseHeaders, requestTime, responseTime);
+                        cacheManager->refresh(cacheKey, cached, expiration);
+                        serveFromCache(clientSocket, req, *cached);
+                    });
                     fromCache = true;
+                    responseComplete = true;
                     break;
                 }
                 
-                // Extract headers
-                std::string headerSection = responseHeaders.substr(0, headerEnd);
-                
-                // Check if server supports keep-alive
-                if (headerSection.find("Connection: keep-alive") != std::string::npos) {
-                    keepAliveServer = true;
-                }
-                
                 // Read the content length
                 size_t contentLengthPos = headerSection.find("Content-Length: ");
                 if (contentLengthPos != std::string::npos) {
@@ -147,6 +485,7 @@ void MessageForwarder::forwardGet(HttpRequest& req, int clientSocket, int client
                     size_t valueEnd = headerSection.find("\r\n", valueStart);
                     std::string lengthStr = headerSection.substr(valueStart, valueEnd - valueStart);
                     contentLength = std::stoul(lengthStr);
+                    lengthKnown = true;
                 }
                 
                 // Check for chunked encoding
@@ -156,9 +495,49 @@ void MessageForwarder::forwardGet(HttpRequest& req, int clientSocket, int client
                 
                 // Calculate how much of the body we've already received
                 receivedBodyBytes = responseHeaders.length() - (headerEnd + 4); // +4 for \r\n\r\n
+                bool chunksDone = chunkedEncoding && chunks.feed(responseHeaders.data() + headerEnd + 4, receivedBodyBytes);
                 
+                // Only a 200 with a known length is cut; anything else, or
+                // several ranges, goes out whole (RFC 9110 14.2 allows that)
+                RangeList ranges(req.arena);
+                streamRange = rangeFromFull && responseStatus(responseHeaders) == 200 && lengthKnown && !chunkedEncoding &&
+                              parseRange(rangeHeader, contentLength, ranges) && ranges.size() == 1;
+                if (streamRange) {
+                    rangeStart = ranges[0].first;
+                    rangeEnd = rangeStart + ranges[0].second;
+                    rangeFillsCache = contentLength <= rangeFetchMax;
+                }
+
+                // Compress eligible bodies for gzip clients; chunked framing needs HTTP/1.1
+                if (streamRange) {
+                    std::pmr::string rangeHead(req.arena);
+                    appendRangeHead(rangeHead, headerSection, rangeStart, rangeEnd - rangeStart, contentLength);
+                    std::string_view slice = rangeSlice(responseHeaders.data() + headerEnd + 4, 0, receivedBodyBytes);
+                    SocketWriter writer(clientSocket);
+                    writer.add(rangeHead.data(), rangeHead.size());
+                    writer.add(slice.data(), slice.size());
+                    if (!co_await asyncFlush(writer)) {
+                        logger->log(Logger::LogLevel::ERROR, "Failed to send response headers to client", clientId);
+                        break;
+                    }
+                }
+                else if (!head && compression.enabled && clientAcceptsGzip && req.version == "HTTP/1.1" &&
+                         !chunkedEncoding && contentLength >= compression.minSize && isCompressible(headerSection, compression)) {
+                    compressor = std::make_unique<GzipCompressor>(compression.level);
+                    std::pmr::string clientHeaders = buildCompressedHeaders(headerSection, "Transfer-Encoding: chunked", req.arena);
+                    std::string chunk;
+                    compressor->compress(responseHeaders.data() + headerEnd + 4, receivedBodyBytes, chunk);
+                    compressedBody += chunk;
+                    // Headers and the first chunk leave in one write
+                    SocketWriter writer(clientSocket);
+                    writer.add(clientHeaders.data(), clientHeaders.length());
+                    if (!queueChunk(writer, chunk) || !co_await asyncFlush(writer)) {
+                        logger->log(Logger::LogLevel::ERROR, "Failed to send response headers to client", clientId);
+                        break;
+                    }
+                }
                 // Send the headers to the client
-                if (send(clientSocket, responseHeaders.c_str(), responseHeaders.length(), 0) < 0) {
+                else if (!co_await asyncWrite(clientSocket, responseHeaders.c_str(), responseHeaders.length())) {
                     logger->log(Logger::LogLevel::ERROR, "Failed to send response headers to client", clientId);
                     break;
                 }
@@ -166,75 +545,144 @@ void MessageForwarder::forwardGet(HttpRequest& req, int clientSocket, int client
                 std::string responseL = responseHeaders.substr(0, newlinePos);
                 logger->log("Responding \"" + responseL.substr(0, responseL.size()-1) + "\"", clientId);
                 
-                // If we already received all data, exit the loop
-                if ((contentLength > 0 && receivedBodyBytes >= contentLength) || 
-                    (contentLength == 0 && !chunkedEncoding)) {
+                // If we already received all data, exit the loop; a HEAD answer has no body
+                if (head || (contentLength > 0 && receivedBodyBytes >= contentLength) || 
+                    (contentLength == 0 && !chunkedEncoding) || chunksDone ||
+                    (streamRange && !rangeFillsCache && receivedBodyBytes >= rangeEnd)) {
+                    responseComplete = head || chunksDone || (lengthKnown && receivedBodyBytes == contentLength);
                     break;
                 }
             }
+        } else if (compressor) {
+            // Compress and send this piece of the body as one chunk
+            std::string chunk;
+            compressor->compress(buffer, bytesRead, chunk);
+            compressedBody += chunk;
+            SocketWriter writer(clientSocket);
+            if (!queueChunk(writer, chunk) || !co_await asyncFlush(writer)) {
+                logger->log(Logger::LogLevel::ERROR, "Failed to send response body to client", clientId);
+                break;
+            }
+            receivedBodyBytes += bytesRead;
+            if (receivedBodyBytes >= contentLength) {
+                responseComplete = receivedBodyBytes == contentLength;
+                break;
+            }
         } else {
-            // Send the body to the client
-            if (send(clientSocket, buffer, bytesRead, 0) < 0) {
+            // Send the body to the client, or the part of it in the range
+            std::string_view toClient = streamRange ? rangeSlice(buffer, receivedBodyBytes, bytesRead)
+                                                    : std::string_view(buffer, bytesRead);
+            if (!toClient.empty() && !co_await asyncWrite(clientSocket, toClient.data(), toClient.size())) {
                 logger->log(Logger::LogLevel::ERROR, "Failed to send response body to client", clientId);
                 break;
             }
             
             receivedBodyBytes += bytesRead;
             
+            // Past the range of an object too large to cache, the rest is not fetched
+            if (streamRange && !rangeFillsCache && receivedBodyBytes >= rangeEnd) {
+                break;
+            }
+            
             // If we've received all data, exit the loop
             if (contentLength > 0 && receivedBodyBytes >= contentLength) {
+                responseComplete = receivedBodyBytes == contentLength;
                 break;
             }
             
-            // For chunked encoding, look for the end chunk marker "0\r\n\r\n"
-            if (chunkedEncoding) {
-                std::string chunk(buffer, bytesRead);
-                if (chunk.find("0\r\n\r\n") != std::string::npos) {
-                    break;
-                }
+            // For chunked encoding, follow the chunks to the last one
+            if (chunkedEncoding && chunks.feed(buffer, bytesRead)) {
+                responseComplete = true;
+                break;
             }
         }
     }
     
 
+    // No answer at all: the origin timed out or hung up
+    if (!headersComplete) {
+        int readError = errno;
+        reportOutcome(origin, ticket, false, clientId, logger);
+        errno = readError;
+    }
     // Handle read errors or connection closed by server
     if (bytesRead < 0) {
+        bool timedOut = errno == ETIMEDOUT;
         logger->log(Logger::LogLevel::ERROR, "Error reading response from server: " + std::string(strerror(errno)), clientId);
+        keepAliveServer = false;
+        if (timedOut) {
+            TimingWheel::stats().count(fullResponse.empty() ? TIMEOUT_FIRST_BYTE : TIMEOUT_BODY_IDLE);
+        }
+        if (timedOut && fullResponse.empty()) {
+            co_await sendErrorResponse(clientSocket, 504, "Gateway Timeout");
+        }
+    }
+    // Flush the gzip trailer and end the chunked body; a truncated body is left unterminated
+    bool compressedComplete = false;
+    if (compressor && receivedBodyBytes >= contentLength) {
+        std::string tail;
+        compressedComplete = compressor->finish(tail);
+        compressedBody += tail;
+        // Last data chunk and the terminating chunk in one write
+        SocketWriter writer(clientSocket);
+        compressedComplete = compressedComplete && queueChunk(writer, tail) &&
+                             writer.add("0\r\n\r\n", 5) && co_await asyncFlush(writer);
     }
     //when it receives the response from the origin server, it should print: ID: Received"RESPONSE" fromSERVER
     size_t newlinePos = fullResponse.find('\n');
-    std::string responseLine = fullResponse.substr(0, newlinePos);
+    std::string responseLine(std::string_view(fullResponse).substr(0, newlinePos));
     logger->log("Received \"" + responseLine.substr(0, responseLine.size()-1) + "\" from " + req.host, clientId);
     // Handle caching if the response wasn't served from cache
     
     
     if (!fromCache && headersComplete) {
         
-        if (isCacheable("GET", responseHeaders)) {
+        if (isCacheable(req.method, responseHeaders) && (!compressor || compressedComplete) &&
+            (!streamRange || (rangeFillsCache && responseComplete))) {
             
             //logger->log(Logger::LogLevel::INFO, "Caching response for: " + req.host + req.request, clientId);
             
-            CacheEntry entry;
-            entry.response = fullResponse;
-            entry.expiration = getExpirationTime(responseHeaders);
-            entry.mustRevalidate = checkMustRevalidate(responseHeaders);
-            extractValidationHeaders(responseHeaders, entry.etag, entry.lastModified);
+            // Store the gzip variant, so compression runs once per object
+            if (compressor) {
+                std::pmr::string framing("Content-Length: ", req.arena);
+                appendNumber(framing, compressedBody.size());
+                fullResponse.assign(buildCompressedHeaders(headerSection, framing, req.arena));
+                fullResponse += compressedBody;
+            }
+            auto entry = std::make_shared<CacheEntry>();
+            entry->response = std::make_shared<const CacheBody>(std::move(fullResponse));
+            entry->expiration = expirationTime(responseHeaders, requestTime, responseTime, cacheManager->getOptions().freshness);
+            entry->mustRevalidate = checkMustRevalidate(responseHeaders);
+            extractValidationHeaders(responseHeaders, entry->etag, entry->lastModified);
+            if (compressor) {
+                entry->etag = weakEtag(entry->etag);
+            }
+            // Remember which request headers select this variant
+            entry->vary = getVaryHeaders(responseHeaders);
+            // Compressible types come in a gzip and an identity variant
+            if (compression.enabled && isCompressible(headerSection, compression) &&
+                std::find(entry->vary.begin(), entry->vary.end(), "accept-encoding") == entry->vary.end()) {
+                entry->vary.push_back("accept-encoding");
+                std::sort(entry->vary.begin(), entry->vary.end());
+            }
+            entry->varyKey = CacheManager::buildVaryKey(entry->vary, req.headers);
+            // Only an identity-framed 200 body can be sliced for Range requests
+            if (responseLine.find(" 200 ") != std::string::npos &&
+                (compressor || (!chunkedEncoding && receivedBodyBytes == contentLength))) {
+                entry->headerLength = entry->response->find("\r\n\r\n") + 4;
+            }
             
-            // print cacheKey
-            //logger->log("Storing Cache key: " + generateCacheKey(req), clientId);
-            responseCache[generateCacheKey(req)] = entry;
-            //for (auto it = responseCache.begin(); it != responseCache.end(); ++it) {
-                //logger->log("Has Cache key: " + it->first, clientId);
-            //}
+            cacheManager->put(cacheKey, entry);
         }
     }
-    
+
     // Close the server connection if keep-alive is not supported/requested
-    if (!keepAliveServer) {
-        close(serverSocket);
-    } else {
+    // (none is left when sending the request again failed)
+    if (serverSocket >= 0 && keepAliveServer && responseComplete) {
         // Store the connection for future use
-        saveKeepAliveConnection(req.host, req.port, serverSocket);
+        saveKeepAliveConnection(req.host, req.port, serverSocket, req.tls);
+    } else if (serverSocket >= 0) {
+        close(serverSocket);
     }
     
     //logger->log(Logger::LogLevel::INFO, "Completed forwarding GET request for client " + std::to_string(clientId), clientId);
@@ -242,210 +690,424 @@ void MessageForwarder::forwardGet(HttpRequest& req, int clientSocket, int client
 }
 
 /*
-@biref: Helper function to build the forwarded request
+ @brief: Bytes buildForwardRequest() may write for req
 */
-std::string MessageForwarder::buildForwardRequest(const HttpRequest& req) {
-    std::stringstream ss;
-    
-    // Build the request line
-    ss <<  req.request << "\r\n";
-    
-    // Add headers
-    for (const auto& header : req.headers) {
-        // Skip hop-by-hop headers
-        /*
-        */
-        if (strcasecmp(header.first.c_str(), "Connection") == 0){
-            continue;
+size_t MessageForwarder::forwardRequestSize(const HttpRequest& req, const std::string* peerSelf) {
+    size_t size = req.method.size() + req.url.size() + req.version.size() + 5;
+    for (const HeaderField& header : req.headers) {
+        size += header.name.size() + header.value.size() + 4;
+    }
+    // Connection, the peer header and the blank line
+    return size + 64 + (peerSelf ? peerSelf->size() : 0);
+}
+
+/*
+ @brief: The request line and headers for the next hop, written straight
+         into buffer (forwardRequestSize() bytes) in the client's order.
+         Hop-by-hop headers and those the client's Connection lists stay
+         here. An origin gets the origin-form target and a connection kept
+         alive for the pool; a peer proxy (peerSelf set) the absolute form,
+         the peer header, and a connection it closes.
+*/
+std::string_view MessageForwarder::buildForwardRequest(const HttpRequest& req, char* buffer, const std::string* peerSelf) {
+    char* out = buffer;
+    auto put = [&out](std::string_view text) {
+        memcpy(out, text.data(), text.size());
+        out += text.size();
+    };
+    std::string_view target = peerSelf ? std::string_view(req.url) : originForm(req.url);
+    put(req.method);
+    put(" ");
+    if (target.empty() || target.front() == '?') {
+        put("/");
+    }
+    put(target);
+    put(" ");
+    put(req.version);
+    put("\r\n");
+
+    bool connectionListed = req.headers.contains(HeaderId::Connection);
+    for (const HeaderField& header : req.headers) {
+        bool skip = isHopByHop(header.id) || (connectionListed && listedInConnection(req.headers, header.name));
+        if (!skip) {
+            put(header.name);
+            put(": ");
+            put(header.value);
+            put("\r\n");
         }
-         //   strcasecmp(header.first.c_str(), "Keep-Alive") == 0 ||
-         //   strcasecmp(header.first.c_str(), "Proxy-Connection") == 0 ||
-         //   strcasecmp(header.first.c_str(), "Proxy-Authorization") == 0 ||
-         //   strcasecmp(header.first.c_str(), "TE") == 0 ||
-         //   strcasecmp(header.first.c_str(), "Trailer") == 0 ||
-          //  strcasecmp(header.first.c_str(), "Transfer-Encoding") == 0 ||
-          //  strcasecmp(header.first.c_str(), "Upgrade") == 0) {
-          //  continue;
-        //}
-        ss << header.first << ": " << header.second << "\r\n";
     }
-    
-    // Web proxy <---> target server (Always Keep-alive)
-    ss << "Connection: close\r\n";
-    
-    // End of headers
-    ss << "\r\n";
-    
-    return ss.str();
+    if (peerSelf) {
+        put(PEER_HEADER);
+        put(": ");
+        put(*peerSelf);
+        put("\r\nConnection: close\r\n\r\n");
+    } else {
+        put("Connection: keep-alive\r\n\r\n");
+    }
+    return std::string_view(buffer, out - buffer);
+}
+
+/*
+ @brief: Whether the origin keeps the connection open after this response:
+         HTTP/1.1 unless it says close, HTTP/1.0 only if it says keep-alive
+*/
+bool MessageForwarder::keepsAlive(const std::string& headerSection) {
+    std::string connection = findHeaderValue(headerSection, "Connection");
+    std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+    if (connection.find("close") != std::string::npos) {
+        return false;
+    }
+    return headerSection.compare(0, 9, "HTTP/1.1 ") == 0 || connection.find("keep-alive") != std::string::npos;
 }
 
 /*
 @brief: Helper function to connect to the target server
 */
- int MessageForwarder::connectToServer(const std::string& host, const std::string& port) {
+Task<int> MessageForwarder::connectToServer(const std::string& host, const std::string& port, bool tls, bool* reused) {
     // First check if we already have a keep-alive connection
-    int existingSocket = getKeepAliveConnection(host, port);
-    if (existingSocket > 0) {
-        // Test if the connection is still valid
+    int existingSocket;
+    while ((existingSocket = getKeepAliveConnection(host, port, tls)) >= 0) {
+        // Still open, with nothing unread: the origin has not hung up meanwhile
         char test;
-        if (recv(existingSocket, &test, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
-            close(existingSocket);
-            removeKeepAliveConnection(host, port);
-        } else {
-            return existingSocket;
+        if (recv(existingSocket, &test, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (reused) {
+                *reused = true;
+            }
+            co_return existingSocket;
         }
+        close(existingSocket);
     }
-    
-    // Create a new connection
-    struct addrinfo hints, *res;
-    int sockfd;
-    
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    
-    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) {
-        return -1;
+    if (reused) {
+        *reused = false;
     }
-    
-    sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (sockfd < 0) {
-        freeaddrinfo(res);
-        return -1;
+    co_return co_await openConnection(host, port, tls);
+}
+
+/*
+ @brief: A new connection to the origin, never one from the pool
+*/
+Task<int> MessageForwarder::openConnection(const std::string& host, const std::string& port, bool tls) {
+#ifdef WEBPROXY_TLS
+    if (tls) {
+        co_return co_await connectTls(host, port);
     }
-    // set socket
-    //setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));    
-    // Non-blocking mode
-    int flags = fcntl(sockfd, F_GETFL, 0);
-    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
-    
-    // Attempt to connect
-    int connectResult = connect(sockfd, res->ai_addr, res->ai_addrlen);
-    if (connectResult < 0) {
-        if (errno == EINPROGRESS) {
-            fd_set fdset;
-            struct timeval tv;
-            
-            FD_ZERO(&fdset);
-            FD_SET(sockfd, &fdset);
-            // 5 s Time out
-            tv.tv_sec = 5;
-            tv.tv_usec = 0;
-            if (select(sockfd + 1, NULL, &fdset, NULL, &tv) == 1) {
-                int so_error;
-                socklen_t len = sizeof so_error;
-                getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &so_error, &len);
-                
-                if (so_error != 0) {
-                    close(sockfd);
-                    freeaddrinfo(res);
-                    return -1;
-                }
-            } else {
-                // Error
-                close(sockfd);
-                freeaddrinfo(res);
-                return -1;
-            }
-        } else {
-            close(sockfd);
-            freeaddrinfo(res);
+#endif
+    auto settings = sharedSettings->get();
+    co_return co_await asyncConnect(host, port, settings->socket, RuntimeSettings::milliseconds(settings->connectTimeout));
+}
+
+/*
+ @brief: A pooled connection failed before any byte of the response: the
+         origin closed it while it sat idle, racing the peek in
+         connectToServer(). Closes it and sends request again, once, on a
+         new connection. Only for idempotent requests. -1 if that fails too.
+*/
+Task<int> MessageForwarder::resend(const HttpRequest& req, int serverSocket, std::string_view request) {
+    close(serverSocket);
+    int fresh = co_await openConnection(req.host, req.port, req.tls);
+    if (fresh < 0) {
+        co_return -1;
+    }
+    bool sent = co_await asyncWrite(fresh, request.data(), request.size());
+    if (!sent) {
+        close(fresh);
+        co_return -1;
+    }
+    co_return fresh;
+}
+
+/*
+ @brief: connectToServer() failed: 504 if the connect timed out, else 502
+*/
+Task<void> MessageForwarder::sendConnectError(int clientSocket, int error) {
+    if (error == ETIMEDOUT) {
+        TimingWheel::stats().count(TIMEOUT_CONNECT);
+        co_await sendErrorResponse(clientSocket, 504, "Gateway Timeout");
+    } else {
+        co_await sendErrorResponse(clientSocket, 502, "Bad Gateway");
+    }
+}
+
+/*
+ @brief: The circuit breaker's name for the origin of req
+*/
+std::string MessageForwarder::originName(const HttpRequest& req) {
+    std::string name = req.tls ? "https://" : "";
+    name.append(req.host).append(":").append(req.port.empty() ? "80" : req.port);
+    return name;
+}
+
+/*
+ @brief: Whether a request to origin may go out, with the ticket its outcome
+         is reported with. When its circuit is open the client is answered
+         here: from a stale cached copy, else with a 503.
+*/
+Task<bool> MessageForwarder::admit(const std::string& origin, BreakerTicket& ticket, HttpRequest& req, int clientSocket, int clientId,
+                                   const std::shared_ptr<Logger>& logger, const std::shared_ptr<const CacheEntry>& stale) {
+    auto settings = sharedSettings->get();
+    time_t now = time(nullptr);
+    if (breaker.allow(origin, settings->breaker, now, ticket)) {
+        co_return true;
+    }
+    if (co_await serveStale(origin, req, clientSocket, clientId, logger, stale)) {
+        co_return false;
+    }
+    logger->log(Logger::WARNING, "Circuit to " + origin + " open, failing fast", clientId);
+    int retryAfter = breaker.retryAfter(origin, settings->breaker, now);
+    co_await sendErrorResponse(clientSocket, 503, "Service Unavailable", "Retry-After: " + std::to_string(retryAfter) + "\r\n");
+    co_return false;
+}
+
+/*
+ @brief: Answer from a stale cached copy because origin is unreachable,
+         unless the origin forbade it (no-cache, must-revalidate) or
+         breaker.serve_stale is off. False when nothing was sent.
+*/
+Task<bool> MessageForwarder::serveStale(const std::string& origin, HttpRequest& req, int clientSocket, int clientId,
+                                        const std::shared_ptr<Logger>& logger, const std::shared_ptr<const CacheEntry>& stale) {
+    if (!stale || !sharedSettings->get()->breaker.serveStale) {
+        co_return false;
+    }
+    bool served = false;
+    co_await offload([&]() {
+        CacheControl control = CacheControl::parse(cacheManager->readHeaders(*stale));
+        if (!control.noCache && !control.mustRevalidate) {
+            serveFromCache(clientSocket, req, *stale);
+            served = true;
+        }
+    });
+    if (served) {
+        CircuitBreaker::stats().staleServed++;
+        logger->log("origin " + origin + " unavailable, served stale copy", clientId);
+    }
+    co_return served;
+}
+
+/*
+ @brief: Relay req through the peer that owns its cache key. False, with
+         nothing sent to the client, when the peer cannot be reached or
+         does not start answering; the peer is then skipped for a while.
+*/
+Task<bool> MessageForwarder::fetchFromPeer(HttpRequest& req, const std::string& peer, int clientSocket, int clientId,
+                                           const std::shared_ptr<Logger>& logger) {
+    auto settings = sharedSettings->get();
+    std::string host, port;
+    if (!PeerRing::splitNode(peer, host, port)) {
+        co_return false;
+    }
+    int peerSocket = co_await asyncConnect(host, port, settings->socket, RuntimeSettings::milliseconds(settings->connectTimeout));
+    if (peerSocket < 0) {
+        logger->log(Logger::LogLevel::ERROR, "Failed to connect to peer " + peer, clientId);
+        peers.markDown(peer, settings->peers, time(nullptr));
+        co_return false;
+    }
+    // The request line stays in absolute form, as a proxy expects it
+    PooledBuffer requestBuffer(forwardRequestSize(req, &settings->peers.self));
+    std::string_view requestToSend = buildForwardRequest(req, requestBuffer.data(), &settings->peers.self);
+    PooledBuffer pooled(settings->bufferSize);
+    char* buffer = pooled.data();
+    ssize_t bytesRead = -1;
+    if (co_await asyncWrite(peerSocket, requestToSend.data(), requestToSend.size())) {
+        bytesRead = co_await asyncRead(peerSocket, buffer, settings->bufferSize,
+                                       RuntimeSettings::milliseconds(settings->firstByteTimeout));
+    }
+    if (bytesRead <= 0) {
+        logger->log(Logger::LogLevel::ERROR, "Peer " + peer + " did not answer", clientId);
+        peers.markDown(peer, settings->peers, time(nullptr));
+        close(peerSocket);
+        co_return false;
+    }
+    std::string_view first(buffer, bytesRead);
+    logger->log("Responding \"" + std::string(first.substr(0, first.find("\r\n"))) + "\" from peer " + peer, clientId);
+    // The peer closes once the response is through (Connection: close)
+    int idleTimeout = RuntimeSettings::milliseconds(settings->idleTimeout);
+    while (bytesRead > 0 && co_await asyncWrite(clientSocket, buffer, bytesRead)) {
+        bytesRead = co_await asyncRead(peerSocket, buffer, settings->bufferSize, idleTimeout);
+    }
+    close(peerSocket);
+    co_return true;
+}
+
+/*
+ @brief: Hedge a GET already sent on serverSocket. If no answer starts
+         within the hedge delay and the budget allows, the request goes out
+         again on a new connection (to the next address, when the name has
+         several) and whichever answers first is kept; the other is closed.
+         Returns the socket to read from; firstByteTimeout is reduced by
+         the time spent here.
+*/
+Task<int> MessageForwarder::hedge(HttpRequest& req, const std::string& origin, int serverSocket, std::string_view requestToSend,
+                                  int& firstByteTimeout, int clientId, const std::shared_ptr<Logger>& logger) {
+    auto settings = sharedSettings->get();
+    if (!req.body.empty()) {
+        co_return serverSocket;
+    }
+    int delay = hedger.delayFor(origin, settings->hedge);
+    if (delay < 0 || (firstByteTimeout >= 0 && delay >= firstByteTimeout)) {
+        co_return serverSocket;
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto remaining = [&]() {
+        if (firstByteTimeout < 0) {
             return -1;
         }
+        auto spent = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        return std::max(1, firstByteTimeout - (int)spent.count());
+    };
+    if (co_await asyncPoll(serverSocket, POLLIN, delay) != 0 || !hedger.takeBudget()) {
+        firstByteTimeout = remaining();
+        co_return serverSocket;
+    }
+    int second;
+#ifdef WEBPROXY_TLS
+    if (req.tls) {
+        second = co_await connectTls(req.host, req.port);
+    } else
+#endif
+    {
+        second = co_await asyncConnect(req.host, req.port, settings->socket, RuntimeSettings::milliseconds(settings->connectTimeout), 1);
+    }
+    if (second < 0 || !co_await asyncWrite(second, requestToSend.data(), requestToSend.size())) {
+        if (second >= 0) {
+            close(second);
+        }
+        firstByteTimeout = remaining();
+        co_return serverSocket;
+    }
+    struct pollfd fds[2] = {{serverSocket, POLLIN, 0}, {second, POLLIN, 0}};
+    int ready = co_await asyncPoll(fds, 2, remaining());
+    firstByteTimeout = remaining();
+    // Only readable without an error counts as an answer: a reset or
+    // refused hedge is a loss, and the original keeps the request
+    auto answered = [](const struct pollfd& fd) {
+        return (fd.revents & POLLIN) && !(fd.revents & (POLLERR | POLLHUP | POLLNVAL));
+    };
+    if (ready > 0 && answered(fds[1]) && !answered(fds[0])) {
+        HedgePolicy::stats().won++;
+        logger->log("hedged request to " + origin + " answered first", clientId);
+        close(serverSocket);
+        co_return second;
+    }
+    close(second);
+    co_return serverSocket;
+}
+
+/*
+ @brief: One outcome of a request admit() let through
+*/
+void MessageForwarder::reportOutcome(const std::string& origin, const BreakerTicket& ticket, bool success, int clientId, const std::shared_ptr<Logger>& logger) {
+    auto settings = sharedSettings->get();
+    int state = breaker.record(origin, ticket, success, settings->breaker, time(nullptr));
+    if (state == BREAKER_OPEN) {
+        logger->log(Logger::WARNING, "Circuit to " + origin + " opened", clientId);
+    } else if (state == BREAKER_CLOSED) {
+        logger->log(Logger::INFO, "Circuit to " + origin + " closed", clientId);
     }
-    // Blocking mode
-    fcntl(sockfd, F_SETFL, flags);
-    freeaddrinfo(res);
-    return sockfd;
 }
 
 /*
  @brief: function to send an error response to the client
 */
- void MessageForwarder::sendErrorResponse(int clientSocket, int statusCode, const std::string& statusText) {
-    std::stringstream ss;
-    ss << "HTTP/1.1 " << statusCode << " " << statusText << "\r\n";
-    ss << "Content-Type: text/html\r\n";
-    ss << "Connection: close\r\n";
-    
-    std::string body = "<html><body><h1>" + std::to_string(statusCode) + " " + statusText + "</h1></body></html>";
-    
-    ss << "Content-Length: " << body.length() << "\r\n";
-    ss << "\r\n";
-    ss << body;
-    
-    std::string response = ss.str();
-    send(clientSocket, response.c_str(), response.length(), 0);
+Task<void> MessageForwarder::sendErrorResponse(int clientSocket, int statusCode, const std::string& statusText, const std::string& extraHeaders) {
+    char body[256];
+    int bodyLength = snprintf(body, sizeof(body), "<html><body><h1>%d %s</h1></body></html>", statusCode, statusText.c_str());
+    bodyLength = std::min<int>(bodyLength, sizeof(body) - 1);
+    char headers[256];
+    int headerLength = snprintf(headers, sizeof(headers),
+                                "HTTP/1.1 %d %s\r\n"
+                                "Content-Type: text/html\r\n"
+                                "Connection: close\r\n"
+                                "%s"
+                                "Content-Length: %d\r\n\r\n",
+                                statusCode, statusText.c_str(), extraHeaders.c_str(), bodyLength);
+    headerLength = std::min<int>(headerLength, sizeof(headers) - 1);
+
+    SocketWriter writer(clientSocket);
+    writer.add(headers, headerLength);
+    writer.add(body, bodyLength);
+    co_await asyncFlush(writer);
 }
 
 /*
-@ brief: Helper function to get a keep-alive connection
+@ brief: Helper function to take an idle keep-alive connection out of the pool, -1 if none
 */
-int MessageForwarder::getKeepAliveConnection(const std::string& host, const std::string& port) {
-    std::string key = host + ":" + port;
+int MessageForwarder::getKeepAliveConnection(const std::string& host, const std::string& port, bool tls) {
+    std::string key = (tls ? "https://" : "") + host + ":" + port;
     std::lock_guard<std::mutex> guard(keepAliveMutex); 
     auto it = keepAliveConnections.find(key);
-    if (it != keepAliveConnections.end()) {
-        return it->second;
+    if (it == keepAliveConnections.end()) {
+        return -1;
+    }
+    // The most recently used one is the least likely to have timed out
+    int socket = it->second.back();
+    it->second.pop_back();
+    if (it->second.empty()) {
+        keepAliveConnections.erase(it);
     }
-    return -1;
+    return socket;
 }
 /*
   @biref: Helper function to save a keep-alive connection
 */
-void MessageForwarder::saveKeepAliveConnection(const std::string& host, const std::string& port, int socket) {
-    std::string key = host + ":" + port;
+void MessageForwarder::saveKeepAliveConnection(const std::string& host, const std::string& port, int socket, bool tls) {
+    std::string key = (tls ? "https://" : "") + host + ":" + port;
     // Thrad safe
     std::lock_guard<std::mutex> guard(keepAliveMutex);
     
-    // If there was an old connection, close it first
-    auto it = keepAliveConnections.find(key);
-    if (it != keepAliveConnections.end()) {
-        close(it->second);
+    // Past the limit, the one idle the longest is closed
+    std::vector<int>& idle = keepAliveConnections[key];
+    if (idle.size() >= MAX_IDLE_PER_ORIGIN) {
+        close(idle.front());
+        idle.erase(idle.begin());
     }
-    
-    keepAliveConnections[key] = socket;
+    idle.push_back(socket);
 }
 
-void MessageForwarder::removeKeepAliveConnection(const std::string& host, const std::string& port) {
-    std::string key = host + ":" + port;
-    std::lock_guard<std::mutex> guard(keepAliveMutex);
-    
-    keepAliveConnections.erase(key);
-}
-
-void MessageForwarder::forwardPost(HttpRequest& req, int clientSocket, int clientId, std::shared_ptr<Logger> logger) {
+Task<void> MessageForwarder::forwardPost(HttpRequest& req, int clientSocket, int clientId, std::shared_ptr<Logger> logger) {
+    auto settings = sharedSettings->get();
     //logger->log(Logger::LogLevel::INFO, "Forwarding POST request for client " + std::to_string(clientId) + ": " + req.url);
     
     //Connect to the target server
     std::string port = req.port.empty() ? "80" : req.port;
-    int serverSocket = connectToServer(req.host, port);
+    std::string origin = originName(req);
+    BreakerTicket ticket;
+    if (!co_await admit(origin, ticket, req, clientSocket, clientId, logger, nullptr)) {
+        co_return;
+    }
+    // Not from the pool: if the origin closed an idle connection meanwhile,
+    // a request that is not idempotent could not be sent again
+    int serverSocket = co_await openConnection(req.host, port, req.tls);
     
     if (serverSocket < 0) {
+        int connectError = errno;
         logger->log(Logger::LogLevel::ERROR, "Failed to connect to server: " + req.host + ":" + port);
-        sendErrorResponse(clientSocket, 502, "Bad Gateway");
-        return;
+        reportOutcome(origin, ticket, false, clientId, logger);
+        co_await sendConnectError(clientSocket, connectError);
+        co_return;
     }
     
     //Check Content-Length header
     size_t contentLength = 0;
-    auto contentLengthIt = req.headers.find("Content-Length");
-    if (contentLengthIt != req.headers.end()) {
+    bool badLength = false;
+    std::string contentLengthValue(req.headers.get(HeaderId::ContentLength));
+    if (req.headers.contains(HeaderId::ContentLength)) {
         try {
-            contentLength = std::stoul(contentLengthIt->second);
+            contentLength = std::stoul(contentLengthValue);
         } catch (const std::exception& e) {
-            logger->log(Logger::LogLevel::ERROR, "Invalid Content-Length: " + contentLengthIt->second);
-            close(serverSocket);
-            sendErrorResponse(clientSocket, 400, "Bad Request");
-            return;
+            // No co_await inside a handler
+            badLength = true;
         }
     }
+    if (badLength) {
+        logger->log(Logger::LogLevel::ERROR, "Invalid Content-Length: " + contentLengthValue);
+        close(serverSocket);
+        co_await sendErrorResponse(clientSocket, 400, "Bad Request");
+        co_return;
+    }
     
     // Check for chunked encoding
     bool chunkedEncoding = false;
-    auto transferEncodingIt = req.headers.find("Transfer-Encoding");
-    if (transferEncodingIt != req.headers.end() && 
-        transferEncodingIt->second.find("chunked") != std::string::npos) {
+    if (req.headers.get(HeaderId::TransferEncoding).find("chunked") != std::string_view::npos) {
         chunkedEncoding = true;
     }
     
@@ -453,51 +1115,58 @@ void MessageForwarder::forwardPost(HttpRequest& req, int clientSocket, int clien
     if (contentLength == 0 && !chunkedEncoding && !req.body.empty()) {
         logger->log(Logger::LogLevel::ERROR, "POST request without proper Content-Length or Transfer-Encoding");
         close(serverSocket);
-        sendErrorResponse(clientSocket, 400, "Bad Request");
-        return;
+        co_await sendErrorResponse(clientSocket, 400, "Bad Request");
+        co_return;
     }
     
     // Build the request to forward
-    std::string requestToSend = buildForwardRequest(req);
-    
-    // For POST requests, we need to append the body
-    requestToSend += req.body;
-    
-    // Send the request to the server
-    if (send(serverSocket, requestToSend.c_str(), requestToSend.length(), 0) < 0) {
+    PooledBuffer requestBuffer(forwardRequestSize(req, nullptr));
+    std::string_view requestToSend = buildForwardRequest(req, requestBuffer.data(), nullptr);
+    
+    // Send the request line, headers and the body in one write
+    SocketWriter requestWriter(serverSocket);
+    requestWriter.add(requestToSend.data(), requestToSend.size());
+    requestWriter.add(req.body.data(), req.body.length());
+    if (!co_await asyncFlush(requestWriter)) {
         logger->log(Logger::LogLevel::ERROR, "Failed to send POST request to server: " + std::string(strerror(errno)));
+        reportOutcome(origin, ticket, false, clientId, logger);
         close(serverSocket);
-        sendErrorResponse(clientSocket, 500, "Internal Server Error");
-        return;
+        co_await sendErrorResponse(clientSocket, 500, "Internal Server Error");
+        co_return;
     }
     
     if (chunkedEncoding && req.body.find("0\r\n\r\n") == std::string::npos) {
         //logger->log(Logger::LogLevel::DEBUG, "Reading additional chunked data from client");
         
-        char buffer[BUFFER_SIZE];
+        PooledBuffer pooled(settings->bufferSize);
+        char* buffer = pooled.data();
         bool chunkedComplete = false;
+        int idleTimeout = RuntimeSettings::milliseconds(settings->idleTimeout);
         
         while (!chunkedComplete) {
-            ssize_t bytesRead = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0);
+            ssize_t bytesRead = co_await asyncRead(clientSocket, buffer, settings->bufferSize - 1, idleTimeout);
             
             if (bytesRead <= 0) {
-                if (bytesRead < 0) {
+                if (bytesRead < 0 && errno == ETIMEDOUT) {
+                    TimingWheel::stats().count(TIMEOUT_BODY_IDLE);
+                    logger->log(Logger::LogLevel::ERROR, "Client stalled while sending chunked data");
+                } else if (bytesRead < 0) {
                     logger->log(Logger::LogLevel::ERROR, "Error reading chunked data from client: " + std::string(strerror(errno)));
                 } else {
                     logger->log(Logger::LogLevel::ERROR, "Client closed connection while reading chunked data");
                 }
                 close(serverSocket);
-                return;
+                co_return;
             }
             
             buffer[bytesRead] = '\0';
             std::string chunk(buffer, bytesRead);
             
             //Forward the chunk to the server
-            if (send(serverSocket, chunk.c_str(), chunk.length(), 0) < 0) {
+            if (!co_await asyncWrite(serverSocket, chunk.c_str(), chunk.length())) {
                 logger->log(Logger::LogLevel::ERROR, "Failed to forward chunk to server: " + std::string(strerror(errno)));
                 close(serverSocket);
-                return;
+                co_return;
             }
             
             //Check if this is the last chunk
@@ -507,19 +1176,16 @@ void MessageForwarder::forwardPost(HttpRequest& req, int clientSocket, int clien
         }
     }
     
-    //Read and forward the response from the server to the client
+    //Read and forward the response from the server to the client; pooled
+    //again only when read to its end
     bool keepAliveServer = false;
-    // bool keepAliveClient = false;
-    
-    //Check if client requested keep-alive
-    auto clientConnectionIt = req.headers.find("Connection");
-    if (clientConnectionIt != req.headers.end() && 
-        strcasecmp(clientConnectionIt->second.c_str(), "keep-alive") == 0) {
-        // keepAliveClient = true;
-    }
+    bool responseComplete = false;
+    bool lengthKnown = false;
+    ChunkedEnd chunks;
     
     //Process server response
-    char buffer[BUFFER_SIZE];
+    PooledBuffer pooled(settings->bufferSize);
+    char* buffer = pooled.data();
     ssize_t bytesRead;
     std::string responseHeaders;
     bool headersComplete = false;
@@ -528,7 +1194,10 @@ void MessageForwarder::forwardPost(HttpRequest& req, int clientSocket, int clien
     bool responseChunked = false;
     
     //Read and process the response
-    while ((bytesRead = recv(serverSocket, buffer, BUFFER_SIZE - 1, 0)) > 0) {
+    int firstByteTimeout = RuntimeSettings::milliseconds(settings->firstByteTimeout);
+    int idleTimeout = RuntimeSettings::milliseconds(settings->idleTimeout);
+    while ((bytesRead = co_await asyncRead(serverSocket, buffer, settings->bufferSize - 1,
+                                           responseHeaders.empty() ? firstByteTimeout : idleTimeout)) > 0) {
         buffer[bytesRead] = '\0';
         
         if (!headersComplete) {
@@ -537,14 +1206,13 @@ void MessageForwarder::forwardPost(HttpRequest& req, int clientSocket, int clien
             size_t headerEnd = responseHeaders.find("\r\n\r\n");
             if (headerEnd != std::string::npos) {
                 headersComplete = true;
+                reportOutcome(origin, ticket, !isOriginFailure(responseStatus(responseHeaders)), clientId, logger);
                 
                 //Extract headers to check for keep-alive and content length
                 std::string headerSection = responseHeaders.substr(0, headerEnd);
                 
                 //Check if server supports keep-alive
-                if (headerSection.find("Connection: keep-alive") != std::string::npos) {
-                    keepAliveServer = true;
-                }
+                keepAliveServer = keepsAlive(headerSection);
                 
                 //Check for Content-Length
                 size_t contentLengthPos = headerSection.find("Content-Length: ");
@@ -553,6 +1221,7 @@ void MessageForwarder::forwardPost(HttpRequest& req, int clientSocket, int clien
                     size_t valueEnd = headerSection.find("\r\n", valueStart);
                     std::string lengthStr = headerSection.substr(valueStart, valueEnd - valueStart);
                     responseContentLength = std::stoul(lengthStr);
+                    lengthKnown = true;
                 }
                 
                 //Check for chunked encoding
@@ -562,9 +1231,10 @@ void MessageForwarder::forwardPost(HttpRequest& req, int clientSocket, int clien
                 
                 //Calculate how much of the body we've already received
                 receivedBodyBytes = responseHeaders.length() - (headerEnd + 4); 
+                bool chunksDone = responseChunked && chunks.feed(responseHeaders.data() + headerEnd + 4, receivedBodyBytes);
                 
                 //Send the complete headers and any part of the body we've received to the client
-                if (send(clientSocket, responseHeaders.c_str(), responseHeaders.length(), 0) < 0) {
+                if (!co_await asyncWrite(clientSocket, responseHeaders.c_str(), responseHeaders.length())) {
                     logger->log(Logger::LogLevel::ERROR, "Failed to send response headers to client");
                     break;
                 }
@@ -574,12 +1244,13 @@ void MessageForwarder::forwardPost(HttpRequest& req, int clientSocket, int clien
                 logger->log("Responding \"" + responseLine + "\"", clientId);
                 
                 if ((responseContentLength > 0 && receivedBodyBytes >= responseContentLength) || 
-                    (responseContentLength == 0 && !responseChunked)) {
+                    (responseContentLength == 0 && !responseChunked) || chunksDone) {
+                    responseComplete = chunksDone || (lengthKnown && receivedBodyBytes == responseContentLength);
                     break;
                 }
             }
         } else {
-            if (send(clientSocket, buffer, bytesRead, 0) < 0) {
+            if (!co_await asyncWrite(clientSocket, buffer, bytesRead)) {
                 logger->log(Logger::LogLevel::ERROR, "Failed to send response body to client");
                 break;
             }
@@ -587,43 +1258,71 @@ void MessageForwarder::forwardPost(HttpRequest& req, int clientSocket, int clien
             receivedBodyBytes += bytesRead;
         
             if (responseContentLength > 0 && receivedBodyBytes >= responseContentLength) {
+                responseComplete = receivedBodyBytes == responseContentLength;
                 break;
             }
             
-            if (responseChunked) {
-                std::string chunk(buffer, bytesRead);
-                if (chunk.find("0\r\n\r\n") != std::string::npos) {
-                    break;
-                }
+            if (responseChunked && chunks.feed(buffer, bytesRead)) {
+                responseComplete = true;
+                break;
             }
         }
     }
     
+    //No answer at all: the origin timed out or hung up
+    if (!headersComplete) {
+        int readError = errno;
+        reportOutcome(origin, ticket, false, clientId, logger);
+        errno = readError;
+    }
     //Handle read errors or connection closed by server
     if (bytesRead < 0) {
+        bool timedOut = errno == ETIMEDOUT;
         logger->log(Logger::LogLevel::ERROR, "Error reading response from server: " + std::string(strerror(errno)));
+        keepAliveServer = false;
+        if (timedOut) {
+            TimingWheel::stats().count(responseHeaders.empty() ? TIMEOUT_FIRST_BYTE : TIMEOUT_BODY_IDLE);
+        }
+        if (timedOut && responseHeaders.empty()) {
+            co_await sendErrorResponse(clientSocket, 504, "Gateway Timeout");
+        }
     }
     
     //Close the server connection if keep-alive is not supported/requested
-    if (!keepAliveServer) {
+    if (!keepAliveServer || !responseComplete) {
         close(serverSocket);
     } else {
         // Store the connection for future use
-        saveKeepAliveConnection(req.host, port, serverSocket);
+        saveKeepAliveConnection(req.host, port, serverSocket, req.tls);
     }
     
     //logger->log(Logger::LogLevel::INFO, "Completed forwarding POST request for client " + std::to_string(clientId));
 }
     
-void MessageForwarder::forwardConnect(HttpRequest& req, int clientSocket, int clientId, std::shared_ptr<Logger> logger) {
+Task<void> MessageForwarder::forwardConnect(HttpRequest& req, int clientSocket, int clientId, std::shared_ptr<Logger> logger) {
+    auto settings = sharedSettings->get();
+#ifdef WEBPROXY_TLS
+    if (interceptor && shouldIntercept(settings->tls, req.host)) {
+        co_await interceptConnect(req, clientSocket, clientId, logger);
+        co_return;
+    }
+#endif
     //logger->log(Logger::INFO, "Handling CONNECT request for client " + std::to_string(clientId) + ": " + req.host + ":" + req.port, clientId);
     
     //Connect to the target server
-    int serverSocket = connectToServer(req.host, req.port);
+    std::string origin = originName(req);
+    BreakerTicket ticket;
+    if (!co_await admit(origin, ticket, req, clientSocket, clientId, logger, nullptr)) {
+        co_return;
+    }
+    // A tunnel of its own, never an idle HTTP connection from the pool
+    int serverSocket = co_await openConnection(req.host, req.port, false);
+    int connectError = errno;
+    reportOutcome(origin, ticket, serverSocket >= 0, clientId, logger);
     if (serverSocket < 0) {
         logger->log(Logger::ERROR, "Failed to connect to server: " + req.host + ":" + req.port, clientId);
-        sendErrorResponse(clientSocket, 502, "Bad Gateway");
-        return;
+        co_await sendConnectError(clientSocket, connectError);
+        co_return;
     }
     
     //Send 200 Connection Established response to the client
@@ -631,156 +1330,70 @@ void MessageForwarder::forwardConnect(HttpRequest& req, int clientSocket, int cl
     response += "Proxy-Agent: MyProxy/1.0\r\n";
     response += "\r\n";
     
-    if (send(clientSocket, response.c_str(), response.length(), 0) < 0) {
+    if (!co_await asyncWrite(clientSocket, response.c_str(), response.length())) {
         logger->log(Logger::ERROR, "Failed to send Connection Established response to client", clientId);
         close(serverSocket);
-        return;
+        co_return;
     }
     
     //Set up for tunneling data between client and server
-    fd_set readFds;
-    char buffer[BUFFER_SIZE];
+    struct pollfd fds[2];
+    fds[0].fd = clientSocket;
+    fds[0].events = POLLIN;
+    fds[1].fd = serverSocket;
+    fds[1].events = POLLIN;
+    PooledBuffer pooled(settings->bufferSize);
+    char* buffer = pooled.data();
     bool tunnelActive = true;
     
-    //Make both sockets non-blocking for the tunneling
-    int clientFlags = fcntl(clientSocket, F_GETFL, 0);
-    int serverFlags = fcntl(serverSocket, F_GETFL, 0);
-    fcntl(clientSocket, F_SETFL, clientFlags | O_NONBLOCK);
-    fcntl(serverSocket, F_SETFL, serverFlags | O_NONBLOCK);
-    
     logger->log(Logger::LogLevel::INFO, "Established tunnel for client " + std::to_string(clientId) + " to " + req.host + ":" + req.port, clientId);
     
     // Tunnel Loop
+    int tunnelTimeout = RuntimeSettings::milliseconds(settings->tunnelTimeout);
     while (tunnelActive) {
-        FD_ZERO(&readFds);
-        FD_SET(clientSocket, &readFds);
-        FD_SET(serverSocket, &readFds);
-        
-        int maxFd = std::max(clientSocket, serverSocket) + 1;
-        struct timeval timeout;
-        timeout.tv_sec = 30; 
-        timeout.tv_usec = 0;
-        
-        int activity = select(maxFd, &readFds, NULL, NULL, &timeout);
+        int activity = co_await asyncPoll(fds, 2, tunnelTimeout);
         
         if (activity < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            logger->log(Logger::LogLevel::ERROR, "Select error in tunnel: " + std::string(strerror(errno)), clientId);
+            logger->log(Logger::LogLevel::ERROR, "Poll error in tunnel: " + std::string(strerror(errno)), clientId);
             break;
         }
         
         if (activity == 0) {
-            //logger->log(Logger::LogLevel::DEBUG, "Tunnel timeout for client " + std::to_string(clientId) + ", checking connection", clientId);
-            //TODO: test here
-            continue;
+            // Nothing either way for tunnel_timeout: the peers are gone or idle
+            TimingWheel::stats().count(TIMEOUT_TUNNEL_IDLE);
+            logger->log(Logger::LogLevel::INFO, "Tunnel idle for " + std::to_string(settings->tunnelTimeout) + " seconds", clientId);
+            break;
         }
         
-        // Check if client has data to read
-        if (FD_ISSET(clientSocket, &readFds)) {
-            ssize_t bytesRead = recv(clientSocket, buffer, BUFFER_SIZE, 0);
-            
-            if (bytesRead <= 0) {
-                // Client closed connection or error
-                if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                    // Non-blocking operation would block, try again later
-                    continue;
-                }
-                logger->log(Logger::LogLevel::INFO, "Client " + std::to_string(clientId) + " closed connection or error occurred", clientId);
-                tunnelActive = false;
-                break;
-            }
-            
-            // Forward data to server
-            ssize_t bytesSent = 0;
-            ssize_t totalBytesSent = 0;
-            
-            while (totalBytesSent < bytesRead) {
-                bytesSent = send(serverSocket, buffer + totalBytesSent, bytesRead - totalBytesSent, 0);
-                
-                if (bytesSent <= 0) {
-                    if (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                        fd_set writeFds;
-                        FD_ZERO(&writeFds);
-                        FD_SET(serverSocket, &writeFds);
-                        
-                        timeout.tv_sec = 5; 
-                        timeout.tv_usec = 0;
-                        
-                        if (select(serverSocket + 1, NULL, &writeFds, NULL, &timeout) <= 0) {
-                            // Timeout or error
-                            tunnelActive = false;
-                            break;
-                        }
-                        continue;
-                    }
-                    
-                    // Error occurred
-                    logger->log(Logger::LogLevel::ERROR, "Error sending data to server: " + std::string(strerror(errno)), clientId);
-                    tunnelActive = false;
-                    break;
-                }
-                
-                totalBytesSent += bytesSent;
-            }
-            
-            if (!tunnelActive) {
-                break;
+        // Client, then server: read what is there and write all of it to the other side
+        for (int side = 0; side < 2 && tunnelActive; ++side) {
+            if (!fds[side].revents) {
+                continue;
             }
-        }
-        
-        // Check if server has data to read
-        if (FD_ISSET(serverSocket, &readFds)) {
-            ssize_t bytesRead = recv(serverSocket, buffer, BUFFER_SIZE, 0);
+            ssize_t bytesRead = recv(fds[side].fd, buffer, settings->bufferSize, MSG_DONTWAIT);
             
             if (bytesRead <= 0) {
-                // Server closed connection or error
-                if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                    // Non-blocking operation would block, try again later
+                if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    // Nothing after all, try again later
                     continue;
                 }
-                
-                logger->log(Logger::LogLevel::INFO, "Server closed connection or error occurred");
+                if (side == 0) {
+                    // Client closed connection or error
+                    logger->log(Logger::LogLevel::INFO, "Client " + std::to_string(clientId) + " closed connection or error occurred", clientId);
+                } else {
+                    logger->log(Logger::LogLevel::INFO, "Server closed connection or error occurred");
+                }
                 tunnelActive = false;
                 break;
             }
             
-            // Forward data to client
-            ssize_t bytesSent = 0;
-            ssize_t totalBytesSent = 0;
-            
-            while (totalBytesSent < bytesRead) {
-                bytesSent = send(clientSocket, buffer + totalBytesSent, bytesRead - totalBytesSent, 0);
-                
-                if (bytesSent <= 0) {
-                    if (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                        fd_set writeFds;
-                        FD_ZERO(&writeFds);
-                        FD_SET(clientSocket, &writeFds);
-                        
-                        timeout.tv_sec = 5;  // 5 seconds timeout for write
-                        timeout.tv_usec = 0;
-                        
-                        if (select(clientSocket + 1, NULL, &writeFds, NULL, &timeout) <= 0) {
-                            // Timeout or error
-                            tunnelActive = false;
-                            break;
-                        }
-                        continue;
-                    }
-                    
-                    // Error occurred
-                    logger->log(Logger::LogLevel::ERROR, "Error sending data to client: " + std::string(strerror(errno)));
-                    tunnelActive = false;
-                    break;
+            // Forward to the other side, giving a full socket buffer 5 seconds
+            if (!co_await asyncWrite(fds[1 - side].fd, buffer, bytesRead, 5000)) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ETIMEDOUT) {
+                    logger->log(Logger::LogLevel::ERROR, std::string(side == 0 ? "Error sending data to server: " : "Error sending data to client: ") +
+                                strerror(errno), clientId);
                 }
-                
-                totalBytesSent += bytesSent;
-            }
-            
-            if (!tunnelActive) {
-                break;
+                tunnelActive = false;
             }
         }
     }
@@ -791,90 +1404,171 @@ void MessageForwarder::forwardConnect(HttpRequest& req, int clientSocket, int cl
     
 }
 
-/****CACHE****/
+#ifdef WEBPROXY_TLS
+/****TLS INTERCEPTION****/
 
-/*
-@biref: Generate cache key from request
-*/
-std::string MessageForwarder::generateCacheKey(const HttpRequest& req) {
-    return req.host + req.port + req.request;
+void MessageForwarder::setInterceptor(std::shared_ptr<TlsInterceptor> interceptor) {
+    this->interceptor = interceptor;
 }
 
-
-
 /*
-@biref: Check if a response is cacheable
+ @brief: CONNECT to an intercepted host: answer the client's handshake with
+         a certificate for the host, then hand the decrypted request to
+         serveDecrypted() through a socket pair, and relay between the two
+         until it is answered
 */
-bool MessageForwarder::isCacheable(const std::string& method, const std::string& responseHeaders) {
-    // Only cache GET responses
-    if (method != "GET") {
-        return false;
+Task<void> MessageForwarder::interceptConnect(HttpRequest& req, int clientSocket, int clientId, std::shared_ptr<Logger> logger) {
+    auto settings = sharedSettings->get();
+    static const char established[] = "HTTP/1.1 200 Connection Established\r\nProxy-Agent: MyProxy/1.0\r\n\r\n";
+    if (!co_await asyncWrite(clientSocket, established, sizeof(established) - 1)) {
+        logger->log(Logger::ERROR, "Failed to send Connection Established response to client", clientId);
+        co_return;
     }
-    
-    // Don't cache if Cache-Control: no-store
-    if (responseHeaders.find("Cache-Control: no-store") != std::string::npos) {
-        return false;
+    SSL* ssl = interceptor->acceptClient(req.host);
+    if (!ssl) {
+        logger->log(Logger::ERROR, "Failed to issue a certificate for " + req.host, clientId);
+        co_return;
     }
-    
-    // Don't cache if private (for shared cache)
-    if (responseHeaders.find("Cache-Control: private") != std::string::npos) {
-        return false;
-    }
-    
-    // Other status code checks (only cache 200, 203, 300, 301, etc.)
-    std::string statusLine = responseHeaders.substr(0, responseHeaders.find("\r\n"));
-    if (statusLine.find(" 200 ") == std::string::npos && 
-        statusLine.find(" 203 ") == std::string::npos && 
-        statusLine.find(" 300 ") == std::string::npos && 
-        statusLine.find(" 301 ") == std::string::npos) {
-        return false;
+    // OpenSSL reads and writes the socket itself: non-blocking for the relay
+    int flags = fcntl(clientSocket, F_GETFL, 0);
+    fcntl(clientSocket, F_SETFL, flags | O_NONBLOCK);
+    SSL_set_fd(ssl, clientSocket);
+    int pair[2];
+    if (!co_await asyncHandshake(ssl, clientSocket, RuntimeSettings::milliseconds(settings->headerTimeout))) {
+        if (errno == ETIMEDOUT) {
+            TimingWheel::stats().count(TIMEOUT_HEADER_READ);
+        }
+        logger->log(Logger::WARNING, "TLS handshake with client failed for " + req.host, clientId);
+    } else if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        logger->log(Logger::ERROR, "socketpair failed: " + std::string(strerror(errno)), clientId);
+    } else {
+        TlsInterceptor::stats().clientHandshakes++;
+        logger->log(Logger::INFO, "Intercepting TLS to " + req.host + ":" + req.port, clientId);
+        launch(serveDecrypted(pair[0], req.host, req.port, clientId, logger));
+        if (!co_await tlsRelay(ssl, clientSocket, pair[1], settings->bufferSize, RuntimeSettings::milliseconds(settings->tunnelTimeout))) {
+            TimingWheel::stats().count(TIMEOUT_TUNNEL_IDLE);
+        }
+        close(pair[1]);
     }
-    return true;
+    SSL_free(ssl);
+    fcntl(clientSocket, F_SETFL, flags);
 }
 
 /*
-@biref: Extract expiration time from headers
+ @brief: The request of an intercepted connection, answered by the usual
+         GET/POST path (cache included) with the tunnel's host as an https
+         origin. Owns plainSocket: closing it ends the client relay.
 */
-time_t MessageForwarder::getExpirationTime(const std::string& responseHeaders) {
-    time_t expiresAt = time(nullptr) + 60; // Default: 60 seconds
-    
-    // Check for Cache-Control: max-age
-    size_t maxAgePos = responseHeaders.find("Cache-Control: max-age=");
-    if (maxAgePos != std::string::npos) {
-        size_t valueStart = maxAgePos + 22; // Length of "Cache-Control: max-age="
-        size_t valueEnd = responseHeaders.find("\r\n", valueStart);
-        if (valueEnd == std::string::npos) {
-            valueEnd = responseHeaders.find(",", valueStart);
+Task<void> MessageForwarder::serveDecrypted(int plainSocket, std::string host, std::string port, int clientId, std::shared_ptr<Logger> logger) {
+    auto settings = sharedSettings->get();
+    std::string raw;
+    {
+        PooledBuffer pooled(settings->bufferSize);
+        ssize_t bytesRead = co_await asyncRead(plainSocket, pooled.data(), settings->bufferSize - 1,
+                                               RuntimeSettings::milliseconds(settings->headerTimeout));
+        if (bytesRead > 0) {
+            raw.assign(pooled.data(), bytesRead);
+        } else if (bytesRead < 0 && errno == ETIMEDOUT) {
+            TimingWheel::stats().count(TIMEOUT_HEADER_READ);
         }
-        if (valueEnd != std::string::npos) {
-            std::string maxAgeStr = responseHeaders.substr(valueStart, valueEnd - valueStart);
-            try {
-                int maxAge = std::stoi(maxAgeStr);
-                expiresAt = time(nullptr) + maxAge;
-            } catch (const std::exception& e) {
-                // Handle parsing error
-            }
+    }
+    if (!raw.empty()) {
+        HttpParser parser;
+        HttpRequest req = parser.parseRequest(raw);
+        RequestArena arena;
+        req.arena = &arena;
+        // The tunnel names the origin, whatever Host says; the scheme keeps
+        // the cached copy apart from the plain http one
+        req.host = host;
+        req.port = port;
+        req.tls = true;
+        if (req.methodId == HttpMethod::Get || req.methodId == HttpMethod::Head) {
+            req.cacheKey = makeCacheKey(host, port, req.url, true);
         }
-    } else {
-        // Check for Expires header if no max-age
-        size_t expiresPos = responseHeaders.find("Expires: ");
-        if (expiresPos != std::string::npos) {
-            size_t valueStart = expiresPos + 9; // Length of "Expires: "
-            size_t valueEnd = responseHeaders.find("\r\n", valueStart);
-            if (valueEnd != std::string::npos) {
-                std::string expiresStr = responseHeaders.substr(valueStart, valueEnd - valueStart);
-                struct tm tm = {};
-                // RFC 7231 date format: "Tue, 01 Jan 2019 00:00:00 GMT"
-                if (strptime(expiresStr.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm) != nullptr) {
-                    expiresAt = mktime(&tm);
-                }
+        try {
+            if (!parser.isValidRequest(req) || req.methodId == HttpMethod::Connect) {
+                co_await sendErrorResponse(plainSocket, 400, "Bad Request");
+            } else if (req.methodId == HttpMethod::Get || req.methodId == HttpMethod::Head) {
+                co_await forwardGet(req, plainSocket, clientId, logger);
+            } else {
+                co_await forwardPost(req, plainSocket, clientId, logger);
             }
+        } catch (const std::exception& e) {
+            logger->log(Logger::ERROR, std::string("Error handling intercepted request: ") + e.what(), clientId);
         }
     }
-    
-    return expiresAt;
+    close(plainSocket);
+}
+
+/*
+ @brief: Relay of an origin TLS connection; owns all three
+*/
+static Task<void> upstreamRelay(SSL* ssl, int tlsSocket, int plainSocket, size_t bufferSize, int idleTimeout) {
+    co_await tlsRelay(ssl, tlsSocket, plainSocket, bufferSize, idleTimeout);
+    SSL_free(ssl);
+    close(tlsSocket);
+    close(plainSocket);
+}
+
+/*
+ @brief: A TLS connection to an origin, handed out as the plain end of a
+         socket pair, so the GET/POST path and the keep-alive pool use it
+         like any upstream socket. The handshake resumes the origin's last
+         session when there is one.
+*/
+Task<int> MessageForwarder::connectTls(const std::string& host, const std::string& port) {
+    auto settings = sharedSettings->get();
+    int timeout = RuntimeSettings::milliseconds(settings->connectTimeout);
+    int sockfd = co_await asyncConnect(host, port, settings->socket, timeout);
+    if (sockfd < 0) {
+        co_return -1;
+    }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+    SSL* ssl = interceptor->connectUpstream(host, port);
+    SSL_set_fd(ssl, sockfd);
+    int pair[2];
+    bool connected = co_await asyncHandshake(ssl, sockfd, timeout);
+    // A failed certificate check is a bad gateway, not a timeout
+    int error = connected ? 0 : errno == ETIMEDOUT ? ETIMEDOUT : EPROTO;
+    if (!connected || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        error = error ? error : errno;
+        SSL_free(ssl);
+        close(sockfd);
+        errno = error;
+        co_return -1;
+    }
+    TlsInterceptor::stats().upstreamHandshakes++;
+    if (SSL_session_reused(ssl)) {
+        TlsInterceptor::stats().resumedSessions++;
+    }
+    // Idle in the pool or waiting for the first byte: whichever allows longer
+    int firstByte = RuntimeSettings::milliseconds(settings->firstByteTimeout);
+    int idle = RuntimeSettings::milliseconds(settings->idleTimeout);
+    launch(upstreamRelay(ssl, sockfd, pair[1], settings->bufferSize, firstByte < 0 || idle < 0 ? -1 : std::max(firstByte, idle)));
+    co_return pair[0];
 }
+#endif
 
+/****CACHE****/
+
+/*
+@biref: Check if a response is cacheable
+*/
+bool MessageForwarder::isCacheable(const std::string& method, const std::string& responseHeaders) {
+    // Only cache GET responses
+    if (method != "GET") {
+        return false;
+    }
+
+    // Vary: * can never be matched by a later request
+    std::string vary = findHeaderValue(responseHeaders, "Vary");
+    if (vary.find('*') != std::string::npos) {
+        return false;
+    }
+
+    // no-store, private, and the status codes a shared cache may keep
+    return isStorable(responseHeaders, cacheManager->getOptions().freshness);
+}
 
 /*
     @brief: Extract cache validation headers
@@ -904,6 +1598,470 @@ void MessageForwarder::extractValidationHeaders(const std::string& responseHeade
 @biref: check whether need revalidate
 */
 bool MessageForwarder::checkMustRevalidate(const std::string& responseHeaders) {
-    return responseHeaders.find("Cache-Control: must-revalidate") != std::string::npos ||
-           responseHeaders.find("Cache-Control: no-cache") != std::string::npos;
-}
\ No newline at end of file
+    // must-revalidate only forbids serving stale copies, which this cache never does
+    return CacheControl::parse(responseHeaders).noCache;
+}
+/*
+@brief: Case-insensitive lookup of a response header value, "" when missing
+*/
+std::string MessageForwarder::findHeaderValue(const std::string& responseHeaders, const std::string& name) {
+    size_t headerEnd = responseHeaders.find("\r\n\r\n");
+    size_t lineStart = responseHeaders.find("\r\n");
+    while (lineStart != std::string::npos && lineStart < headerEnd) {
+        lineStart += 2;
+        size_t lineEnd = responseHeaders.find("\r\n", lineStart);
+        if (lineEnd == std::string::npos) {
+            lineEnd = responseHeaders.size();
+        }
+        if (lineEnd - lineStart > name.size() && responseHeaders[lineStart + name.size()] == ':' &&
+            strncasecmp(responseHeaders.c_str() + lineStart, name.c_str(), name.size()) == 0) {
+            size_t valueStart = responseHeaders.find_first_not_of(" \t", lineStart + name.size() + 1);
+            if (valueStart == std::string::npos || valueStart > lineEnd) {
+                return "";
+            }
+            return responseHeaders.substr(valueStart, lineEnd - valueStart);
+        }
+        lineStart = responseHeaders.find("\r\n", lineStart);
+    }
+    return "";
+}
+
+/*
+@brief: Lower-cased, sorted header names listed in Vary
+*/
+std::vector<std::string> MessageForwarder::getVaryHeaders(const std::string& responseHeaders) {
+    std::vector<std::string> names;
+    std::stringstream vary(findHeaderValue(responseHeaders, "Vary"));
+    std::string name;
+    while (std::getline(vary, name, ',')) {
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if (name.empty()) {
+            continue;
+        }
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        names.push_back(name);
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    return names;
+}
+
+/****COMPRESSION****/
+
+/*
+@brief: Whether a response may be gzipped by the proxy: a 200 with an
+        eligible Content-Type that is not already encoded or no-transform
+*/
+bool MessageForwarder::isCompressible(const std::string& headerSection, const CompressionOptions& compression) {
+    std::string statusLine = headerSection.substr(0, headerSection.find("\r\n"));
+    if (statusLine.find(" 200 ") == std::string::npos) {
+        return false;
+    }
+    if (!findHeaderValue(headerSection, "Content-Encoding").empty() ||
+        findHeaderValue(headerSection, "Cache-Control").find("no-transform") != std::string::npos) {
+        return false;
+    }
+    std::string contentType = findHeaderValue(headerSection, "Content-Type");
+    for (const auto& type : compression.types) {
+        if (strncasecmp(contentType.c_str(), type.c_str(), type.size()) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+@brief: Rewrite the origin's headers for a gzipped body. framing is either
+        "Transfer-Encoding: chunked" (streaming) or a Content-Length (cache).
+        Built in the request arena.
+*/
+std::pmr::string MessageForwarder::buildCompressedHeaders(std::string_view headerSection, std::string_view framing, std::pmr::memory_resource* arena) {
+    std::pmr::string head(arena);
+    head.reserve(headerSection.size() + framing.size() + 64);
+    size_t lineEnd = headerSection.find("\r\n");
+    std::string_view statusLine = headerSection.substr(0, lineEnd);
+    // Chunked framing is HTTP/1.1 only
+    if (statusLine.compare(0, 8, "HTTP/1.0") == 0) {
+        head += "HTTP/1.1";
+        statusLine.remove_prefix(8);
+    }
+    head.append(statusLine).append("\r\n");
+    bool varySeen = false;
+    while (lineEnd != std::string_view::npos) {
+        size_t lineStart = lineEnd + 2;
+        lineEnd = headerSection.find("\r\n", lineStart);
+        std::string_view line = headerSection.substr(lineStart, lineEnd == std::string_view::npos ? std::string_view::npos : lineEnd - lineStart);
+        if (strncasecmp(line.data(), "Content-Length:", 15) == 0 ||
+            strncasecmp(line.data(), "Transfer-Encoding:", 18) == 0) {
+            continue;
+        }
+        if (strncasecmp(line.data(), "ETag:", 5) == 0) {
+            std::string_view etag = line.substr(5);
+            while (!etag.empty() && (etag.front() == ' ' || etag.front() == '\t')) {
+                etag.remove_prefix(1);
+            }
+            head += "ETag: ";
+            if (!etag.empty() && etag.compare(0, 2, "W/") != 0) {
+                head += "W/";
+            }
+            head.append(etag).append("\r\n");
+            continue;
+        }
+        head.append(line);
+        if (strncasecmp(line.data(), "Vary:", 5) == 0) {
+            varySeen = true;
+            bool listed = false;
+            for (size_t i = 5; i + 15 <= line.size() && !listed; ++i) {
+                listed = strncasecmp(line.data() + i, "accept-encoding", 15) == 0;
+            }
+            if (!listed) {
+                head += ", Accept-Encoding";
+            }
+        }
+        head += "\r\n";
+    }
+    if (!varySeen) {
+        head += "Vary: Accept-Encoding\r\n";
+    }
+    head += "Content-Encoding: gzip\r\n";
+    head.append(framing).append("\r\n\r\n");
+    return head;
+}
+
+/*
+@brief: Send data as one HTTP/1.1 chunk (nothing for empty data)
+*/
+bool MessageForwarder::queueChunk(SocketWriter& writer, const std::string& data) {
+    if (data.empty()) {
+        return !writer.failed();
+    }
+    char sizeLine[24];
+    int length = snprintf(sizeLine, sizeof(sizeLine), "%zx\r\n", data.size());
+    return writer.addCopy(sizeLine, length) && writer.add(data.data(), data.size()) && writer.add("\r\n", 2);
+}
+
+/****RANGE****/
+
+// A byte position of a Range spec: digits only, no sign, no overflow
+static bool parseOffset(std::string_view digits, size_t& value) {
+    if (digits.empty() || digits.front() < '0' || digits.front() > '9') {
+        return false;
+    }
+    auto result = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+    return result.ec == std::errc() && result.ptr == digits.data() + digits.size();
+}
+
+/*
+@brief: Answer from a cached response, cutting out the requested ranges when
+        the client sent Range and the body can be sliced
+*/
+void MessageForwarder::serveFromCache(int clientSocket, HttpRequest& req, const CacheEntry& entry) {
+    // A client that already holds this version gets a 304, HEAD the headers
+    bool notModified = clientValidatorsMatch(req, entry);
+    if (notModified || req.methodId == HttpMethod::Head) {
+        sendCachedHeaders(clientSocket, req, entry, notModified);
+        return;
+    }
+    if (!req.headers.contains(HeaderId::Range) || entry.headerLength == 0) {
+        cacheManager->send(clientSocket, entry);
+        return;
+    }
+    // If-Range: only slice when the client holds the same (strong) version.
+    // A content-coded body, such as the gzip variant, is never matched: its
+    // Last-Modified is the identity variant's too.
+    std::string_view ifRange = req.headers.get(HeaderId::IfRange);
+    if (req.headers.contains(HeaderId::IfRange) &&
+        (ifRange.compare(0, 2, "W/") == 0 || (ifRange != entry.etag && ifRange != entry.lastModified) ||
+         !findHeaderValue(cacheManager->readHeaders(entry), "Content-Encoding").empty())) {
+        cacheManager->send(clientSocket, entry);
+        return;
+    }
+    size_t bodyLength = entry.size - entry.headerLength;
+    RangeList ranges(req.arena);
+    if (!parseRange(req.headers.get(HeaderId::Range), bodyLength, ranges)) {
+        // Malformed Range headers are ignored
+        cacheManager->send(clientSocket, entry);
+        return;
+    }
+    if (ranges.empty()) {
+        std::pmr::string response("HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */", req.arena);
+        appendNumber(response, bodyLength);
+        response += "\r\nContent-Length: 0\r\n\r\n";
+        sendAll(clientSocket, response.c_str(), response.length());
+        return;
+    }
+    sendRanges(clientSocket, entry, ranges, req.arena);
+}
+
+/*
+ @brief: The client's own If-None-Match / If-Modified-Since against the
+         cached validators. If-None-Match wins when both are sent, and uses
+         the weak comparison (RFC 9110 13.1.2).
+*/
+bool MessageForwarder::clientValidatorsMatch(const HttpRequest& req, const CacheEntry& entry) {
+    if (req.headers.contains(HeaderId::IfNoneMatch)) {
+        if (entry.etag.empty()) {
+            return false;
+        }
+        std::string_view cached(entry.etag);
+        if (cached.compare(0, 2, "W/") == 0) {
+            cached.remove_prefix(2);
+        }
+        std::string_view list = req.headers.get(HeaderId::IfNoneMatch);
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            std::string_view tag = list.substr(0, comma);
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) {
+                tag.remove_prefix(1);
+            }
+            while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) {
+                tag.remove_suffix(1);
+            }
+            if (tag.compare(0, 2, "W/") == 0) {
+                tag.remove_prefix(2);
+            }
+            if (tag == "*" || tag == cached) {
+                return true;
+            }
+        }
+        return false;
+    }
+    if (!req.headers.contains(HeaderId::IfModifiedSince) || entry.lastModified.empty()) {
+        return false;
+    }
+    time_t since = parseHttpDate(std::string(req.headers.get(HeaderId::IfModifiedSince)));
+    time_t modified = parseHttpDate(entry.lastModified);
+    return since != -1 && modified != -1 && modified <= since;
+}
+
+/*
+ @brief: Headers of a cached response without its body: the whole block for
+         HEAD, or a 304 carrying the fields RFC 9110 15.4.5 asks for
+*/
+void MessageForwarder::sendCachedHeaders(int clientSocket, HttpRequest& req, const CacheEntry& entry, bool notModified) {
+    static const char* const KEPT[] = {
+        "Cache-Control:", "Content-Location:", "Date:", "ETag:", "Expires:", "Last-Modified:", "Vary:"
+    };
+    std::string diskHeaders;
+    std::string_view headerSection = cacheManager->headerView(entry, diskHeaders);
+    if (headerSection.empty()) {
+        cacheManager->send(clientSocket, entry);
+        return;
+    }
+    std::pmr::string head(req.arena);
+    if (!notModified) {
+        head.reserve(headerSection.size() + 4);
+        head.append(headerSection).append("\r\n\r\n");
+        sendAll(clientSocket, head.c_str(), head.length());
+        return;
+    }
+    head.reserve(headerSection.size());
+    head += "HTTP/1.1 304 Not Modified\r\n";
+    size_t lineEnd = headerSection.find("\r\n");
+    while (lineEnd != std::string_view::npos) {
+        size_t lineStart = lineEnd + 2;
+        lineEnd = headerSection.find("\r\n", lineStart);
+        const char* line = headerSection.data() + lineStart;
+        size_t lineLength = (lineEnd == std::string_view::npos ? headerSection.size() : lineEnd) - lineStart;
+        for (const char* name : KEPT) {
+            if (strncasecmp(line, name, strlen(name)) == 0) {
+                head.append(line, lineLength).append("\r\n");
+                break;
+            }
+        }
+    }
+    head += "\r\n";
+    sendAll(clientSocket, head.c_str(), head.length());
+}
+
+
+/*
+@brief: Parse "bytes=a-b, c-, -n" against the body length into (start, length)
+        pairs. Returns false for a malformed header; ranges stays empty when
+        nothing is satisfiable.
+*/
+bool MessageForwarder::parseRange(std::string_view value, size_t bodyLength, RangeList& ranges) {
+    if (value.compare(0, 6, "bytes=") != 0) {
+        return false;
+    }
+    std::string_view specs = value.substr(6);
+    while (!specs.empty()) {
+        size_t comma = specs.find(',');
+        std::string_view spec = specs.substr(0, comma);
+        specs = comma == std::string_view::npos ? std::string_view() : specs.substr(comma + 1);
+        while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t')) {
+            spec.remove_prefix(1);
+        }
+        while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t')) {
+            spec.remove_suffix(1);
+        }
+        size_t dash = spec.find('-');
+        if (dash == std::string_view::npos) {
+            return false;
+        }
+        std::string_view first = spec.substr(0, dash);
+        std::string_view last = spec.substr(dash + 1);
+        size_t start, end;
+        if (first.empty()) {
+            // Suffix range: the last n bytes
+            size_t suffix;
+            if (!parseOffset(last, suffix)) {
+                return false;
+            }
+            if (suffix == 0 || bodyLength == 0) {
+                continue;
+            }
+            start = suffix >= bodyLength ? 0 : bodyLength - suffix;
+            end = bodyLength - 1;
+        } else {
+            if (!parseOffset(first, start)) {
+                return false;
+            }
+            end = std::string_view::npos;
+            if (!last.empty() && !parseOffset(last, end)) {
+                return false;
+            }
+            if (end < start) {
+                return false;
+            }
+            if (start >= bodyLength) {
+                continue;
+            }
+            end = std::min(end, bodyLength - 1);
+        }
+        ranges.emplace_back(start, end - start + 1);
+    }
+    return true;
+}
+
+/*
+@brief: The 206 header block for one range of a body of total bytes: the
+        origin's headers (without the blank line) but those describing the
+        whole body
+*/
+void MessageForwarder::appendRangeHead(std::pmr::string& head, std::string_view headerSection, size_t start, size_t length, size_t total) {
+    head.reserve(head.size() + headerSection.size() + 96);
+    head += "HTTP/1.1 206 Partial Content\r\n";
+    size_t lineEnd = headerSection.find("\r\n");
+    while (lineEnd != std::string_view::npos) {
+        size_t lineStart = lineEnd + 2;
+        lineEnd = headerSection.find("\r\n", lineStart);
+        std::string_view line = headerSection.substr(lineStart, lineEnd == std::string_view::npos ? std::string_view::npos : lineEnd - lineStart);
+        if (strncasecmp(line.data(), "Content-Length:", 15) == 0 ||
+            strncasecmp(line.data(), "Content-Range:", 14) == 0) {
+            continue;
+        }
+        head.append(line);
+        head += "\r\n";
+    }
+    head += "Content-Range: bytes ";
+    appendNumber(head, start);
+    head += '-';
+    appendNumber(head, start + length - 1);
+    head += '/';
+    appendNumber(head, total);
+    head += "\r\nContent-Length: ";
+    appendNumber(head, length);
+    head += "\r\n\r\n";
+}
+
+/*
+@brief: 206 with one Content-Range, or multipart/byteranges for several ranges.
+        Header blocks are built in the request arena.
+*/
+void MessageForwarder::sendRanges(int clientSocket, const CacheEntry& entry, const RangeList& ranges, std::pmr::memory_resource* arena) {
+    std::string diskHeaders;
+    std::string_view headerSection = cacheManager->headerView(entry, diskHeaders);
+    size_t total = entry.size - entry.headerLength;
+    std::pmr::string head(arena);
+    if (ranges.size() == 1) {
+        size_t start = ranges[0].first;
+        size_t length = ranges[0].second;
+        appendRangeHead(head, headerSection, start, length, total);
+        // Header block and body slice in one write (sendfile for disk objects)
+        SocketWriter writer(clientSocket);
+        writer.add(head.data(), head.length());
+        cacheManager->send(writer, entry, entry.headerLength + start, length) && writer.flush();
+        return;
+    }
+
+    // Keep the origin's headers except the ones describing the whole body
+    head.reserve(headerSection.size() + 128);
+    head += "HTTP/1.1 206 Partial Content\r\n";
+    const char* contentType = nullptr;
+    size_t contentTypeLength = 0;
+    size_t lineEnd = headerSection.find("\r\n");
+    while (lineEnd != std::string_view::npos) {
+        size_t lineStart = lineEnd + 2;
+        lineEnd = headerSection.find("\r\n", lineStart);
+        const char* line = headerSection.data() + lineStart;
+        size_t lineLength = (lineEnd == std::string_view::npos ? headerSection.size() : lineEnd) - lineStart;
+        if (strncasecmp(line, "Content-Length:", 15) == 0 ||
+            strncasecmp(line, "Content-Range:", 14) == 0) {
+            continue;
+        }
+        if (strncasecmp(line, "Content-Type:", 13) == 0) {
+            contentType = line;
+            contentTypeLength = lineLength;
+            continue;
+        }
+        head.append(line, lineLength);
+        head += "\r\n";
+    }
+
+    std::pmr::string boundary(arena);
+    boundary += "webproxy-";
+    appendNumber(boundary, entry.timestamp);
+    boundary += '-';
+    appendNumber(boundary, total);
+    std::pmr::vector<std::pmr::string> partHeaders(arena);
+    partHeaders.reserve(ranges.size());
+    size_t contentLength = 0;
+    for (const auto& range : ranges) {
+        std::pmr::string part(arena);
+        part += "\r\n--";
+        part += boundary;
+        part += "\r\n";
+        if (contentType) {
+            part.append(contentType, contentTypeLength);
+            part += "\r\n";
+        }
+        part += "Content-Range: bytes ";
+        appendNumber(part, range.first);
+        part += '-';
+        appendNumber(part, range.first + range.second - 1);
+        part += '/';
+        appendNumber(part, total);
+        part += "\r\n\r\n";
+        contentLength += part.size() + range.second;
+        partHeaders.push_back(std::move(part));
+    }
+    std::pmr::string closing(arena);
+    closing += "\r\n--";
+    closing += boundary;
+    closing += "--\r\n";
+    contentLength += closing.size();
+    head += "Content-Type: multipart/byteranges; boundary=";
+    head += boundary;
+    head += "\r\nContent-Length: ";
+    appendNumber(head, contentLength);
+    head += "\r\n\r\n";
+
+    // From memory the whole multipart body is one writev; from disk the framing
+    // and the sendfile() calls are corked into full packets
+    SocketWriter writer(clientSocket);
+    if (!entry.inMemory()) {
+        writer.cork();
+    }
+    writer.add(head.data(), head.length());
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        writer.add(partHeaders[i].data(), partHeaders[i].length());
+        if (!cacheManager->send(writer, entry, entry.headerLength + ranges[i].first, ranges[i].second)) {
+            return;
+        }
+    }
+    writer.add(closing.data(), closing.length());
+    writer.flush();
+}
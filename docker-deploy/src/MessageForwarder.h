@@ -1,39 +1,92 @@
+#pragma once
 #include <string>
+#include <string_view>
 #include "Logger.h"
 #include "HttpParser.h"
+#include "CacheManager.h"
+#include "Compressor.h"
+#include "SocketWriter.h"
+#include "SocketOptions.h"
+#include "Config.h"
+#include "Task.h"
+#include "TlsInterceptor.h"
+#include "CircuitBreaker.h"
+#include "HedgePolicy.h"
+#include "PeerRing.h"
 #include <fcntl.h> 
 #include <map>
+#include <vector>
 #include <memory>
-#ifndef BUFFER_SIZE
-#define BUFFER_SIZE 65536
-#endif
 class MessageForwarder {
 public:
-    void forwardGet(HttpRequest& req, int clientSocket,int clientId, std::shared_ptr<Logger> logger);
-    void forwardPost(HttpRequest& req, int clientSocket,int clientId, std::shared_ptr<Logger> logger);
-    void forwardConnect(HttpRequest& req, int clientSock, int clientId, std::shared_ptr<Logger> logger);
+    // Without settings the defaults of Config are used
+    MessageForwarder(std::shared_ptr<CacheManager> cacheManager, std::shared_ptr<SharedSettings> settings = nullptr);
+    // Coroutines: suspend on an event loop, block on a client thread (Task::runHere)
+    Task<void> forwardGet(HttpRequest& req, int clientSocket,int clientId, std::shared_ptr<Logger> logger);
+    Task<void> forwardPost(HttpRequest& req, int clientSocket,int clientId, std::shared_ptr<Logger> logger);
+    Task<void> forwardConnect(HttpRequest& req, int clientSock, int clientId, std::shared_ptr<Logger> logger);
+    // The request head for the next hop, into a buffer of forwardRequestSize() bytes
+    static size_t forwardRequestSize(const HttpRequest& req, const std::string* peerSelf);
+    static std::string_view buildForwardRequest(const HttpRequest& req, char* buffer, const std::string* peerSelf);
+#ifdef WEBPROXY_TLS
+    // Set to intercept the CONNECTs tls.domains allows
+    void setInterceptor(std::shared_ptr<TlsInterceptor> interceptor);
+#endif
 private:
-    void sendErrorResponse(int clientSocket, int statusCode, const std::string& statusText);
-    int getKeepAliveConnection(const std::string& host, const std::string& port);
-    void saveKeepAliveConnection(const std::string& host, const std::string& port, int socket);
-    void removeKeepAliveConnection(const std::string& host, const std::string& port);
-    std::string buildForwardRequest(const HttpRequest& req);
-    std::map<std::string, int> keepAliveConnections;
+    Task<void> sendErrorResponse(int clientSocket, int statusCode, const std::string& statusText, const std::string& extraHeaders = "");
+    Task<void> sendConnectError(int clientSocket, int error);
+    // unhealthy origins fail fast; keyed by originName()
+    CircuitBreaker breaker;
+    static std::string originName(const HttpRequest& req);
+    Task<bool> admit(const std::string& origin, BreakerTicket& ticket, HttpRequest& req, int clientSocket, int clientId,
+                     const std::shared_ptr<Logger>& logger, const std::shared_ptr<const CacheEntry>& stale);
+    Task<bool> serveStale(const std::string& origin, HttpRequest& req, int clientSocket, int clientId,
+                          const std::shared_ptr<Logger>& logger, const std::shared_ptr<const CacheEntry>& stale);
+    void reportOutcome(const std::string& origin, const BreakerTicket& ticket, bool success, int clientId, const std::shared_ptr<Logger>& logger);
+    // second attempts for GETs slow to answer
+    HedgePolicy hedger;
+    Task<int> hedge(HttpRequest& req, const std::string& origin, int serverSocket, std::string_view requestToSend,
+                    int& firstByteTimeout, int clientId, const std::shared_ptr<Logger>& logger);
+    // cache misses for keys another proxy in the cluster owns go there
+    PeerRing peers;
+    Task<bool> fetchFromPeer(HttpRequest& req, const std::string& peer, int clientSocket, int clientId,
+                             const std::shared_ptr<Logger>& logger);
+    int getKeepAliveConnection(const std::string& host, const std::string& port, bool tls = false);
+    void saveKeepAliveConnection(const std::string& host, const std::string& port, int socket, bool tls = false);
+    bool keepsAlive(const std::string& headerSection);
+    // idle upstream connections by origin, each handed out to one request at a time
+    std::map<std::string, std::vector<int>> keepAliveConnections;
     std::mutex keepAliveMutex;
-    int connectToServer(const std::string& host, const std::string& port);
+    // reused, if given, is set when the connection comes from the pool
+    Task<int> connectToServer(const std::string& host, const std::string& port, bool tls = false, bool* reused = nullptr);
+    Task<int> openConnection(const std::string& host, const std::string& port, bool tls);
+    Task<int> resend(const HttpRequest& req, int serverSocket, std::string_view request);
+#ifdef WEBPROXY_TLS
+    std::shared_ptr<TlsInterceptor> interceptor;
+    Task<void> interceptConnect(HttpRequest& req, int clientSocket, int clientId, std::shared_ptr<Logger> logger);
+    Task<void> serveDecrypted(int plainSocket, std::string host, std::string port, int clientId, std::shared_ptr<Logger> logger);
+    Task<int> connectTls(const std::string& host, const std::string& port);
+#endif
+    // buffer size, timeouts, socket and gzip options; replaced on reload
+    std::shared_ptr<SharedSettings> sharedSettings;
 
     // for the Cache
-    struct CacheEntry {
-        std::string response;
-        std::string etag;
-        std::string lastModified;
-        time_t expiration;
-        bool mustRevalidate;
-    };
-    std::unordered_map<std::string, CacheEntry> responseCache;
-    std::string generateCacheKey(const HttpRequest& req);
+    std::shared_ptr<CacheManager> cacheManager;
+    // gzip stage of the GET response path
+    bool isCompressible(const std::string& headerSection, const CompressionOptions& compression);
+    std::pmr::string buildCompressedHeaders(std::string_view headerSection, std::string_view framing, std::pmr::memory_resource* arena);
+    bool queueChunk(SocketWriter& writer, const std::string& data);
     bool isCacheable(const std::string& method, const std::string& responseHeaders);
-    time_t getExpirationTime(const std::string& responseHeaders);
     void extractValidationHeaders(const std::string& responseHeaders, std::string& etag, std::string& lastModified);
     bool checkMustRevalidate(const std::string& responseHeaders);
+    std::string findHeaderValue(const std::string& responseHeaders, const std::string& name);
+    std::vector<std::string> getVaryHeaders(const std::string& responseHeaders);
+    // answering from cached objects (Range / 206); blocking, run through offload()
+    typedef std::pmr::vector<std::pair<size_t, size_t>> RangeList; // (start, length) in the body
+    void serveFromCache(int clientSocket, HttpRequest& req, const CacheEntry& entry);
+    bool clientValidatorsMatch(const HttpRequest& req, const CacheEntry& entry);
+    void sendCachedHeaders(int clientSocket, HttpRequest& req, const CacheEntry& entry, bool notModified);
+    bool parseRange(std::string_view value, size_t bodyLength, RangeList& ranges);
+    void sendRanges(int clientSocket, const CacheEntry& entry, const RangeList& ranges, std::pmr::memory_resource* arena);
+    void appendRangeHead(std::pmr::string& head, std::string_view headerSection, size_t start, size_t length, size_t total);
 };
\ No newline at end of file
@@ -0,0 +1,69 @@
+#include "PeerRing.h"
+#include "CacheKey.h"
+
+std::string PeerStats::describe() const {
+    return "forwarded=" + std::to_string(forwarded.load()) +
+           " fallbacks=" + std::to_string(fallbacks.load()) +
+           " served=" + std::to_string(served.load());
+}
+
+PeerStats& PeerRing::stats() {
+    static PeerStats peers;
+    return peers;
+}
+
+// splitmix64 finalizer: spreads (node, key) pairs evenly over 64 bits
+static uint64_t mix(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ull;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31);
+}
+
+const std::string* PeerRing::owner(uint64_t keyHash, const PeerOptions& options) {
+    const std::string* best = nullptr;
+    uint64_t bestScore = 0;
+    for (const std::string& node : options.nodes) {
+        uint64_t score = mix(hashBytes(node.data(), node.size()) ^ keyHash);
+        if (!best || score > bestScore) {
+            best = &node;
+            bestScore = score;
+        }
+    }
+    if (!best || *best == options.self) {
+        return nullptr;
+    }
+    return best;
+}
+
+bool PeerRing::splitNode(const std::string& node, std::string& host, std::string& port) {
+    size_t colon = node.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == node.size()) {
+        return false;
+    }
+    host = node.substr(0, colon);
+    port = node.substr(colon + 1);
+    return true;
+}
+
+bool PeerRing::isDown(const std::string& node, time_t now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = downUntil.find(node);
+    if (it == downUntil.end()) {
+        return false;
+    }
+    if (now >= it->second) {
+        downUntil.erase(it);
+        return false;
+    }
+    return true;
+}
+
+void PeerRing::markDown(const std::string& node, const PeerOptions& options, time_t now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (downUntil.size() >= MAX_DOWN) {
+        // Only a reload that drops nodes can leave stale names behind
+        downUntil.clear();
+    }
+    downUntil[node] = now + options.retry;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ @brief: The proxies that share one cache between them. Every cache key has
+         one owner among nodes; the others send their misses for it there.
+*/
+struct PeerOptions {
+    std::vector<std::string> nodes;  // host:port of every proxy in the cluster, empty = peer mode off
+    std::string self;                // this proxy's entry in nodes; not listed = owns nothing, a child of the others
+    int retry = 10;                  // seconds a peer that failed is skipped
+};
+
+struct PeerStats {
+    std::atomic<uint64_t> forwarded{0};  // misses answered by the owning peer
+    std::atomic<uint64_t> fallbacks{0};  // owner down or failed, fetched from the origin instead
+    std::atomic<uint64_t> served{0};     // requests other peers sent here
+
+    // "forwarded=120 fallbacks=2 served=98" for the log
+    std::string describe() const;
+};
+
+/*
+ @brief: Rendezvous hashing over the configured nodes: the owner of a key is
+         the node with the highest hash of (node, key). Adding or removing a
+         node only moves the keys that node wins or owned. Nodes that failed
+         are remembered for retry seconds.
+*/
+class PeerRing {
+private:
+    static constexpr size_t MAX_DOWN = 1024;
+    std::mutex mutex;
+    std::unordered_map<std::string, time_t> downUntil;
+
+public:
+    // The node owning keyHash, nullptr when peer mode is off or self owns it
+    static const std::string* owner(uint64_t keyHash, const PeerOptions& options);
+    // Split "host:port"; false when there is no port
+    static bool splitNode(const std::string& node, std::string& host, std::string& port);
+    bool isDown(const std::string& node, time_t now);
+    void markDown(const std::string& node, const PeerOptions& options, time_t now);
+
+    static PeerStats& stats();
+};
@@ -8,21 +8,53 @@
 #include <thread>
 #include <vector>
 #include <stdexcept>
+#include <csignal>
+#include <cerrno>
+#include <map>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 
 #include "ProxyServer.h"
 #include "Logger.h"
 #include "CacheManager.h"
 #include "RequestHandler.h"
 #include "ConnectionHandler.h"
+#include "BufferPool.h"
+#include "Handoff.h"
+#include "TimingWheel.h"
 
-#define BUFFER_SIZE 4096  // 4 KB buffer
 
-
-ProxyServer::ProxyServer(int port) : port(port), running(false) {
-    logger = std::make_shared<Logger>("/var/log/erss/proxy.log");
-    cacheManager = std::make_shared<CacheManager>();
+ProxyServer::ProxyServer(const ConfigSource& source)
+    : running(false), source(source), inheritedListener(-1), handoffSocket(-1), handedOff(false) {
+    std::string error;
+    if (!buildConfig(source, config, error)) {
+        throw std::runtime_error("Bad configuration: " + error);
+    }
+    CacheOptions cacheOptions = config.cache;
+    if (config.workers > 0) {
+        if (source.takeOver) {
+            throw std::runtime_error("--upgrade does not work with workers");
+        }
+        // Every worker would write these files at once
+        cacheOptions.diskEnabled = false;
+        cacheOptions.snapshotPath.clear();
+    } else {
+        cacheOptions.sharedBytes = 0;
+    }
+    snapshotPath = cacheOptions.snapshotPath;
+    upgradeSocket = config.workers > 0 ? "" : config.upgradeSocket;
+    logger = std::make_shared<Logger>(config.logPath);
+    cacheManager = std::make_shared<CacheManager>(cacheOptions);
+    BufferPool::setLimits(config.poolGlobalBuffers, config.poolThreadBuffers);
+    bool cacheTaken = source.takeOver && takeOver();
+    // Warm restart: the bodies stay in the snapshot file until they are hit
+    if (!snapshotPath.empty() && !cacheTaken) {
+        size_t loaded = cacheManager->loadSnapshot(snapshotPath);
+        logger->log(Logger::INFO, "Loaded " + std::to_string(loaded) + " cached responses from " + snapshotPath);
+    }
+    settings = std::make_shared<SharedSettings>(config);
     auto requestHandler = std::make_shared<RequestHandler>(cacheManager, logger);
-    connectionHandler = std::make_unique<ConnectionHandler>(requestHandler, logger);
+    connectionHandler = std::make_unique<ConnectionHandler>(requestHandler, cacheManager, logger, settings);
 }
 
 ProxyServer::~ProxyServer() {
@@ -36,18 +68,411 @@ void ProxyServer::start() {
     }
     // Update the state
     running = true;
+    // Block SIGINT/SIGTERM/SIGHUP/SIGUSR1 before any thread exists, so every
+    // thread inherits the mask and only handleSignals() receives them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    int port, backlog, workers;
+    {
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        port = config.port;
+        backlog = config.listenBacklog;
+        workers = config.workers;
+    }
+    // Worker mode: this process only forks and watches the workers, which go
+    // on from here with the listener it bound. No thread may exist before.
+    if (workers > 0 && !superviseWorkers(port, workers)) {
+        return;
+    }
+    std::thread(&ProxyServer::handleSignals, this).detach();
+    if (!snapshotPath.empty()) {
+        snapshotThread = std::thread(&ProxyServer::snapshotLoop, this);
+    }
+    if (!upgradeSocket.empty()) {
+        handoffSocket = openHandoffSocket(upgradeSocket);
+        if (handoffSocket < 0) {
+            logger->log(Logger::ERROR, "Failed to open the upgrade socket " + upgradeSocket);
+        } else {
+            handoffThread = std::thread(&ProxyServer::handoffLoop, this);
+        }
+    }
     // Write the log file
     logger->log(Logger::INFO, "Starting proxy server on port " + std::to_string(port));
-    connectionHandler->start(port);
+    try {
+        // Returns once stop() has been called and the clients are done
+        connectionHandler->start(port, backlog, inheritedListener);
+    } catch (const std::exception& e) {
+        stop();
+        joinThreads();
+        throw;
+    }
+    joinThreads();
+    // Final snapshot for the next start; after a handoff the successor owns the cache
+    if (!handedOff) {
+        saveSnapshot();
+    }
+}
+
+void ProxyServer::joinThreads() {
+    if (snapshotThread.joinable()) {
+        snapshotThread.join();
+    }
+    if (handoffThread.joinable()) {
+        handoffThread.join();
+    }
+    if (handoffSocket >= 0) {
+        close(handoffSocket);
+        handoffSocket = -1;
+        // The successor has bound its own socket at this path by now
+        if (!handedOff) {
+            unlink(upgradeSocket.c_str());
+        }
+    }
 }
 
 void ProxyServer::stop() {
-    if (!running) {
+    if (!running.exchange(false)) {
         return;
     }
-    running = false;
     logger->log(Logger::INFO, "Stopping proxy server");
+    logger->log(Logger::INFO, "Timeouts: " + TimingWheel::stats().describe());
+    logger->log(Logger::INFO, "Circuits: " + CircuitBreaker::stats().describe());
+    logger->log(Logger::INFO, "Hedges: " + HedgePolicy::stats().describe());
+    logger->log(Logger::INFO, "Peers: " + PeerRing::stats().describe());
+    logger->log(Logger::INFO, "Cache memory: " + cacheManager->describeMemory());
     connectionHandler->stop();
+    if (handoffSocket >= 0) {
+        // Wakes handoffLoop() from accept()
+        shutdown(handoffSocket, SHUT_RDWR);
+    }
+    {
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+    }
+    snapshotCv.notify_all();
+}
+
+/*
+ @brief: SIGHUP reloads the configuration, SIGUSR1 logs the timeout,
+         circuit breaker, hedging, peer and cache memory counts; SIGINT/SIGTERM stop the server
+*/
+void ProxyServer::handleSignals() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    int sig;
+    while (sigwait(&signals, &sig) == 0) {
+        logger->log(Logger::INFO, "Received signal " + std::to_string(sig));
+        if (sig == SIGHUP) {
+            reload();
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            logger->log(Logger::INFO, "Timeouts: " + TimingWheel::stats().describe());
+            logger->log(Logger::INFO, "Circuits: " + CircuitBreaker::stats().describe());
+            logger->log(Logger::INFO, "Hedges: " + HedgePolicy::stats().describe());
+            logger->log(Logger::INFO, "Peers: " + PeerRing::stats().describe());
+            logger->log(Logger::INFO, "Cache memory: " + cacheManager->describeMemory());
+            continue;
+        }
+        stop();
+        return;
+    }
+}
+
+/*
+ @brief: Bind the listener, fork count workers and start a new one for each
+         that dies, until SIGINT/SIGTERM. SIGHUP and SIGUSR1 are passed on,
+         so each worker reloads or logs its own counts. Returns true in a
+         worker, which then serves on the shared listener, and false here
+         once every worker has exited.
+*/
+bool ProxyServer::superviseWorkers(int port, int count) {
+    int listener = connectionHandler->bindListener(port);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    pid_t supervisor = getpid();
+    std::map<pid_t, time_t> workers; // pid -> start time
+    // True in the new worker
+    auto spawn = [&]() {
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Workers stop with the supervisor, even when it is killed
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != supervisor) {
+                _exit(0);
+            }
+            sigset_t child;
+            sigemptyset(&child);
+            sigaddset(&child, SIGCHLD);
+            pthread_sigmask(SIG_UNBLOCK, &child, nullptr);
+            inheritedListener = listener;
+            return true;
+        }
+        if (pid < 0) {
+            logger->log(Logger::ERROR, "Failed to start a worker: " + std::string(strerror(errno)));
+        } else {
+            workers[pid] = time(nullptr);
+        }
+        return false;
+    };
+    for (int i = 0; i < count; i++) {
+        if (spawn()) {
+            return true;
+        }
+    }
+    logger->log(Logger::INFO, "Started " + std::to_string(workers.size()) + " workers on port " + std::to_string(port));
+    bool stopping = false;
+    int sig;
+    while (!workers.empty() && sigwait(&signals, &sig) == 0) {
+        if (sig != SIGCHLD) {
+            stopping = stopping || sig == SIGINT || sig == SIGTERM;
+            for (const auto& worker : workers) {
+                kill(worker.first, sig);
+            }
+            continue;
+        }
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            auto worker = workers.find(pid);
+            if (worker == workers.end()) {
+                continue;
+            }
+            bool early = time(nullptr) - worker->second < 1;
+            workers.erase(worker);
+            if (stopping) {
+                continue;
+            }
+            logger->log(Logger::WARNING, "Worker " + std::to_string(pid) +
+                        (WIFSIGNALED(status) ? " killed by signal " + std::to_string(WTERMSIG(status))
+                                             : " exited with status " + std::to_string(WEXITSTATUS(status))) +
+                        ", starting another");
+            if (early) {
+                // One that cannot even start is not restarted in a tight loop
+                sleep(1);
+            }
+            if (spawn()) {
+                return true;
+            }
+        }
+    }
+    close(listener);
+    running = false;
+    logger->log(Logger::INFO, "All workers stopped");
+    return false;
+}
+
+/*
+ @brief: Started with --upgrade: take the listening socket, and the cache if
+         upgradeCache is set, from the process serving at upgradeSocket.
+         Returns whether a cache was loaded.
+*/
+bool ProxyServer::takeOver() {
+    if (upgradeSocket.empty()) {
+        throw std::runtime_error("--upgrade needs upgrade_socket in the configuration");
+    }
+    int connection = requestHandoff(upgradeSocket, config.upgradeCache);
+    if (connection < 0) {
+        throw std::runtime_error("No running proxy at " + upgradeSocket);
+    }
+    inheritedListener = receiveDescriptor(connection);
+    if (inheritedListener < 0) {
+        close(connection);
+        throw std::runtime_error("The running proxy did not hand over its socket");
+    }
+    logger->log(Logger::INFO, "Took over the listening socket from the running proxy");
+    bool loaded = false;
+    if (config.upgradeCache) {
+        std::string cachePath = upgradeSocket + ".cache";
+        if (receiveFileStream(connection, cachePath)) {
+            size_t count = cacheManager->loadSnapshot(cachePath);
+            // The loaded entries keep the file open
+            unlink(cachePath.c_str());
+            logger->log(Logger::INFO, "Took over " + std::to_string(count) + " cached responses");
+            loaded = true;
+        } else {
+            logger->log(Logger::WARNING, "No cache received from the running proxy");
+        }
+    }
+    close(connection);
+    return loaded;
+}
+
+/*
+ @brief: Wait for a successor on the upgrade socket; a completed handoff
+         stops this server
+*/
+void ProxyServer::handoffLoop() {
+    while (running) {
+        int connection = accept(handoffSocket, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        bool done = handOff(connection);
+        close(connection);
+        if (done) {
+            stop();
+            return;
+        }
+    }
+}
+
+/*
+ @brief: Pass the listener to the successor and stop accepting. Connections
+         arriving meanwhile wait in the shared backlog. The cache is streamed
+         as a snapshot before the clients are drained.
+*/
+bool ProxyServer::handOff(int connection) {
+    bool wantCache;
+    if (!readHandoffRequest(connection, wantCache)) {
+        logger->log(Logger::WARNING, "Ignored a bad request on the upgrade socket");
+        return false;
+    }
+    int listener = connectionHandler->listener();
+    if (listener < 0 || !sendDescriptor(connection, listener)) {
+        logger->log(Logger::ERROR, "Failed to hand over the listening socket");
+        return false;
+    }
+    handedOff = true;
+    connectionHandler->stop();
+    logger->log(Logger::INFO, "Handed the listening socket to a new process");
+    if (wantCache) {
+        std::string path = upgradeSocket + ".snapshot";
+        bool saved = cacheManager->saveSnapshot(path);
+        if (sendFileStream(connection, saved ? path : "")) {
+            logger->log(Logger::INFO, "Streamed " + std::to_string(saved ? cacheManager->size() : 0) + " cached responses to the new process");
+        } else {
+            logger->log(Logger::ERROR, "Failed to stream the cache to the new process");
+        }
+        unlink(path.c_str());
+    }
+    return true;
+}
+
+/*
+ @brief: Rebuild the configuration and apply what can change while running.
+         A bad file keeps the current configuration. Requests in flight
+         finish with the settings they started with.
+*/
+void ProxyServer::reload() {
+    Config updated;
+    std::string error;
+    if (!buildConfig(source, updated, error)) {
+        logger->log(Logger::ERROR, "Reload failed, keeping the current configuration: " + error);
+        return;
+    }
+    if (updated.logPath != config.logPath && !logger->reopen(updated.logPath)) {
+        logger->log(Logger::ERROR, "Cannot open log file " + updated.logPath);
+        updated.logPath = config.logPath;
+    }
+    // These are bound when the listener, the policy or the disk tier is created
+    std::string restart;
+    if (updated.port != config.port) restart += " port";
+    if (updated.listenBacklog != config.listenBacklog) restart += " listen_backlog";
+    if (updated.workers != config.workers) restart += " workers";
+    if (updated.ioBackend != config.ioBackend) restart += " io_backend";
+    if (updated.loopThreads != config.loopThreads || updated.blockingThreads != config.blockingThreads) restart += " loop_threads/blocking_threads";
+    if (updated.cache.evictionPolicy != config.cache.evictionPolicy) restart += " cache.eviction";
+    if (updated.cache.diskEnabled != config.cache.diskEnabled ||
+        updated.cache.diskDirectory != config.cache.diskDirectory ||
+        updated.cache.diskSegmentBytes != config.cache.diskSegmentBytes ||
+        updated.cache.diskSegments != config.cache.diskSegments) restart += " cache.disk*";
+    if (updated.cache.sharedBytes != config.cache.sharedBytes) restart += " cache.shared_bytes";
+    if (updated.cache.slabs != config.cache.slabs || updated.cache.hugePages != config.cache.hugePages) restart += " cache.slabs/huge_pages";
+    if (updated.cache.snapshotPath != config.cache.snapshotPath) restart += " cache.snapshot";
+    if (updated.upgradeSocket != config.upgradeSocket) restart += " upgrade_socket";
+    if (updated.socket.reuseAddress != config.socket.reuseAddress ||
+        updated.socket.fastOpen != config.socket.fastOpen ||
+        updated.socket.fastOpenQueue != config.socket.fastOpenQueue ||
+        updated.socket.deferAccept != config.socket.deferAccept) restart += " socket.reuseaddr/fastopen/defer_accept";
+    if (updated.tls.intercept != config.tls.intercept ||
+        updated.tls.caCert != config.tls.caCert ||
+        updated.tls.caKey != config.tls.caKey ||
+        updated.tls.verifyUpstream != config.tls.verifyUpstream ||
+        updated.tls.upstreamCa != config.tls.upstreamCa) restart += " tls.intercept/ca_*/*upstream*";
+    if (!restart.empty()) {
+        logger->log(Logger::WARNING, "Changed settings that take effect after a restart:" + restart);
+    }
+    // Keep config describing what is actually in effect
+    updated.port = config.port;
+    updated.listenBacklog = config.listenBacklog;
+    updated.workers = config.workers;
+    updated.ioBackend = config.ioBackend;
+    updated.loopThreads = config.loopThreads;
+    updated.blockingThreads = config.blockingThreads;
+    updated.cache.evictionPolicy = config.cache.evictionPolicy;
+    updated.cache.diskEnabled = config.cache.diskEnabled;
+    updated.cache.diskDirectory = config.cache.diskDirectory;
+    updated.cache.diskSegmentBytes = config.cache.diskSegmentBytes;
+    updated.cache.diskSegments = config.cache.diskSegments;
+    updated.cache.sharedBytes = config.cache.sharedBytes;
+    updated.cache.slabs = config.cache.slabs;
+    updated.cache.hugePages = config.cache.hugePages;
+    updated.cache.snapshotPath = config.cache.snapshotPath;
+    updated.upgradeSocket = config.upgradeSocket;
+    std::vector<std::string> domains = updated.tls.domains;
+    updated.tls = config.tls;
+    updated.tls.domains = domains;
+
+    cacheManager->reconfigure(updated.cache);
+    BufferPool::setLimits(updated.poolGlobalBuffers, updated.poolThreadBuffers);
+    settings->set(updated);
+    {
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        config = updated;
+    }
+    // Restart the wait with the new snapshot interval
+    snapshotCv.notify_all();
+    logger->log(Logger::INFO, "Configuration reloaded");
+}
+
+/*
+ @brief: Save a snapshot every snapshotInterval seconds while running
+*/
+void ProxyServer::snapshotLoop() {
+    std::unique_lock<std::mutex> lock(snapshotMutex);
+    while (running) {
+        int interval = config.cache.snapshotInterval;
+        auto due = std::chrono::steady_clock::now() + std::chrono::seconds(interval);
+        // A reload with a new interval wakes the wait and starts a new one
+        if (snapshotCv.wait_until(lock, due, [this, interval] { return !running || config.cache.snapshotInterval != interval; })) {
+            if (!running) {
+                break;
+            }
+            continue;
+        }
+        lock.unlock();
+        saveSnapshot();
+        lock.lock();
+    }
+}
+
+void ProxyServer::saveSnapshot() {
+    if (snapshotPath.empty() || handedOff) {
+        return;
+    }
+    if (cacheManager->saveSnapshot(snapshotPath)) {
+        logger->log(Logger::INFO, "Saved cache snapshot (" + std::to_string(cacheManager->size()) + " responses)");
+    } else {
+        logger->log(Logger::ERROR, "Failed to save cache snapshot to " + snapshotPath);
+    }
 }
 
 bool ProxyServer::isRunning() const {
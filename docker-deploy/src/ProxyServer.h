@@ -1,23 +1,52 @@
 #pragma once
 #include <string>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include "ConnectionHandler.h"
 #include "CacheManager.h"
 #include "Logger.h"
+#include "Config.h"
 
 class ProxyServer {
 private:
-    int port;
-    bool running;
+    std::atomic<bool> running;
     std::unique_ptr<ConnectionHandler> connectionHandler;
     std::shared_ptr<CacheManager> cacheManager;
     std::shared_ptr<Logger> logger;
+    // Rebuilt from the same source on SIGHUP
+    ConfigSource source;
+    Config config;
+    std::shared_ptr<SharedSettings> settings;
+    std::string snapshotPath; // fixed at startup
+    // Upgrades: the listener taken over at startup, and the socket a successor connects to
+    std::string upgradeSocket;
+    int inheritedListener;
+    int handoffSocket;
+    std::thread handoffThread;
+    std::atomic<bool> handedOff;
+    // Periodic cache snapshots; snapshotMutex also guards config
+    std::thread snapshotThread;
+    std::mutex snapshotMutex;
+    std::condition_variable snapshotCv;
+
+    void handleSignals();
+    bool superviseWorkers(int port, int count);
+    void reload();
+    bool takeOver();
+    void handoffLoop();
+    bool handOff(int connection);
+    void joinThreads();
+    void snapshotLoop();
+    void saveSnapshot();
 
 public:
-    ProxyServer(int port = 8080);
+    ProxyServer(const ConfigSource& source = ConfigSource());
     ~ProxyServer();
     
     void start();
     void stop();
     bool isRunning() const;
-}; 
\ No newline at end of file
+}; 
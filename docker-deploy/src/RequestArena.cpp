@@ -0,0 +1,53 @@
+#include "RequestArena.h"
+#include "BufferPool.h"
+#include <cstdint>
+#include <algorithm>
+
+RequestArena::RequestArena(size_t blockSize)
+    : blocks(nullptr), cursor(nullptr), limit(nullptr), blockSize(blockSize), used(0) {}
+
+RequestArena::~RequestArena() {
+    release();
+}
+
+/*
+ @brief: Take a block big enough for minimum bytes; the block header lives at
+         its start so the arena itself never allocates
+*/
+void RequestArena::addBlock(size_t minimum) {
+    size_t capacity;
+    size_t wanted = std::max(blockSize, minimum + sizeof(Block) + alignof(std::max_align_t));
+    char* data = BufferPool::acquire(wanted, capacity);
+    BufferPool::stats().arenaBlocks++;
+    Block* block = reinterpret_cast<Block*>(data);
+    block->next = blocks;
+    block->capacity = capacity;
+    blocks = block;
+    cursor = data + sizeof(Block);
+    limit = data + capacity;
+}
+
+void* RequestArena::do_allocate(size_t bytes, size_t alignment) {
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (!cursor || aligned + bytes > reinterpret_cast<uintptr_t>(limit)) {
+        addBlock(bytes + alignment);
+        aligned = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    }
+    cursor = reinterpret_cast<char*>(aligned + bytes);
+    used += bytes;
+    return reinterpret_cast<void*>(aligned);
+}
+
+/*
+ @brief: Give every block back to the pool in one go
+*/
+void RequestArena::release() {
+    while (blocks) {
+        Block* next = blocks->next;
+        BufferPool::release(reinterpret_cast<char*>(blocks), blocks->capacity);
+        blocks = next;
+    }
+    cursor = nullptr;
+    limit = nullptr;
+    used = 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <memory_resource>
+#include <cstddef>
+
+/*
+ @brief: Bump allocator for one request. Blocks come from the BufferPool and
+         are all handed back when the arena is destroyed; deallocate() is a
+         no-op. Usable with any std::pmr container.
+*/
+class RequestArena : public std::pmr::memory_resource {
+private:
+    struct Block {
+        Block* next;
+        size_t capacity;
+    };
+    Block* blocks;
+    char* cursor;
+    char* limit;
+    size_t blockSize;
+    size_t used;
+
+    void addBlock(size_t minimum);
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {}
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+public:
+    explicit RequestArena(size_t blockSize = 4096);
+    ~RequestArena();
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator=(const RequestArena&) = delete;
+
+    void release();
+    size_t bytesUsed() const { return used; }
+};
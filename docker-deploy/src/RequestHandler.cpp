@@ -8,51 +8,71 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <string>
+#include "RequestArena.h"
 //#include "MessageForwarder.h"
 
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; 
 
+// Spare requests kept, and the largest request buffer worth keeping
+static const size_t MAX_SPARE_REQUESTS = 256;
+static const size_t MAX_SPARE_REQUEST_BYTES = 64 * 1024;
+
 RequestHandler::RequestHandler(std::shared_ptr<CacheManager> cache, std::shared_ptr<Logger> logger)
-    : cacheManager(cache), logger(logger), httpParser(std::make_unique<HttpParser>()) {}
+    : cacheManager(cache), logger(logger), httpParser(std::make_unique<HttpParser>()) {
+    spareRequests.reserve(MAX_SPARE_REQUESTS);
+}
+
+std::unique_ptr<HttpRequest> RequestHandler::takeRequest() {
+    {
+        std::lock_guard<std::mutex> lock(spareMutex);
+        if (!spareRequests.empty()) {
+            std::unique_ptr<HttpRequest> request = std::move(spareRequests.back());
+            spareRequests.pop_back();
+            return request;
+        }
+    }
+    return std::make_unique<HttpRequest>();
+}
 
-void RequestHandler::handleRequest(const std::string& request, int clientSocket, int clientId, MessageForwarder& forwarder) {
+/*
+ @brief: Keep a finished request for the next one, unless the pool is full or
+         an oversized request grew its buffers
+*/
+void RequestHandler::returnRequest(std::unique_ptr<HttpRequest> request) {
+    if (request->raw.capacity() > MAX_SPARE_REQUEST_BYTES || request->body.capacity() > MAX_SPARE_REQUEST_BYTES) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(spareMutex);
+    if (spareRequests.size() < MAX_SPARE_REQUESTS) {
+        spareRequests.push_back(std::move(request));
+    }
+}
+
+Task<void> RequestHandler::handleRequest(const std::string& request, int clientSocket, int clientId, MessageForwarder& forwarder) {
     //logger->log("Handling request: " + request, clientId); // wks
+    std::unique_ptr<HttpRequest> parsedRequest = takeRequest();
     try {
         // Parse the http request
-        HttpRequest parsedRequest = httpParser->parseRequest(request);
-        if (!httpParser->isValidRequest(parsedRequest)) {
+        httpParser->parseRequest(request, *parsedRequest);
+        // Scratch memory for this request, released in one go when it is done
+        RequestArena arena;
+        parsedRequest->arena = &arena;
+        if (!httpParser->isValidRequest(*parsedRequest)) {
             //TODO: fix the format  it should be id: [TYPE] message rather than [TYPE] id:xxxxx
             logger->log(Logger::ERROR, std::to_string(clientId) + ":Invalid request received");
-            return ;
-        }
-        // Build the cache keys
-        std::string cacheKey = parsedRequest.method + " " + parsedRequest.url;
-        std::string cachedResponse;
-        //TODO: test cache later Feb-22
-        /*
-        if (cacheManager->get(cacheKey, cachedResponse)) {
-            logger->log(Logger::INFO, "Cache hit for: " + parsedRequest.url);
-            return cachedResponse;
+        } else {
+            co_await forwardRequest(*parsedRequest, clientSocket, clientId, forwarder);
         }
-        */
-        forwardRequest(parsedRequest, clientSocket,clientId, forwarder);
-        // TODO: test cache later 
-        // cacheManager->put(cacheKey, response, time(nullptr) + 300); // Cache for 5 minutes
-        
-        return;
     } catch (const std::exception& e) {
         logger->log(Logger::ERROR, std::string("Error handling request: ") + e.what());
-        return;
     }
+    returnRequest(std::move(parsedRequest));
 }
 
-void RequestHandler::forwardRequest(HttpRequest httpRequest, int clientSocket, int clientId, MessageForwarder& forwarder) {
+Task<void> RequestHandler::forwardRequest(HttpRequest& httpRequest, int clientSocket, int clientId, MessageForwarder& forwarder) {
     try {
         
-        std::string serverName = httpRequest.headers["Host"];
-        std::string requestLine = httpRequest.method + " " + serverName + " " + httpRequest.version;
-        
         // Log the request before forwarding
         //logger->log("Requesting \"" + httpRequest.request + "\" from " + serverName, clientId);
         // wks
@@ -67,22 +87,25 @@ void RequestHandler::forwardRequest(HttpRequest httpRequest, int clientSocket, i
         strftime(timeBuffer, sizeof(timeBuffer), "%a %b %d %H:%M:%S %Y", utcTime);
 
         // Log the request in the required format
-        logger->log( httpRequest.request  + " from " + clientIP + " @ " + timeBuffer, clientId);
+        std::pmr::string line(httpRequest.arena);
+        line.reserve(httpRequest.request.size() + 64);
+        line.append(httpRequest.request).append(" from ").append(clientIP).append(" @ ").append(timeBuffer);
+        logger->log(line, clientId);
         //wks
 
-        std::string response;
-        
-        if (httpRequest.method == "GET") {
-            //logger->log(httpRequest.method , clientId);
-            forwarder.forwardGet(httpRequest, clientSocket, clientId, logger);
-        } else if (httpRequest.method == "POST") {
-            //logger->log(httpRequest.method , clientId);
-            forwarder.forwardPost(httpRequest, clientSocket, clientId, logger);
-        } else if (httpRequest.method == "CONNECT") {
-            //logger->log(httpRequest.method , clientId);
-            forwarder.forwardConnect(httpRequest, clientSocket, clientId, logger);
-        } else {
-            return;
+        switch (httpRequest.methodId) {
+        case HttpMethod::Get:
+        case HttpMethod::Head:
+            co_await forwarder.forwardGet(httpRequest, clientSocket, clientId, logger);
+            break;
+        case HttpMethod::Post:
+            co_await forwarder.forwardPost(httpRequest, clientSocket, clientId, logger);
+            break;
+        case HttpMethod::Connect:
+            co_await forwarder.forwardConnect(httpRequest, clientSocket, clientId, logger);
+            break;
+        default:
+            co_return;
         }
         
         // Parse the first line of the response to log
@@ -91,8 +114,8 @@ void RequestHandler::forwardRequest(HttpRequest httpRequest, int clientSocket, i
         // Log the response after receiving
         //logger->log("Received \"" + responseLine + "\" from " + serverName, clientId);
         
-        return ;
+        co_return;
     } catch (const std::exception& e) {
-        return ;
+        co_return;
     }
 }
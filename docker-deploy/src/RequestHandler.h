@@ -1,6 +1,8 @@
 #pragma once
 #include <string>
 #include <memory>
+#include <mutex>
+#include <vector>
 #include "HttpParser.h"
 #include "CacheManager.h"
 #include "Logger.h"
@@ -11,9 +13,17 @@ private:
     std::shared_ptr<CacheManager> cacheManager;
     std::shared_ptr<Logger> logger;
     std::unique_ptr<HttpParser> httpParser;
+    // Parsed requests kept for reuse: their strings keep their capacity,
+    // so a warm request is parsed and keyed without allocating
+    std::vector<std::unique_ptr<HttpRequest>> spareRequests;
+    std::mutex spareMutex;
+
+    std::unique_ptr<HttpRequest> takeRequest();
+    void returnRequest(std::unique_ptr<HttpRequest> request);
 
 public:
     RequestHandler(std::shared_ptr<CacheManager> cache, std::shared_ptr<Logger> logger);
-    void handleRequest(const std::string& request, int clientSocket, int clientId, MessageForwarder& forwarder);
-    void forwardRequest(HttpRequest httpRequest, int clientSocket, int clientId, MessageForwarder& forwarder);
+    // Coroutines like the forwarder's; client threads run them with runHere()
+    Task<void> handleRequest(const std::string& request, int clientSocket, int clientId, MessageForwarder& forwarder);
+    Task<void> forwardRequest(HttpRequest& httpRequest, int clientSocket, int clientId, MessageForwarder& forwarder);
 }; 
\ No newline at end of file
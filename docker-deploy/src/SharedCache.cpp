@@ -0,0 +1,331 @@
+#include "SharedCache.h"
+#include "CacheManager.h"
+#include <sys/mman.h>
+#include <pthread.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+struct SharedCache::Shard {
+    pthread_mutex_t mutex;
+    uint64_t writePos;     // bytes ever appended to the ring; a record's position is its value at the time
+    uint64_t capacity;     // bytes in the ring
+    uint64_t bucketCount;
+};
+
+struct SharedCache::Bucket {
+    uint64_t hash;
+    uint64_t position;     // where the record starts in the ring, as a writePos value
+    uint32_t length;       // 0: empty
+    uint32_t varyHash;     // tells the variants of one URL apart without reading them
+    int64_t expiration;    // kept here so a revalidation does not rewrite the record
+};
+
+/*
+ @brief: Holds a shard's lock. When its last holder died, the shard may be
+         half written, so its index is dropped before the lock is used again.
+*/
+class SharedCache::Guard {
+private:
+    Shard& shard;
+
+public:
+    Guard(Shard& shard) : shard(shard) {
+        if (pthread_mutex_lock(&shard.mutex) == EOWNERDEAD) {
+            reset(shard);
+            pthread_mutex_consistent(&shard.mutex);
+        }
+    }
+    ~Guard() { pthread_mutex_unlock(&shard.mutex); }
+};
+
+static size_t align8(size_t value) {
+    return (value + 7) & ~(size_t)7;
+}
+
+static void putU32(std::string& out, uint32_t value) {
+    out.append((const char*)&value, sizeof(value));
+}
+
+static void putU64(std::string& out, uint64_t value) {
+    out.append((const char*)&value, sizeof(value));
+}
+
+static void putString(std::string& out, const std::string& value) {
+    putU32(out, (uint32_t)value.size());
+    out.append(value);
+}
+
+/*
+ @brief: Bounds-checked reads over one record
+*/
+struct RecordReader {
+    const char* next;
+    const char* end;
+    bool ok = true;
+
+    bool take(void* out, size_t length) {
+        if (!ok || (size_t)(end - next) < length) {
+            return ok = false;
+        }
+        memcpy(out, next, length);
+        next += length;
+        return true;
+    }
+    uint32_t u32() {
+        uint32_t value = 0;
+        take(&value, sizeof(value));
+        return value;
+    }
+    uint64_t u64() {
+        uint64_t value = 0;
+        take(&value, sizeof(value));
+        return value;
+    }
+    std::string string() {
+        uint32_t length = u32();
+        if (!ok || (size_t)(end - next) < length) {
+            ok = false;
+            return "";
+        }
+        std::string value(next, length);
+        next += length;
+        return value;
+    }
+};
+
+/*
+ @brief: Everything of a record but the response, which follows it:
+         key, validators, Vary, timestamps and the response length
+*/
+static std::string encodeMeta(const CacheKey& key, const CacheEntry& entry) {
+    std::string meta;
+    putString(meta, key.key);
+    putString(meta, entry.etag);
+    putString(meta, entry.lastModified);
+    putString(meta, entry.varyKey);
+    putU32(meta, (uint32_t)entry.vary.size());
+    for (const std::string& name : entry.vary) {
+        putString(meta, name);
+    }
+    putU64(meta, (uint64_t)entry.timestamp);
+    putU64(meta, entry.headerLength);
+    putU32(meta, entry.mustRevalidate ? 1 : 0);
+    putU64(meta, entry.response->size());
+    return meta;
+}
+
+SharedCache::SharedCache(size_t bytes) {
+    shardBytes = bytes / SHARDS & ~(size_t)63;
+    size_t bucketCount = std::max<size_t>(shardBytes / AVERAGE_OBJECT, PROBES);
+    size_t indexBytes = align8(sizeof(Shard)) + bucketCount * sizeof(Bucket);
+    if (shardBytes < indexBytes + 64 * 1024) {
+        throw std::runtime_error("Shared cache of " + std::to_string(bytes) + " bytes is too small");
+    }
+    regionBytes = shardBytes * SHARDS;
+    void* mapped = mmap(nullptr, regionBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("Failed to map the shared cache: " + std::string(strerror(errno)));
+    }
+    region = (char*)mapped;
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    for (size_t i = 0; i < SHARDS; i++) {
+        // The mapping starts zeroed: empty buckets, empty ring
+        Shard& shard = *(Shard*)(region + i * shardBytes);
+        pthread_mutex_init(&shard.mutex, &attributes);
+        shard.bucketCount = bucketCount;
+        shard.capacity = shardBytes - indexBytes;
+        shard.writePos = 0;
+    }
+    pthread_mutexattr_destroy(&attributes);
+}
+
+SharedCache::~SharedCache() {
+    munmap(region, regionBytes);
+}
+
+SharedCache::Shard& SharedCache::shardFor(uint64_t hash) {
+    return *(Shard*)(region + (hash % SHARDS) * shardBytes);
+}
+
+SharedCache::Bucket* SharedCache::bucketsOf(Shard& shard) {
+    return (Bucket*)((char*)&shard + align8(sizeof(Shard)));
+}
+
+char* SharedCache::ringOf(Shard& shard) {
+    return (char*)(bucketsOf(shard) + shard.bucketCount);
+}
+
+/*
+ @brief: Whether the ring has not yet wrapped over the bucket's record
+*/
+bool SharedCache::intact(const Shard& shard, const Bucket& bucket) {
+    return bucket.length != 0 && shard.writePos <= bucket.position + shard.capacity;
+}
+
+void SharedCache::reset(Shard& shard) {
+    memset(bucketsOf(shard), 0, shard.bucketCount * sizeof(Bucket));
+}
+
+/*
+ @brief: Copy a record out of the ring, if it is key's and its Vary values
+         match the request. Called with the shard locked.
+*/
+std::shared_ptr<CacheEntry> SharedCache::decode(Shard& shard, const Bucket& bucket, const CacheKey& key,
+                                                const HeaderList& requestHeaders) {
+    const char* record = ringOf(shard) + bucket.position % shard.capacity;
+    RecordReader reader{record, record + bucket.length};
+    if (reader.string() != key.key || !reader.ok) {
+        return nullptr;
+    }
+    auto entry = std::make_shared<CacheEntry>();
+    entry->etag = reader.string();
+    entry->lastModified = reader.string();
+    entry->varyKey = reader.string();
+    uint32_t varyCount = reader.u32();
+    for (uint32_t i = 0; i < varyCount && reader.ok; i++) {
+        entry->vary.push_back(reader.string());
+    }
+    entry->timestamp = (time_t)reader.u64();
+    entry->headerLength = reader.u64();
+    entry->mustRevalidate = reader.u32() != 0;
+    uint64_t responseLength = reader.u64();
+    if (!reader.ok || (uint64_t)(reader.end - reader.next) < responseLength) {
+        return nullptr;
+    }
+    if (!entry->vary.empty() && CacheManager::buildVaryKey(entry->vary, requestHeaders) != entry->varyKey) {
+        return nullptr;
+    }
+    entry->response = std::make_shared<const CacheBody>(reader.next, responseLength);
+    entry->size = responseLength;
+    entry->expiration = bucket.expiration;
+    return entry;
+}
+
+std::shared_ptr<const CacheEntry> SharedCache::get(const CacheKey& key, const HeaderList& requestHeaders) {
+    Shard& shard = shardFor(key.hash);
+    Guard guard(shard);
+    Bucket* buckets = bucketsOf(shard);
+    // The low bits picked the shard; the rest pick the home bucket
+    uint64_t home = key.hash / SHARDS;
+    for (size_t i = 0; i < PROBES; i++) {
+        Bucket& bucket = buckets[(home + i) % shard.bucketCount];
+        if (bucket.hash != key.hash || bucket.length == 0) {
+            continue;
+        }
+        if (!intact(shard, bucket)) {
+            bucket.length = 0;
+            continue;
+        }
+        auto entry = decode(shard, bucket, key, requestHeaders);
+        if (entry) {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ @brief: Append the record and point a bucket at it: the one holding the
+         same variant, else a free or overwritten one, else the oldest
+*/
+bool SharedCache::put(const CacheKey& key, const CacheEntry& entry) {
+    if (!entry.response) {
+        return false;
+    }
+    std::string meta = encodeMeta(key, entry);
+    size_t length = meta.size() + entry.response->size();
+    Shard& shard = shardFor(key.hash);
+    // capacity never changes after the constructor
+    if (length > shard.capacity / 8 || length > UINT32_MAX) {
+        return false;
+    }
+    uint32_t varyHash = (uint32_t)hashBytes(entry.varyKey.data(), entry.varyKey.size());
+    Guard guard(shard);
+    Bucket* buckets = bucketsOf(shard);
+    uint64_t home = key.hash / SHARDS;
+    Bucket* same = nullptr;
+    Bucket* unused = nullptr;
+    Bucket* oldest = nullptr;
+    for (size_t i = 0; i < PROBES && !same; i++) {
+        Bucket& bucket = buckets[(home + i) % shard.bucketCount];
+        if (!intact(shard, bucket)) {
+            unused = unused ? unused : &bucket;
+        } else if (bucket.hash == key.hash && bucket.varyHash == varyHash) {
+            same = &bucket;
+        } else if (!oldest || bucket.position < oldest->position) {
+            oldest = &bucket;
+        }
+    }
+    Bucket* target = same ? same : unused ? unused : oldest;
+
+    // Records never wrap: skip the tail of the ring when this one does not fit there
+    uint64_t offset = shard.writePos % shard.capacity;
+    if (offset + length > shard.capacity) {
+        shard.writePos += shard.capacity - offset;
+        offset = 0;
+    }
+    char* record = ringOf(shard) + offset;
+    memcpy(record, meta.data(), meta.size());
+    memcpy(record + meta.size(), entry.response->data(), entry.response->size());
+    target->hash = key.hash;
+    target->position = shard.writePos;
+    target->length = (uint32_t)length;
+    target->varyHash = varyHash;
+    target->expiration = (int64_t)entry.expiration;
+    shard.writePos += align8(length);
+    return true;
+}
+
+void SharedCache::refresh(const CacheKey& key, const std::string& varyKey, time_t expiration) {
+    uint32_t varyHash = (uint32_t)hashBytes(varyKey.data(), varyKey.size());
+    Shard& shard = shardFor(key.hash);
+    Guard guard(shard);
+    Bucket* buckets = bucketsOf(shard);
+    uint64_t home = key.hash / SHARDS;
+    for (size_t i = 0; i < PROBES; i++) {
+        Bucket& bucket = buckets[(home + i) % shard.bucketCount];
+        if (bucket.hash == key.hash && bucket.varyHash == varyHash && intact(shard, bucket)) {
+            bucket.expiration = (int64_t)expiration;
+            return;
+        }
+    }
+}
+
+void SharedCache::remove(const CacheKey& key) {
+    Shard& shard = shardFor(key.hash);
+    Guard guard(shard);
+    Bucket* buckets = bucketsOf(shard);
+    uint64_t home = key.hash / SHARDS;
+    for (size_t i = 0; i < PROBES; i++) {
+        Bucket& bucket = buckets[(home + i) % shard.bucketCount];
+        if (bucket.hash == key.hash) {
+            bucket.length = 0;
+        }
+    }
+}
+
+void SharedCache::clear() {
+    for (size_t i = 0; i < SHARDS; i++) {
+        Shard& shard = *(Shard*)(region + i * shardBytes);
+        Guard guard(shard);
+        reset(shard);
+    }
+}
+
+size_t SharedCache::size() {
+    size_t count = 0;
+    for (size_t i = 0; i < SHARDS; i++) {
+        Shard& shard = *(Shard*)(region + i * shardBytes);
+        Guard guard(shard);
+        Bucket* buckets = bucketsOf(shard);
+        for (uint64_t b = 0; b < shard.bucketCount; b++) {
+            count += intact(shard, buckets[b]);
+        }
+    }
+    return count;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include "CacheKey.h"
+#include "HttpHeaders.h"
+
+struct CacheEntry;
+
+/*
+ @brief: Cache tier in one shared memory mapping, created before the worker
+         processes are forked so that all of them serve the same objects.
+         The mapping is cut into shards. Each has a process-shared robust
+         mutex, an open-addressing index and a ring of records; the index
+         refers to records by their offset in the ring, never by pointer.
+         A record is gone once the ring has wrapped over it, like a disk
+         tier segment. A worker that dies holding a shard lock leaves that
+         shard emptied, not corrupted.
+*/
+class SharedCache {
+private:
+    struct Shard;
+    struct Bucket;
+    class Guard;
+    static constexpr size_t SHARDS = 16;
+    static constexpr size_t PROBES = 8;            // buckets looked at from the home bucket
+    static constexpr size_t AVERAGE_OBJECT = 4096; // sizes the index: one bucket per this many bytes
+    char* region;
+    size_t regionBytes;
+    size_t shardBytes;
+
+    Shard& shardFor(uint64_t hash);
+    static Bucket* bucketsOf(Shard& shard);
+    static char* ringOf(Shard& shard);
+    static bool intact(const Shard& shard, const Bucket& bucket);
+    static void reset(Shard& shard);
+    std::shared_ptr<CacheEntry> decode(Shard& shard, const Bucket& bucket, const CacheKey& key,
+                                       const HeaderList& requestHeaders);
+
+public:
+    // Throws std::runtime_error when the mapping cannot be made
+    SharedCache(size_t bytes);
+    ~SharedCache();
+    SharedCache(const SharedCache&) = delete;
+    SharedCache& operator=(const SharedCache&) = delete;
+
+    // A copy of the variant matching the request, nullptr on a miss
+    std::shared_ptr<const CacheEntry> get(const CacheKey& key, const HeaderList& requestHeaders);
+    // False when the object is too large for a shard's ring
+    bool put(const CacheKey& key, const CacheEntry& entry);
+    void refresh(const CacheKey& key, const std::string& varyKey, time_t expiration);
+    void remove(const CacheKey& key);
+    void clear();
+    size_t size();
+};
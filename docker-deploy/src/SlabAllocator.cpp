@@ -0,0 +1,197 @@
+#include "SlabAllocator.h"
+#include <sys/mman.h>
+#include <algorithm>
+#include <new>
+
+std::string SlabStats::describe() const {
+    return "requested=" + std::to_string(requested) +
+           " chunks=" + std::to_string(chunkBytes) +
+           " resident=" + std::to_string(resident) +
+           " mapped=" + std::to_string(mapped) +
+           " pages=" + std::to_string(pagesInUse) + "/" + std::to_string(pageLimit) +
+           " failures=" + std::to_string(failures);
+}
+
+SlabAllocator::SlabAllocator(size_t limitBytes, bool hugePages) : carvedPages(0), hugePages(hugePages) {
+    for (size_t size = MIN_CHUNK; size < PAGE_BYTES; size = (size * 5 / 4 + 15) & ~(size_t)15) {
+        classSizes.push_back(size);
+    }
+    classSizes.push_back(PAGE_BYTES);
+    available.resize(classSizes.size());
+    setLimit(limitBytes);
+}
+
+SlabAllocator::~SlabAllocator() {
+    for (Arena& arena : arenas) {
+        munmap(arena.base, arena.pages * PAGE_BYTES);
+    }
+}
+
+int SlabAllocator::classOf(size_t bytes) const {
+    auto it = std::lower_bound(classSizes.begin(), classSizes.end(), bytes);
+    return it == classSizes.end() ? -1 : (int)(it - classSizes.begin());
+}
+
+size_t SlabAllocator::chunkBytes(size_t bytes) const {
+    int sizeClass = classOf(bytes);
+    return sizeClass < 0 ? bytes : classSizes[sizeClass];
+}
+
+void SlabAllocator::setLimit(size_t limitBytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pageLimit = std::max<size_t>((limitBytes + PAGE_BYTES - 1) / PAGE_BYTES, 1);
+    counters.pageLimit = pageLimit;
+}
+
+SlabStats SlabAllocator::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+SlabAllocator::Page* SlabAllocator::pageOf(void* pointer) {
+    char* address = static_cast<char*>(pointer);
+    for (Arena& arena : arenas) {
+        if (address >= arena.base && address < arena.base + arena.pages * PAGE_BYTES) {
+            return &arena.meta[(address - arena.base) / PAGE_BYTES];
+        }
+    }
+    return nullptr;
+}
+
+/*
+ @brief: A page for sizeClass: from the free pool, else carved from the last
+         arena, else from a newly mapped one. nullptr at the page limit.
+*/
+SlabAllocator::Page* SlabAllocator::takePage(int sizeClass) {
+    if (counters.pagesInUse >= pageLimit) {
+        // Rebalance: the empty page every class keeps goes to the one that needs it
+        for (auto& pages : available) {
+            for (size_t i = 0; i < pages.size();) {
+                if (pages[i]->used == 0) {
+                    releasePage(pages[i]);
+                    pages.erase(pages.begin() + i);
+                } else {
+                    i++;
+                }
+            }
+        }
+        if (counters.pagesInUse >= pageLimit) {
+            return nullptr;
+        }
+    }
+    Page* page;
+    if (!freePages.empty()) {
+        page = freePages.back();
+        freePages.pop_back();
+    } else {
+        if (arenas.empty() || carvedPages == arenas.back().pages) {
+            // Over-map by a page to start the arena on a huge page boundary
+            size_t pages = ARENA_PAGES;
+            size_t length = (pages + 1) * PAGE_BYTES;
+            void* mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (mapped == MAP_FAILED) {
+                return nullptr;
+            }
+            char* raw = static_cast<char*>(mapped);
+            char* base = (char*)(((uintptr_t)raw + PAGE_BYTES - 1) & ~(uintptr_t)(PAGE_BYTES - 1));
+            if (base > raw) {
+                munmap(raw, base - raw);
+            }
+            munmap(base + pages * PAGE_BYTES, raw + length - (base + pages * PAGE_BYTES));
+            if (hugePages) {
+                madvise(base, pages * PAGE_BYTES, MADV_HUGEPAGE);
+            }
+            Arena arena{base, pages, std::vector<Page>(pages)};
+            for (size_t i = 0; i < pages; i++) {
+                arena.meta[i].start = base + i * PAGE_BYTES;
+            }
+            arenas.push_back(std::move(arena));
+            carvedPages = 0;
+            counters.mapped += pages * PAGE_BYTES;
+        }
+        page = &arenas.back().meta[carvedPages++];
+    }
+    page->sizeClass = sizeClass;
+    page->used = 0;
+    page->carved = 0;
+    page->freeList = nullptr;
+    available[sizeClass].push_back(page);
+    counters.pagesInUse++;
+    counters.resident += PAGE_BYTES;
+    return page;
+}
+
+void SlabAllocator::releasePage(Page* page) {
+    madvise(page->start, PAGE_BYTES, MADV_DONTNEED);
+    page->sizeClass = -1;
+    freePages.push_back(page);
+    counters.pagesInUse--;
+    counters.resident -= PAGE_BYTES;
+}
+
+void* SlabAllocator::do_allocate(size_t bytes, size_t alignment) {
+    int sizeClass = classOf(bytes);
+    if (sizeClass < 0 || alignment > 16) {
+        void* pointer = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.requested += bytes;
+        counters.chunkBytes += bytes;
+        counters.resident += bytes;
+        return pointer;
+    }
+    size_t size = classSizes[sizeClass];
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<Page*>& pages = available[sizeClass];
+    Page* page = pages.empty() ? takePage(sizeClass) : pages.back();
+    if (!page) {
+        counters.failures++;
+        throw std::bad_alloc();
+    }
+    void* chunk;
+    if (page->freeList) {
+        chunk = page->freeList;
+        page->freeList = *static_cast<void**>(chunk);
+    } else {
+        chunk = page->start + page->carved * size;
+        page->carved++;
+    }
+    if (++page->used == PAGE_BYTES / size) {
+        pages.pop_back();
+    }
+    counters.requested += bytes;
+    counters.chunkBytes += size;
+    return chunk;
+}
+
+void SlabAllocator::do_deallocate(void* pointer, size_t bytes, size_t alignment) {
+    int sizeClass = classOf(bytes);
+    if (sizeClass < 0 || alignment > 16) {
+        std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.requested -= bytes;
+        counters.chunkBytes -= bytes;
+        counters.resident -= bytes;
+        return;
+    }
+    size_t size = classSizes[sizeClass];
+    std::lock_guard<std::mutex> lock(mutex);
+    Page* page = pageOf(pointer);
+    counters.requested -= bytes;
+    counters.chunkBytes -= size;
+    std::vector<Page*>& pages = available[sizeClass];
+    if (page->used == PAGE_BYTES / size) {
+        // Was full: it has room again, behind the page being filled
+        pages.insert(pages.begin(), page);
+    }
+    *static_cast<void**>(pointer) = page->freeList;
+    page->freeList = pointer;
+    // The class keeps one page, so one object coming and going does not map and unmap
+    if (--page->used == 0 && pages.size() > 1) {
+        pages.erase(std::find(pages.begin(), pages.end(), page));
+        releasePage(page);
+    }
+}
+
+bool SlabAllocator::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
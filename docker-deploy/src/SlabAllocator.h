@@ -0,0 +1,85 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct SlabStats {
+    size_t requested = 0;   // bytes asked for by live allocations
+    size_t chunkBytes = 0;  // bytes of the chunks holding them
+    size_t resident = 0;    // pages handed to size classes, plus heap allocations
+    size_t mapped = 0;      // arena address space
+    size_t pagesInUse = 0;
+    size_t pageLimit = 0;
+    uint64_t failures = 0;  // allocations refused at the page limit
+
+    // "requested=52428800 chunks=... resident=... mapped=... pages=30/36 failures=12" for the log
+    std::string describe() const;
+};
+
+/*
+ @brief: memory_resource for cached bodies. Memory is taken in pages from
+         large anonymous arenas (backed by transparent huge pages if asked)
+         and every page is cut into chunks of one size class, 1.25x apart.
+         A freed chunk is reused by the next object of its class, so churn
+         does not fragment the heap. A page whose chunks are all free goes
+         back to the kernel and to a pool any class can take it from. Past
+         the page limit an allocation throws std::bad_alloc and the caller
+         makes room, emptying whole pages so they can change class.
+         Allocations larger than a page go to the heap.
+*/
+class SlabAllocator : public std::pmr::memory_resource {
+public:
+    static constexpr size_t PAGE_BYTES = 2 * 1024 * 1024;  // one huge page
+    static constexpr size_t ARENA_PAGES = 32;              // mapped at a time
+    static constexpr size_t MIN_CHUNK = 64;
+
+private:
+    struct Page {
+        char* start = nullptr;
+        void* freeList = nullptr;  // freed chunks, linked through their first bytes
+        uint32_t used = 0;
+        uint32_t carved = 0;       // chunks handed out at least once; the rest was never touched
+        int sizeClass = -1;
+    };
+    struct Arena {
+        char* base;
+        size_t pages;
+        std::vector<Page> meta;
+    };
+    std::mutex mutex;
+    std::vector<size_t> classSizes;
+    std::vector<std::vector<Page*>> available;  // per class: pages with a free chunk, the one in use last
+    std::vector<Page*> freePages;
+    std::vector<Arena> arenas;
+    size_t carvedPages;  // pages of the last arena handed out so far
+    size_t pageLimit;
+    bool hugePages;
+    SlabStats counters;
+
+    Page* pageOf(void* pointer);
+    Page* takePage(int sizeClass);
+    void releasePage(Page* page);
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* pointer, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+public:
+    SlabAllocator(size_t limitBytes, bool hugePages);
+    ~SlabAllocator();
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+    // The class an allocation of bytes is served from, -1 above a page
+    int classOf(size_t bytes) const;
+    // Bytes an allocation really occupies
+    size_t chunkBytes(size_t bytes) const;
+    size_t classCount() const { return classSizes.size(); }
+    // Pages in use may stay above a lowered limit until they are freed
+    void setLimit(size_t limitBytes);
+    SlabStats stats();
+};
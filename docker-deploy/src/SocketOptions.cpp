@@ -0,0 +1,64 @@
+#include "SocketOptions.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+// Options are best effort: a kernel without one of them still serves traffic
+static void setOption(int fd, int level, int name, int value) {
+    setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+static void setBuffers(int fd, const SocketOptions& options) {
+    if (options.receiveBuffer > 0) {
+        setOption(fd, SOL_SOCKET, SO_RCVBUF, options.receiveBuffer);
+    }
+    if (options.sendBuffer > 0) {
+        setOption(fd, SOL_SOCKET, SO_SNDBUF, options.sendBuffer);
+    }
+}
+
+/*
+ @brief: Buffer sizes set here are inherited by the accepted sockets
+*/
+void tuneListener(int fd, const SocketOptions& options) {
+    if (options.reuseAddress) {
+        setOption(fd, SOL_SOCKET, SO_REUSEADDR, 1);
+    }
+    if (options.fastOpen) {
+        setOption(fd, IPPROTO_TCP, TCP_FASTOPEN, options.fastOpenQueue);
+    }
+    if (options.deferAccept > 0) {
+        setOption(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, options.deferAccept);
+    }
+    setBuffers(fd, options);
+}
+
+void tuneAccepted(int fd, const SocketOptions& options) {
+    if (options.noDelay) {
+        setOption(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    }
+}
+
+/*
+ @brief: Upstream sockets may be pooled, so they also get keepalive probes
+*/
+void tuneUpstream(int fd, const SocketOptions& options) {
+    if (options.noDelay) {
+        setOption(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    }
+    if (options.fastOpen) {
+        // connect() returns at once and the request rides on the SYN
+        setOption(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+    }
+    if (options.keepAlive) {
+        setOption(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+        setOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, options.keepAliveIdle);
+        setOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, options.keepAliveInterval);
+        setOption(fd, IPPROTO_TCP, TCP_KEEPCNT, options.keepAliveCount);
+    }
+    setBuffers(fd, options);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+/*
+ @brief: TCP tuning for the listener, accepted client sockets and upstream
+         connections. Every knob can be switched off to A/B it.
+*/
+struct SocketOptions {
+    bool reuseAddress = true;     // rebind while old connections sit in TIME_WAIT
+    bool noDelay = true;          // writes are already coalesced, don't wait for ACKs
+    bool fastOpen = false;        // TCP_FASTOPEN on the listener, TCP_FASTOPEN_CONNECT upstream
+    int fastOpenQueue = 256;      // pending TFO requests the listener accepts
+    int deferAccept = 0;          // seconds; wake accept() only once data arrived, 0 = off
+    int receiveBuffer = 0;        // SO_RCVBUF bytes, 0 = kernel default (autotuning)
+    int sendBuffer = 0;           // SO_SNDBUF bytes, 0 = kernel default
+    bool keepAlive = true;        // probe pooled upstream connections
+    int keepAliveIdle = 60;       // seconds before the first probe
+    int keepAliveInterval = 10;   // seconds between probes
+    int keepAliveCount = 5;       // failed probes before the connection is dropped
+};
+
+// Before bind()/listen()
+void tuneListener(int fd, const SocketOptions& options);
+// Right after accept()
+void tuneAccepted(int fd, const SocketOptions& options);
+// Before connect()
+void tuneUpstream(int fd, const SocketOptions& options);
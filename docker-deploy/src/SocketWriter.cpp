@@ -0,0 +1,195 @@
+#include "SocketWriter.h"
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+SocketWriter::SocketWriter(int fd)
+    : fd(fd), count(0), scratchUsed(0), isSocket(true), corked(false), ok(true), waits(true), isBlocked(false) {}
+
+SocketWriter::~SocketWriter() {
+    uncork();
+}
+
+IoStats& SocketWriter::stats() {
+    static IoStats counters;
+    return counters;
+}
+
+bool SocketWriter::waitWritable() {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    int ready;
+    do {
+        ready = poll(&pfd, 1, WRITE_TIMEOUT_MS);
+    } while (ready < 0 && errno == EINTR);
+    return ready > 0;
+}
+
+bool SocketWriter::add(const void* data, size_t length) {
+    if (!ok || length == 0) {
+        return ok;
+    }
+    if (count == MAX_SEGMENTS && !flush(true)) {
+        return false;
+    }
+    segments[count].iov_base = const_cast<void*>(data);
+    segments[count].iov_len = length;
+    ++count;
+    return true;
+}
+
+bool SocketWriter::addCopy(const char* data, size_t length) {
+    if (length > SCRATCH_SIZE) {
+        return false;
+    }
+    if ((scratchUsed + length > SCRATCH_SIZE || count == MAX_SEGMENTS) && !flush(true)) {
+        return false;
+    }
+    char* copy = scratch + scratchUsed;
+    memcpy(copy, data, length);
+    scratchUsed += length;
+    return add(copy, length);
+}
+
+/*
+ @brief: Write everything queued. sendmsg() takes the MSG_MORE flag, plain
+         files (no socket) fall back to writev()
+*/
+bool SocketWriter::flush(bool more) {
+    int first = 0;
+    isBlocked = false;
+    while (ok && first < count) {
+        ssize_t n;
+        if (isSocket) {
+            struct msghdr msg = {};
+            msg.msg_iov = segments + first;
+            msg.msg_iovlen = count - first;
+            n = sendmsg(fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0) | (waits ? 0 : MSG_DONTWAIT));
+            if (n < 0 && errno == ENOTSOCK) {
+                isSocket = false;
+                continue;
+            }
+        } else {
+            n = writev(fd, segments + first, count - first);
+        }
+        stats().writeCalls++;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && !waits) {
+                // Keep the rest, moved to the front, for the next flush()
+                count -= first;
+                memmove(segments, segments + first, count * sizeof(struct iovec));
+                isBlocked = true;
+                return false;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && waitWritable()) {
+                continue;
+            }
+            ok = false;
+            break;
+        }
+        stats().bytes += n;
+        // Skip what was written; a partially written segment is trimmed
+        while (n > 0) {
+            if ((size_t)n >= segments[first].iov_len) {
+                n -= segments[first].iov_len;
+                ++first;
+            } else {
+                segments[first].iov_base = static_cast<char*>(segments[first].iov_base) + n;
+                segments[first].iov_len -= n;
+                n = 0;
+            }
+        }
+    }
+    count = 0;
+    scratchUsed = 0;
+    if (!more) {
+        uncork();
+    }
+    return ok;
+}
+
+bool SocketWriter::pending(struct msghdr& message) {
+    if (!ok || count == 0) {
+        return false;
+    }
+    message.msg_iov = segments;
+    message.msg_iovlen = count;
+    return true;
+}
+
+/*
+ @brief: Drop what the caller's send wrote from the queue, as flush() does;
+         the next pending() names the rest. flush() afterwards uncorks.
+*/
+bool SocketWriter::written(ssize_t result) {
+    if (result <= 0) {
+        ok = false;
+        return false;
+    }
+    stats().ringSends++;
+    stats().bytes += result;
+    size_t n = result;
+    int first = 0;
+    while (n > 0 && first < count) {
+        if (n >= segments[first].iov_len) {
+            n -= segments[first].iov_len;
+            ++first;
+        } else {
+            segments[first].iov_base = static_cast<char*>(segments[first].iov_base) + n;
+            segments[first].iov_len -= n;
+            n = 0;
+        }
+    }
+    count -= first;
+    memmove(segments, segments + first, count * sizeof(struct iovec));
+    return true;
+}
+
+bool SocketWriter::addFile(int fileFd, off_t offset, size_t length) {
+    if (!flush(true)) {
+        return false;
+    }
+    size_t remaining = length;
+    while (remaining > 0) {
+        ssize_t n = sendfile(fd, fileFd, &offset, remaining);
+        stats().sendfileCalls++;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && waitWritable()) {
+                continue;
+            }
+        }
+        if (n <= 0) {
+            ok = false;
+            return false;
+        }
+        stats().bytes += n;
+        remaining -= n;
+    }
+    return true;
+}
+
+void SocketWriter::cork() {
+    int on = 1;
+    // Fails harmlessly on anything but TCP sockets
+    corked = setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0;
+}
+
+void SocketWriter::uncork() {
+    if (corked) {
+        int off = 0;
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        corked = false;
+    }
+}
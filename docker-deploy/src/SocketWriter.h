@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+/*
+ @brief: System calls made by SocketWriter, read by the benchmarks
+*/
+struct IoStats {
+    std::atomic<uint64_t> writeCalls{0};    // sendmsg / writev
+    std::atomic<uint64_t> sendfileCalls{0};
+    std::atomic<uint64_t> ringSends{0};     // sendmsg submitted to an io_uring instead
+    std::atomic<uint64_t> bytes{0};
+};
+
+/*
+ @brief: Gathers the pieces of a response (header block, cached body slices,
+         chunk framing) and writes them with as few system calls as possible.
+         Queued data is borrowed: it has to stay alive until flush(). Partial
+         writes and EAGAIN on non-blocking sockets are handled here; with
+         setWait(false) flush() never blocks: it returns with blocked() set
+         and keeps the rest queued for the caller to wait and flush again
+         (asyncFlush).
+*/
+class SocketWriter {
+public:
+    static const int MAX_SEGMENTS = 32;
+    static const size_t SCRATCH_SIZE = 256;
+    // How long a full socket buffer may block a write
+    static const int WRITE_TIMEOUT_MS = 30000;
+
+private:
+    int fd;
+    struct iovec segments[MAX_SEGMENTS];
+    int count;
+    char scratch[SCRATCH_SIZE]; // copies of small framing pieces
+    size_t scratchUsed;
+    bool isSocket;
+    bool corked;
+    bool ok;
+    bool waits;      // poll() on EAGAIN, or hand back to the caller
+    bool isBlocked;
+
+    bool waitWritable();
+
+public:
+    explicit SocketWriter(int fd);
+    ~SocketWriter();
+    SocketWriter(const SocketWriter&) = delete;
+    SocketWriter& operator=(const SocketWriter&) = delete;
+
+    bool add(const void* data, size_t length);
+    // Copy a small piece (chunk size line) that does not outlive the caller
+    bool addCopy(const char* data, size_t length);
+    // Send file data with sendfile(); what is queued goes out first, flagged MSG_MORE
+    bool addFile(int fileFd, off_t offset, size_t length);
+    // more: further data follows soon, let the kernel hold back a partial packet
+    bool flush(bool more = false);
+    // TCP_CORK while several writes make up one response
+    void cork();
+    void uncork();
+    bool failed() const { return !ok; }
+    // Only for add() and flush(): addFile() always waits
+    void setWait(bool wait) { waits = wait; }
+    // The last flush() stopped on a full socket buffer with data left
+    bool blocked() const { return isBlocked; }
+    // For a caller that sends the queue itself (an io_uring sendmsg): points
+    // message at what flush() would write next; false when nothing is queued
+    bool pending(struct msghdr& message);
+    // The result of that send: bytes written, or -1 with errno set
+    bool written(ssize_t result);
+    int descriptor() const { return fd; }
+
+    static IoStats& stats();
+};
@@ -0,0 +1,179 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+#include <cstddef>
+#include <new>
+#include <iostream>
+#include "BufferPool.h"
+
+template <typename T> class Task;
+
+namespace detail {
+
+/*
+ @brief: What every Task promise shares: the coroutine waiting for it, the
+         exception it ended with, and frames taken from the BufferPool so a
+         request's coroutines cost no heap allocations once the pool is warm
+*/
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+    bool detached = false;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            TaskPromiseBase& promise = handle.promise();
+            if (promise.continuation) {
+                return promise.continuation;
+            }
+            if (promise.detached) {
+                // Nobody awaits a detached task: report its exception
+                // before the frame, and the exception with it, goes away
+                if (promise.error) {
+                    reportDetachedError(promise.error);
+                }
+                handle.destroy();
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    static void reportDetachedError(const std::exception_ptr& error) noexcept {
+        try {
+            std::rethrow_exception(error);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: detached task failed: " << e.what() << std::endl;
+        } catch (...) {
+            std::cerr << "Error: detached task failed with a non-standard exception" << std::endl;
+        }
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+
+    static void* operator new(size_t size) {
+        // The capacity goes in front of the frame for the delete
+        size_t capacity;
+        char* block = BufferPool::acquire(size + alignof(std::max_align_t), capacity);
+        if (!block) {
+            throw std::bad_alloc();
+        }
+        *reinterpret_cast<size_t*>(block) = capacity;
+        return block + alignof(std::max_align_t);
+    }
+    static void operator delete(void* frame) {
+        char* block = static_cast<char*>(frame) - alignof(std::max_align_t);
+        BufferPool::release(block, *reinterpret_cast<size_t*>(block));
+    }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    T value{};
+
+    Task<T> get_return_object();
+    void return_value(T result) { value = std::move(result); }
+    T take() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(value);
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void take() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+}
+
+/*
+ @brief: A lazily started coroutine returning T. co_await runs it and resumes
+         the caller when it is done (symmetric transfer, no recursion through
+         the event loop). Exceptions travel to the awaiting coroutine.
+*/
+template <typename T = void>
+class Task {
+public:
+    typedef detail::TaskPromise<T> promise_type;
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+public:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+                handle.promise().continuation = caller;
+                return handle;
+            }
+            T await_resume() { return handle.promise().take(); }
+        };
+        return Awaiter{handle};
+    }
+
+    /*
+     @brief: Run on the calling thread. Only for coroutines that never
+             suspend, which is what the awaitables do off an event loop.
+    */
+    T runHere() {
+        handle.resume();
+        if (!handle.done()) {
+            throw std::logic_error("Task suspended outside an event loop");
+        }
+        return handle.promise().take();
+    }
+
+    /*
+     @brief: Hand the frame over to itself: it is destroyed when it finishes.
+             The caller resumes the returned handle (once) to start it.
+    */
+    std::coroutine_handle<> detach() {
+        handle.promise().detached = true;
+        return std::exchange(handle, nullptr);
+    }
+};
+
+namespace detail {
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+}
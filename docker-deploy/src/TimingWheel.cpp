@@ -0,0 +1,143 @@
+#include "TimingWheel.h"
+
+static const char* const TIMEOUT_NAMES[TIMEOUT_KINDS] = {
+    "header_read", "body_idle", "connect", "first_byte", "tunnel_idle"
+};
+
+std::string TimeoutStats::describe() const {
+    std::string text;
+    for (int kind = 0; kind < TIMEOUT_KINDS; kind++) {
+        if (kind > 0) {
+            text += ' ';
+        }
+        text += TIMEOUT_NAMES[kind];
+        text += '=';
+        text += std::to_string(expired[kind].load());
+    }
+    return text;
+}
+
+TimeoutStats& TimingWheel::stats() {
+    static TimeoutStats timeouts;
+    return timeouts;
+}
+
+TimingWheel::TimingWheel() : start(Clock::now()), current(0), count(0) {
+    for (auto& level : slots) {
+        for (TimerNode& head : level) {
+            head.prev = &head;
+            head.next = &head;
+        }
+    }
+}
+
+uint64_t TimingWheel::tickAt(Clock::time_point when) const {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(when - start).count() / TICK_MS;
+}
+
+/*
+ @brief: Link a node into the finest level whose range covers it. A timer
+         in level L shares a slot with everything in the same 64^L tick
+         block, and is re-placed when the level below wraps into that block.
+*/
+void TimingWheel::place(TimerNode* node) {
+    uint64_t delta = node->expires > current ? node->expires - current : 0;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    TimerNode& head = slots[level][(node->expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+    node->prev = head.prev;
+    node->next = &head;
+    head.prev->next = node;
+    head.prev = node;
+}
+
+/*
+ @brief: Due from the clock, not from current: the loop may have slept in
+         epoll_wait() since the wheel last advanced. Rounded up to the next
+         tick, so a timer never fires early.
+*/
+void TimingWheel::arm(TimerNode* node, int timeout) {
+    if (node->armed()) {
+        cancel(node);
+    }
+    uint64_t due = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count() +
+                   uint64_t(timeout > 0 ? timeout : 0) * 1000;
+    uint64_t expires = (due + TICK_MS * 1000 - 1) / (TICK_MS * 1000);
+    uint64_t range = (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+    expires = expires > current ? expires : current + 1;
+    node->expires = expires - current < range ? expires : current + range;
+    place(node);
+    count++;
+}
+
+void TimingWheel::cancel(TimerNode* node) {
+    if (!node->armed()) {
+        return;
+    }
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = nullptr;
+    node->next = nullptr;
+    count--;
+}
+
+void TimingWheel::step(std::vector<TimerNode*>& expired) {
+    current++;
+    // Each time a level wraps, the next level's slot for the new block is due:
+    // spread its timers over the finer levels
+    for (int level = 1; level < LEVELS; level++) {
+        if ((current & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) != 0) {
+            break;
+        }
+        TimerNode& head = slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        TimerNode* node = head.next;
+        head.prev = &head;
+        head.next = &head;
+        while (node != &head) {
+            TimerNode* next = node->next;
+            place(node);
+            node = next;
+        }
+    }
+    TimerNode& head = slots[0][current & (SLOTS - 1)];
+    while (head.next != &head) {
+        TimerNode* node = head.next;
+        cancel(node);
+        expired.push_back(node);
+    }
+}
+
+void TimingWheel::advance(Clock::time_point now, std::vector<TimerNode*>& expired) {
+    uint64_t target = tickAt(now);
+    if (count == 0) {
+        // Nothing to cascade: jump instead of stepping through idle time
+        current = target > current ? target : current;
+        return;
+    }
+    while (current < target) {
+        step(expired);
+    }
+}
+
+int TimingWheel::nextTimeout(Clock::time_point now) const {
+    if (count == 0) {
+        return -1;
+    }
+    // The nearest busy level-0 slot, or the next wrap, where a cascade may
+    // bring timers down
+    uint64_t ticks = SLOTS - (current & (SLOTS - 1));
+    for (uint64_t distance = 1; distance < ticks; distance++) {
+        const TimerNode& head = slots[0][(current + distance) & (SLOTS - 1)];
+        if (head.next != &head) {
+            ticks = distance;
+            break;
+        }
+    }
+    auto due = start + std::chrono::milliseconds((current + ticks) * TICK_MS);
+    if (due <= now) {
+        return 0;
+    }
+    return (int)std::chrono::ceil<std::chrono::milliseconds>(due - now).count();
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ @brief: The timeouts of a request, each counted when it fires
+*/
+enum TimeoutKind {
+    TIMEOUT_HEADER_READ,  // client sent no request in header_timeout
+    TIMEOUT_BODY_IDLE,    // a body transfer stalled for idle_timeout
+    TIMEOUT_CONNECT,      // upstream connect() took connect_timeout
+    TIMEOUT_FIRST_BYTE,   // upstream sent nothing for first_byte_timeout
+    TIMEOUT_TUNNEL_IDLE,  // CONNECT tunnel quiet for tunnel_timeout
+    TIMEOUT_KINDS
+};
+
+struct TimeoutStats {
+    std::atomic<uint64_t> expired[TIMEOUT_KINDS] = {};
+
+    void count(TimeoutKind kind) { expired[kind]++; }
+    // "header_read=0 body_idle=2 ..." for the log
+    std::string describe() const;
+};
+
+/*
+ @brief: A timer linked into a TimingWheel. Embedded in whatever waits, so
+         arming allocates nothing.
+*/
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expires = 0; // in ticks
+
+    bool armed() const { return next != nullptr; }
+};
+
+/*
+ @brief: Hierarchical timing wheel (4 levels of 64 slots, 10 ms ticks, about
+         46 hours of range). arm() and cancel() are O(1) list operations;
+         timers far out sit in a coarse slot and move down a level each time
+         the finer level wraps. Used by one thread, the event loop.
+*/
+class TimingWheel {
+public:
+    typedef std::chrono::steady_clock Clock;
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int TICK_MS = 10;
+
+private:
+    TimerNode slots[LEVELS][SLOTS]; // list heads, circular
+    Clock::time_point start;
+    uint64_t current;               // last tick processed
+    size_t count;
+
+    void place(TimerNode* node);
+    void step(std::vector<TimerNode*>& expired);
+    uint64_t tickAt(Clock::time_point when) const;
+
+public:
+    TimingWheel();
+    TimingWheel(const TimingWheel&) = delete;
+    TimingWheel& operator=(const TimingWheel&) = delete;
+
+    // Fire timeout milliseconds from now, at the end of that tick
+    void arm(TimerNode* node, int timeout);
+    void cancel(TimerNode* node);
+    // Unlink every timer due by now into expired
+    void advance(Clock::time_point now, std::vector<TimerNode*>& expired);
+    // Milliseconds until the wheel needs advancing, -1 when it is empty
+    int nextTimeout(Clock::time_point now) const;
+    size_t size() const { return count; }
+
+    static TimeoutStats& stats();
+};
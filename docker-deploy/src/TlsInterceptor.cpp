@@ -0,0 +1,401 @@
+#include "TlsInterceptor.h"
+#include <arpa/inet.h>
+#include <strings.h>
+#include <cctype>
+
+/*
+ @brief: Intercept host if it or a parent domain is listed. Only plain host
+         names and addresses qualify: the name ends up in a certificate.
+*/
+bool shouldIntercept(const TlsOptions& options, const std::string& host) {
+    if (!options.intercept || host.empty()) {
+        return false;
+    }
+    for (char c : host) {
+        if (!isalnum((unsigned char)c) && c != '.' && c != '-' && c != ':') {
+            return false;
+        }
+    }
+    for (const std::string& domain : options.domains) {
+        if (domain == "*" || strcasecmp(host.c_str(), domain.c_str()) == 0) {
+            return true;
+        }
+        if (host.size() > domain.size() && host[host.size() - domain.size() - 1] == '.' &&
+            strcasecmp(host.c_str() + host.size() - domain.size(), domain.c_str()) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef WEBPROXY_TLS
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/x509v3.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+#include "BufferPool.h"
+#include "EventLoop.h"
+
+// Issued certificates kept before the cache starts over
+static const size_t MAX_CERTIFICATES = 1024;
+static const long CERTIFICATE_DAYS = 30;
+
+// ex_data slot of the client SSLs: the "host:port" their session is filed under
+static int sessionKeyIndex() {
+    static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr,
+        [](void*, void* key, CRYPTO_EX_DATA*, int, long, void*) { delete static_cast<std::string*>(key); });
+    return index;
+}
+
+static bool isAddress(const std::string& host) {
+    unsigned char address[16];
+    return inet_pton(AF_INET, host.c_str(), address) == 1 || inet_pton(AF_INET6, host.c_str(), address) == 1;
+}
+
+TlsStats& TlsInterceptor::stats() {
+    static TlsStats tls;
+    return tls;
+}
+
+TlsInterceptor::TlsInterceptor(const TlsOptions& options)
+    : serverContext(nullptr), clientContext(nullptr), caCert(nullptr), caKey(nullptr), leafKey(nullptr),
+      verifyUpstream(options.verifyUpstream) {
+    FILE* file = fopen(options.caCert.c_str(), "r");
+    if (file) {
+        caCert = PEM_read_X509(file, nullptr, nullptr, nullptr);
+        fclose(file);
+    }
+    file = fopen(options.caKey.c_str(), "r");
+    if (file) {
+        caKey = PEM_read_PrivateKey(file, nullptr, nullptr, nullptr);
+        fclose(file);
+    }
+    if (!caCert || !caKey || X509_check_private_key(caCert, caKey) != 1) {
+        X509_free(caCert);
+        EVP_PKEY_free(caKey);
+        throw std::runtime_error("Cannot load the interception CA from " + options.caCert + " and " + options.caKey);
+    }
+    leafKey = EVP_EC_gen("P-256");
+
+    serverContext = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_set_min_proto_version(serverContext, TLS1_2_VERSION);
+    SSL_CTX_set_mode(serverContext, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    clientContext = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(clientContext, TLS1_2_VERSION);
+    SSL_CTX_set_mode(clientContext, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (verifyUpstream) {
+        SSL_CTX_set_verify(clientContext, SSL_VERIFY_PEER, nullptr);
+        if (options.upstreamCa.empty()) {
+            SSL_CTX_set_default_verify_paths(clientContext);
+        } else if (SSL_CTX_load_verify_locations(clientContext, options.upstreamCa.c_str(), nullptr) != 1) {
+            throw std::runtime_error("Cannot load tls.upstream_ca " + options.upstreamCa);
+        }
+    }
+    // Sessions (TLS 1.3 tickets arrive after the handshake) are filed per origin
+    SSL_CTX_set_session_cache_mode(clientContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(clientContext, &TlsInterceptor::storeSession);
+    SSL_CTX_set_app_data(clientContext, this);
+}
+
+TlsInterceptor::~TlsInterceptor() {
+    for (auto& entry : certificates) {
+        X509_free(entry.second);
+    }
+    for (auto& entry : sessions) {
+        SSL_SESSION_free(entry.second);
+    }
+    SSL_CTX_free(serverContext);
+    SSL_CTX_free(clientContext);
+    EVP_PKEY_free(leafKey);
+    EVP_PKEY_free(caKey);
+    X509_free(caCert);
+}
+
+/*
+ @brief: A certificate for host, signed by the CA. The caller holds the lock.
+*/
+X509* TlsInterceptor::issue(const std::string& host) {
+    X509* cert = X509_new();
+    X509_set_version(cert, 2);
+    unsigned char serial[16];
+    RAND_bytes(serial, sizeof(serial));
+    serial[0] &= 0x7f;
+    BIGNUM* number = BN_bin2bn(serial, sizeof(serial), nullptr);
+    BN_to_ASN1_INTEGER(number, X509_get_serialNumber(cert));
+    BN_free(number);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), CERTIFICATE_DAYS * 24 * 3600);
+    X509_set_pubkey(cert, leafKey);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char*>(host.c_str()), -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(caCert));
+
+    X509V3_CTX context;
+    X509V3_set_ctx_nodb(&context);
+    X509V3_set_ctx(&context, caCert, cert, nullptr, nullptr, 0);
+    std::string altName = (isAddress(host) ? "IP:" : "DNS:") + host;
+    const std::pair<int, const char*> extensions[] = {
+        {NID_basic_constraints, "critical,CA:FALSE"},
+        {NID_ext_key_usage, "serverAuth"},
+        {NID_subject_alt_name, altName.c_str()},
+    };
+    for (const auto& extension : extensions) {
+        X509_EXTENSION* made = X509V3_EXT_conf_nid(nullptr, &context, extension.first, extension.second);
+        if (made) {
+            X509_add_ext(cert, made, -1);
+            X509_EXTENSION_free(made);
+        }
+    }
+    if (X509_sign(cert, caKey, EVP_sha256()) == 0) {
+        X509_free(cert);
+        return nullptr;
+    }
+    stats().certificatesIssued++;
+    return cert;
+}
+
+SSL* TlsInterceptor::acceptClient(const std::string& host) {
+    std::string name = host;
+    for (char& c : name) {
+        c = (char)tolower((unsigned char)c);
+    }
+    SSL* ssl = SSL_new(serverContext);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = certificates.find(name);
+    if (it == certificates.end()) {
+        if (certificates.size() >= MAX_CERTIFICATES) {
+            for (auto& entry : certificates) {
+                X509_free(entry.second);
+            }
+            certificates.clear();
+        }
+        X509* cert = issue(name);
+        if (!cert) {
+            SSL_free(ssl);
+            return nullptr;
+        }
+        it = certificates.emplace(name, cert).first;
+    }
+    // Both are reference counted: the cache may drop the certificate meanwhile
+    SSL_use_certificate(ssl, it->second);
+    SSL_use_PrivateKey(ssl, leafKey);
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+SSL* TlsInterceptor::connectUpstream(const std::string& host, const std::string& port) {
+    SSL* ssl = SSL_new(clientContext);
+    if (isAddress(host)) {
+        if (verifyUpstream) {
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host.c_str());
+        }
+    } else {
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+        if (verifyUpstream) {
+            SSL_set1_host(ssl, host.c_str());
+        }
+    }
+    std::string* key = new std::string(host + ":" + port);
+    SSL_set_ex_data(ssl, sessionKeyIndex(), key);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = sessions.find(*key);
+        if (it != sessions.end()) {
+            SSL_set_session(ssl, it->second);
+        }
+    }
+    SSL_set_connect_state(ssl);
+    return ssl;
+}
+
+/*
+ @brief: new-session callback: keep the newest session of each origin
+*/
+int TlsInterceptor::storeSession(SSL* ssl, SSL_SESSION* session) {
+    TlsInterceptor* self = static_cast<TlsInterceptor*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    std::string* key = static_cast<std::string*>(SSL_get_ex_data(ssl, sessionKeyIndex()));
+    if (!self || !key) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(self->mutex);
+    SSL_SESSION*& stored = self->sessions[*key];
+    if (stored) {
+        SSL_SESSION_free(stored);
+    }
+    // Returning 1 keeps the reference OpenSSL passed in
+    stored = session;
+    return 1;
+}
+
+Task<bool> asyncHandshake(SSL* ssl, int fd, int timeout) {
+    while (true) {
+        // The error queue is per thread and an event loop interleaves connections
+        ERR_clear_error();
+        int result = SSL_do_handshake(ssl);
+        if (result == 1) {
+            co_return true;
+        }
+        int error = SSL_get_error(ssl, result);
+        short events = error == SSL_ERROR_WANT_READ ? POLLIN : error == SSL_ERROR_WANT_WRITE ? POLLOUT : 0;
+        if (events == 0) {
+            co_return false;
+        }
+        int ready = co_await asyncPoll(fd, events, timeout);
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            co_return false;
+        }
+    }
+}
+
+/*
+ @brief: One side's pending bytes: filled by a read, drained by writes
+*/
+struct RelayBuffer {
+    PooledBuffer pooled;
+    size_t length = 0;
+    size_t offset = 0;
+
+    explicit RelayBuffer(size_t size) : pooled(size) {}
+    bool empty() const { return offset == length; }
+    void clear() { length = offset = 0; }
+};
+
+Task<bool> tlsRelay(SSL* ssl, int tlsFd, int plainFd, size_t bufferSize, int idleTimeout) {
+    RelayBuffer toPlain(bufferSize), toTls(bufferSize);
+    bool tlsReadable = true, plainReadable = true, tlsBroken = false;
+    while (tlsReadable || plainReadable || !toPlain.empty() || !toTls.empty()) {
+        short tlsEvents = 0, plainEvents = 0;
+        bool moved = false;
+
+        // TLS to plain
+        if (tlsReadable && toPlain.empty()) {
+            ERR_clear_error();
+            int n = SSL_read(ssl, toPlain.pooled.data(), (int)bufferSize);
+            if (n > 0) {
+                toPlain.length = n;
+                toPlain.offset = 0;
+                moved = true;
+            } else {
+                int error = SSL_get_error(ssl, n);
+                if (error == SSL_ERROR_WANT_READ) {
+                    tlsEvents |= POLLIN;
+                } else if (error == SSL_ERROR_WANT_WRITE) {
+                    tlsEvents |= POLLOUT;
+                } else {
+                    // close_notify, or the connection is gone
+                    tlsBroken = error != SSL_ERROR_ZERO_RETURN;
+                    tlsReadable = false;
+                    shutdown(plainFd, SHUT_WR);
+                    moved = true;
+                }
+            }
+        }
+        if (!toPlain.empty()) {
+            ssize_t n = send(plainFd, toPlain.pooled.data() + toPlain.offset, toPlain.length - toPlain.offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0) {
+                toPlain.offset += n;
+                moved = true;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                plainEvents |= POLLOUT;
+            } else {
+                // Nobody reads the plain side any more
+                toPlain.clear();
+                tlsReadable = false;
+                moved = true;
+            }
+        }
+
+        // Plain to TLS
+        if (plainReadable && toTls.empty()) {
+            ssize_t n = recv(plainFd, toTls.pooled.data(), bufferSize, MSG_DONTWAIT);
+            if (n > 0) {
+                toTls.length = n;
+                toTls.offset = 0;
+                moved = true;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                plainEvents |= POLLIN;
+            } else {
+                // The plain side is done with this connection: nothing the
+                // TLS peer still sends has a reader
+                plainReadable = false;
+                tlsReadable = false;
+                toPlain.clear();
+                if (!tlsBroken) {
+                    // Best effort close_notify; the socket is closed after us anyway
+                    ERR_clear_error();
+                    SSL_shutdown(ssl);
+                }
+                moved = true;
+            }
+        }
+        if (!toTls.empty()) {
+            if (tlsBroken) {
+                toTls.clear();
+                moved = true;
+            } else {
+                ERR_clear_error();
+                int n = SSL_write(ssl, toTls.pooled.data() + toTls.offset, (int)(toTls.length - toTls.offset));
+                if (n > 0) {
+                    toTls.offset += n;
+                    moved = true;
+                } else {
+                    int error = SSL_get_error(ssl, n);
+                    if (error == SSL_ERROR_WANT_READ) {
+                        tlsEvents |= POLLIN;
+                    } else if (error == SSL_ERROR_WANT_WRITE) {
+                        tlsEvents |= POLLOUT;
+                    } else {
+                        tlsBroken = true;
+                        tlsReadable = false;
+                        toTls.clear();
+                        shutdown(plainFd, SHUT_WR);
+                        moved = true;
+                    }
+                }
+            }
+        }
+        if (toPlain.empty()) {
+            toPlain.clear();
+        }
+        if (toTls.empty()) {
+            toTls.clear();
+        }
+        if (moved) {
+            continue;
+        }
+
+        // Only the sides with something to wait for: a closed socket would
+        // report POLLHUP over and over
+        struct pollfd fds[2];
+        int count = 0;
+        if (tlsEvents) {
+            fds[count].fd = tlsFd;
+            fds[count++].events = tlsEvents;
+        }
+        if (plainEvents) {
+            fds[count].fd = plainFd;
+            fds[count++].events = plainEvents;
+        }
+        if (count == 0) {
+            break;
+        }
+        int ready = co_await asyncPoll(fds, count, idleTimeout);
+        if (ready == 0) {
+            co_return false;
+        }
+        if (ready < 0) {
+            break;
+        }
+    }
+    co_return true;
+}
+#endif
@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <vector>
+
+/*
+ @brief: TLS interception of CONNECT tunnels. For allowlisted hosts the
+         proxy answers the client's handshake with a certificate its own CA
+         signs, and the requests inside go through the caching GET/POST path
+         to the origin over a second TLS connection.
+*/
+struct TlsOptions {
+    bool intercept = false;            // off: every CONNECT is an opaque tunnel
+    std::vector<std::string> domains;  // intercepted hosts: "example.com" also covers its subdomains
+    std::string caCert;                // PEM CA certificate the clients trust
+    std::string caKey;                 // its private key
+    bool verifyUpstream = true;        // check origin certificates and host names
+    std::string upstreamCa;            // PEM bundle for that check, empty = system store
+};
+
+// Whether a CONNECT to host is intercepted under options
+bool shouldIntercept(const TlsOptions& options, const std::string& host);
+
+#ifdef WEBPROXY_TLS
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <cstdint>
+#include <openssl/ssl.h>
+#include "Task.h"
+
+struct TlsStats {
+    std::atomic<uint64_t> clientHandshakes{0};   // intercepted client connections
+    std::atomic<uint64_t> upstreamHandshakes{0}; // TLS connections to origins
+    std::atomic<uint64_t> resumedSessions{0};    // of those, resumed from a cached session
+    std::atomic<uint64_t> certificatesIssued{0}; // leaf certificates signed
+};
+
+class TlsInterceptor {
+private:
+    SSL_CTX* serverContext;   // toward clients
+    SSL_CTX* clientContext;   // toward origins
+    X509* caCert;
+    EVP_PKEY* caKey;
+    EVP_PKEY* leafKey;        // one key for every issued certificate
+    bool verifyUpstream;
+    std::mutex mutex;
+    std::map<std::string, X509*> certificates;   // per host
+    std::map<std::string, SSL_SESSION*> sessions; // per origin host:port, for resumption
+
+    X509* issue(const std::string& host);
+    static int storeSession(SSL* ssl, SSL_SESSION* session);
+
+public:
+    // Throws runtime_error if the CA cannot be loaded
+    explicit TlsInterceptor(const TlsOptions& options);
+    ~TlsInterceptor();
+    TlsInterceptor(const TlsInterceptor&) = delete;
+    TlsInterceptor& operator=(const TlsInterceptor&) = delete;
+
+    // Server side SSL for a client that CONNECTed to host, or nullptr
+    SSL* acceptClient(const std::string& host);
+    // Client side SSL toward host:port, resuming the last session there
+    SSL* connectUpstream(const std::string& host, const std::string& port);
+
+    static TlsStats& stats();
+};
+
+/*
+ @brief: Coroutines over a non-blocking socket carrying ssl
+*/
+// Finish the handshake; false on failure or timeout (milliseconds)
+Task<bool> asyncHandshake(SSL* ssl, int fd, int timeout);
+// Move bytes between the TLS connection on tlsFd and the plain socket
+// plainFd until both directions ended, or nothing moved for idleTimeout.
+// Returns false on the timeout.
+Task<bool> tlsRelay(SSL* ssl, int tlsFd, int plainFd, size_t bufferSize, int idleTimeout);
+#endif
@@ -1,14 +1,26 @@
 #include "ProxyServer.h"
 #include <iostream>
+#include <cstring>
 
-int main() {
+int main(int argc, char* argv[]) {
     try {
-        // Create the server and listen at 8080
-        ProxyServer server(12345);
+        // Usage: ./main [--config FILE] [--set KEY=VALUE]... [--port PORT]
+        //               [--disk-cache DIR] [--snapshot FILE] [--gzip LEVEL] [--gzip-min-size BYTES]
+        //               [--eviction lru|tinylfu] [--no-nodelay] [--no-reuseaddr] [--no-keepalive]
+        //               [--fastopen] [--defer-accept SECONDS] [--rcvbuf BYTES] [--sndbuf BYTES]
+        // Flags override the file; see proxy.conf for the keys. SIGHUP re-reads both.
+        ConfigSource source;
+        std::string error;
+        if (!parseCommandLine(argc, argv, source, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return 1;
+        }
+        // Create the server and listen at the configured port (12345 by default)
+        ProxyServer server(source);
         server.start();
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
     return 0;
-} 
\ No newline at end of file
+}
@@ -2,5 +2,5 @@
 make clean
 make
 echo 'Start running proxy server'
-./main &
-while true ; do continue ; done
\ No newline at end of file
+# exec so that docker stop's SIGTERM reaches the proxy and the cache snapshot is saved
+exec ./main --config proxy.conf
@@ -0,0 +1,116 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "RequestHandler.h"
+#include "BufferPool.h"
+#include "SocketWriter.h"
+
+// Count heap allocations and write system calls per request on the cache-hit
+// path: a GET goes through the parser, the request arena, the cache lookup
+// and the response send, exactly as a client thread runs it. Every operator
+// new in the process is counted; a hit that allocates fails the bench.
+
+static std::atomic<uint64_t> heapAllocations(0);
+
+void* operator new(size_t size) {
+    heapAllocations++;
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+struct Drain {
+    int fds[2];
+    std::thread reader;
+
+    Drain() {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        reader = std::thread([this]() {
+            char buffer[65536];
+            while (recv(fds[1], buffer, sizeof(buffer), 0) > 0) {
+            }
+        });
+    }
+    ~Drain() {
+        shutdown(fds[0], SHUT_WR);
+        reader.join();
+        close(fds[0]);
+        close(fds[1]);
+    }
+};
+
+static double measure(const char* name, const std::string& request, RequestHandler& handler,
+                    MessageForwarder& forwarder, int rounds) {
+    Drain drain;
+    // Warm the pool, then measure the steady state
+    for (int i = 0; i < 100; ++i) {
+        handler.handleRequest(request, drain.fds[0], i, forwarder).runHere();
+    }
+    AllocationStats& pool = BufferPool::stats();
+    IoStats& io = SocketWriter::stats();
+    uint64_t heapBefore = heapAllocations;
+    uint64_t systemBefore = pool.systemAllocations;
+    uint64_t syscallsBefore = io.writeCalls + io.sendfileCalls;
+    for (int i = 0; i < rounds; ++i) {
+        handler.handleRequest(request, drain.fds[0], i, forwarder).runHere();
+    }
+    double heap = (double)(heapAllocations - heapBefore) / rounds;
+    double system = (double)(pool.systemAllocations - systemBefore) / rounds;
+    double syscalls = (double)(io.writeCalls + io.sendfileCalls - syscallsBefore) / rounds;
+    std::cout << name << "\t" << heap << "\t" << system << "\t" << syscalls << std::endl;
+    return heap;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? std::atoi(argv[1]) : 10000;
+
+    auto logger = std::make_shared<Logger>("/dev/null");
+    auto cache = std::make_shared<CacheManager>();
+    RequestHandler handler(cache, logger);
+    MessageForwarder forwarder(cache);
+
+    // A fresh object the hit path can serve
+    std::string request = "GET http://bench.local/index.html HTTP/1.1\r\n"
+                          "Host: bench.local\r\n"
+                          "User-Agent: alloc_bench\r\n"
+                          "Accept: */*\r\n\r\n";
+    std::string rangeRequest = "GET http://bench.local/index.html HTTP/1.1\r\n"
+                               "Host: bench.local\r\n"
+                               "Range: bytes=0-99,1000-1999,-100\r\n\r\n";
+    std::string headRequest = "HEAD http://bench.local/index.html HTTP/1.1\r\n"
+                              "Host: bench.local\r\n\r\n";
+    std::string body(4096, 'x');
+    auto entry = std::make_shared<CacheEntry>();
+    entry->response = std::make_shared<const CacheBody>(
+        "HTTP/1.1 200 OK\r\nContent-Length: 4096\r\nCache-Control: max-age=3600\r\n\r\n" + body);
+    entry->headerLength = entry->response->size() - body.size();
+    entry->expiration = time(nullptr) + 3600;
+    entry->mustRevalidate = false;
+    cache->put(makeCacheKey("bench.local", "80", "/index.html"), entry);
+
+    std::cout << "requests: " << rounds << std::endl;
+    std::cout << "path\theap_allocs\tpool_mallocs\tsyscalls" << std::endl;
+    double allocations = measure("hit", request, handler, forwarder, rounds);
+    allocations += measure("range_hit", rangeRequest, handler, forwarder, rounds);
+    allocations += measure("head_hit", headRequest, handler, forwarder, rounds);
+    if (allocations > 0) {
+        std::cout << "FAIL: the hit path allocates" << std::endl;
+        return 1;
+    }
+    return 0;
+}
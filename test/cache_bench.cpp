@@ -0,0 +1,79 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "CacheManager.h"
+#include "SocketWriter.h"
+
+// Measure the cost of serving cache hits from the memory tier vs the disk tier.
+// Hits are written to a socketpair that a background thread keeps draining.
+
+// Average microseconds per hit; syscalls receives the write calls per hit
+static double benchHits(CacheManager& cache, const CacheKey& key, int rounds, double& syscalls) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return -1;
+    }
+    std::atomic<bool> done(false);
+    std::thread drain([&]() {
+        char buffer[65536];
+        while (recv(fds[1], buffer, sizeof(buffer), 0) > 0) {
+        }
+        done = true;
+    });
+
+    IoStats& io = SocketWriter::stats();
+    uint64_t callsBefore = io.writeCalls + io.sendfileCalls;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        auto entry = cache.get(key, CacheManager::Headers());
+        if (!entry || !cache.send(fds[0], *entry)) {
+            std::cerr << "hit failed for " << key.key << std::endl;
+            break;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    syscalls = (double)(io.writeCalls + io.sendfileCalls - callsBefore) / rounds;
+    close(fds[0]);
+    drain.join();
+    close(fds[1]);
+    return std::chrono::duration<double, std::micro>(end - start).count() / rounds;
+}
+
+int main(int argc, char* argv[]) {
+    std::string dir = argc > 1 ? argv[1] : "/tmp/cache_bench";
+    int rounds = argc > 2 ? std::atoi(argv[2]) : 2000;
+
+    CacheOptions memoryOnly;
+    CacheManager memoryCache(memoryOnly);
+
+    // Everything goes to disk and never gets promoted back
+    CacheOptions diskOnly;
+    diskOnly.diskEnabled = true;
+    diskOnly.diskDirectory = dir;
+    diskOnly.maxMemoryObject = 0;
+    diskOnly.promoteAfterHits = (unsigned)-1;
+    CacheManager diskCache(diskOnly);
+
+    std::cout << "size\tmemory_us\tdisk_us\tmemory_syscalls\tdisk_syscalls" << std::endl;
+    for (size_t size : {4096, 65536, 1048576}) {
+        CacheKey key = makeCacheKey("bench/object" + std::to_string(size));
+        auto body = std::make_shared<const CacheBody>(size, 'x');
+        for (CacheManager* cache : {&memoryCache, &diskCache}) {
+            auto entry = std::make_shared<CacheEntry>();
+            entry->response = body;
+            entry->expiration = time(nullptr) + 3600;
+            entry->mustRevalidate = false;
+            cache->put(key, entry);
+        }
+        double memoryCalls, diskCalls;
+        double memoryUs = benchHits(memoryCache, key, rounds, memoryCalls);
+        double diskUs = benchHits(diskCache, key, rounds, diskCalls);
+        std::cout << size << "\t" << memoryUs << "\t" << diskUs << "\t" << memoryCalls << "\t" << diskCalls << std::endl;
+    }
+    return 0;
+}
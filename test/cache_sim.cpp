@@ -0,0 +1,140 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include "CacheManager.h"
+
+// Replay a key trace against the memory tier and report the hit ratio per
+// eviction policy and cache size, with bodies on the heap and in the slabs.
+//
+// Usage: ./cache_sim [TRACE|-] [CAPACITY_MB ...]
+// TRACE has one request per line: "key [size]" (size defaults to 4096).
+// Without a trace (or with "-") a synthetic one is generated: Zipf-distributed
+// requests over a hot set, interrupted by crawls of one-off URLs. On that
+// trace the slabs must not change which policy wins: the exit status is 1
+// when tinylfu does not beat lru with slabs on.
+
+struct Request {
+    CacheKey key;
+    size_t size;
+};
+
+static std::vector<Request> loadTrace(const std::string& path) {
+    std::vector<Request> trace;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::stringstream fields(line);
+        std::string key;
+        size_t size = 4096;
+        if (!(fields >> key)) {
+            continue;
+        }
+        fields >> size;
+        trace.push_back(Request{makeCacheKey(key), std::max<size_t>(size, 1)});
+    }
+    return trace;
+}
+
+static std::vector<Request> syntheticTrace() {
+    const size_t keys = 100000;
+    const size_t requests = 1000000;
+    const size_t crawlEvery = 50000;
+    const size_t crawlLength = 20000;
+
+    std::vector<double> cdf(keys);
+    double sum = 0;
+    for (size_t i = 0; i < keys; ++i) {
+        sum += 1.0 / std::pow(i + 1, 0.99);
+        cdf[i] = sum;
+    }
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> uniform(0, sum);
+
+    std::vector<Request> trace;
+    trace.reserve(requests);
+    size_t crawled = 0;
+    while (trace.size() < requests) {
+        if (trace.size() % crawlEvery == 0 && !trace.empty()) {
+            for (size_t i = 0; i < crawlLength && trace.size() < requests; ++i) {
+                trace.push_back(Request{makeCacheKey("crawl/" + std::to_string(crawled++)), 4096});
+            }
+        }
+        size_t rank = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+        trace.push_back(Request{makeCacheKey("hot/" + std::to_string(rank)), 4096});
+    }
+    return trace;
+}
+
+static double replay(const std::vector<Request>& trace, const std::string& policy, size_t capacity, bool slabs) {
+    CacheOptions options;
+    options.memoryBytes = capacity;
+    options.maxMemoryObject = capacity;
+    options.evictionPolicy = policy;
+    options.slabs = slabs;
+    CacheManager cache(options);
+
+    // Bodies are shared between entries of the same size
+    std::unordered_map<size_t, std::shared_ptr<const CacheBody>> bodies;
+    CacheManager::Headers headers;
+    size_t hits = 0;
+    for (const auto& request : trace) {
+        if (cache.get(request.key, headers)) {
+            ++hits;
+            continue;
+        }
+        auto& body = bodies[request.size];
+        if (!body) {
+            body = std::make_shared<const CacheBody>(request.size, 'x');
+        }
+        auto entry = std::make_shared<CacheEntry>();
+        entry->response = body;
+        entry->expiration = time(nullptr) + 3600;
+        entry->mustRevalidate = false;
+        cache.put(request.key, entry);
+    }
+    if (slabs) {
+        std::cerr << policy << " " << capacity / (1024 * 1024) << "MB: " << cache.describeMemory() << std::endl;
+    }
+    return trace.empty() ? 0 : (double)hits / trace.size();
+}
+
+int main(int argc, char* argv[]) {
+    std::string path = argc > 1 ? argv[1] : "-";
+    std::vector<size_t> capacities;
+    for (int i = 2; i < argc; ++i) {
+        capacities.push_back(std::strtoull(argv[i], nullptr, 10));
+    }
+    if (capacities.empty()) {
+        capacities = {4, 16, 64};
+    }
+
+    std::vector<Request> trace = path == "-" ? syntheticTrace() : loadTrace(path);
+    std::cout << "requests: " << trace.size() << std::endl;
+    std::cout << "policy\tcapacity_mb\tslabs\thit_ratio" << std::endl;
+    bool failed = false;
+    for (size_t capacity : capacities) {
+        double slabRatio[2];
+        for (bool slabs : {false, true}) {
+            for (int i = 0; i < 2; ++i) {
+                const char* policy = i == 0 ? "lru" : "tinylfu";
+                double ratio = replay(trace, policy, capacity * 1024 * 1024, slabs);
+                std::cout << policy << "\t" << capacity << "\t" << (slabs ? "on" : "off") << "\t" << ratio << std::endl;
+                if (slabs) {
+                    slabRatio[i] = ratio;
+                }
+            }
+        }
+        if (path == "-" && slabRatio[1] <= slabRatio[0]) {
+            std::cout << "FAIL: tinylfu does not beat lru with slabs at " << capacity << " MB" << std::endl;
+            failed = true;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,143 @@
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "MessageForwarder.h"
+#include "HttpParser.h"
+#include "BufferPool.h"
+
+// Check the request head MessageForwarder sends upstream: the client's header
+// order, no hop-by-hop fields nor those the client's Connection lists, and
+// origin-form targets for origins. Then count heap allocations per build once
+// the buffer pool is warm; a build that allocates fails the bench.
+
+static std::atomic<uint64_t> heapAllocations(0);
+
+void* operator new(size_t size) {
+    heapAllocations++;
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+struct Case {
+    const char* name;
+    const char* raw;
+    const char* peerSelf;  // set: the head for a peer proxy
+    const char* expected;
+};
+
+static const Case CASES[] = {
+    {"absolute_form",
+     "GET http://example.com:8080/a/b?x=1 HTTP/1.1\r\nHost: example.com:8080\r\nAccept: */*\r\n\r\n", nullptr,
+     "GET /a/b?x=1 HTTP/1.1\r\nHost: example.com:8080\r\nAccept: */*\r\nConnection: keep-alive\r\n\r\n"},
+    {"no_path",
+     "GET http://example.com HTTP/1.1\r\nHost: example.com\r\n\r\n", nullptr,
+     "GET / HTTP/1.1\r\nHost: example.com\r\nConnection: keep-alive\r\n\r\n"},
+    {"query_only",
+     "GET http://example.com?q=1 HTTP/1.1\r\nHost: example.com\r\n\r\n", nullptr,
+     "GET /?q=1 HTTP/1.1\r\nHost: example.com\r\nConnection: keep-alive\r\n\r\n"},
+    {"origin_form",
+     "GET /index.html HTTP/1.0\r\nHost: example.com\r\n\r\n", nullptr,
+     "GET /index.html HTTP/1.0\r\nHost: example.com\r\nConnection: keep-alive\r\n\r\n"},
+    {"hop_by_hop",
+     "GET http://example.com/ HTTP/1.1\r\nConnection: close\r\nHost: example.com\r\n"
+     "Proxy-Connection: keep-alive\r\nKeep-Alive: timeout=5\r\nTE: trailers\r\nTrailer: X-Sum\r\n"
+     "Upgrade: websocket\r\nProxy-Authorization: Basic Zm9vOmJhcg==\r\nUser-Agent: forward_bench\r\n"
+     "Accept: */*\r\n\r\n", nullptr,
+     "GET / HTTP/1.1\r\nHost: example.com\r\nUser-Agent: forward_bench\r\nAccept: */*\r\n"
+     "Connection: keep-alive\r\n\r\n"},
+    // Every token of every Connection header, in any case, with any spacing
+    {"connection_listed",
+     "GET http://example.com/x HTTP/1.1\r\nX-First: 1\r\nHost: example.com\r\n"
+     "Connection: close,x-secret , X-Token-3\t,X-Token-4, X-Token-5, X-Token-6, X-Token-7, X-Token-8, X-Token-9\r\n"
+     "X-Secret: s\r\nX-Token-3: 3\r\nX-Kept: k\r\nconnection: X-Late\r\nx-token-9: 9\r\nX-Late: l\r\n"
+     "Cookie: a=b\r\n\r\n", nullptr,
+     "GET /x HTTP/1.1\r\nX-First: 1\r\nHost: example.com\r\nX-Kept: k\r\nCookie: a=b\r\n"
+     "Connection: keep-alive\r\n\r\n"},
+    {"post_framing",
+     "POST http://example.com/form HTTP/1.1\r\nHost: example.com\r\nTransfer-Encoding: chunked\r\n"
+     "Content-Type: text/plain\r\n\r\n", nullptr,
+     "POST /form HTTP/1.1\r\nHost: example.com\r\nTransfer-Encoding: chunked\r\nContent-Type: text/plain\r\n"
+     "Connection: keep-alive\r\n\r\n"},
+    // A peer proxy gets the absolute form, the peer header and a connection it closes
+    {"peer",
+     "GET http://example.com/p HTTP/1.1\r\nHost: example.com\r\nConnection: X-Hop\r\nX-Hop: 1\r\n\r\n", "10.0.0.1:12345",
+     "GET http://example.com/p HTTP/1.1\r\nHost: example.com\r\nX-Proxy-Peer: 10.0.0.1:12345\r\n"
+     "Connection: close\r\n\r\n"},
+};
+
+static std::string build(const HttpRequest& req, const std::string* peerSelf) {
+    PooledBuffer buffer(MessageForwarder::forwardRequestSize(req, peerSelf));
+    return std::string(MessageForwarder::buildForwardRequest(req, buffer.data(), peerSelf));
+}
+
+static int checkHeads() {
+    int errors = 0;
+    HttpParser parser;
+    for (const Case& test : CASES) {
+        HttpRequest req = parser.parseRequest(test.raw);
+        std::string peerSelf = test.peerSelf ? test.peerSelf : "";
+        std::string head = build(req, test.peerSelf ? &peerSelf : nullptr);
+        if (head != test.expected) {
+            std::cout << "FAIL: " << test.name << "\n--- got\n" << head << "--- expected\n" << test.expected;
+            ++errors;
+        }
+    }
+    return errors;
+}
+
+// Allocations per build, steady state
+static double measure(const char* name, const HttpRequest& req, int rounds) {
+    size_t bytes = 0;
+    for (int i = 0; i < 100; ++i) {
+        PooledBuffer buffer(MessageForwarder::forwardRequestSize(req, nullptr));
+        bytes += MessageForwarder::buildForwardRequest(req, buffer.data(), nullptr).size();
+    }
+    AllocationStats& pool = BufferPool::stats();
+    uint64_t heapBefore = heapAllocations;
+    uint64_t systemBefore = pool.systemAllocations;
+    for (int i = 0; i < rounds; ++i) {
+        PooledBuffer buffer(MessageForwarder::forwardRequestSize(req, nullptr));
+        bytes += MessageForwarder::buildForwardRequest(req, buffer.data(), nullptr).size();
+    }
+    double heap = (double)(heapAllocations - heapBefore) / rounds;
+    double system = (double)(pool.systemAllocations - systemBefore) / rounds;
+    std::cout << name << "\t" << heap << "\t" << system << "\t" << bytes / (rounds + 100) << std::endl;
+    return heap + system;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? std::atoi(argv[1]) : 100000;
+
+    int errors = checkHeads();
+    std::cout << "heads: " << (sizeof(CASES) / sizeof(CASES[0]) - errors) << "/" << sizeof(CASES) / sizeof(CASES[0])
+              << " as expected" << std::endl;
+
+    HttpParser parser;
+    std::cout << "requests: " << rounds << std::endl;
+    std::cout << "case\theap_allocs\tpool_mallocs\thead_bytes" << std::endl;
+    double allocations = 0;
+    for (const Case& test : CASES) {
+        if (!test.peerSelf) {
+            HttpRequest req = parser.parseRequest(test.raw);
+            allocations += measure(test.name, req, rounds);
+        }
+    }
+    if (allocations > 0) {
+        std::cout << "FAIL: building the request head allocates" << std::endl;
+    }
+    return errors > 0 || allocations > 0 ? 1 : 0;
+}
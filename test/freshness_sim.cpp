@@ -0,0 +1,169 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include "Freshness.h"
+
+// Replay a day of requests against origins that describe freshness in
+// different ways, and compare the hit ratio of the old expiration rules with
+// RFC 9111 freshness and negative caching.
+//
+// Usage: ./freshness_sim [REQUESTS]
+// Every URL has one kind of origin response: explicit max-age, s-maxage
+// behind another cache (with Age), Last-Modified only, nothing at all, or a
+// 404/410/503 from crawler probes. Requests are Zipf-distributed over the URLs
+// and spread evenly over 24 simulated hours.
+
+enum Kind { MAX_AGE, SHARED, LAST_MODIFIED, BARE, NOT_FOUND, GONE, UNAVAILABLE, KINDS };
+static const char* const KIND_NAMES[KINDS] = {"max-age", "s-maxage+Age", "last-modified", "bare", "404", "410", "503"};
+// Share of the URLs of each kind, in percent
+static const int KIND_SHARE[KINDS] = {30, 10, 25, 5, 20, 5, 5};
+
+struct Request {
+    time_t time;
+    size_t url;
+};
+
+static std::string httpDate(time_t when) {
+    char text[64];
+    struct tm tm;
+    gmtime_r(&when, &tm);
+    strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return text;
+}
+
+static Kind kindOf(size_t url) {
+    int bucket = (int)((url * 2654435761u) % 100);
+    for (int kind = 0; kind < KINDS; kind++) {
+        if (bucket < KIND_SHARE[kind]) {
+            return (Kind)kind;
+        }
+        bucket -= KIND_SHARE[kind];
+    }
+    return BARE;
+}
+
+// What the origin sends for url at now
+static std::string originResponse(size_t url, time_t now) {
+    std::string date = "\r\nDate: " + httpDate(now);
+    switch (kindOf(url)) {
+    case MAX_AGE:
+        return "HTTP/1.1 200 OK" + date + "\r\nCache-Control: max-age=3600\r\n\r\n";
+    case SHARED:
+        return "HTTP/1.1 200 OK" + date + "\r\nCache-Control: max-age=60, s-maxage=900\r\nAge: " +
+               std::to_string(url % 300) + "\r\n\r\n";
+    case LAST_MODIFIED:
+        return "HTTP/1.1 200 OK" + date + "\r\nLast-Modified: " + httpDate(now - 86400 * (1 + url % 60)) + "\r\n\r\n";
+    case BARE:
+        return "HTTP/1.1 200 OK" + date + "\r\n\r\n";
+    case NOT_FOUND:
+        return "HTTP/1.1 404 Not Found" + date + "\r\n\r\n";
+    case GONE:
+        return "HTTP/1.1 410 Gone" + date + "\r\n\r\n";
+    default:
+        return "HTTP/1.1 503 Service Unavailable" + date + "\r\nRetry-After: 30\r\n\r\n";
+    }
+}
+
+/*
+ @brief: The expiration rules before RFC 9111 support: 60 seconds unless
+         Expires says otherwise (the max-age value was never parsed), and
+         only 200/203/300/301 stored. -1 when not stored.
+*/
+static time_t legacyExpiration(const std::string& headers, time_t now) {
+    int status = responseStatus(headers);
+    if (status != 200 && status != 203 && status != 300 && status != 301) {
+        return -1;
+    }
+    return now + 60;
+}
+
+struct Result {
+    size_t hits = 0;
+    size_t staleHits = 0; // hits on a copy RFC 9111 already considers stale
+    size_t hitsByKind[KINDS] = {};
+    size_t requestsByKind[KINDS] = {};
+};
+
+template <typename Expiration>
+static Result replay(const std::vector<Request>& trace, const FreshnessOptions& options, Expiration expiration) {
+    struct Stored {
+        time_t expiration;
+        time_t stale; // per RFC 9111
+    };
+    std::unordered_map<size_t, Stored> cache;
+    Result result;
+    for (const Request& request : trace) {
+        Kind kind = kindOf(request.url);
+        result.requestsByKind[kind]++;
+        auto it = cache.find(request.url);
+        if (it != cache.end() && request.time < it->second.expiration) {
+            result.hits++;
+            result.hitsByKind[kind]++;
+            result.staleHits += request.time >= it->second.stale;
+            continue;
+        }
+        std::string headers = originResponse(request.url, request.time);
+        time_t expires = expiration(headers, request.time);
+        if (expires == -1) {
+            cache.erase(request.url);
+            continue;
+        }
+        cache[request.url] = Stored{expires, expirationTime(headers, request.time, request.time, options)};
+    }
+    return result;
+}
+
+static void report(const char* name, const Result& result, size_t requests) {
+    printf("%-18s %8.4f %10zu", name, (double)result.hits / requests, result.staleHits);
+    for (int kind = 0; kind < KINDS; kind++) {
+        printf(" %8.3f", result.requestsByKind[kind] ? (double)result.hitsByKind[kind] / result.requestsByKind[kind] : 0.0);
+    }
+    printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+    size_t requests = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    const size_t urls = 50000;
+    const time_t start = 1700000000;
+    const time_t day = 86400;
+
+    std::vector<double> cdf(urls);
+    double sum = 0;
+    for (size_t i = 0; i < urls; ++i) {
+        sum += 1.0 / std::pow(i + 1, 0.9);
+        cdf[i] = sum;
+    }
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> uniform(0, sum);
+    std::vector<Request> trace;
+    trace.reserve(requests);
+    for (size_t i = 0; i < requests; ++i) {
+        size_t rank = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+        trace.push_back(Request{start + (time_t)(i * day / requests), rank});
+    }
+
+    FreshnessOptions rfc;
+    FreshnessOptions errors;
+    errors.errorStatuses = {503};
+    auto storable = [](const FreshnessOptions& options) {
+        return [&options](const std::string& headers, time_t now) -> time_t {
+            return isStorable(headers, options) ? expirationTime(headers, now, now, options) : -1;
+        };
+    };
+
+    std::cout << "requests: " << requests << ", urls: " << urls << std::endl;
+    printf("%-18s %8s %10s", "rules", "hit", "stale_hits");
+    for (int kind = 0; kind < KINDS; kind++) {
+        printf(" %8.8s", KIND_NAMES[kind]);
+    }
+    printf("\n");
+    report("legacy", replay(trace, rfc, legacyExpiration), requests);
+    report("rfc9111", replay(trace, rfc, storable(rfc)), requests);
+    report("rfc9111+503", replay(trace, errors, storable(errors)), requests);
+    return 0;
+}
@@ -0,0 +1,165 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <chrono>
+#include <cstdlib>
+#include <cctype>
+#include "HttpHeaders.h"
+
+// Check the perfect-hash lookups and HeaderList, then compare method dispatch
+// and header parse+lookup against the string compares and std::unordered_map
+// the parser used.
+
+typedef std::chrono::steady_clock Clock;
+
+// Headers of a few typical requests, one of them from a client that lowercases names
+static const std::vector<std::vector<std::pair<std::string, std::string>>> REQUESTS = {
+    {{"Host", "example.com"}, {"User-Agent", "curl/8.5.0"}, {"Accept", "*/*"}, {"Connection", "keep-alive"}},
+    {{"Host", "cdn.example.com:8080"}, {"User-Agent", "Mozilla/5.0 (X11; Linux x86_64)"},
+     {"Accept", "text/html,application/xhtml+xml"}, {"Accept-Language", "en-US,en;q=0.5"},
+     {"Accept-Encoding", "gzip, deflate, br"}, {"Referer", "http://example.com/"}, {"Cookie", "session=0123456789abcdef"},
+     {"If-None-Match", "\"5f3a\""}, {"Cache-Control", "max-age=0"}, {"Connection", "keep-alive"}},
+    {{"host", "api.example.com"}, {"content-type", "application/json"}, {"content-length", "27"},
+     {"x-request-id", "7d1e2c"}, {"authorization", "Bearer abc.def"}, {"connection", "close"}},
+    {{"Host", "upload.example.com"}, {"Transfer-Encoding", "chunked"}, {"Content-Type", "application/octet-stream"},
+     {"Expect", "100-continue"}, {"Proxy-Connection", "keep-alive"}},
+};
+
+static const char* METHODS[] = {"GET", "GET", "GET", "HEAD", "POST", "GET", "CONNECT", "OPTIONS"};
+
+static int checkLookups() {
+    int errors = 0;
+    for (HeaderId id = HeaderId::Host; id <= HeaderId::Via; id = HeaderId((int)id + 1)) {
+        std::string name(headerName(id));
+        std::string lower, upper;
+        for (char c : name) {
+            lower += (char)std::tolower((unsigned char)c);
+            upper += (char)std::toupper((unsigned char)c);
+        }
+        errors += headerId(name) != id || headerId(lower) != id || headerId(upper) != id;
+    }
+    for (const char* other : {"", "X-Forwarded-For", "Hosts", "Hos", "Content-Lengths", "If-Range-", "Vi"}) {
+        errors += headerId(other) != HeaderId::Other;
+    }
+    errors += methodId("GET") != HttpMethod::Get || methodId("CONNECT") != HttpMethod::Connect ||
+              methodId("Get") != HttpMethod::Unknown || methodId("GETS") != HttpMethod::Unknown;
+
+    HeaderList headers;
+    headers.append("Host", "example.com");
+    headers.append("X-Trace", "1");
+    headers.append("accept-encoding", "gzip");
+    headers.append("x-trace", "2");
+    errors += headers.get(HeaderId::AcceptEncoding) != "gzip" || headers.get("X-TRACE") != "1";
+    headers.set("X-Trace", headers.get(HeaderId::Host));
+    errors += headers.size() != 3 || headers.get("x-trace") != "example.com" || headers[1].name != "X-Trace";
+    errors += headers.erase(HeaderId::Host) != 1 || headers.contains(HeaderId::Host) || headers[0].name != "X-Trace";
+    // Past the inline fields, and back
+    for (int i = 0; i < 40; i++) {
+        headers.append("X-Extra", std::to_string(i));
+    }
+    errors += headers.size() != 42 || headers[41].value != "39" || headers.get(HeaderId::AcceptEncoding) != "gzip";
+    HeaderList copy = headers;
+    errors += copy.erase("x-extra") != 40 || copy.size() != 2 || copy[1].value != "gzip" || headers.size() != 42;
+    return errors;
+}
+
+// ns per request to classify the method the way isValidRequest and forwardRequest did
+static double benchMethodCompare(int rounds) {
+    std::vector<std::string> methods(std::begin(METHODS), std::end(METHODS));
+    int handled = 0;
+    auto begin = Clock::now();
+    for (int i = 0; i < rounds; i++) {
+        const std::string& method = methods[i % methods.size()];
+        if (method != "GET" && method != "HEAD" && method != "POST" && method != "CONNECT") {
+            continue;
+        }
+        if (method == "GET" || method == "HEAD") {
+            handled += 1;
+        } else if (method == "POST") {
+            handled += 2;
+        } else if (method == "CONNECT") {
+            handled += 3;
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - begin).count() / rounds;
+    return handled ? ns : -1;
+}
+
+static double benchMethodHash(int rounds) {
+    std::vector<std::string> methods(std::begin(METHODS), std::end(METHODS));
+    int handled = 0;
+    auto begin = Clock::now();
+    for (int i = 0; i < rounds; i++) {
+        switch (methodId(methods[i % methods.size()])) {
+        case HttpMethod::Get:
+        case HttpMethod::Head:
+            handled += 1;
+            break;
+        case HttpMethod::Post:
+            handled += 2;
+            break;
+        case HttpMethod::Connect:
+            handled += 3;
+            break;
+        default:
+            break;
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - begin).count() / rounds;
+    return handled ? ns : -1;
+}
+
+// ns per request to store its headers and look up the four the proxy acts on;
+// found counts the lookups that hit, which exact-case keys miss for lowercased names
+static double benchMap(int rounds, long& found) {
+    found = 0;
+    auto begin = Clock::now();
+    for (int i = 0; i < rounds; i++) {
+        const auto& request = REQUESTS[i % REQUESTS.size()];
+        std::unordered_map<std::string, std::string> headers;
+        headers.reserve(16);
+        for (const auto& header : request) {
+            headers[header.first] = header.second;
+        }
+        for (const char* name : {"Host", "Content-Length", "Transfer-Encoding", "Connection"}) {
+            found += headers.find(name) != headers.end();
+        }
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - begin).count() / rounds;
+}
+
+static double benchHeaderList(int rounds, long& found) {
+    found = 0;
+    auto begin = Clock::now();
+    for (int i = 0; i < rounds; i++) {
+        const auto& request = REQUESTS[i % REQUESTS.size()];
+        HeaderList headers;
+        headers.reserve(256);
+        for (const auto& header : request) {
+            headers.append(header.first, header.second);
+        }
+        for (HeaderId id : {HeaderId::Host, HeaderId::ContentLength, HeaderId::TransferEncoding, HeaderId::Connection}) {
+            found += headers.contains(id);
+        }
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - begin).count() / rounds;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? std::atoi(argv[1]) : 2000000;
+
+    int errors = checkLookups();
+    std::cout << "lookup check: " << (errors == 0 ? "ok" : std::to_string(errors) + " wrong") << std::endl;
+
+    std::cout << "method dispatch  compare ns/op  perfect hash ns/op" << std::endl;
+    std::cout << "  " << benchMethodCompare(rounds * 10) << "  " << benchMethodHash(rounds * 10) << std::endl;
+
+    long mapFound, listFound;
+    double mapNs = benchMap(rounds, mapFound);
+    double listNs = benchHeaderList(rounds, listFound);
+    std::cout << "headers  unordered_map ns/request  HeaderList ns/request  map found  list found" << std::endl;
+    std::cout << "  " << mapNs << "  " << listNs << "  " << mapFound << "  " << listFound << std::endl;
+    return errors == 0 ? 0 : 1;
+}
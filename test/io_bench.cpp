@@ -0,0 +1,137 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "ConnectionHandler.h"
+
+// Cache hits through the real accept loop, once per io_backend: concurrent
+// clients each open a connection per request, while a set of idle clients
+// stays connected without sending anything (slowloris-style). Reports
+// throughput, latency and how many threads the proxy holds for the idle ones.
+
+static int connectTo(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int threadCount() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 8, "Threads:") == 0) {
+            return std::atoi(line.c_str() + 8);
+        }
+    }
+    return -1;
+}
+
+static void run(const std::string& backend, int port, int clients, int requests, int idle) {
+    Config config;
+    config.ioBackend = backend;
+    config.drainTimeout = 1;
+    auto settings = std::make_shared<SharedSettings>(config);
+    auto logger = std::make_shared<Logger>("/dev/null");
+    auto cache = std::make_shared<CacheManager>();
+    std::string body(4096, 'x');
+    auto entry = std::make_shared<CacheEntry>();
+    entry->response = std::make_shared<const CacheBody>(
+        "HTTP/1.1 200 OK\r\nContent-Length: 4096\r\nCache-Control: max-age=3600\r\n\r\n" + body);
+    entry->headerLength = entry->response->size() - body.size();
+    entry->expiration = time(nullptr) + 3600;
+    entry->mustRevalidate = false;
+    cache->put(makeCacheKey("bench.local", "80", "/index.html"), entry);
+    auto requestHandler = std::make_shared<RequestHandler>(cache, logger);
+    ConnectionHandler handler(requestHandler, cache, logger, settings);
+    std::thread server([&]() { handler.start(port, 1024); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    int baseThreads = threadCount();
+    std::vector<int> idleSockets;
+    for (int i = 0; i < idle; ++i) {
+        idleSockets.push_back(connectTo(port));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    int idleThreads = threadCount() - baseThreads;
+
+    const std::string request = "GET http://bench.local/index.html HTTP/1.1\r\nHost: bench.local\r\n\r\n";
+    std::vector<std::vector<double>> latencies(clients);
+    std::atomic<int> failures(0);
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int c = 0; c < clients; ++c) {
+        workers.emplace_back([&, c]() {
+            char buffer[8192];
+            for (int i = 0; i < requests; ++i) {
+                auto start = std::chrono::steady_clock::now();
+                int fd = connectTo(port);
+                size_t received = 0;
+                if (fd >= 0 && send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size()) {
+                    ssize_t n;
+                    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+                        received += n;
+                    }
+                }
+                if (fd >= 0) {
+                    close(fd);
+                }
+                if (received < body.size()) {
+                    failures++;
+                }
+                latencies[c].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    for (int fd : idleSockets) {
+        close(fd);
+    }
+    handler.stop();
+    server.join();
+
+    std::vector<double> all;
+    for (auto& list : latencies) {
+        all.insert(all.end(), list.begin(), list.end());
+    }
+    std::sort(all.begin(), all.end());
+    std::cout << backend << "\t" << (int)(all.size() / seconds) << "\t" << all[all.size() / 2] << "\t"
+              << all[all.size() * 99 / 100] << "\t" << idleThreads << "\t" << failures << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    int clients = argc > 1 ? std::atoi(argv[1]) : 16;
+    int requests = argc > 2 ? std::atoi(argv[2]) : 2000;
+    int idle = argc > 3 ? std::atoi(argv[3]) : 200;
+    int port = argc > 4 ? std::atoi(argv[4]) : 18080;
+
+    std::cout << "clients: " << clients << ", requests each: " << requests << ", idle connections: " << idle << std::endl;
+    std::cout << "backend\treq/s\tp50_us\tp99_us\tidle_threads\tfailures" << std::endl;
+    run("threads", port, clients, requests, idle);
+#ifdef WEBPROXY_IO_URING
+    run("uring", port + 1, clients, requests, idle);
+#else
+    std::cout << "uring\t(built with IO_URING=0)" << std::endl;
+#endif
+    run("async", port + 2, clients, requests, idle);
+    return 0;
+}
@@ -0,0 +1,238 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "ConnectionHandler.h"
+#include "HttpParser.h"
+
+// Peer mode end to end, per io_backend: three proxies on localhost share one
+// cache through rendezvous hashing in front of a counting origin stub. The
+// owner of a key fetches and serves it, the other nodes relay their misses
+// to the owner, and with the owner stopped a node goes to the origin itself.
+
+static const int NODES = 3;
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    std::cout << (ok ? "ok    " : "FAIL  ") << what << std::endl;
+    failures += !ok;
+}
+
+static int listenOn(int& port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    listen(fd, 16);
+    socklen_t length = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &length);
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int connectTo(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ @brief: The origin: one connection at a time, answers with the path as the
+         body, cacheable, and closes; requests counts what reached it
+*/
+class OriginStub {
+private:
+    int listener;
+    std::thread thread;
+
+    void serve() {
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                return;
+            }
+            char request[4096];
+            ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+            if (n > 0) {
+                request[n] = '\0';
+                requests++;
+                std::string line(request, strcspn(request, "\r\n"));
+                std::string path = line.substr(line.find(' ') + 1);
+                path = path.substr(0, path.find(' '));
+                std::string response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(path.size()) +
+                                       "\r\nCache-Control: max-age=60\r\nConnection: close\r\n\r\n" + path;
+                send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+            }
+            close(fd);
+        }
+    }
+
+public:
+    int port;
+    std::atomic<int> requests{0};
+
+    OriginStub() {
+        listener = listenOn(port);
+        thread = std::thread(&OriginStub::serve, this);
+    }
+    ~OriginStub() {
+        shutdown(listener, SHUT_RDWR);
+        close(listener);
+        thread.join();
+    }
+};
+
+/*
+ @brief: One proxy of the cluster, with a cache of its own
+*/
+class Node {
+private:
+    std::shared_ptr<CacheManager> cache;
+    std::unique_ptr<ConnectionHandler> handler;
+    std::thread server;
+
+public:
+    Node(const Config& config, int port) {
+        auto settings = std::make_shared<SharedSettings>(config);
+        auto logger = std::make_shared<Logger>("/dev/null");
+        cache = std::make_shared<CacheManager>();
+        auto requestHandler = std::make_shared<RequestHandler>(cache, logger);
+        handler = std::make_unique<ConnectionHandler>(requestHandler, cache, logger, settings);
+        server = std::thread([this, port]() { handler->start(port, 64); });
+    }
+    ~Node() { stop(); }
+
+    void stop() {
+        if (server.joinable()) {
+            handler->stop();
+            server.join();
+        }
+    }
+};
+
+/*
+ @brief: GET path from the origin through the proxy on proxyPort; the body,
+         "" on any failure. Reads until the proxy closes, which it does once
+         the request is done with: the body stored, the counters updated.
+*/
+static std::string fetch(int proxyPort, int originPort, const std::string& path) {
+    int fd = connectTo(proxyPort);
+    if (fd < 0) {
+        return "";
+    }
+    struct timeval timeout = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string target = "127.0.0.1:" + std::to_string(originPort);
+    std::string request = "GET http://" + target + path + " HTTP/1.1\r\nHost: " + target + "\r\nConnection: close\r\n\r\n";
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    std::string response;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        response.append(buffer, n);
+    }
+    close(fd);
+    size_t headerEnd = response.find("\r\n\r\n");
+    if (response.compare(0, 12, "HTTP/1.1 200") != 0 || headerEnd == std::string::npos) {
+        return "";
+    }
+    return response.substr(headerEnd + 4);
+}
+
+/*
+ @brief: A path whose cache key the given node owns, found the way the
+         proxies find owners: from the key the parser builds
+*/
+static std::string pathOwnedBy(int node, const PeerOptions& peers, int originPort) {
+    HttpParser parser;
+    std::string target = "127.0.0.1:" + std::to_string(originPort);
+    for (int i = 0;; ++i) {
+        std::string path = "/object" + std::to_string(node) + "-" + std::to_string(i);
+        HttpRequest req = parser.parseRequest("GET http://" + target + path + " HTTP/1.1\r\nHost: " + target + "\r\n\r\n");
+        PeerOptions asOwner = peers;
+        asOwner.self = peers.nodes[node];
+        if (!PeerRing::owner(req.cacheKey.hash, asOwner)) {
+            return path;
+        }
+    }
+}
+
+static void run(const std::string& backend, int basePort) {
+    std::cout << "== " << backend << std::endl;
+    OriginStub origin;
+    Config config;
+    config.ioBackend = backend;
+    config.drainTimeout = 1;
+    config.peers.retry = 60;
+    for (int i = 0; i < NODES; ++i) {
+        config.peers.nodes.push_back("127.0.0.1:" + std::to_string(basePort + i));
+    }
+    std::unique_ptr<Node> nodes[NODES];
+    for (int i = 0; i < NODES; ++i) {
+        config.peers.self = config.peers.nodes[i];
+        nodes[i] = std::make_unique<Node>(config, basePort + i);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    PeerStats& stats = PeerRing::stats();
+    uint64_t forwarded = stats.forwarded, fallbacks = stats.fallbacks, served = stats.served;
+
+    // The owner answers its own key: from the origin once, then from its cache
+    std::string own = pathOwnedBy(0, config.peers, origin.port);
+    std::string body = fetch(basePort, origin.port, own);
+    check(body == own && origin.requests == 1, "owner fetches its key from the origin");
+    body = fetch(basePort, origin.port, own);
+    check(body == own && origin.requests == 1 && stats.forwarded == forwarded && stats.fallbacks == fallbacks,
+          "owner serves its key from its cache");
+
+    // Another node's key goes through the owner, which fetches and keeps it
+    std::string other = pathOwnedBy(1, config.peers, origin.port);
+    body = fetch(basePort, origin.port, other);
+    check(body == other && origin.requests == 2 && stats.forwarded == forwarded + 1 && stats.served == served + 1,
+          "non-owner forwards a miss to the owner");
+    body = fetch(basePort + 2, origin.port, other);
+    check(body == other && origin.requests == 2 && stats.forwarded == forwarded + 2 && stats.served == served + 2,
+          "a third node's miss is a hit at the owner");
+
+    // With the owner stopped, its key comes from the origin directly
+    nodes[2]->stop();
+    std::string orphan = pathOwnedBy(2, config.peers, origin.port);
+    body = fetch(basePort, origin.port, orphan);
+    check(body == orphan && origin.requests == 3 && stats.fallbacks == fallbacks + 1 && stats.forwarded == forwarded + 2,
+          "owner down: fetched from the origin, fallbacks counted");
+    body = fetch(basePort + 1, origin.port, orphan);
+    check(body == orphan && origin.requests == 4 && stats.fallbacks == fallbacks + 2,
+          "every node falls back while the owner is down");
+
+    for (auto& node : nodes) {
+        node->stop();
+    }
+    std::cout << "peers: " << stats.describe() << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? std::atoi(argv[1]) : 12381;
+
+    run("threads", port);
+    run("async", port + NODES);
+    run("uring", port + 2 * NODES);
+
+    std::cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
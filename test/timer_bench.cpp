@@ -0,0 +1,107 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <random>
+#include <cstdlib>
+#include "TimingWheel.h"
+
+// Check the timing wheel fires every timer on time on a simulated clock,
+// then compare arm+cancel against the std::multimap the event loop used.
+
+typedef TimingWheel::Clock Clock;
+
+struct TestTimer : TimerNode {
+    int timeout;      // ms
+    bool cancelled = false;
+    long firedAt = -1; // simulated ms
+};
+
+// Timers with timeouts up to maxTimeout ms, a third cancelled half way;
+// returns the number that fired early, late or not as expected
+static int checkFiring(int count, int maxTimeout) {
+    std::mt19937 random(7);
+    TimingWheel wheel;
+    Clock::time_point start = Clock::now();
+    std::vector<TestTimer> timers(count);
+    for (auto& timer : timers) {
+        timer.timeout = 1 + (int)(random() % maxTimeout);
+        wheel.arm(&timer, timer.timeout);
+    }
+    // arm() reads the real clock: the last timers were armed this much later
+    long armedWithin = (long)std::chrono::ceil<std::chrono::milliseconds>(Clock::now() - start).count();
+    std::vector<TimerNode*> expired;
+    int errors = 0;
+    for (long now = 0; wheel.size() > 0; now += TimingWheel::TICK_MS) {
+        if (now == maxTimeout / 2) {
+            for (size_t i = 0; i < timers.size(); i += 3) {
+                timers[i].cancelled = timers[i].armed();
+                wheel.cancel(&timers[i]);
+            }
+        }
+        expired.clear();
+        wheel.advance(start + std::chrono::milliseconds(now), expired);
+        for (TimerNode* node : expired) {
+            static_cast<TestTimer*>(node)->firedAt = now;
+        }
+        // Never sleeps past the next level-0 wrap while timers are pending
+        int wait = wheel.nextTimeout(start + std::chrono::milliseconds(now));
+        if (wheel.size() > 0 && (wait < 0 || wait > TimingWheel::SLOTS * TimingWheel::TICK_MS)) {
+            errors++;
+            break;
+        }
+    }
+    for (auto& timer : timers) {
+        if (timer.cancelled) {
+            errors += timer.firedAt >= 0;
+        } else if (timer.firedAt < timer.timeout || timer.firedAt > timer.timeout + armedWithin + 2 * TimingWheel::TICK_MS) {
+            errors++;
+        }
+    }
+    return errors;
+}
+
+// Nanoseconds per arm+cancel with live timers pending
+static double benchWheel(int live, int rounds) {
+    TimingWheel wheel;
+    std::vector<TestTimer> timers(live);
+    for (int i = 0; i < live; ++i) {
+        wheel.arm(&timers[i], 1000 + i);
+    }
+    auto begin = Clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        TestTimer& timer = timers[i % live];
+        wheel.cancel(&timer);
+        wheel.arm(&timer, 30000 + i % 1000);
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - begin).count() / rounds;
+}
+
+static double benchMultimap(int live, int rounds) {
+    std::multimap<Clock::time_point, int> timers;
+    std::vector<std::multimap<Clock::time_point, int>::iterator> handles;
+    Clock::time_point now = Clock::now();
+    for (int i = 0; i < live; ++i) {
+        handles.push_back(timers.emplace(now + std::chrono::milliseconds(1000 + i), i));
+    }
+    auto begin = Clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        int index = i % live;
+        timers.erase(handles[index]);
+        handles[index] = timers.emplace(Clock::now() + std::chrono::milliseconds(30000 + i % 1000), index);
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - begin).count() / rounds;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? std::atoi(argv[1]) : 2000000;
+
+    int errors = checkFiring(100000, 60000) + checkFiring(20000, 3 * 3600 * 1000);
+    std::cout << "firing check: " << (errors == 0 ? "ok" : std::to_string(errors) + " timers wrong") << std::endl;
+
+    std::cout << "live timers  wheel ns/op  multimap ns/op" << std::endl;
+    for (int live : {100, 10000, 100000}) {
+        std::cout << live << "  " << benchWheel(live, rounds) << "  " << benchMultimap(live, rounds) << std::endl;
+    }
+    return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,267 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include "ConnectionHandler.h"
+
+// TLS interception end to end, per io_backend: a test CA is generated, a
+// local TLS origin stub serves with a certificate from it, and a client
+// trusting only that CA fetches through CONNECT. Checks the proxy presents
+// its own certificate for allowlisted hosts, answers repeats from the cache,
+// resumes origin sessions, and tunnels other hosts untouched.
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what) {
+    std::cout << (ok ? "ok    " : "FAIL  ") << what << std::endl;
+    failures += !ok;
+}
+
+static void addExtension(X509* cert, X509* issuer, int nid, const char* value) {
+    X509V3_CTX context;
+    X509V3_set_ctx_nodb(&context);
+    X509V3_set_ctx(&context, issuer, cert, nullptr, nullptr, 0);
+    X509_EXTENSION* extension = X509V3_EXT_conf_nid(nullptr, &context, nid, value);
+    X509_add_ext(cert, extension, -1);
+    X509_EXTENSION_free(extension);
+}
+
+// A certificate named cn for key, signed by issuerKey (self-signed without issuer)
+static X509* makeCertificate(const char* cn, EVP_PKEY* key, X509* issuer, EVP_PKEY* issuerKey, bool ca) {
+    X509* cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), ca ? 1 : 2);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (const unsigned char*)cn, -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(issuer ? issuer : cert));
+    if (ca) {
+        addExtension(cert, cert, NID_basic_constraints, "critical,CA:TRUE");
+        addExtension(cert, cert, NID_key_usage, "critical,keyCertSign,cRLSign");
+    } else {
+        addExtension(cert, issuer, NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1");
+    }
+    X509_sign(cert, issuerKey, EVP_sha256());
+    return cert;
+}
+
+static std::string commonName(X509* cert, bool issuer) {
+    char name[256] = "";
+    if (cert) {
+        X509_NAME_get_text_by_NID(issuer ? X509_get_issuer_name(cert) : X509_get_subject_name(cert), NID_commonName, name, sizeof(name));
+    }
+    return name;
+}
+
+static int listenOn(int& port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    listen(fd, 16);
+    socklen_t length = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &length);
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int connectTo(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ @brief: The origin: one connection at a time, answers with the path as the
+         body, cacheable, and closes, so every miss is a new TLS connection
+*/
+class OriginStub {
+private:
+    SSL_CTX* context;
+    int listener;
+    std::thread thread;
+
+    void serve() {
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                return;
+            }
+            SSL* ssl = SSL_new(context);
+            SSL_set_fd(ssl, fd);
+            char request[4096];
+            int n;
+            if (SSL_accept(ssl) == 1 && (n = SSL_read(ssl, request, sizeof(request) - 1)) > 0) {
+                request[n] = '\0';
+                requests++;
+                std::string line(request, strcspn(request, "\r\n"));
+                std::string path = line.substr(line.find(' ') + 1);
+                path = path.substr(0, path.find(' '));
+                std::string response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(path.size()) +
+                                       "\r\nCache-Control: max-age=60\r\nConnection: close\r\n\r\n" + path;
+                SSL_write(ssl, response.data(), (int)response.size());
+                SSL_shutdown(ssl);
+            }
+            SSL_free(ssl);
+            close(fd);
+        }
+    }
+
+public:
+    int port;
+    std::atomic<int> requests{0};
+
+    OriginStub(X509* cert, EVP_PKEY* key) {
+        context = SSL_CTX_new(TLS_server_method());
+        SSL_CTX_use_certificate(context, cert);
+        SSL_CTX_use_PrivateKey(context, key);
+        listener = listenOn(port);
+        thread = std::thread(&OriginStub::serve, this);
+    }
+    ~OriginStub() {
+        shutdown(listener, SHUT_RDWR);
+        close(listener);
+        thread.join();
+        SSL_CTX_free(context);
+    }
+};
+
+/*
+ @brief: GET path from host:originPort through the proxy's CONNECT, trusting
+         only the CA. Returns the body, "" on any failure; peer is the
+         certificate the client was shown.
+*/
+static std::string fetch(int proxyPort, const std::string& host, int originPort, const std::string& path,
+                         SSL_CTX* context, std::string& peer, std::string& peerIssuer) {
+    int fd = connectTo(proxyPort);
+    std::string target = host + ":" + std::to_string(originPort);
+    std::string connectRequest = "CONNECT " + target + " HTTP/1.1\r\nHost: " + target + "\r\n\r\n";
+    send(fd, connectRequest.data(), connectRequest.size(), 0);
+    std::string reply;
+    char c;
+    while (reply.find("\r\n\r\n") == std::string::npos && recv(fd, &c, 1, 0) == 1) {
+        reply += c;
+    }
+    std::string body;
+    SSL* ssl = SSL_new(context);
+    SSL_set_fd(ssl, fd);
+    if (host == "localhost") {
+        SSL_set1_host(ssl, host.c_str());
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+    }
+    if (reply.compare(0, 12, "HTTP/1.1 200") == 0 && SSL_connect(ssl) == 1) {
+        X509* cert = SSL_get1_peer_certificate(ssl);
+        peer = commonName(cert, false);
+        peerIssuer = commonName(cert, true);
+        X509_free(cert);
+        std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + target + "\r\n\r\n";
+        SSL_write(ssl, request.data(), (int)request.size());
+        std::string response;
+        char buffer[4096];
+        int n;
+        while ((n = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
+            response.append(buffer, n);
+            size_t headerEnd = response.find("\r\n\r\n");
+            size_t lengthAt = response.find("Content-Length: ");
+            if (headerEnd != std::string::npos && lengthAt != std::string::npos &&
+                response.size() >= headerEnd + 4 + std::stoul(response.substr(lengthAt + 16))) {
+                break;
+            }
+        }
+        size_t headerEnd = response.find("\r\n\r\n");
+        if (response.compare(0, 12, "HTTP/1.1 200") == 0 && headerEnd != std::string::npos) {
+            body = response.substr(headerEnd + 4);
+        }
+    }
+    SSL_free(ssl);
+    close(fd);
+    return body;
+}
+
+static void run(const std::string& backend, int proxyPort, const std::string& dir, X509* originCert, EVP_PKEY* originKey) {
+    std::cout << "== " << backend << std::endl;
+    OriginStub origin(originCert, originKey);
+    Config config;
+    config.ioBackend = backend;
+    config.drainTimeout = 1;
+    config.tls.intercept = true;
+    config.tls.domains = {"localhost"};
+    config.tls.caCert = dir + "/ca.pem";
+    config.tls.caKey = dir + "/ca.key";
+    config.tls.upstreamCa = dir + "/ca.pem";
+    auto settings = std::make_shared<SharedSettings>(config);
+    auto logger = std::make_shared<Logger>("/dev/null");
+    auto cache = std::make_shared<CacheManager>();
+    auto requestHandler = std::make_shared<RequestHandler>(cache, logger);
+    ConnectionHandler handler(requestHandler, cache, logger, settings);
+    std::thread server([&]() { handler.start(proxyPort, 64); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    SSL_CTX* client = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_load_verify_locations(client, (dir + "/ca.pem").c_str(), nullptr);
+    SSL_CTX_set_verify(client, SSL_VERIFY_PEER, nullptr);
+    std::string peer, issuer;
+    TlsStats& tls = TlsInterceptor::stats();
+    uint64_t resumedBefore = tls.resumedSessions;
+
+    std::string body = fetch(proxyPort, "localhost", origin.port, "/first", client, peer, issuer);
+    check(body == "/first" && origin.requests == 1, "intercepted GET reaches the origin");
+    check(peer == "localhost" && issuer == "WebProxy test CA", "client sees the proxy's certificate (" + peer + " from " + issuer + ")");
+    body = fetch(proxyPort, "localhost", origin.port, "/first", client, peer, issuer);
+    check(body == "/first" && origin.requests == 1, "repeat is a cache hit");
+    body = fetch(proxyPort, "localhost", origin.port, "/second", client, peer, issuer);
+    check(body == "/second" && origin.requests == 2, "another path is fetched");
+    check(tls.resumedSessions > resumedBefore, "origin session resumed");
+    body = fetch(proxyPort, "127.0.0.1", origin.port, "/tunnel", client, peer, issuer);
+    check(body == "/tunnel" && origin.requests == 3 && peer == "origin stub", "other hosts are tunnelled (client sees " + peer + ")");
+
+    SSL_CTX_free(client);
+    handler.stop();
+    server.join();
+}
+
+int main(int argc, char* argv[]) {
+    std::string dir = argc > 1 ? argv[1] : "/tmp/tls_test";
+    int port = argc > 2 ? std::atoi(argv[2]) : 12391;
+    mkdir(dir.c_str(), 0700);
+
+    EVP_PKEY* caKey = EVP_EC_gen("P-256");
+    X509* ca = makeCertificate("WebProxy test CA", caKey, nullptr, caKey, true);
+    FILE* file = fopen((dir + "/ca.pem").c_str(), "w");
+    PEM_write_X509(file, ca);
+    fclose(file);
+    file = fopen((dir + "/ca.key").c_str(), "w");
+    PEM_write_PrivateKey(file, caKey, nullptr, nullptr, 0, nullptr, nullptr);
+    fclose(file);
+    EVP_PKEY* originKey = EVP_EC_gen("P-256");
+    X509* originCert = makeCertificate("origin stub", originKey, ca, caKey, false);
+
+    run("threads", port, dir, originCert, originKey);
+    run("async", port + 1, dir, originCert, originKey);
+
+    X509_free(originCert);
+    EVP_PKEY_free(originKey);
+    X509_free(ca);
+    EVP_PKEY_free(caKey);
+    std::cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}